@@ -21,13 +21,15 @@ class VersionEdit;
 // will be named according to meta->number.  On success, the rest of
 // *meta will be filled with metadata about the generated table.
 // If no data is present in *iter, meta->file_size will be set to
-// zero, and no Table file will be produced.
+// zero, and no Table file will be produced.  If "mirror" is false, the
+// file gets no mirror copy.
 extern Status BuildTable(const std::string& dbname,
                          Env* env,
                          const Options& options,
                          TableCache* table_cache,
                          Iterator* iter,
-                         FileMetaData* meta);
+                         FileMetaData* meta,
+                         bool mirror);
 
 }  // namespace leveldb
 
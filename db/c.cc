@@ -42,8 +42,9 @@ using leveldb::WriteBatch;
 using leveldb::WriteOptions;
 
 /****** declared in mirror.h ******/
-int MIRROR_ENABLE = 0;
-const char *MIRROR_PATH;
+int MIRROR_POOL_BUFFERS = 64;
+int MIRROR_HUGE_PAGES = 0;
+size_t MIRROR_READAHEAD = 1 << 20;
 
 extern "C" {
 
@@ -454,6 +455,15 @@ void leveldb_options_set_compression(leveldb_options_t* opt, int t) {
   opt->rep.compression = static_cast<CompressionType>(t);
 }
 
+void leveldb_options_set_mirror_path(leveldb_options_t* opt,
+                                     const char* path) {
+  opt->rep.mirror_path = (path != NULL) ? path : "";
+}
+
+void leveldb_options_set_mirror_helpers(leveldb_options_t* opt, int n) {
+  opt->rep.mirror_helpers = n;
+}
+
 leveldb_comparator_t* leveldb_comparator_create(
     void* state,
     void (*destructor)(void*),
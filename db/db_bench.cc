@@ -11,14 +11,17 @@
 
 #include "db/db_impl.h"
 #include "db/version_set.h"
+#include "helpers/memenv/device_env.h"
 #include "leveldb/cache.h"
 #include "leveldb/db.h"
 #include "leveldb/env.h"
 #include "leveldb/mirror.h"
+#include "leveldb/mirror_policy.h"
 #include "leveldb/write_batch.h"
 #include "port/port.h"
 #include "util/crc32c.h"
 #include "util/histogram.h"
+#include "util/mpsc_ring.h"
 #include "util/mutexlock.h"
 #include "util/random.h"
 #include "util/testutil.h"
@@ -40,11 +43,19 @@
 //      seekrandom    -- N random seeks
 //      crc32c        -- repeated crc32c of 4K of data
 //      acquireload   -- load N*1000 times
+//      opqtailq      -- enqueue N mirror ops per thread on the TAILQ op queue
+//      opqring       -- enqueue N mirror ops per thread on the lock-free op ring
 //		rwrandom	  -- read and write N times in random order
 //   Meta operations:
 //      compact     -- Compact the entire DB
 //      stats       -- Print DB stats
 //      sstables    -- Print sstable info
+//      mirrorqueue -- Print mirror queue usage and throttling
+//      readplacement -- Print table reads per level, primary vs. mirror
+//      mirrorresync -- Wait for the mirror copies to land, e.g. those the
+//                      resync on open rebuilds, and print its progress
+//      devices     -- Print the I/O of the devices --device_profile emulates
+//      follower    -- Catch a --use_follower DB up and print its progress
 //      heapprofile -- Dump a heap profile (if supported by this port)
 static const char* FLAGS_benchmarks =
     "fillseq,"
@@ -101,6 +112,23 @@ static int FLAGS_open_files = 0;
 // Negative means use default settings.
 static int FLAGS_bloom_bits = -1;
 
+// Shape of the tree (use default if == 0): table file size in MiB and
+// its growth per level, bytes of level 1 in MiB and the ratio of each
+// level to the one above, and the level-0 file counts that trigger a
+// compaction, slow writes down and stop them
+static int FLAGS_file_size = 0;
+static int FLAGS_file_size_multiplier = 0;
+static int FLAGS_level0_size = 0;
+static int FLAGS_level_ratio = 0;
+static int FLAGS_level0_trigger = 0;
+static int FLAGS_level0_slowdown = 0;
+static int FLAGS_level0_stop = 0;
+
+// Number of compactions that may run at once, and of threads one may be
+// split across (use default if == 0)
+static int FLAGS_max_background_compactions = 0;
+static int FLAGS_max_subcompactions = 0;
+
 // If true, do not destroy the existing database.  If you set this
 // flag and also specify a benchmark that wants a fresh database, that
 // benchmark will fail.
@@ -123,6 +151,62 @@ static int64_t FLAGS_read_span = -1;
 
 static double FLAGS_countdown = -1;
 
+// Mirror table files to FLAGS_mirror_path if FLAGS_mirror is set
+static bool FLAGS_mirror = false;
+static const char* FLAGS_mirror_path = NULL;
+static int FLAGS_mirror_helpers = leveldb::Options().mirror_helpers;
+static int FLAGS_mirror_queue_cap =
+    leveldb::Options().mirror_queue_cap >> 20;  // in MiB
+static int FLAGS_mirror_lag_target =
+    leveldb::Options().mirror_lag_target >> 20;  // in MiB
+
+// Copy table files to the mirror once closed instead of writing both
+static bool FLAGS_mirror_copy_on_close = false;
+
+// Mirror the MANIFEST, CURRENT and logs too, so that another db_bench
+// can follow the DB with --use_follower
+static bool FLAGS_mirror_metadata = false;
+
+// Open --mirror_path read-only, as a follower of a DB mirrored there
+// with --mirror_metadata=1; implies --use_existing_db
+static bool FLAGS_use_follower = false;
+
+// Mirror only the table files of this level and below, 0 for all
+static int FLAGS_mirror_min_level = 0;
+
+// Background I/O budgets in MiB/s, 0 for no limit
+static int FLAGS_compaction_write_rate = 0;
+static int FLAGS_mirror_write_rate = 0;
+static int FLAGS_mirror_delete_rate = 0;
+
+// Threads and MiB/s of the mirror resync on open
+static int FLAGS_mirror_resync_threads =
+    leveldb::Options().mirror_resync_threads;
+static int FLAGS_mirror_resync_rate =
+    leveldb::Options().mirror_resync_rate >> 20;
+
+// MiB/s the mirror scrubber reads, 0 to disable it
+static int FLAGS_mirror_scrub_rate =
+    leveldb::Options().mirror_scrub_rate >> 20;
+
+// Levels whose user reads go to the mirror, e.g. "4-15" or "0,2"
+static int FLAGS_mirror_read_levels = 0;
+
+// Route every table read to the faster copy, primary or mirror
+static bool FLAGS_mirror_read_routing = false;
+
+// Spread block reads over both copies: 1 by file number, 2 by load
+static int FLAGS_mirror_read_balance = leveldb::kNoReadBalance;
+
+// Data blocks readseq reads ahead of its iterator
+static int FLAGS_prefetch_blocks = 0;
+
+// Emulate the devices under --db and --mirror_path, e.g. "ssd:hdd", or
+// "ssd" for both (see helpers/memenv/device_env.h).  Both paths are best
+// on a tmpfs then, so that the real disks do not add to the numbers.
+static const char* FLAGS_device_profile = NULL;
+static leveldb::DeviceEnv* device_env = NULL;
+
 static double rwrandom_wspeed = 0;
 
 static int rwrandom_read_completed = 0;
@@ -193,6 +277,24 @@ static void AppendWithSpace(std::string* str, Slice msg) {
   str->append(msg.data(), msg.size());
 }
 
+// Parse a list of levels and level ranges ("0,4-6") into a bitmask
+static int ParseLevels(const char* list) {
+  int mask = 0;
+  while (*list != '\0') {
+    int from, to, n;
+    if (sscanf(list, "%d-%d%n", &from, &to, &n) == 2 ||
+        (sscanf(list, "%d%n", &from, &n) == 1 && (to = from) >= 0)) {
+      for (int level = from; level <= to && level < 31; level++) {
+        mask |= 1 << level;
+      }
+      list += n;
+    }
+    if (*list != ',') break;
+    list++;
+  }
+  return mask;
+}
+
 class Stats {
  private:
   double start_;
@@ -396,12 +498,26 @@ struct ThreadState {
   }
 };
 
+// State shared by the opq* producer threads and their single consumer,
+// which stands in for the mirror helper.
+struct OpqState {
+  opq_tailq tailq;
+  MPSCRing<mio_op_s>* ring;
+  port::Mutex mu;
+  port::CondVar cv;
+  bool done;
+  int64_t consumed;
+
+  OpqState() : tailq(NULL), ring(NULL), cv(&mu), done(false), consumed(0) { }
+};
+
 }  // namespace
 
 class Benchmark {
  private:
   Cache* cache_;
   const FilterPolicy* filter_policy_;
+  const MirrorPolicy* mirror_policy_;
   DB* db_;
   int num_;
   int value_size_;
@@ -409,6 +525,7 @@ class Benchmark {
   WriteOptions write_options_;
   int reads_;
   int heap_counter_;
+  OpqState* opq_state_;
 
   void PrintHeader() {
     const int kKeySize = 16;
@@ -424,6 +541,9 @@ class Benchmark {
     fprintf(stdout, "FileSize:   %.1f MB (estimated)\n",
             (((kKeySize + FLAGS_value_size * FLAGS_compression_ratio) * num_)
              / 1048576.0));
+    if (FLAGS_device_profile != NULL) {
+      fprintf(stdout, "Devices:    %s (emulated)\n", FLAGS_device_profile);
+    }
     PrintWarnings();
     fprintf(stdout, "------------------------------------------------\n");
   }
@@ -490,12 +610,16 @@ class Benchmark {
     filter_policy_(FLAGS_bloom_bits >= 0
                    ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                    : NULL),
+    mirror_policy_(FLAGS_mirror_min_level > 0
+                   ? NewLevelMirrorPolicy(FLAGS_mirror_min_level)
+                   : NULL),
     db_(NULL),
     num_(FLAGS_num),
     value_size_(FLAGS_value_size),
     entries_per_batch_(1),
     reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads),
-    heap_counter_(0) {
+    heap_counter_(0),
+    opq_state_(NULL) {
     std::vector<std::string> files;
     Env::Default()->GetChildren(FLAGS_db, &files);
     for (int i = 0; i < files.size(); i++) {
@@ -504,7 +628,7 @@ class Benchmark {
       }
     }
     if (!FLAGS_use_existing_db) {
-      DestroyDB(FLAGS_db, Options());
+      DestroyDB(FLAGS_db, BaseOptions());
     }
   }
 
@@ -512,6 +636,7 @@ class Benchmark {
     delete db_;
     delete cache_;
     delete filter_policy_;
+    delete mirror_policy_;
   }
 
   void Run() {
@@ -592,6 +717,12 @@ class Benchmark {
         method = &Benchmark::Crc32c;
       } else if (name == Slice("acquireload")) {
         method = &Benchmark::AcquireLoad;
+      } else if (name == Slice("opqtailq")) {
+        StartOpqConsumer(false);
+        method = &Benchmark::OpqEnqueue;
+      } else if (name == Slice("opqring")) {
+        StartOpqConsumer(true);
+        method = &Benchmark::OpqEnqueue;
       } else if (name == Slice("snappycomp")) {
         method = &Benchmark::SnappyCompress;
       } else if (name == Slice("snappyuncomp")) {
@@ -602,6 +733,26 @@ class Benchmark {
         PrintStats("leveldb.stats");
       } else if (name == Slice("sstables")) {
         PrintStats("leveldb.sstables");
+      } else if (name == Slice("mirrorqueue")) {
+        PrintStats("leveldb.mirror-queue");
+      } else if (name == Slice("devices")) {
+        if (device_env != NULL) {
+          fprintf(stdout, "\n%s\n", device_env->Summary().c_str());
+        }
+      } else if (name == Slice("readplacement")) {
+        PrintStats("leveldb.read-placement");
+      } else if (name == Slice("mirrorresync")) {
+        Status s = db_->WaitForMirror(600000000);
+        if (!s.ok()) {
+          fprintf(stderr, "wait for mirror: %s\n", s.ToString().c_str());
+        }
+        PrintStats("leveldb.mirror-resync");
+      } else if (name == Slice("follower")) {
+        Status s = db_->CatchUp();
+        if (!s.ok()) {
+          fprintf(stderr, "catch up: %s\n", s.ToString().c_str());
+        }
+        PrintStats("leveldb.follower");
       } else if (name == Slice("rwrandom")) {
         method = &Benchmark::RWRandom;
       } else {
@@ -618,7 +769,7 @@ class Benchmark {
         } else {
           delete db_;
           db_ = NULL;
-          DestroyDB(FLAGS_db, Options());
+          DestroyDB(FLAGS_db, BaseOptions());
           Open();
         }
       }
@@ -626,6 +777,9 @@ class Benchmark {
       if (method != NULL) {
         RunBenchmark(num_threads, name, method);
       }
+      if (opq_state_ != NULL) {
+        StopOpqConsumer();
+      }
     }
   }
 
@@ -750,6 +904,89 @@ class Benchmark {
     if (ptr == NULL) exit(1); // Disable unused variable warning.
   }
 
+  static void OpqConsumer(void* arg) {
+    OpqState* state = reinterpret_cast<OpqState*>(arg);
+    mio_op_s op_buf;
+    mio_op op = &op_buf;
+    int64_t consumed = 0;
+    while (true) {
+      if (state->ring != NULL) {
+        if (!state->ring->TryPop(op)) {
+          state->ring->WaitNonEmpty();
+          continue;
+        }
+      } else {
+        if (!OPQ_TAILQ_NONEMPTY(state->tailq)) {
+          OPQ_TAILQ_WAIT(state->tailq);
+          continue;
+        }
+        OPQ_TAILQ_POP(state->tailq, op);
+      }
+      if (op->type == MHalt) {
+        break;
+      }
+      consumed++;
+    }
+    MutexLock l(&state->mu);
+    state->consumed = consumed;
+    state->done = true;
+    state->cv.SignalAll();
+  }
+
+  void StartOpqConsumer(bool ring) {
+    opq_state_ = new OpqState;
+    if (ring) {
+      opq_state_->ring = new MPSCRing<mio_op_s>(OPQ_RING_SLOTS);
+    } else {
+      opq_state_->tailq = OPQ_TAILQ_MALLOC;
+      OPQ_TAILQ_INIT(opq_state_->tailq);
+    }
+    Env::Default()->StartThread(&Benchmark::OpqConsumer, opq_state_);
+  }
+
+  void StopOpqConsumer() {
+    OpqState* state = opq_state_;
+    OPQ_NEW_OP(halt, MHalt);
+    if (state->ring != NULL) {
+      state->ring->Push(halt);
+    } else {
+      OPQ_TAILQ_ADD(state->tailq, halt);
+    }
+    {
+      MutexLock l(&state->mu);
+      while (!state->done) {
+        state->cv.Wait();
+      }
+    }
+    fprintf(stdout, "%-12s : consumer drained %lld ops\n", "",
+            static_cast<long long>(state->consumed));
+    delete state->ring;
+    free(state->tailq);
+    delete state;
+    opq_state_ = NULL;
+  }
+
+  // Each op is one MBufSync enqueued from this thread; the consumer
+  // only pops it, so this measures the queue and not the I/O.
+  void OpqEnqueue(ThreadState* thread) {
+    OpqState* state = opq_state_;
+    for (int i = 0; i < num_; i++) {
+      OPQ_NEW_OP(op, MBufSync);
+      op.fd = thread->tid;
+      op.size = BLKSIZE;
+      op.offset = static_cast<uint64_t>(i) * BLKSIZE;
+      if (state->ring != NULL) {
+        state->ring->Push(op);
+      } else {
+        OPQ_TAILQ_ADD(state->tailq, op);
+      }
+      thread->stats.FinishedSingleOp();
+    }
+    char msg[100];
+    snprintf(msg, sizeof(msg), "(%d producers, 1 consumer)", FLAGS_threads);
+    thread->stats.AddMessage(msg);
+  }
+
   void SnappyCompress(ThreadState* thread) {
     RandomGenerator gen;
     Slice input = gen.Generate(Options().block_size);
@@ -797,16 +1034,83 @@ class Benchmark {
     }
   }
 
+  // Options shared by Open() and DestroyDB()
+  static Options BaseOptions() {
+    Options options;
+    if (FLAGS_mirror && FLAGS_mirror_path != NULL) {
+      options.mirror_path = FLAGS_mirror_path;
+      options.mirror_helpers = FLAGS_mirror_helpers;
+      options.mirror_queue_cap =
+          static_cast<size_t>(FLAGS_mirror_queue_cap) << 20;
+      options.mirror_lag_target =
+          static_cast<size_t>(FLAGS_mirror_lag_target) << 20;
+      options.mirror_write_rate =
+          static_cast<uint64_t>(FLAGS_mirror_write_rate) << 20;
+      options.mirror_delete_rate =
+          static_cast<uint64_t>(FLAGS_mirror_delete_rate) << 20;
+      options.mirror_copy_on_close = FLAGS_mirror_copy_on_close;
+      options.mirror_metadata = FLAGS_mirror_metadata;
+      options.mirror_resync_threads = FLAGS_mirror_resync_threads;
+      options.mirror_resync_rate =
+          static_cast<uint64_t>(FLAGS_mirror_resync_rate) << 20;
+      options.mirror_scrub_rate =
+          static_cast<uint64_t>(FLAGS_mirror_scrub_rate) << 20;
+      options.mirror_read_levels = FLAGS_mirror_read_levels;
+      options.mirror_read_routing = FLAGS_mirror_read_routing;
+      options.mirror_read_balance =
+          static_cast<leveldb::MirrorReadBalance>(FLAGS_mirror_read_balance);
+    }
+    options.compaction_write_rate =
+        static_cast<uint64_t>(FLAGS_compaction_write_rate) << 20;
+    if (device_env != NULL) {
+      options.env = device_env;
+    }
+    return options;
+  }
+
   void Open() {
     assert(db_ == NULL);
-    Options options;
+    Options options = BaseOptions();
     options.create_if_missing = !FLAGS_use_existing_db;
     options.block_cache = cache_;
     options.write_buffer_size = FLAGS_write_buffer_size;
     options.max_open_files = FLAGS_open_files;
     options.filter_policy = filter_policy_;
+    options.mirror_policy = mirror_policy_;
     options.compression = leveldb::kNoCompression;
-    Status s = DB::Open(options, FLAGS_db, &db_);
+    if (FLAGS_file_size > 0) {
+      options.target_file_size = static_cast<uint64_t>(FLAGS_file_size) << 20;
+    }
+    if (FLAGS_file_size_multiplier > 0) {
+      options.target_file_size_multiplier = FLAGS_file_size_multiplier;
+    }
+    if (FLAGS_level0_size > 0) {
+      options.level1_size = static_cast<uint64_t>(FLAGS_level0_size) << 20;
+    }
+    if (FLAGS_level_ratio > 0) {
+      options.level_ratio = FLAGS_level_ratio;
+    }
+    if (FLAGS_level0_trigger > 0) {
+      options.level0_compaction_trigger = FLAGS_level0_trigger;
+    }
+    if (FLAGS_level0_slowdown > 0) {
+      options.level0_slowdown_writes_trigger = FLAGS_level0_slowdown;
+    }
+    if (FLAGS_level0_stop > 0) {
+      options.level0_stop_writes_trigger = FLAGS_level0_stop;
+    }
+    if (FLAGS_max_background_compactions > 0) {
+      options.max_background_compactions = FLAGS_max_background_compactions;
+    }
+    if (FLAGS_max_subcompactions > 0) {
+      options.max_subcompactions = FLAGS_max_subcompactions;
+    }
+    Status s;
+    if (FLAGS_use_follower) {
+      s = DB::OpenAsFollower(options, FLAGS_mirror_path, &db_);
+    } else {
+      s = DB::Open(options, FLAGS_db, &db_);
+    }
     if (!s.ok()) {
       fprintf(stderr, "open error: %s\n", s.ToString().c_str());
       exit(1);
@@ -852,7 +1156,9 @@ class Benchmark {
   }
 
   void ReadSequential(ThreadState* thread) {
-    Iterator* iter = db_->NewIterator(ReadOptions());
+    ReadOptions options;
+    options.prefetch_blocks = FLAGS_prefetch_blocks;
+    Iterator* iter = db_->NewIterator(options);
     int i = 0;
     int64_t bytes = 0;
     for (iter->SeekToFirst(); i < reads_ && iter->Valid(); iter->Next()) {
@@ -1291,16 +1597,80 @@ int main(int argc, char** argv) {
       FLAGS_write_from = n64;
     } else if (sscanf(argv[i], "--write_key_upto=%ld%c", &n64, &junk) == 1) {
       FLAGS_write_upto = n64;
-    } else if (sscanf(argv[i], "--mirror=%d%c", &n, &junk) == 1) {
-      MIRROR_ENABLE = n;
+    } else if (sscanf(argv[i], "--mirror=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_mirror = n;
     } else if (strncmp(argv[i], "--mirror_path=", 14) == 0) {
-      MIRROR_PATH = argv[i] + 14;
+      FLAGS_mirror_path = argv[i] + 14;
+    } else if (sscanf(argv[i], "--mirror_helpers=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_helpers = n;
+    } else if (sscanf(argv[i], "--mirror_queue_cap=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_queue_cap = n;
+    } else if (strncmp(argv[i], "--mirror_read_levels=", 21) == 0) {
+      FLAGS_mirror_read_levels = leveldb::ParseLevels(argv[i] + 21);
+    } else if (sscanf(argv[i], "--mirror_read_routing=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_mirror_read_routing = n;
+    } else if (sscanf(argv[i], "--mirror_lag_target=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_lag_target = n;
+    } else if (sscanf(argv[i], "--mirror_copy_on_close=%d%c",
+                      &n, &junk) == 1 && (n == 0 || n == 1)) {
+      FLAGS_mirror_copy_on_close = n;
+    } else if (sscanf(argv[i], "--mirror_metadata=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_mirror_metadata = n;
+    } else if (sscanf(argv[i], "--use_follower=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_use_follower = n;
+    } else if (sscanf(argv[i], "--mirror_min_level=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_min_level = n;
+    } else if (sscanf(argv[i], "--compaction_write_rate=%d%c",
+                      &n, &junk) == 1) {
+      FLAGS_compaction_write_rate = n;
+    } else if (sscanf(argv[i], "--mirror_write_rate=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_write_rate = n;
+    } else if (sscanf(argv[i], "--mirror_delete_rate=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_delete_rate = n;
+    } else if (sscanf(argv[i], "--mirror_resync_threads=%d%c",
+                      &n, &junk) == 1) {
+      FLAGS_mirror_resync_threads = n;
+    } else if (sscanf(argv[i], "--mirror_resync_rate=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_resync_rate = n;
+    } else if (sscanf(argv[i], "--mirror_scrub_rate=%d%c", &n, &junk) == 1) {
+      FLAGS_mirror_scrub_rate = n;
+    } else if (sscanf(argv[i], "--mirror_read_balance=%d%c", &n, &junk) == 1 &&
+               n >= leveldb::kNoReadBalance && n <= leveldb::kBalanceByLoad) {
+      FLAGS_mirror_read_balance = n;
+    } else if (sscanf(argv[i], "--mirror_pool_buffers=%d%c", &n, &junk) == 1) {
+      MIRROR_POOL_BUFFERS = n;
+    } else if (sscanf(argv[i], "--mirror_huge_pages=%d%c", &n, &junk) == 1) {
+      MIRROR_HUGE_PAGES = n;
+    } else if (sscanf(argv[i], "--mirror_readahead=%d%c", &n, &junk) == 1) {
+      MIRROR_READAHEAD = static_cast<size_t>(n) * 1024; // in KiB
+    } else if (sscanf(argv[i], "--prefetch_blocks=%d%c", &n, &junk) == 1) {
+      FLAGS_prefetch_blocks = n;
+    } else if (strncmp(argv[i], "--device_profile=", 17) == 0) {
+      FLAGS_device_profile = argv[i] + 17;
     } else if (sscanf(argv[i], "--file_size=%d%c", &n, &junk) == 1) {
-      leveldb::config::kTargetFileSize = n * 1048576; // in MiB
+      FLAGS_file_size = n;
+    } else if (sscanf(argv[i], "--file_size_multiplier=%d%c",
+                      &n, &junk) == 1) {
+      FLAGS_file_size_multiplier = n;
     } else if (sscanf(argv[i], "--level0_size=%d%c", &n, &junk) == 1) {
-      leveldb::config::kL0_Size = n;
+      FLAGS_level0_size = n;
     } else if (sscanf(argv[i], "--level_ratio=%d%c", &n, &junk) == 1) {
-      leveldb::config::kLevelRatio = n;
+      FLAGS_level_ratio = n;
+    } else if (sscanf(argv[i], "--level0_trigger=%d%c", &n, &junk) == 1) {
+      FLAGS_level0_trigger = n;
+    } else if (sscanf(argv[i], "--level0_slowdown=%d%c", &n, &junk) == 1) {
+      FLAGS_level0_slowdown = n;
+    } else if (sscanf(argv[i], "--level0_stop=%d%c", &n, &junk) == 1) {
+      FLAGS_level0_stop = n;
+    } else if (sscanf(argv[i], "--max_background_compactions=%d%c",
+                      &n, &junk) == 1) {
+      FLAGS_max_background_compactions = n;
+    } else if (sscanf(argv[i], "--max_subcompactions=%d%c", &n, &junk) == 1) {
+      FLAGS_max_subcompactions = n;
     } else if (sscanf(argv[i], "--countdown=%lf%c", &d, &junk) == 1) {
       FLAGS_countdown = d;
     } else {
@@ -1323,6 +1693,31 @@ int main(int argc, char** argv) {
       FLAGS_db = default_db_path.c_str();
   }
 
+  if (FLAGS_use_follower) {
+    if (FLAGS_mirror_path == NULL) {
+      fprintf(stderr, "--use_follower needs --mirror_path\n");
+      exit(1);
+    }
+    FLAGS_use_existing_db = true;  // The leader writes it
+  }
+
+  if (FLAGS_device_profile != NULL) {
+    std::string primary = FLAGS_device_profile;
+    std::string secondary = primary;
+    const size_t colon = primary.find(':');
+    if (colon != std::string::npos) {
+      secondary = primary.substr(colon + 1);
+      primary.resize(colon);
+    }
+    leveldb::DeviceProfile p, s;
+    if (!leveldb::GetDeviceProfile(primary, &p) ||
+        !leveldb::GetDeviceProfile(secondary, &s)) {
+      fprintf(stderr, "Invalid device profile '%s'\n", FLAGS_device_profile);
+      exit(1);
+    }
+    device_env = leveldb::NewDeviceEnv(leveldb::Env::Default(), p, s);
+  }
+
   leveldb::Benchmark benchmark;
   benchmark.Run();
   return 0;
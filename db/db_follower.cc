@@ -0,0 +1,493 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/db_follower.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "db/db_iter.h"
+#include "db/filename.h"
+#include "db/log_reader.h"
+#include "db/memtable.h"
+#include "db/table_cache.h"
+#include "db/version_set.h"
+#include "db/write_batch_internal.h"
+#include "leveldb/cache.h"
+#include "leveldb/write_batch.h"
+#include "table/merger.h"
+#include "util/logging.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+// Shares the table cache sizing of DBImpl
+static const int kNumNonTableCacheFiles = 10;
+
+// Longest the poll thread sleeps at a time, so that shutdown is not
+// held up
+static const uint64_t kSliceMicros = 100000;
+
+namespace {
+
+struct TailReporter : public log::Reader::Reporter {
+  bool torn;
+  TailReporter() : torn(false) { }
+  virtual void Corruption(size_t bytes, const Status& s) {
+    torn = true;
+  }
+};
+
+// Append to *records the records of the log file "fname" that follow
+// those read before: *position is one past the offset of the last one
+// read, 0 if none was, and is advanced.  Stops at the first torn or
+// corrupt record, as the leader's helper may be in the middle of
+// writing it; the next call tries it again.  A missing file has no
+// records.
+void TailLog(Env* env, const std::string& fname, uint64_t* position,
+             std::vector<std::string>* records) {
+  SequentialFile* file;
+  if (!env->NewSequentialFile(fname, &file).ok()) {
+    return;
+  }
+  TailReporter reporter;
+  log::Reader reader(file, &reporter, true/*checksum*/,
+                     (*position > 0) ? *position - 1 : 0);
+  Slice record;
+  std::string scratch;
+  while (reader.ReadRecord(&record, &scratch) && !reporter.torn) {
+    if (reader.LastRecordOffset() >= *position) {
+      records->push_back(record.ToString());
+      *position = reader.LastRecordOffset() + 1;
+    }
+  }
+  delete file;
+}
+
+struct IterState {
+  port::Mutex* mu;
+  Version* version;
+  MemTable* mem;
+};
+
+static void CleanupIteratorState(void* arg1, void* arg2) {
+  IterState* state = reinterpret_cast<IterState*>(arg1);
+  state->mu->Lock();
+  state->mem->Unref();
+  state->version->Unref();
+  state->mu->Unlock();
+  delete state;
+}
+
+}  // namespace
+
+static Options SanitizeFollowerOptions(const InternalKeyComparator* icmp,
+                                       const InternalFilterPolicy* ipolicy,
+                                       const Options& src) {
+  Options result = src;
+  result.comparator = icmp;
+  result.filter_policy = (src.filter_policy != NULL) ? ipolicy : NULL;
+  if (result.max_open_files < 64 + kNumNonTableCacheFiles) {
+    result.max_open_files = 64 + kNumNonTableCacheFiles;
+  }
+  if (result.block_cache == NULL) {
+    result.block_cache = NewLRUCache(8 << 20);
+  }
+  // The follower's directory is the mirror; it has none of its own
+  result.mirror_path.clear();
+  result.mirror_metadata = false;
+  result.mirror_read_levels = 0;
+  result.mirror_read_routing = false;
+  result.mirror_read_balance = kNoReadBalance;
+  return result;
+}
+
+DBFollower::DBFollower(const Options& options, const std::string& dbname)
+    : env_(options.env),
+      internal_comparator_(options.comparator),
+      internal_filter_policy_(options.filter_policy),
+      options_(SanitizeFollowerOptions(
+          &internal_comparator_, &internal_filter_policy_, options)),
+      owns_cache_(options_.block_cache != options.block_cache),
+      dbname_(dbname),
+      manifest_position_(0),
+      log_position_(0),
+      shutting_down_(NULL),
+      bg_cv_(&mutex_),
+      polling_(false),
+      mem_(new MemTable(internal_comparator_)),
+      mem_log_(0),
+      log_(0),
+      sequence_(0) {
+  memset(&stats_, 0, sizeof(stats_));
+  mem_->Ref();
+  table_cache_ = new TableCache(dbname_, &options_,
+                                options_.max_open_files -
+                                kNumNonTableCacheFiles);
+  versions_ = new VersionSet(dbname_, &options_, table_cache_,
+                             &internal_comparator_);
+}
+
+DBFollower::~DBFollower() {
+  // Wait for the poll thread to finish
+  mutex_.Lock();
+  shutting_down_.Release_Store(this);
+  while (polling_) {
+    bg_cv_.Wait();
+  }
+  mutex_.Unlock();
+
+  delete versions_;
+  mem_->Unref();
+  delete table_cache_;
+  if (owns_cache_) {
+    delete options_.block_cache;
+  }
+}
+
+Status DBFollower::Open() {
+  Status s = CatchUp();
+  if (s.ok()) {
+    MutexLock l(&catch_up_mu_);
+    if (manifest_.empty()) {
+      s = Status::IOError(dbname_, "tables named by the MANIFEST are missing");
+    }
+  }
+  if (s.ok() && options_.follower_poll_micros > 0) {
+    MutexLock l(&mutex_);
+    polling_ = true;
+    env_->StartThread(&DBFollower::Work, this);
+  }
+  return s;
+}
+
+void DBFollower::Work(void* arg) {
+  reinterpret_cast<DBFollower*>(arg)->Run();
+}
+
+void DBFollower::Run() {
+  const uint64_t interval = options_.follower_poll_micros;
+  uint64_t idle = 0;
+  while (shutting_down_.Acquire_Load() == NULL) {
+    if (idle < interval) {
+      const uint64_t slice = std::min(kSliceMicros, interval - idle);
+      env_->SleepForMicroseconds(static_cast<int>(slice));
+      idle += slice;
+    } else {
+      CatchUp();  // Failures are counted; the next poll tries again
+      idle = 0;
+    }
+  }
+  MutexLock l(&mutex_);
+  polling_ = false;
+  bg_cv_.SignalAll();
+}
+
+Status DBFollower::CatchUp() {
+  MutexLock l(&catch_up_mu_);
+  std::string current;
+  Status s = ReadFileToString(env_, CurrentFileName(dbname_), &current);
+  if (s.ok() && (current.empty() || current[current.size()-1] != '\n')) {
+    s = Status::Corruption("CURRENT file does not end with newline");
+  }
+
+  // The edits appended to the MANIFEST, or all of a new one
+  std::vector<std::string> edits;
+  bool from_scratch = false;
+  uint64_t position = 0;
+  if (s.ok()) {
+    current.resize(current.size() - 1);
+    from_scratch = (current != manifest_);
+    position = from_scratch ? 0 : manifest_position_;
+    TailLog(env_, dbname_ + "/" + current, &position, &edits);
+  }
+  bool installed = true;
+  uint64_t log_number = 0;
+  {
+    MutexLock m(&mutex_);
+    stats_.catch_ups++;
+    if (s.ok() && !edits.empty()) {
+      s = versions_->Replay(edits, from_scratch, &installed);
+      if (s.ok() && installed) {
+        stats_.edits += edits.size();
+      } else if (s.ok()) {
+        stats_.deferred++;
+      }
+    }
+    log_number = versions_->LogNumber();
+    if (!s.ok()) {
+      stats_.errors++;
+      return s;
+    }
+  }
+  if (installed && !edits.empty()) {
+    manifest_ = current;
+    manifest_position_ = position;
+  }
+  if (manifest_.empty()) {
+    return s;  // Nothing to read the log against yet
+  }
+
+  // Then the logs from the one that MANIFEST names on.  They are listed
+  // first: a log followed by a newer one in the listing was complete in
+  // the mirror when listed (the metadata helper renames a new log into
+  // place only after the writes queued before it), so only the newest
+  // can be missing records that a newer log holds.
+  std::vector<std::string> children;
+  env_->GetChildren(dbname_, &children);  // Ignoring errors on purpose
+  std::vector<uint64_t> logs;
+  uint64_t number;
+  FileType type;
+  for (size_t i = 0; i < children.size(); i++) {
+    if (ParseFileName(children[i], &number, &type) &&
+        type == kLogFile && number >= log_number) {
+      logs.push_back(number);
+    }
+  }
+  std::sort(logs.begin(), logs.end());
+
+  SequenceNumber max_sequence = 0;
+  if (log_number != mem_log_) {
+    // The logs before log_number are in table files by now
+    MemTable* mem = new MemTable(internal_comparator_);
+    mem->Ref();
+    uint64_t newest = log_number;
+    uint64_t position = 0;
+    for (size_t i = 0; i < logs.size(); i++) {
+      newest = logs[i];
+      position = 0;
+      ReplayLog(newest, &position, mem, &max_sequence);
+    }
+    MutexLock m(&mutex_);
+    mem_->Unref();
+    mem_ = mem;
+    mem_log_ = log_number;
+    log_ = newest;
+    log_position_ = position;
+    stats_.rebuilds++;
+  } else {
+    for (size_t i = 0; i < logs.size(); i++) {
+      if (logs[i] < log_) {
+        continue;
+      } else if (logs[i] > log_) {
+        MutexLock m(&mutex_);
+        log_ = logs[i];
+        log_position_ = 0;
+      }
+      ReplayLog(log_, &log_position_, mem_, &max_sequence);
+    }
+  }
+  MutexLock m(&mutex_);
+  sequence_ = std::max(sequence_,
+                       std::max(versions_->LastSequence(), max_sequence));
+  return s;
+}
+
+void DBFollower::ReplayLog(uint64_t number, uint64_t* position,
+                           MemTable* mem, SequenceNumber* max_sequence) {
+  std::vector<std::string> records;
+  TailLog(env_, LogFileName(dbname_, number), position, &records);
+  WriteBatch batch;
+  uint64_t replayed = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    if (records[i].size() < 12) {
+      continue;
+    }
+    WriteBatchInternal::SetContents(&batch, records[i]);
+    // Readers of mem do not see these until sequence_ covers them
+    if (WriteBatchInternal::InsertInto(&batch, mem).ok()) {
+      const SequenceNumber last_seq =
+          WriteBatchInternal::Sequence(&batch) +
+          WriteBatchInternal::Count(&batch) - 1;
+      *max_sequence = std::max(*max_sequence, last_seq);
+      replayed++;
+    }
+  }
+  MutexLock l(&mutex_);
+  stats_.records += replayed;
+}
+
+Status DBFollower::Put(const WriteOptions& o, const Slice& key,
+                       const Slice& val) {
+  return Status::NotSupported("read-only follower");
+}
+
+Status DBFollower::Delete(const WriteOptions& o, const Slice& key) {
+  return Status::NotSupported("read-only follower");
+}
+
+Status DBFollower::Write(const WriteOptions& options, WriteBatch* updates) {
+  return Status::NotSupported("read-only follower");
+}
+
+void DBFollower::CompactRange(const Slice* begin, const Slice* end) {
+  // The leader compacts
+}
+
+Status DBFollower::Get(const ReadOptions& options,
+                       const Slice& key,
+                       std::string* value) {
+  Status s;
+  MutexLock l(&mutex_);
+  SequenceNumber snapshot;
+  if (options.snapshot != NULL) {
+    snapshot = reinterpret_cast<const SnapshotImpl*>(options.snapshot)->number_;
+  } else {
+    snapshot = sequence_;
+  }
+
+  MemTable* mem = mem_;
+  Version* current = versions_->current();
+  mem->Ref();
+  current->Ref();
+
+  // Unlock while reading from files and memtables
+  {
+    mutex_.Unlock();
+    LookupKey lkey(key, snapshot);
+    if (!mem->Get(lkey, value, &s)) {
+      Version::GetStats stats;
+      s = current->Get(options, lkey, value, &stats);
+    }
+    mutex_.Lock();
+  }
+
+  mem->Unref();
+  current->Unref();
+  return s;
+}
+
+Iterator* DBFollower::NewIterator(const ReadOptions& options, bool mirror) {
+  IterState* cleanup = new IterState;
+  mutex_.Lock();
+  const SequenceNumber latest_snapshot = sequence_;
+
+  // Collect together all needed child iterators
+  std::vector<Iterator*> list;
+  list.push_back(mem_->NewIterator());
+  mem_->Ref();
+  versions_->current()->AddIterators(options, &list, mirror);
+  Iterator* internal_iter =
+      NewMergingIterator(&internal_comparator_, &list[0], list.size());
+  versions_->current()->Ref();
+
+  cleanup->mu = &mutex_;
+  cleanup->mem = mem_;
+  cleanup->version = versions_->current();
+  internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, NULL);
+  mutex_.Unlock();
+
+  return NewDBIterator(
+      &dbname_, env_, user_comparator(), internal_iter,
+      (options.snapshot != NULL
+       ? reinterpret_cast<const SnapshotImpl*>(options.snapshot)->number_
+       : latest_snapshot));
+}
+
+const Snapshot* DBFollower::GetSnapshot() {
+  MutexLock l(&mutex_);
+  return snapshots_.New(sequence_);
+}
+
+void DBFollower::ReleaseSnapshot(const Snapshot* s) {
+  MutexLock l(&mutex_);
+  snapshots_.Delete(reinterpret_cast<const SnapshotImpl*>(s));
+}
+
+void DBFollower::GetStats(Stats* stats) {
+  MutexLock l(&mutex_);
+  *stats = stats_;
+}
+
+bool DBFollower::GetProperty(const Slice& property, std::string* value) {
+  value->clear();
+
+  MutexLock l(&mutex_);
+  Slice in = property;
+  Slice prefix("leveldb.");
+  if (!in.starts_with(prefix)) return false;
+  in.remove_prefix(prefix.size());
+
+  if (in.starts_with("num-files-at-level")) {
+    in.remove_prefix(strlen("num-files-at-level"));
+    uint64_t level;
+    bool ok = ConsumeDecimalNumber(&in, &level) && in.empty();
+    if (!ok || level >= config::kNumLevels) {
+      return false;
+    } else {
+      char buf[100];
+      snprintf(buf, sizeof(buf), "%d",
+               versions_->NumLevelFiles(static_cast<int>(level)));
+      *value = buf;
+      return true;
+    }
+  } else if (in == "sstables") {
+    *value = versions_->current()->DebugString();
+    return true;
+  } else if (in == "follower") {
+    char buf[500];
+    snprintf(buf, sizeof(buf),
+             "Catch-ups: %llu\n"
+             "Edits replayed: %llu\n"
+             "Edits deferred: %llu\n"
+             "Log records replayed: %llu\n"
+             "Memtable rebuilds: %llu\n"
+             "Errors: %llu\n"
+             "Log: %llu\n"
+             "Sequence: %llu\n",
+             static_cast<unsigned long long>(stats_.catch_ups),
+             static_cast<unsigned long long>(stats_.edits),
+             static_cast<unsigned long long>(stats_.deferred),
+             static_cast<unsigned long long>(stats_.records),
+             static_cast<unsigned long long>(stats_.rebuilds),
+             static_cast<unsigned long long>(stats_.errors),
+             static_cast<unsigned long long>(log_),
+             static_cast<unsigned long long>(sequence_));
+    *value = buf;
+    return true;
+  }
+
+  return false;
+}
+
+void DBFollower::GetApproximateSizes(
+    const Range* range, int n,
+    uint64_t* sizes) {
+  Version* v;
+  {
+    MutexLock l(&mutex_);
+    versions_->current()->Ref();
+    v = versions_->current();
+  }
+
+  for (int i = 0; i < n; i++) {
+    // Convert user_key into a corresponding internal key.
+    InternalKey k1(range[i].start, kMaxSequenceNumber, kValueTypeForSeek);
+    InternalKey k2(range[i].limit, kMaxSequenceNumber, kValueTypeForSeek);
+    uint64_t start = versions_->ApproximateOffsetOf(v, k1);
+    uint64_t limit = versions_->ApproximateOffsetOf(v, k2);
+    sizes[i] = (limit >= start ? limit - start : 0);
+  }
+
+  {
+    MutexLock l(&mutex_);
+    v->Unref();
+  }
+}
+
+Status DB::OpenAsFollower(const Options& options,
+                          const std::string& mirror_path,
+                          DB** dbptr) {
+  *dbptr = NULL;
+  DBFollower* follower = new DBFollower(options, mirror_path);
+  Status s = follower->Open();
+  if (s.ok()) {
+    *dbptr = follower;
+  } else {
+    delete follower;
+  }
+  return s;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,120 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// DBFollower is a read-only DB over the mirror directory of a DB opened
+// elsewhere with Options::mirror_metadata (the leader); see
+// DB::OpenAsFollower().  Each catch-up replays the edits the leader has
+// appended to its MANIFEST since the last one, then the records it has
+// appended to the logs from the one that MANIFEST names on, into a
+// memtable of the follower's own.  When the MANIFEST names a newer log,
+// the memtable is rebuilt from the logs left: the older ones are in
+// table files by then.
+// The metadata helper writes a MANIFEST record to the mirror only after
+// the log records and the table copies queued before it, so whatever
+// the edits a catch-up installs cover is readable from the mirror.
+
+#ifndef STORAGE_LEVELDB_DB_DB_FOLLOWER_H_
+#define STORAGE_LEVELDB_DB_DB_FOLLOWER_H_
+
+#include <string>
+#include <vector>
+#include "db/dbformat.h"
+#include "db/snapshot.h"
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "port/port.h"
+
+namespace leveldb {
+
+class MemTable;
+class TableCache;
+class VersionSet;
+
+class DBFollower : public DB {
+ public:
+  struct Stats {
+    uint64_t catch_ups;
+    uint64_t edits;             // MANIFEST records replayed
+    uint64_t deferred;          // Catch-ups whose edits named missing tables
+    uint64_t records;           // Log records replayed
+    uint64_t rebuilds;          // Memtables rebuilt from a newer log
+    uint64_t errors;            // Catch-ups that failed
+  };
+
+  DBFollower(const Options& options, const std::string& dbname);
+  virtual ~DBFollower();
+
+  // Catch up for the first time, then start polling every
+  // options.follower_poll_micros.  Fails if the mirror has no CURRENT
+  // or the tables its MANIFEST names are not all there.
+  Status Open();
+
+  // Implementations of the DB interface
+  virtual Status Put(const WriteOptions&, const Slice& key, const Slice& value);
+  virtual Status Delete(const WriteOptions&, const Slice& key);
+  virtual Status Write(const WriteOptions& options, WriteBatch* updates);
+  virtual Status Get(const ReadOptions& options,
+                     const Slice& key,
+                     std::string* value);
+  virtual Iterator* NewIterator(const ReadOptions&, bool mirror=false);
+  virtual const Snapshot* GetSnapshot();
+  virtual void ReleaseSnapshot(const Snapshot* snapshot);
+  virtual bool GetProperty(const Slice& property, std::string* value);
+  virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
+  virtual void CompactRange(const Slice* begin, const Slice* end);
+  virtual Status CatchUp();
+
+  void GetStats(Stats* stats);
+
+ private:
+  static void Work(void* arg);
+  void Run();
+
+  // Replay the records that follow *position (see TailLog()) in log file
+  // "number" into "mem".  Raises *max_sequence to the last sequence
+  // number they hold.
+  void ReplayLog(uint64_t number, uint64_t* position, MemTable* mem,
+                 SequenceNumber* max_sequence);
+
+  const Comparator* user_comparator() const {
+    return internal_comparator_.user_comparator();
+  }
+
+  // Constant after construction
+  Env* const env_;
+  const InternalKeyComparator internal_comparator_;
+  const InternalFilterPolicy internal_filter_policy_;
+  const Options options_;  // options_.comparator == &internal_comparator_
+  bool owns_cache_;
+  const std::string dbname_;
+
+  // table_cache_ provides its own synchronization
+  TableCache* table_cache_;
+
+  // Serializes catch-ups; guards the positions they resume from
+  port::Mutex catch_up_mu_;
+  std::string manifest_;        // Descriptor being replayed, "" before
+  uint64_t manifest_position_;
+  uint64_t log_position_;       // In log_
+
+  port::Mutex mutex_;
+  port::AtomicPointer shutting_down_;
+  port::CondVar bg_cv_;         // Signalled when the poll thread exits
+  bool polling_;
+  VersionSet* versions_;
+  MemTable* mem_;
+  uint64_t mem_log_;            // First log whose records mem_ holds
+  uint64_t log_;                // Newest log read, 0 before
+  SequenceNumber sequence_;     // Reads see the updates up to it
+  SnapshotList snapshots_;
+  Stats stats_;
+
+  // No copying allowed
+  DBFollower(const DBFollower&);
+  void operator=(const DBFollower&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_DB_FOLLOWER_H_
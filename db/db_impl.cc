@@ -5,6 +5,7 @@
 #include "db/db_impl.h"
 
 #include <algorithm>
+#include <map>
 #include <set>
 #include <string>
 #include <stdint.h>
@@ -18,6 +19,8 @@
 #include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/memtable.h"
+#include "db/mirror_resync.h"
+#include "db/mirror_scrubber.h"
 #include "db/table_cache.h"
 #include "db/version_set.h"
 #include "db/write_batch_internal.h"
@@ -27,6 +30,7 @@
 #include "leveldb/table.h"
 #include "leveldb/table_builder.h"
 #include "leveldb/mirror.h"
+#include "leveldb/mirror_policy.h"
 #include "port/port.h"
 #include "table/block.h"
 #include "table/merger.h"
@@ -34,6 +38,7 @@
 #include "util/coding.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
+#include "util/rate_limiter.h"
 
 namespace leveldb {
 
@@ -64,6 +69,7 @@ struct DBImpl::CompactionState {
     uint64_t number;
     uint64_t file_size;
     InternalKey smallest, largest;
+    bool mirrored;        // See Options::mirror_policy
   };
   std::vector<Output> outputs;
 
@@ -73,16 +79,32 @@ struct DBImpl::CompactionState {
 
   uint64_t total_bytes;
 
+  // Key range of a shard of the compaction: the user keys after
+  // *shard_begin and up to *shard_end, NULL meaning unbounded
+  const std::string* shard_begin;
+  const std::string* shard_end;
+  Status shard_status;
+
   Output* current_output() { return &outputs[outputs.size()-1]; }
 
   explicit CompactionState(Compaction* c)
       : compaction(c),
         outfile(NULL),
         builder(NULL),
-        total_bytes(0) {
+        total_bytes(0),
+        shard_begin(NULL),
+        shard_end(NULL) {
   }
 };
 
+// A shard of a compaction run in a thread of its own
+struct DBImpl::ShardWork {
+  DBImpl* db;
+  CompactionState* compact;
+  bool mirror_reads;
+  void* thread;           // See Env::StartJoinableThread()
+};
+
 // Fix user-supplied options to be reasonable
 template <class T,class V>
 static void ClipToRange(T* ptr, V minvalue, V maxvalue) {
@@ -99,6 +121,18 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.max_open_files,    64 + kNumNonTableCacheFiles, 50000);
   ClipToRange(&result.write_buffer_size, 64<<10,                      1<<30);
   ClipToRange(&result.block_size,        1<<10,                       4<<20);
+  ClipToRange(&result.target_file_size,  uint64_t(64<<10),            uint64_t(1<<30));
+  ClipToRange(&result.target_file_size_multiplier, 1,                 10);
+  ClipToRange(&result.level1_size,       uint64_t(1<<20),             uint64_t(1)<<40);
+  ClipToRange(&result.level_ratio,       2,                           100);
+  ClipToRange(&result.level0_compaction_trigger, 1,                   1000);
+  ClipToRange(&result.level0_slowdown_writes_trigger,
+              result.level0_compaction_trigger,                       1000);
+  ClipToRange(&result.level0_stop_writes_trigger,
+              result.level0_slowdown_writes_trigger,                  1000);
+  ClipToRange(&result.max_mem_compact_level, 0,                       config::kNumLevels - 2);
+  ClipToRange(&result.max_background_compactions, 1,                  64);
+  ClipToRange(&result.max_subcompactions, 1,                          64);
   if (result.info_log == NULL) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -124,37 +158,67 @@ DBImpl::DBImpl(const Options& options, const std::string& dbname)
       owns_info_log_(options_.info_log != options.info_log),
       owns_cache_(options_.block_cache != options.block_cache),
       dbname_(dbname),
+      mirror_(NULL),
+      compaction_limiter_(NULL),
+      resync_(NULL),
+      scrubber_(NULL),
       db_lock_(NULL),
       shutting_down_(NULL),
       bg_cv_(&mutex_),
       mem_(new MemTable(internal_comparator_)),
       imm_(NULL),
+      imm_sequence_(0),
       logfile_(NULL),
       logfile_number_(0),
       log_(NULL),
       tmp_batch_(new WriteBatch),
-      bg_compaction_scheduled_(false),
+      bg_compactions_scheduled_(0),
+      bg_flush_scheduled_(false),
+      flushing_(false),
+      manifest_busy_(false),
       manual_compaction_(NULL),
+      flushed_sequence_(0),
+      mirrored_sequence_(0),
+      unmirrored_files_(0),
+      unmirrored_bytes_(0),
       consecutive_compaction_errors_(0) {
   mem_->Ref();
   has_imm_.Release_Store(NULL);
 
+  if (!options_.mirror_path.empty()) {
+    mirror_status_ = env_->AttachMirror(dbname_, options_, &mirror_);
+  }
+  if (mirror_ != NULL) {
+    resync_ = new MirrorResync(env_, dbname_, mirror_,
+                               options_.mirror_resync_threads,
+                               options_.mirror_resync_rate);
+  }
+  if (options_.compaction_write_rate > 0) {
+    compaction_limiter_ = new RateLimiter(options_.compaction_write_rate,
+                                          env_);
+  }
+
   // Reserve ten files or so for other uses and give the rest to TableCache.
   const int table_cache_size = options.max_open_files - kNumNonTableCacheFiles;
-  table_cache_ = new TableCache(dbname_, &options_, table_cache_size);
+  table_cache_ = new TableCache(dbname_, &options_, table_cache_size,
+                                mirror_);
 
   versions_ = new VersionSet(dbname_, &options_, table_cache_,
                              &internal_comparator_);
+  env_->EnsureBackgroundThreads(options_.max_background_compactions,
+                                Env::kLowPriority);
+  if (mirror_ != NULL && options_.mirror_scrub_rate > 0) {
+    scrubber_ = new MirrorScrubber(env_, dbname_, mirror_, table_cache_,
+                                   versions_, &mutex_,
+                                   options_.mirror_scrub_rate);
+  }
 }
 
-extern pthread_t *mirror_helper;
-extern opq mio_queue;
-
 DBImpl::~DBImpl() {
   // Wait for background work to finish
   mutex_.Lock();
   shutting_down_.Release_Store(this);  // Any non-NULL value is ok
-  while (bg_compaction_scheduled_) {
+  while (bg_compactions_scheduled_ > 0 || bg_flush_scheduled_) {
     bg_cv_.Wait();
   }
   mutex_.Unlock();
@@ -163,24 +227,29 @@ DBImpl::~DBImpl() {
     env_->UnlockFile(db_lock_);
   }
 
-#ifdef USE_OPQ_THREAD
-	if (MIRROR_ENABLE) {
-		uint64_t primary_end_at = Env::Default()->NowMicros();
-		OPQ_ADD_HALT(mio_queue);	
-		if (mirror_helper != NULL) pthread_join(*mirror_helper, NULL);
-		uint64_t secondary_end_at = Env::Default()->NowMicros();
-		DEBUG_INFO3("MJoin", mirror_helper, (secondary_end_at - primary_end_at)/1000);
-		Log(options_.info_log, "MJoin takes %d ms", (secondary_end_at - primary_end_at)/1000);
-	}
-#endif
+  delete resync_;  // Before the mirror it copies to
+  delete scrubber_;
 
+  // The MANIFEST and the log queue their last writes to the mirror when
+  // closed (Options::mirror_metadata)
   delete versions_;
   if (mem_ != NULL) mem_->Unref();
   if (imm_ != NULL) imm_->Unref();
   delete tmp_batch_;
   delete log_;
   delete logfile_;
+
+	if (mirror_ != NULL) {
+		uint64_t primary_end_at = env_->NowMicros();
+		env_->DetachMirror(mirror_);	//waits for the queued mirror I/O
+		uint64_t secondary_end_at = env_->NowMicros();
+		DEBUG_INFO2("MJoin", (secondary_end_at - primary_end_at)/1000);
+		Log(options_.info_log, "MJoin takes %d ms",
+		    static_cast<int>((secondary_end_at - primary_end_at)/1000));
+	}
+
   delete table_cache_;
+  delete compaction_limiter_;
 
   if (owns_info_log_) {
     delete options_.info_log;
@@ -294,6 +363,9 @@ Status DBImpl::Recover(VersionEdit* edit) {
   if (!s.ok()) {
     return s;
   }
+  if (!mirror_status_.ok()) {
+    return mirror_status_;
+  }
 
   if (!env_->FileExists(CurrentFileName(dbname_))) {
     if (options_.create_if_missing) {
@@ -315,6 +387,7 @@ Status DBImpl::Recover(VersionEdit* edit) {
   s = versions_->Recover();
   if (s.ok()) {
     SequenceNumber max_sequence(0);
+    mirrored_sequence_ = versions_->LastSequence();
 
     // Recover from all newer log files than the ones named in the
     // descriptor (new log files may have been added by the previous
@@ -364,6 +437,8 @@ Status DBImpl::Recover(VersionEdit* edit) {
       if (versions_->LastSequence() < max_sequence) {
         versions_->SetLastSequence(max_sequence);
       }
+      // The logs were replayed into level-0 tables
+      flushed_sequence_ = versions_->LastSequence();
     }
   }
 
@@ -443,7 +518,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
     }
 
     if (mem->ApproximateMemoryUsage() > options_.write_buffer_size) {
-      status = WriteLevel0Table(mem, edit, NULL);
+      status = WriteLevel0Table(mem, edit, NULL, NULL);
       if (!status.ok()) {
         // Reflect errors immediately so that conditions like full
         // file-systems cause the DB::Open() to fail.
@@ -455,7 +530,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
   }
 
   if (status.ok() && mem != NULL) {
-    status = WriteLevel0Table(mem, edit, NULL);
+    status = WriteLevel0Table(mem, edit, NULL, NULL);
     // Reflect errors immediately so that conditions like full
     // file-systems cause the DB::Open() to fail.
   }
@@ -466,20 +541,26 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
 }
 
 Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
-                                Version* base) {
+                                Version* base, uint64_t* number) {
   mutex_.AssertHeld();
   const uint64_t start_micros = env_->NowMicros();
   FileMetaData meta;
   meta.number = versions_->NewFileNumber();
   pending_outputs_.insert(meta.number);
+  if (number != NULL) {
+    *number = meta.number;
+  }
   Iterator* iter = mem->NewIterator();
   Log(options_.info_log, "Level-0 table #%llu: started",
       (unsigned long long) meta.number);
 
+  // Judged as a level-0 file: where it lands is only known once it is built
+  const bool mirror = ShouldMirror(0, mem->ApproximateMemoryUsage());
   Status s;
   {
     mutex_.Unlock();
-    s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta);
+    s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta,
+                   mirror);
     mutex_.Lock();
   }
 
@@ -488,8 +569,9 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
       (unsigned long long) meta.file_size,
       s.ToString().c_str());
   delete iter;
-  pending_outputs_.erase(meta.number);
-
+  if (number == NULL) {
+    pending_outputs_.erase(meta.number);
+  }
 
   // Note that if file_size is zero, the file has been deleted and
   // should not be added to the manifest.
@@ -498,10 +580,22 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
     const Slice min_user_key = meta.smallest.user_key();
     const Slice max_user_key = meta.largest.user_key();
     if (base != NULL) {
-      level = base->PickLevelForMemTableOutput(min_user_key, max_user_key);
+      // Against the current version: compactions may have installed
+      // theirs while the table was being built.  Until the caller
+      // installs the edit, the table stays in pending_outputs_ and its
+      // range reserved, so that no compaction adds files over it.
+      level = versions_->current()->PickLevelForMemTableOutput(
+          min_user_key, max_user_key);
+      if (level > 0) {
+        versions_->ReserveFlushOutput(level, meta.smallest, meta.largest);
+      }
     }
     edit->AddFile(level, meta.number, meta.file_size,
                   meta.smallest, meta.largest);
+    if (!mirror) {
+      unmirrored_files_++;
+      unmirrored_bytes_ += meta.file_size;
+    }
   }
 
   CompactionStats stats;
@@ -514,12 +608,15 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
 Status DBImpl::CompactMemTable() {
   mutex_.AssertHeld();
   assert(imm_ != NULL);
+  assert(!flushing_);
+  flushing_ = true;
 
   // Save the contents of the memtable as a new Table
   VersionEdit edit;
   Version* base = versions_->current();
   base->Ref();
-  Status s = WriteLevel0Table(imm_, &edit, base);
+  uint64_t number;
+  Status s = WriteLevel0Table(imm_, &edit, base, &number);
   base->Unref();
 
   if (s.ok() && shutting_down_.Acquire_Load()) {
@@ -530,16 +627,21 @@ Status DBImpl::CompactMemTable() {
   if (s.ok()) {
     edit.SetPrevLogNumber(0);
     edit.SetLogNumber(logfile_number_);  // Earlier logs no longer needed
-    s = versions_->LogAndApply(&edit, &mutex_);
+    s = LogAndApply(&edit);
   }
+  pending_outputs_.erase(number);
+  versions_->ReleaseFlushOutput();
+  flushing_ = false;
 
   if (s.ok()) {
     // Commit to the new state
+    flushed_sequence_ = imm_sequence_;
     imm_->Unref();
     imm_ = NULL;
     has_imm_.Release_Store(NULL);
     DeleteObsoleteFiles();
   }
+  bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
 
   return s;
 }
@@ -612,19 +714,54 @@ Status DBImpl::TEST_CompactMemTable() {
   return s;
 }
 
+Status DBImpl::TEST_ScrubMirror() {
+  if (scrubber_ == NULL) {
+    return Status::NotSupported("no mirror scrubber");
+  }
+  scrubber_->RunPass();
+  return Status::OK();
+}
+
+Status DBImpl::LogAndApply(VersionEdit* edit) {
+  mutex_.AssertHeld();
+  while (manifest_busy_) {
+    bg_cv_.Wait();
+  }
+  manifest_busy_ = true;
+  Status s = versions_->LogAndApply(edit, &mutex_);
+  manifest_busy_ = false;
+  bg_cv_.SignalAll();
+  return s;
+}
+
 void DBImpl::MaybeScheduleCompaction() {
   mutex_.AssertHeld();
-  if (bg_compaction_scheduled_) {
-    // Already scheduled
-  } else if (shutting_down_.Acquire_Load()) {
+  if (shutting_down_.Acquire_Load()) {
     // DB is being deleted; no more background compactions
-  } else if (imm_ == NULL &&
-             manual_compaction_ == NULL &&
-             !versions_->NeedsCompaction()) {
-    // No work to be done
-  } else {
-    bg_compaction_scheduled_ = true;
-    env_->Schedule(&DBImpl::BGWork, this);
+    return;
+  }
+  if (imm_ != NULL && !bg_flush_scheduled_) {
+    bg_flush_scheduled_ = true;
+    env_->Schedule(&DBImpl::BGFlushWork, this, Env::kHighPriority);
+  }
+  while (bg_compactions_scheduled_ < options_.max_background_compactions) {
+    Compaction* c = NULL;
+    if (manual_compaction_ != NULL) {
+      // Runs alone: wait for the others to finish
+      if (bg_compactions_scheduled_ > 0) {
+        break;
+      }
+    } else if (!versions_->NeedsCompaction() ||
+               (c = versions_->PickCompaction()) == NULL) {
+      // No work to be done, or none that can run alongside the others
+      break;
+    }
+    queued_compactions_.push_back(c);
+    bg_compactions_scheduled_++;
+    env_->Schedule(&DBImpl::BGWork, this, Env::kLowPriority);
+    if (c == NULL) {
+      break;
+    }
   }
 }
 
@@ -632,39 +769,52 @@ void DBImpl::BGWork(void* db) {
   reinterpret_cast<DBImpl*>(db)->BackgroundCall();
 }
 
+void DBImpl::BGFlushWork(void* db) {
+  reinterpret_cast<DBImpl*>(db)->BackgroundFlush();
+}
+
+// Wait a little bit before retrying background work in case this is an
+// environmental problem and we do not want to chew up resources for
+// failed compactions for the duration of the problem.
+void DBImpl::BackoffAfterError(const Status& s) {
+  mutex_.AssertHeld();
+  if (s.ok()) {
+    // Success
+    consecutive_compaction_errors_ = 0;
+  } else if (shutting_down_.Acquire_Load()) {
+    // Error most likely due to shutdown; do not wait
+  } else {
+    bg_cv_.SignalAll();  // In case a waiter can proceed despite the error
+    Log(options_.info_log, "Waiting after background compaction error: %s",
+        s.ToString().c_str());
+    mutex_.Unlock();
+    ++consecutive_compaction_errors_;
+    int seconds_to_sleep = 1;
+    for (int i = 0; i < 3 && i < consecutive_compaction_errors_ - 1; ++i) {
+      seconds_to_sleep *= 2;
+    }
+    env_->SleepForMicroseconds(seconds_to_sleep * 1000000);
+    mutex_.Lock();
+  }
+}
+
 void DBImpl::BackgroundCall() {
-  //struct timespec bg_delay = { .tv_sec = 0, .tv_nsec = 62500000 };
-  //nanosleep(&bg_delay, NULL);
-  
   MutexLock l(&mutex_);
-  assert(bg_compaction_scheduled_);
+  assert(bg_compactions_scheduled_ > 0);
+  assert(!queued_compactions_.empty());
+  Compaction* c = queued_compactions_.front();
+  queued_compactions_.pop_front();
   if (!shutting_down_.Acquire_Load()) {
-    Status s = BackgroundCompaction();
-    if (s.ok()) {
-      // Success
-      consecutive_compaction_errors_ = 0;
-    } else if (shutting_down_.Acquire_Load()) {
-      // Error most likely due to shutdown; do not wait
-    } else {
-      // Wait a little bit before retrying background compaction in
-      // case this is an environmental problem and we do not want to
-      // chew up resources for failed compactions for the duration of
-      // the problem.
-      bg_cv_.SignalAll();  // In case a waiter can proceed despite the error
-      Log(options_.info_log, "Waiting after background compaction error: %s",
-          s.ToString().c_str());
-      mutex_.Unlock();
-      ++consecutive_compaction_errors_;
-      int seconds_to_sleep = 1;
-      for (int i = 0; i < 3 && i < consecutive_compaction_errors_ - 1; ++i) {
-        seconds_to_sleep *= 2;
-      }
-      env_->SleepForMicroseconds(seconds_to_sleep * 1000000);
-      mutex_.Lock();
+    BackoffAfterError(BackgroundCompaction(c));
+  } else {
+    delete c;
+    if (c == NULL && manual_compaction_ != NULL) {
+      manual_compaction_->done = true;
+      manual_compaction_ = NULL;
     }
   }
 
-  bg_compaction_scheduled_ = false;
+  bg_compactions_scheduled_--;
 
   // Previous compaction may have produced too many files in a level,
   // so reschedule another compaction if needed.
@@ -672,17 +822,32 @@ void DBImpl::BackgroundCall() {
   bg_cv_.SignalAll();
 }
 
-Status DBImpl::BackgroundCompaction() {
-  mutex_.AssertHeld();
-
-  if (imm_ != NULL) {
-    return CompactMemTable();
+void DBImpl::BackgroundFlush() {
+  MutexLock l(&mutex_);
+  assert(bg_flush_scheduled_);
+  // A compaction may have written imm_ out already, or be doing so
+  if (!shutting_down_.Acquire_Load() && imm_ != NULL && !flushing_) {
+    BackoffAfterError(CompactMemTable());
   }
 
-  Compaction* c;
-  bool is_manual = (manual_compaction_ != NULL);
+  bg_flush_scheduled_ = false;
+
+  // The new table may call for a compaction, or imm_ still be there
+  MaybeScheduleCompaction();
+  bg_cv_.SignalAll();
+}
+
+Status DBImpl::BackgroundCompaction(Compaction* c) {
+  mutex_.AssertHeld();
+
+  bool is_manual = (c == NULL);
   InternalKey manual_end;
   if (is_manual) {
+    // The flush reserves its output range before CompactRange() could
+    // see it
+    while (flushing_) {
+      bg_cv_.Wait();
+    }
     ManualCompaction* m = manual_compaction_;
     c = versions_->CompactRange(m->level, m->begin, m->end);
     m->done = (c == NULL);
@@ -695,8 +860,6 @@ Status DBImpl::BackgroundCompaction() {
         (m->begin ? m->begin->DebugString().c_str() : "(begin)"),
         (m->end ? m->end->DebugString().c_str() : "(end)"),
         (m->done ? "(end)" : manual_end.DebugString().c_str()));
-  } else {
-    c = versions_->PickCompaction();
   }
 
   Status status;
@@ -709,7 +872,7 @@ Status DBImpl::BackgroundCompaction() {
     c->edit()->DeleteFile(c->level(), f->number);
     c->edit()->AddFile(c->level() + 1, f->number, f->file_size,
                        f->smallest, f->largest);
-    status = versions_->LogAndApply(c->edit(), &mutex_);
+    status = LogAndApply(c->edit());
     VersionSet::LevelSummaryStorage tmp;
     Log(options_.info_log, "Moved #%lld to level-%d %lld bytes %s: %s\n",
         static_cast<unsigned long long>(f->number),
@@ -771,9 +934,125 @@ void DBImpl::CleanupCompaction(CompactionState* compact) {
   delete compact;
 }
 
+// Hold back a compaction that is about to start a new output file while
+// the mirror lags by more than options_.mirror_lag_target.
+void DBImpl::PaceForMirror() {
+  if (mirror_ == NULL || options_.mirror_lag_target == 0) {
+    return;
+  }
+  const uint64_t kMaxPauseMicros = 100000;
+  const uint64_t kSliceMicros = 10000;
+  for (uint64_t paused = 0; paused < kMaxPauseMicros; paused += kSliceMicros) {
+    // With a memtable waiting to be flushed, writers are about to wait
+    // too: do not hold back the compaction that makes level-0 room for
+    // the flush and, if the flush thread has not got to it, runs it
+    // inline (see DoCompactionShard())
+    if (shutting_down_.Acquire_Load() || has_imm_.NoBarrier_Load() != NULL) {
+      break;
+    }
+    if (mirror_->WaitForLag(options_.mirror_lag_target, kSliceMicros)) {
+      break;
+    }
+  }
+}
+
+SequenceNumber DBImpl::MirroredSequence() {
+  mutex_.AssertHeld();
+  // A compaction output may hold updates of any age, so flushed updates
+  // only count as mirrored once no live table is still being copied or
+  // has a failed copy.  Tables the policy keeps off the mirror have no
+  // copy to wait for.
+  uint64_t failed;
+  if (mirror_->FirstFailedCopy(&failed)) {
+    return mirrored_sequence_;
+  }
+  std::set<uint64_t> live;
+  versions_->AddLiveFiles(&live);
+  for (std::set<uint64_t>::iterator it = live.begin(); it != live.end(); ++it) {
+    if (!mirror_->CopyLanded(*it) && !mirror_->IsCopySkipped(*it)) {
+      return mirrored_sequence_;
+    }
+  }
+  mirrored_sequence_ = flushed_sequence_;
+  return mirrored_sequence_;
+}
+
+Status DBImpl::WaitForMirror(uint64_t timeout_micros) {
+  if (mirror_ == NULL) {
+    return Status::NotSupported("no mirror configured");
+  }
+  const uint64_t start = env_->NowMicros();
+  const uint64_t target = mirror_->LastCopyStarted();
+  if (!mirror_->WaitForWatermark(target, timeout_micros)) {
+    return Status::IOError("timed out waiting for the mirror");
+  }
+  uint64_t failed;
+  if (mirror_->FirstFailedCopy(&failed)) {
+    // Landed, but not written: only a new copy can fix that
+    return Status::IOError(TableFileName(options_.mirror_path, failed),
+                           "mirror copy failed; see ResyncMirror()");
+  }
+  if (options_.mirror_metadata) {
+    // The MANIFEST and log records are written by the helpers too
+    const uint64_t waited = env_->NowMicros() - start;
+    if (waited >= timeout_micros ||
+        !mirror_->WaitForLag(0, timeout_micros - waited)) {
+      return Status::IOError("timed out waiting for the mirror");
+    }
+  }
+  return mirror_->SyncDir();
+}
+
+bool DBImpl::ShouldMirror(int level, uint64_t expected_size) const {
+  return mirror_ == NULL || options_.mirror_policy == NULL ||
+         options_.mirror_policy->ShouldMirror(level, expected_size);
+}
+
+void DBImpl::GetUnmirroredFiles(std::map<uint64_t, uint64_t>* live,
+                                std::set<uint64_t>* unmirrored) {
+  mutex_.AssertHeld();
+  versions_->AddLiveFiles(live);
+  if (options_.mirror_policy == NULL) {
+    return;
+  }
+  // Asked again by where the files are now; files only in older
+  // versions are on their way out and keep the copies they have
+  std::map<uint64_t, int> levels;
+  versions_->GetFileLevels(&levels);
+  for (std::map<uint64_t, int>::iterator it = levels.begin();
+       it != levels.end(); ++it) {
+    if (!ShouldMirror(it->second, (*live)[it->first])) {
+      unmirrored->insert(it->first);
+    }
+  }
+}
+
+void DBImpl::StartMirrorResync() {
+  mutex_.AssertHeld();
+  std::map<uint64_t, uint64_t> live;
+  std::set<uint64_t> unmirrored;
+  GetUnmirroredFiles(&live, &unmirrored);
+  if (resync_->Start(live, unmirrored, pending_outputs_,
+                     versions_->NextFileNumber())) {
+    Log(options_.info_log, "Mirror resync started");
+  }
+}
+
+Status DBImpl::ResyncMirror() {
+  if (resync_ == NULL) {
+    return Status::NotSupported("no mirror configured");
+  }
+  MutexLock l(&mutex_);
+  StartMirrorResync();
+  return Status::OK();
+}
+
 Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
   assert(compact != NULL);
   assert(compact->builder == NULL);
+  PaceForMirror();
+  const bool mirrored = ShouldMirror(compact->compaction->level() + 1,
+                                     compact->compaction->MaxOutputFileSize());
   uint64_t file_number;
   {
     mutex_.Lock();
@@ -783,14 +1062,19 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
     out.number = file_number;
     out.smallest.Clear();
     out.largest.Clear();
+    out.mirrored = mirrored;
     compact->outputs.push_back(out);
     mutex_.Unlock();
   }
 
   // Make the output file
   std::string fname = TableFileName(dbname_, file_number);
-  Status s = env_->NewWritableFile(fname, &compact->outfile);
+  Status s = env_->NewWritableFile(fname, &compact->outfile, mirrored);
   if (s.ok()) {
+    if (compaction_limiter_ != NULL) {
+      compact->outfile = NewRateLimitedWritableFile(compact->outfile,
+                                                    compaction_limiter_);
+    }
     compact->builder = new TableBuilder(options_, compact->outfile);
   }
   return s;
@@ -865,8 +1149,12 @@ Status DBImpl::InstallCompactionResults(CompactionState* compact) {
     compact->compaction->edit()->AddFile(
         level + 1,
         out.number, out.file_size, out.smallest, out.largest);
+    if (!out.mirrored) {
+      unmirrored_files_++;
+      unmirrored_bytes_ += out.file_size;
+    }
   }
-  return versions_->LogAndApply(compact->compaction->edit(), &mutex_);
+  return LogAndApply(compact->compaction->edit());
 }
 
 Status DBImpl::DoCompactionWork(CompactionState* compact) {
@@ -888,13 +1176,126 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     compact->smallest_snapshot = snapshots_.oldest()->number_;
   }
 
+  CompactionStats stats;
+  for (int which = 0; which < 2; which++) {
+    for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
+      stats.bytes_read += compact->compaction->input(which, i)->file_size;
+    }
+  }
+
+  // Split a compaction with several output files' worth of input into
+  // shards, the first of which runs in this thread
+  std::vector<std::string> boundaries;
+  const int64_t max_shards =
+      stats.bytes_read / compact->compaction->MaxOutputFileSize();
+  if (options_.max_subcompactions > 1 && max_shards > 1) {
+    compact->compaction->GetShardBoundaries(
+        std::min<int64_t>(options_.max_subcompactions, max_shards),
+        &boundaries);
+  }
+  std::vector<CompactionState*> shards;
+  if (!boundaries.empty()) {
+    for (size_t i = 0; i <= boundaries.size(); i++) {
+      CompactionState* shard =
+          new CompactionState(compact->compaction->NewShard());
+      shard->smallest_snapshot = compact->smallest_snapshot;
+      shard->shard_begin = (i == 0 ? NULL : &boundaries[i - 1]);
+      shard->shard_end = (i == boundaries.size() ? NULL : &boundaries[i]);
+      shards.push_back(shard);
+    }
+    Log(options_.info_log, "Compacting in %d shards", int(shards.size()));
+  }
+
   // Release mutex while we're actually doing the compaction work
   mutex_.Unlock();
 
-  Iterator* input = versions_->MakeInputIterator(compact->compaction, MIRROR_ENABLE && COMPACT_READ_ON_SECONDARY);
+  // Leave a lagging mirror to catch up rather than reading from it
+  bool mirror_reads = options_.mirror_compaction_reads;
+  if (mirror_reads && mirror_ != NULL && options_.mirror_lag_target > 0 &&
+      mirror_->QueuedBytes() > options_.mirror_lag_target) {
+    mirror_reads = false;
+    Log(options_.info_log, "Mirror lagging: compaction reads the primary");
+  }
+
+  Status status;
+  if (shards.empty()) {
+    status = DoCompactionShard(compact, mirror_reads, &imm_micros);
+    mutex_.Lock();
+  } else {
+    std::vector<ShardWork> work(shards.size());
+    for (size_t i = 1; i < shards.size(); i++) {
+      work[i].db = this;
+      work[i].compact = shards[i];
+      work[i].mirror_reads = mirror_reads;
+      work[i].thread =
+          env_->StartJoinableThread(&DBImpl::CompactionShardWork, &work[i]);
+    }
+    shards[0]->shard_status =
+        DoCompactionShard(shards[0], mirror_reads, &imm_micros);
+    for (size_t i = 1; i < shards.size(); i++) {
+      env_->JoinThread(work[i].thread);
+    }
+
+    // Gather the outputs of all shards, in key order
+    mutex_.Lock();
+    for (size_t i = 0; i < shards.size(); i++) {
+      CompactionState* shard = shards[i];
+      if (status.ok()) {
+        status = shard->shard_status;
+      }
+      compact->outputs.insert(compact->outputs.end(),
+                              shard->outputs.begin(), shard->outputs.end());
+      compact->total_bytes += shard->total_bytes;
+      if (shard->builder != NULL) {
+        shard->builder->Abandon();
+        delete shard->builder;
+      }
+      delete shard->outfile;
+      delete shard->compaction;
+      delete shard;
+    }
+  }
+
+  stats.micros = env_->NowMicros() - start_micros - imm_micros;
+  for (size_t i = 0; i < compact->outputs.size(); i++) {
+    stats.bytes_written += compact->outputs[i].file_size;
+  }
+  stats_[compact->compaction->level() + 1].Add(stats);
+
+  if (status.ok()) {
+    status = InstallCompactionResults(compact);
+  }
+  VersionSet::LevelSummaryStorage tmp;
+  Log(options_.info_log,
+      "compacted to: %s", versions_->LevelSummary(&tmp));
+  return status;
+}
+
+void DBImpl::CompactionShardWork(void* arg) {
+  ShardWork* work = reinterpret_cast<ShardWork*>(arg);
+  DBImpl* db = work->db;
+  work->compact->shard_status =
+      db->DoCompactionShard(work->compact, work->mirror_reads, NULL);
+}
+
+Status DBImpl::DoCompactionShard(CompactionState* compact, bool mirror_reads,
+                                 int64_t* imm_micros) {
+  Iterator* input = versions_->MakeInputIterator(
+      compact->compaction, mirror_reads);
 	DEBUG_INFO("MakeInputIterator");
 
-  input->SeekToFirst();
+  if (compact->shard_begin == NULL) {
+    input->SeekToFirst();
+  } else {
+    // Skip the entries of *shard_begin, the previous shard's last key
+    const Slice begin(*compact->shard_begin);
+    input->Seek(InternalKey(begin, 0, static_cast<ValueType>(0)).Encode());
+    while (input->Valid() && input->key().size() >= 8 &&
+           user_comparator()->Compare(ExtractUserKey(input->key()),
+                                      begin) == 0) {
+      input->Next();
+    }
+  }
   Status status;
   ParsedInternalKey ikey;
   std::string current_user_key;
@@ -902,18 +1303,23 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
   SequenceNumber last_sequence_for_key = kMaxSequenceNumber;
   for (; input->Valid() && !shutting_down_.Acquire_Load(); ) {
     // Prioritize immutable compaction work
-    if (has_imm_.NoBarrier_Load() != NULL) {
+    if (imm_micros != NULL && has_imm_.NoBarrier_Load() != NULL) {
       const uint64_t imm_start = env_->NowMicros();
       mutex_.Lock();
-      if (imm_ != NULL) {
+      if (imm_ != NULL && !flushing_) {
         CompactMemTable();
-        bg_cv_.SignalAll();  // Wakeup MakeRoomForWrite() if necessary
       }
       mutex_.Unlock();
-      imm_micros += (env_->NowMicros() - imm_start);
+      *imm_micros += (env_->NowMicros() - imm_start);
     }
 
     Slice key = input->key();
+    if (compact->shard_end != NULL && key.size() >= 8 &&
+        user_comparator()->Compare(ExtractUserKey(key),
+                                   Slice(*compact->shard_end)) > 0) {
+      // The next shard's
+      break;
+    }
     if (compact->compaction->ShouldStopBefore(key) &&
         compact->builder != NULL) {
       status = FinishCompactionOutputFile(compact, input);
@@ -1004,28 +1410,6 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
     status = input->status();
   }
   delete input;
-  input = NULL;
-
-  CompactionStats stats;
-  stats.micros = env_->NowMicros() - start_micros - imm_micros;
-  for (int which = 0; which < 2; which++) {
-    for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
-      stats.bytes_read += compact->compaction->input(which, i)->file_size;
-    }
-  }
-  for (size_t i = 0; i < compact->outputs.size(); i++) {
-    stats.bytes_written += compact->outputs[i].file_size;
-  }
-
-  mutex_.Lock();
-  stats_[compact->compaction->level() + 1].Add(stats);
-
-  if (status.ok()) {
-    status = InstallCompactionResults(compact);
-  }
-  VersionSet::LevelSummaryStorage tmp;
-  Log(options_.info_log,
-      "compacted to: %s", versions_->LevelSummary(&tmp));
   return status;
 }
 
@@ -1289,7 +1673,8 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       break;
     } else if (
         allow_delay &&
-        versions_->NumLevelFiles(0) >= config::kL0_SlowdownWritesTrigger) {
+        versions_->NumLevelFiles(0) >=
+            options_.level0_slowdown_writes_trigger) {
       // We are getting close to hitting a hard limit on the number of
       // L0 files.  Rather than delaying a single write by several
       // seconds when we hit the hard limit, start delaying each
@@ -1309,7 +1694,8 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       // one is still being compacted, so we wait.
       Log(options_.info_log, "Current memtable full; waiting...\n");
       bg_cv_.Wait();
-    } else if (versions_->NumLevelFiles(0) >= config::kL0_StopWritesTrigger) {
+    } else if (versions_->NumLevelFiles(0) >=
+               options_.level0_stop_writes_trigger) {
       // There are too many level-0 files.
       Log(options_.info_log, "Too many L0 files; waiting...\n");
       bg_cv_.Wait();
@@ -1330,6 +1716,7 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       logfile_number_ = new_log_number;
       log_ = new log::Writer(lfile);
       imm_ = mem_;
+      imm_sequence_ = versions_->LastSequence();
       has_imm_.Release_Store(imm_);
       mem_ = new MemTable(internal_comparator_);
       mem_->Ref();
@@ -1385,10 +1772,126 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
         value->append(buf);
       }
     }
+    if (compaction_limiter_ != NULL) {
+      RateLimiter::Stats limit;
+      compaction_limiter_->GetStats(&limit);
+      snprintf(buf, sizeof(buf),
+               "Write rate limit(MB/s): %.1f, throttled %llu times, "
+               "%.3f sec\n",
+               limit.bytes_per_second / 1048576.0,
+               static_cast<unsigned long long>(limit.throttled),
+               limit.throttled_micros / 1e6);
+      value->append(buf);
+    }
     return true;
   } else if (in == "sstables") {
     *value = versions_->current()->DebugString();
     return true;
+  } else if (in == "read-placement") {
+    *value = versions_->ReadPlacementSummary();
+    return true;
+  } else if (in == "mirror-queue") {
+    if (mirror_ == NULL) {
+      return false;
+    }
+    MirrorQueueStats stats;
+    mirror_->GetStats(&stats);
+    char buf[1500];
+    snprintf(buf, sizeof(buf),
+             "Helpers: %d\n"
+             "In flight(MB): %.1f\n"
+             "Peak(MB): %.1f\n"
+             "Cap(MB): %.1f\n"
+             "Slowdowns: %llu\n"
+             "Stalls: %llu\n"
+             "Stall time(sec): %.3f\n"
+             "Compaction pauses: %llu\n"
+             "Compaction pause time(sec): %.3f\n"
+             "Helper write calls: %llu\n"
+             "Buffers written: %llu\n"
+             "Files copied on close: %llu\n"
+             "Files cloned on close: %llu\n"
+             "Metadata copies failed: %llu\n"
+             "Metadata waits timed out: %llu\n"
+             "Write throttle time(sec): %.3f\n"
+             "Delete throttle time(sec): %.3f\n"
+             "Buffers reused: %llu\n"
+             "Buffers allocated: %llu\n"
+             "Buffers peak: %llu\n"
+             "Buffers free: %llu\n"
+             "Buffers on huge pages: %llu\n"
+             "Copies in flight: %llu\n"
+             "Copy land time(ms): %.1f\n"
+             "Copy waits: %llu\n"
+             "Copy wait time(sec): %.3f\n"
+             "Copy fallbacks: %llu\n"
+             "Tables not mirrored: %llu\n"
+             "Table copies failed: %llu\n"
+             "Tables skipped by policy: %llu\n"
+             "Mirror writes saved(MB): %.1f\n",
+             stats.helpers,
+             stats.inflight_bytes / 1048576.0,
+             stats.peak_bytes / 1048576.0,
+             stats.cap_bytes / 1048576.0,
+             static_cast<unsigned long long>(stats.slowdowns),
+             static_cast<unsigned long long>(stats.stalls),
+             stats.stall_micros / 1e6,
+             static_cast<unsigned long long>(stats.pace_waits),
+             stats.pace_micros / 1e6,
+             static_cast<unsigned long long>(stats.write_calls),
+             static_cast<unsigned long long>(stats.buffers_written),
+             static_cast<unsigned long long>(stats.files_copied),
+             static_cast<unsigned long long>(stats.files_cloned),
+             static_cast<unsigned long long>(stats.metadata_failures),
+             static_cast<unsigned long long>(stats.metadata_wait_timeouts),
+             stats.write_throttle_micros / 1e6,
+             stats.delete_throttle_micros / 1e6,
+             static_cast<unsigned long long>(stats.buffer_hits),
+             static_cast<unsigned long long>(stats.buffer_misses),
+             static_cast<unsigned long long>(stats.buffers_peak),
+             static_cast<unsigned long long>(stats.buffers_free),
+             static_cast<unsigned long long>(stats.buffers_huge),
+             static_cast<unsigned long long>(stats.copies_inflight),
+             stats.copy_land_micros / 1e3,
+             static_cast<unsigned long long>(stats.copy_waits),
+             stats.copy_wait_micros / 1e6,
+             static_cast<unsigned long long>(stats.copy_fallbacks),
+             static_cast<unsigned long long>(stats.copies_skipped),
+             static_cast<unsigned long long>(stats.copies_failed),
+             static_cast<unsigned long long>(unmirrored_files_),
+             unmirrored_bytes_ / 1048576.0);
+    value->append(buf);
+    return true;
+  } else if (in == "mirror-scrub") {
+    if (scrubber_ == NULL) {
+      return false;
+    }
+    *value = scrubber_->Summary();
+    return true;
+  } else if (in == "mirror-resync") {
+    if (resync_ == NULL) {
+      return false;
+    }
+    *value = resync_->Summary();
+    return true;
+  } else if (in == "mirror-watermark") {
+    if (mirror_ == NULL) {
+      return false;
+    }
+    char buf[50];
+    snprintf(buf, sizeof(buf), "%llu",
+             static_cast<unsigned long long>(mirror_->Watermark()));
+    *value = buf;
+    return true;
+  } else if (in == "mirrored-sequence") {
+    if (mirror_ == NULL) {
+      return false;
+    }
+    char buf[50];
+    snprintf(buf, sizeof(buf), "%llu",
+             static_cast<unsigned long long>(MirroredSequence()));
+    *value = buf;
+    return true;
   }
 
   return false;
@@ -1434,16 +1937,20 @@ Status DB::Delete(const WriteOptions& opt, const Slice& key) {
   return Write(opt, &batch);
 }
 
-DB::~DB() {
-#ifdef USE_OPQ_THREAD
-	if (MIRROR_ENABLE) {
-		OPQ_ADD_HALT(mio_queue);	
-		DEBUG_INFO2("MJoin[~DB]", mirror_helper);
-		//if (mirror_helper != NULL) pthread_join(*mirror_helper, NULL);
-	}	
-#endif
+Status DB::WaitForMirror(uint64_t timeout_micros) {
+  return Status::NotSupported("no mirror configured");
+}
+
+Status DB::ResyncMirror() {
+  return Status::NotSupported("no mirror configured");
+}
+
+Status DB::CatchUp() {
+  return Status::NotSupported("not a follower");
 }
 
+DB::~DB() { }
+
 Status DB::Open(const Options& options, const std::string& dbname,
                 DB** dbptr) {
   *dbptr = NULL;
@@ -1462,10 +1969,29 @@ Status DB::Open(const Options& options, const std::string& dbname,
       impl->logfile_ = lfile;
       impl->logfile_number_ = new_log_number;
       impl->log_ = new log::Writer(lfile);
-      s = impl->versions_->LogAndApply(&edit, &impl->mutex_);
+      s = impl->LogAndApply(&edit);
     }
     if (s.ok()) {
       impl->DeleteObsoleteFiles();
+      if (impl->resync_ != NULL && options.mirror_resync_threads > 0) {
+        impl->StartMirrorResync();
+      } else if (impl->resync_ != NULL) {
+        // No resync to sort them out: tables the policy keeps off the
+        // mirror and that have no copy must not be read from it
+        std::map<uint64_t, uint64_t> live;
+        std::set<uint64_t> unmirrored;
+        impl->GetUnmirroredFiles(&live, &unmirrored);
+        for (std::set<uint64_t>::iterator it = unmirrored.begin();
+             it != unmirrored.end(); ++it) {
+          if (!options.env->FileExists(impl->mirror_->MirrorFileName(
+                  TableFileName(dbname, *it)))) {
+            impl->mirror_->CopySkipped(*it);
+          }
+        }
+      }
+      if (impl->scrubber_ != NULL) {
+        impl->scrubber_->Start();
+      }
       impl->MaybeScheduleCompaction();
     }
   }
@@ -1503,6 +2029,11 @@ Status DestroyDB(const std::string& dbname, const Options& options) {
         if (result.ok() && !del.ok()) {
           result = del;
         }
+        if (type != kInfoLogFile && !options.mirror_path.empty()) {
+          // Ignore error; the copy may not have been written yet, and
+          // only tables have one without Options::mirror_metadata
+          env->DeleteFile(options.mirror_path + "/" + filenames[i]);
+        }
       }
     }
     env->UnlockFile(lock);  // Ignore error since state is already gone
@@ -6,6 +6,7 @@
 #define STORAGE_LEVELDB_DB_DB_IMPL_H_
 
 #include <deque>
+#include <map>
 #include <set>
 #include "db/dbformat.h"
 #include "db/log_writer.h"
@@ -17,7 +18,12 @@
 
 namespace leveldb {
 
+class Compaction;
 class MemTable;
+class MirrorContext;
+class MirrorResync;
+class MirrorScrubber;
+class RateLimiter;
 class TableCache;
 class Version;
 class VersionEdit;
@@ -41,6 +47,8 @@ class DBImpl : public DB {
   virtual bool GetProperty(const Slice& property, std::string* value);
   virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
   virtual void CompactRange(const Slice* begin, const Slice* end);
+  virtual Status WaitForMirror(uint64_t timeout_micros);
+  virtual Status ResyncMirror();
 
   // Extra methods (for testing) that are not in the public DB interface
 
@@ -50,6 +58,9 @@ class DBImpl : public DB {
   // Force current memtable contents to be compacted.
   Status TEST_CompactMemTable();
 
+  // Run a mirror scrubber pass now.  Returns NotSupported without one.
+  Status TEST_ScrubMirror();
+
   // Return an internal iterator over the current state of the database.
   // The keys of this iterator are internal keys (see format.h).
   // The returned iterator should be deleted when no longer needed.
@@ -62,6 +73,7 @@ class DBImpl : public DB {
  private:
   friend class DB;
   struct CompactionState;
+  struct ShardWork;
   struct Writer;
 
   Iterator* NewInternalIterator(const ReadOptions&,
@@ -89,23 +101,51 @@ class DBImpl : public DB {
                         SequenceNumber* max_sequence)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
-  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base)
+  // Write "mem" out as a table and add it to *edit: to level-0, or if
+  // "base" is non-NULL to the level PickLevelForMemTableOutput() picks,
+  // whose range stays reserved until versions_->ReleaseFlushOutput().
+  // If "number" is non-NULL the table is left in pending_outputs_ and
+  // its number stored in *number, for the caller to erase once the
+  // edit is installed.
+  Status WriteLevel0Table(MemTable* mem, VersionEdit* edit, Version* base,
+                          uint64_t* number)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
   Status MakeRoomForWrite(bool force /* compact even if there is room? */)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   WriteBatch* BuildBatchGroup(Writer** last_writer);
 
+  // Serializes the calls of versions_->LogAndApply() made by the
+  // background threads and DB::Open().
+  Status LogAndApply(VersionEdit* edit) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   void MaybeScheduleCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   static void BGWork(void* db);
+  static void BGFlushWork(void* db);
   void BackgroundCall();
-  Status BackgroundCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void BackgroundFlush();
+  void BackoffAfterError(const Status& s) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  Status BackgroundCompaction(Compaction* c) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   void CleanupCompaction(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   Status DoCompactionWork(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // Merge the inputs of compact->compaction in the key range of the
+  // shard into output tables.  Flushes imm_ on the way, and adds the
+  // time it takes to *imm_micros, unless "imm_micros" is NULL.
+  Status DoCompactionShard(CompactionState* compact, bool mirror_reads,
+                           int64_t* imm_micros);
+  static void CompactionShardWork(void* arg);
+
   Status OpenCompactionOutputFile(CompactionState* compact);
+  void PaceForMirror();
+  SequenceNumber MirroredSequence() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void StartMirrorResync() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool ShouldMirror(int level, uint64_t expected_size) const;
+  void GetUnmirroredFiles(std::map<uint64_t, uint64_t>* live,
+                          std::set<uint64_t>* unmirrored)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   Status FinishCompactionOutputFile(CompactionState* compact, Iterator* input);
   Status InstallCompactionResults(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
@@ -119,6 +159,22 @@ class DBImpl : public DB {
   bool owns_cache_;
   const std::string dbname_;
 
+  // Mirror of the table files; NULL unless options_.mirror_path is set.
+  // mirror_status_ holds the error if attaching it failed.
+  MirrorContext* mirror_;
+  Status mirror_status_;
+
+  // Holds compaction output to options_.compaction_write_rate; NULL
+  // without a limit.
+  RateLimiter* compaction_limiter_;
+
+  // Rebuilds missing mirror copies; NULL without a mirror.
+  MirrorResync* resync_;
+
+  // Verifies the mirror copies; NULL without a mirror or
+  // options_.mirror_scrub_rate.
+  MirrorScrubber* scrubber_;
+
   // table_cache_ provides its own synchronization
   TableCache* table_cache_;
 
@@ -132,6 +188,7 @@ class DBImpl : public DB {
   MemTable* mem_;
   MemTable* imm_;                // Memtable being compacted
   port::AtomicPointer has_imm_;  // So bg thread can detect non-NULL imm_
+  SequenceNumber imm_sequence_;  // Last sequence in imm_
   WritableFile* logfile_;
   uint64_t logfile_number_;
   log::Writer* log_;
@@ -146,8 +203,19 @@ class DBImpl : public DB {
   // part of ongoing compactions.
   std::set<uint64_t> pending_outputs_;
 
-  // Has a background compaction been scheduled or is running?
-  bool bg_compaction_scheduled_;
+  // Background compactions scheduled or running, and the compactions
+  // picked for the ones that have not started yet, in order.  A NULL
+  // entry stands for manual_compaction_, which runs alone.
+  int bg_compactions_scheduled_;
+  std::deque<Compaction*> queued_compactions_;
+
+  // Has a memtable flush been scheduled or is running?  Is imm_ being
+  // written out, by the flush or by a compaction that got to it first?
+  bool bg_flush_scheduled_;
+  bool flushing_;
+
+  // Is a thread in versions_->LogAndApply()?
+  bool manifest_busy_;
 
   // Information for a manual compaction
   struct ManualCompaction {
@@ -161,6 +229,17 @@ class DBImpl : public DB {
 
   VersionSet* versions_;
 
+  // Every update up to flushed_sequence_ is in a live table file, and
+  // every update up to mirrored_sequence_ is in mirrored ones.  Tables
+  // written before the DB was opened count as mirrored.
+  SequenceNumber flushed_sequence_;
+  SequenceNumber mirrored_sequence_;
+
+  // Table files written without a mirror copy by options_.mirror_policy,
+  // and their bytes, i.e. the mirror writes the policy saved.
+  uint64_t unmirrored_files_;
+  uint64_t unmirrored_bytes_;
+
   // Have we encountered a background error in paranoid mode?
   Status bg_error_;
   int consecutive_compaction_errors_;
@@ -4,6 +4,7 @@
 
 #include "leveldb/db.h"
 #include "leveldb/filter_policy.h"
+#include "leveldb/mirror_policy.h"
 #include "db/db_impl.h"
 #include "db/filename.h"
 #include "db/version_set.h"
@@ -87,7 +88,8 @@ class SpecialEnv : public EnvWrapper {
     manifest_write_error_.Release_Store(NULL);
   }
 
-  Status NewWritableFile(const std::string& f, WritableFile** r) {
+  Status NewWritableFile(const std::string& f, WritableFile** r,
+                         bool m = true) {
     class SSTableFile : public WritableFile {
      private:
       SpecialEnv* env_;
@@ -109,11 +111,11 @@ class SpecialEnv : public EnvWrapper {
       }
       Status Close() { return base_->Close(); }
       Status Flush() { return base_->Flush(); }
-      Status Sync() {
+      Status Sync(int flags) {
         while (env_->delay_sstable_sync_.Acquire_Load() != NULL) {
           DelayMilliseconds(100);
         }
-        return base_->Sync();
+        return base_->Sync(flags);
       }
     };
     class ManifestFile : public WritableFile {
@@ -132,11 +134,11 @@ class SpecialEnv : public EnvWrapper {
       }
       Status Close() { return base_->Close(); }
       Status Flush() { return base_->Flush(); }
-      Status Sync() {
+      Status Sync(int flags) {
         if (env_->manifest_sync_error_.Acquire_Load() != NULL) {
           return Status::IOError("simulated sync error");
         } else {
-          return base_->Sync();
+          return base_->Sync(flags);
         }
       }
     };
@@ -145,7 +147,7 @@ class SpecialEnv : public EnvWrapper {
       return Status::IOError("simulated write error");
     }
 
-    Status s = target()->NewWritableFile(f, r);
+    Status s = target()->NewWritableFile(f, r, m);
     if (s.ok()) {
       if (strstr(f.c_str(), ".sst") != NULL) {
         *r = new SSTableFile(this, *r);
@@ -156,7 +158,8 @@ class SpecialEnv : public EnvWrapper {
     return s;
   }
 
-  Status NewRandomAccessFile(const std::string& f, RandomAccessFile** r) {
+  Status NewRandomAccessFile(const std::string& f, RandomAccessFile** r,
+                             bool m = false) {
     class CountingFile : public RandomAccessFile {
      private:
       RandomAccessFile* target_;
@@ -173,7 +176,7 @@ class SpecialEnv : public EnvWrapper {
       }
     };
 
-    Status s = target()->NewRandomAccessFile(f, r);
+    Status s = target()->NewRandomAccessFile(f, r, m);
     if (s.ok() && count_random_reads_) {
       *r = new CountingFile(*r, &random_read_counter_);
     }
@@ -471,6 +474,49 @@ class DBTest {
     return result;
   }
 
+  // Parse the first row of the "leveldb.read-placement" table: the
+  // read policy of its level and the reads each copy served.
+  void GetReadPlacement(std::string* policy, uint64_t* primary,
+                        uint64_t* mirror) {
+    std::string placement;
+    ASSERT_TRUE(db_->GetProperty("leveldb.read-placement", &placement));
+    size_t pos = placement.find("---\n");
+    ASSERT_TRUE(pos != std::string::npos);
+    int level;
+    char buf[10];
+    unsigned long long p, m;
+    ASSERT_EQ(4, sscanf(placement.c_str() + pos + 4, "%d %9s %llu %llu",
+                        &level, buf, &p, &m));
+    *policy = buf;
+    *primary = p;
+    *mirror = m;
+  }
+
+  // The times reads were routed to "copy" ("primary" or "mirror") and
+  // the block reads it served, from "leveldb.read-placement".
+  void GetRoutedReads(const std::string& copy, uint64_t* picks,
+                      uint64_t* reads) {
+    std::string placement;
+    ASSERT_TRUE(db_->GetProperty("leveldb.read-placement", &placement));
+    size_t pos = placement.find(copy + " ");
+    ASSERT_TRUE(pos != std::string::npos);
+    unsigned long long p, r;
+    ASSERT_EQ(2, sscanf(placement.c_str() + pos + copy.size(), " %llu %llu",
+                        &p, &r));
+    *picks = p;
+    *reads = r;
+  }
+
+  // Delete the mirror directory "path" with whatever is left in it.
+  void DestroyMirror(const std::string& path) {
+    std::vector<std::string> files;
+    env_->GetChildren(path, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      env_->DeleteFile(path + "/" + files[i]);
+    }
+    ASSERT_OK(env_->DeleteDir(path));
+  }
+
   bool DeleteAnSSTFile() {
     std::vector<std::string> filenames;
     ASSERT_OK(env_->GetChildren(dbname_, &filenames));
@@ -894,6 +940,480 @@ static std::string Key(int i) {
   return std::string(buf);
 }
 
+TEST(DBTest, GetFromMirror) {
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_read_levels = ~0;
+  DestroyAndReopen(&options);
+
+  Random rnd(301);
+  std::string values[100];
+  for (int i = 0; i < 100; i++) {
+    values[i] = RandomString(&rnd, 1000);  // Table file over 64KB
+    ASSERT_OK(Put(Key(i), values[i]));
+  }
+  dbfull()->TEST_CompactMemTable();
+  Reopen(&options);  // Waits for the copy to land
+
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+  std::string policy;
+  uint64_t primary, mirror;
+  GetReadPlacement(&policy, &primary, &mirror);
+  ASSERT_EQ("yes", policy);
+  ASSERT_EQ(0, primary);
+  ASSERT_EQ(100, mirror);
+
+  Close();
+  DestroyDB(dbname_, options);
+  ASSERT_OK(env_->DeleteDir(options.mirror_path));  // Copies are gone
+}
+
+TEST(DBTest, RoutedReads) {
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_read_routing = true;
+  DestroyAndReopen(&options);
+
+  Random rnd(301);
+  std::string values[100];
+  for (int i = 0; i < 100; i++) {
+    values[i] = RandomString(&rnd, 1000);
+    ASSERT_OK(Put(Key(i), values[i]));
+  }
+  dbfull()->TEST_CompactMemTable();
+  Reopen(&options);
+
+  for (int r = 0; r < 3; r++) {
+    for (int i = 0; i < 100; i++) {
+      ASSERT_EQ(values[i], Get(Key(i)));
+    }
+  }
+  std::string policy;
+  uint64_t primary, mirror;
+  GetReadPlacement(&policy, &primary, &mirror);
+  ASSERT_EQ("auto", policy);
+  ASSERT_EQ(300, primary + mirror);
+
+  // Both copies got picked and timed
+  uint64_t picks[2], reads[2];
+  GetRoutedReads("primary", &picks[0], &reads[0]);
+  GetRoutedReads("mirror", &picks[1], &reads[1]);
+  ASSERT_GE(picks[0] + picks[1], 300);
+  ASSERT_GT(picks[1], 0);
+  ASSERT_GT(reads[0] + reads[1], 0);
+
+  Close();
+  DestroyDB(dbname_, options);
+}
+
+TEST(DBTest, BalancedReads) {
+  Cache* tiny_cache = NewLRUCache(1);  // Every Get reads its block
+  for (int balance = kBalanceByFileNumber; balance <= kBalanceByLoad;
+       balance++) {
+    Options options = CurrentOptions();
+    options.create_if_missing = true;
+    options.mirror_path = dbname_ + "_mirror";
+    options.mirror_read_balance = static_cast<MirrorReadBalance>(balance);
+    options.block_cache = tiny_cache;
+    DestroyAndReopen(&options);
+
+    Random rnd(301);
+    std::string values[100];
+    for (int i = 0; i < 100; i++) {
+      values[i] = RandomString(&rnd, 1000);
+      ASSERT_OK(Put(Key(i), values[i]));
+    }
+    dbfull()->TEST_CompactMemTable();
+    Reopen(&options);
+
+    for (int r = 0; r < 10; r++) {
+      for (int i = 0; i < 100; i++) {
+        ASSERT_EQ(values[i], Get(Key(i)));
+      }
+    }
+
+    std::string placement;
+    ASSERT_TRUE(db_->GetProperty("leveldb.read-placement", &placement));
+    if (balance == kBalanceByLoad) {
+      // Both copies served block reads
+      uint64_t picks, reads[2];
+      GetRoutedReads("primary", &picks, &reads[0]);
+      GetRoutedReads("mirror", &picks, &reads[1]);
+      ASSERT_GT(reads[0], 0);
+      ASSERT_GT(reads[1], 0);
+    } else {
+      ASSERT_EQ(std::string::npos, placement.find("Routed"));
+    }
+    Close();
+    DestroyDB(dbname_, options);
+  }
+  delete tiny_cache;
+}
+
+TEST(DBTest, WaitForMirror) {
+  std::string value;
+  ASSERT_TRUE(!db_->WaitForMirror(1000000).ok());  // No mirror
+  ASSERT_TRUE(!db_->GetProperty("leveldb.mirrored-sequence", &value));
+
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  DestroyAndReopen(&options);
+  Random rnd(301);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(Put(Key(i), RandomString(&rnd, 1000)));
+  }
+  // Nothing is in a table yet
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirrored-sequence", &value));
+  ASSERT_EQ("0", value);
+
+  dbfull()->TEST_CompactMemTable();
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirrored-sequence", &value));
+  ASSERT_EQ("100", value);
+
+  // The watermark covers the new table, and its copy is complete
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-watermark", &value));
+  const uint64_t watermark = strtoull(value.c_str(), NULL, 10);
+  std::vector<std::string> files;
+  ASSERT_OK(env_->GetChildren(dbname_, &files));
+  int tables = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(files[i], &number, &type) && type == kTableFile) {
+      tables++;
+      ASSERT_LE(number, watermark);
+      uint64_t size, msize;
+      ASSERT_OK(env_->GetFileSize(dbname_ + "/" + files[i], &size));
+      ASSERT_OK(env_->GetFileSize(options.mirror_path + "/" + files[i],
+                                  &msize));
+      ASSERT_EQ(size, msize);
+    }
+  }
+  ASSERT_EQ(1, tables);
+  Close();
+  DestroyDB(dbname_, options);
+  ASSERT_OK(env_->DeleteDir(options.mirror_path));
+}
+
+TEST(DBTest, MirrorPolicy) {
+  const MirrorPolicy* policy = NewLevelMirrorPolicy(1);
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_read_levels = ~0;
+  options.mirror_policy = policy;
+  DestroyAndReopen(&options);
+  Random rnd(301);
+  std::string values[200];
+  for (int r = 0; r < 2; r++) {
+    for (int i = 0; i < 100; i++) {
+      values[r * 100 + i] = RandomString(&rnd, 1000);
+      ASSERT_OK(Put(Key(i), values[r * 100 + i]));
+    }
+    dbfull()->TEST_CompactMemTable();
+  }
+
+  // Flushes are level-0 files: no copies, reads go to the primary
+  std::vector<std::string> files;
+  ASSERT_OK(env_->GetChildren(options.mirror_path, &files));
+  for (size_t i = 0; i < files.size(); i++) {
+    uint64_t number;
+    FileType type;
+    ASSERT_TRUE(!ParseFileName(files[i], &number, &type) ||
+                type != kTableFile) << files[i];
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(values[100 + i], Get(Key(i)));
+  }
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  std::string queue;
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-queue", &queue));
+  ASSERT_TRUE(queue.find("Tables skipped by policy: 2") != std::string::npos)
+      << queue;
+
+  // Tables kept off the mirror do not hold back what counts as mirrored
+  std::string sequence;
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirrored-sequence", &sequence));
+  ASSERT_EQ("200", sequence);
+
+  // Compaction output is below level 0 and mirrored
+  db_->CompactRange(NULL, NULL);
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  int copies = 0;
+  ASSERT_OK(env_->GetChildren(dbname_, &files));
+  for (size_t i = 0; i < files.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(files[i], &number, &type) && type == kTableFile) {
+      std::string primary, copy;
+      ASSERT_OK(ReadFileToString(env_, dbname_ + "/" + files[i], &primary));
+      ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/" + files[i],
+                                 &copy));
+      ASSERT_TRUE(primary == copy);
+      copies++;
+    }
+  }
+  ASSERT_GE(copies, 1);
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-queue", &queue));
+  ASSERT_TRUE(queue.find("Tables not mirrored: 0") != std::string::npos)
+      << queue;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(values[100 + i], Get(Key(i)));
+  }
+  Close();
+  DestroyDB(dbname_, options);
+  DestroyMirror(options.mirror_path);
+  delete policy;
+}
+
+TEST(DBTest, MirrorScrub) {
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_read_levels = ~0;
+  options.mirror_scrub_rate = 100 << 20;
+  DestroyAndReopen(&options);
+  Random rnd(301);
+  std::string values[200];
+  for (int i = 0; i < 200; i++) {
+    values[i] = RandomString(&rnd, 1000);
+    ASSERT_OK(Put(Key(i), values[i]));
+    if (i % 100 == 99) {
+      dbfull()->TEST_CompactMemTable();
+    }
+  }
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  ASSERT_OK(dbfull()->TEST_ScrubMirror());
+  std::string scrub;
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-scrub", &scrub));
+  ASSERT_TRUE(scrub.find("Files checked: 2") != std::string::npos) << scrub;
+  ASSERT_TRUE(scrub.find("Mismatches: 0") != std::string::npos) << scrub;
+
+  // Flip a byte in the middle of one copy
+  std::vector<std::string> files;
+  std::string table;
+  ASSERT_OK(env_->GetChildren(dbname_, &files));
+  for (size_t i = 0; i < files.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(files[i], &number, &type) && type == kTableFile) {
+      table = files[i];
+    }
+  }
+  const std::string copy = options.mirror_path + "/" + table;
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, copy, &data));
+  data[data.size() / 2] ^= 0x40;
+  ASSERT_OK(WriteStringToFile(env_, data, copy));
+
+  ASSERT_OK(dbfull()->TEST_ScrubMirror());
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-scrub", &scrub));
+  ASSERT_TRUE(scrub.find("Passes: 2") != std::string::npos) << scrub;
+  ASSERT_TRUE(scrub.find("Mismatches: 1") != std::string::npos) << scrub;
+  ASSERT_TRUE(scrub.find("Recopied: 1") != std::string::npos) << scrub;
+  std::string quarantined, primary, recopied;
+  ASSERT_OK(ReadFileToString(env_, copy + ".quarantine", &quarantined));
+  ASSERT_TRUE(quarantined == data);
+  ASSERT_OK(ReadFileToString(env_, dbname_ + "/" + table, &primary));
+  ASSERT_OK(ReadFileToString(env_, copy, &recopied));
+  ASSERT_TRUE(primary == recopied);
+  for (int i = 0; i < 200; i++) {
+    ASSERT_EQ(values[i], Get(Key(i)));
+  }
+
+  // The quarantined copy is kept through the next pass only
+  ASSERT_OK(dbfull()->TEST_ScrubMirror());
+  ASSERT_TRUE(!env_->FileExists(copy + ".quarantine"));
+  Close();
+  DestroyDB(dbname_, options);
+  DestroyMirror(options.mirror_path);
+}
+
+TEST(DBTest, MirrorResync) {
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_read_levels = ~0;
+  DestroyAndReopen(&options);
+  Random rnd(301);
+  std::string values[100];
+  for (int r = 0; r < 2; r++) {
+    for (int i = 0; i < 100; i++) {
+      values[i] = RandomString(&rnd, 1000);
+      ASSERT_OK(Put(Key(r * 100 + i), values[i]));
+    }
+    dbfull()->TEST_CompactMemTable();
+  }
+  std::string resync;
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-resync", &resync));
+  ASSERT_TRUE(resync.find("Files copied: 0 of 0") != std::string::npos);
+  Close();
+
+  // Lose one copy, damage the other and leave an orphan behind
+  std::vector<std::string> tables;
+  std::vector<std::string> files;
+  ASSERT_OK(env_->GetChildren(dbname_, &files));
+  for (size_t i = 0; i < files.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(files[i], &number, &type) && type == kTableFile) {
+      tables.push_back(files[i]);
+    }
+  }
+  ASSERT_EQ(2, tables.size());
+  ASSERT_OK(env_->DeleteFile(options.mirror_path + "/" + tables[0]));
+  ASSERT_OK(WriteStringToFile(env_, "short",
+                              options.mirror_path + "/" + tables[1]));
+  const std::string orphan = options.mirror_path + "/000002.sst";
+  ASSERT_OK(WriteStringToFile(env_, "orphan", orphan));
+
+  Reopen(&options);
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  for (int i = 0; i < 1000; i++) {  // Orphans may still be in progress
+    ASSERT_TRUE(db_->GetProperty("leveldb.mirror-resync", &resync));
+    if (resync.find("State: done") != std::string::npos) break;
+    env_->SleepForMicroseconds(10000);
+  }
+  ASSERT_TRUE(resync.find("State: done") != std::string::npos) << resync;
+  ASSERT_TRUE(resync.find("Files copied: 2 of 2") != std::string::npos);
+  ASSERT_TRUE(resync.find("Orphans deleted: 1 of 1") != std::string::npos);
+  ASSERT_TRUE(!env_->FileExists(orphan));
+  for (size_t i = 0; i < tables.size(); i++) {
+    std::string primary, copy;
+    ASSERT_OK(ReadFileToString(env_, dbname_ + "/" + tables[i], &primary));
+    ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/" + tables[i],
+                               &copy));
+    ASSERT_TRUE(primary == copy);
+  }
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(values[i], Get(Key(100 + i)));
+  }
+
+  // Nothing left to do
+  ASSERT_OK(db_->ResyncMirror());
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  ASSERT_TRUE(db_->GetProperty("leveldb.mirror-resync", &resync));
+  ASSERT_TRUE(resync.find("Passes: 2") != std::string::npos);
+  ASSERT_TRUE(resync.find("Files copied: 0 of 0") != std::string::npos);
+  Close();
+  DestroyDB(dbname_, options);
+  DestroyMirror(options.mirror_path);
+}
+
+TEST(DBTest, MirrorFollower) {
+  Options options = CurrentOptions();
+  options.create_if_missing = true;
+  options.mirror_path = dbname_ + "_mirror";
+  options.mirror_metadata = true;
+  DestroyAndReopen(&options);
+  ASSERT_OK(Put("foo", "v1"));
+  ASSERT_OK(Put("bar", "v1"));
+  dbfull()->TEST_CompactMemTable();
+  ASSERT_OK(Put("baz", "v1"));  // In the log only
+  ASSERT_OK(db_->WaitForMirror(10000000));
+
+  Options follower_options = CurrentOptions();
+  follower_options.follower_poll_micros = 0;
+  DB* follower;
+  ASSERT_OK(DB::OpenAsFollower(follower_options, options.mirror_path,
+                               &follower));
+  ReadOptions ropts;
+  std::string value;
+  ASSERT_OK(follower->Get(ropts, "foo", &value));
+  ASSERT_EQ("v1", value);
+  ASSERT_OK(follower->Get(ropts, "baz", &value));
+  ASSERT_EQ("v1", value);
+  ASSERT_TRUE(!follower->Put(WriteOptions(), "foo", "v2").ok());
+  ASSERT_TRUE(!follower->Delete(WriteOptions(), "foo").ok());
+
+  // Updates, a flush into a new log and a snapshot taken before them
+  const Snapshot* snapshot = follower->GetSnapshot();
+  ASSERT_OK(Put("foo", "v2"));
+  ASSERT_OK(Delete("bar"));
+  dbfull()->TEST_CompactMemTable();
+  ASSERT_OK(Put("qux", "v2"));
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  ASSERT_OK(follower->CatchUp());
+  ASSERT_OK(follower->Get(ropts, "foo", &value));
+  ASSERT_EQ("v2", value);
+  ASSERT_TRUE(follower->Get(ropts, "bar", &value).IsNotFound());
+  ASSERT_OK(follower->Get(ropts, "qux", &value));
+  ASSERT_EQ("v2", value);
+  ropts.snapshot = snapshot;
+  ASSERT_OK(follower->Get(ropts, "foo", &value));
+  ASSERT_EQ("v1", value);
+  ropts.snapshot = NULL;
+  follower->ReleaseSnapshot(snapshot);
+  Iterator* iter = follower->NewIterator(ropts);
+  int count = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) count++;
+  ASSERT_EQ(3, count);  // baz, foo, qux
+  delete iter;
+  std::string stats;
+  ASSERT_TRUE(follower->GetProperty("leveldb.follower", &stats));
+  ASSERT_TRUE(stats.find("Memtable rebuilds: 2") != std::string::npos)
+      << stats;
+  ASSERT_TRUE(stats.find("Errors: 0") != std::string::npos) << stats;
+
+  // The leader reopens with a new MANIFEST
+  Reopen(&options);
+  ASSERT_OK(Put("quux", "v3"));
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  ASSERT_OK(follower->CatchUp());
+  ASSERT_OK(follower->Get(ropts, "quux", &value));
+  ASSERT_EQ("v3", value);
+  ASSERT_OK(follower->Get(ropts, "qux", &value));
+  ASSERT_EQ("v2", value);
+  delete follower;
+
+  // A polling follower catches up by itself; env_ does not really sleep
+  follower_options.env = Env::Default();
+  follower_options.follower_poll_micros = 10000;
+  ASSERT_OK(DB::OpenAsFollower(follower_options, options.mirror_path,
+                               &follower));
+  ASSERT_OK(Put("polled", "v4"));
+  ASSERT_OK(db_->WaitForMirror(10000000));
+  for (int i = 0; i < 1000; i++) {
+    if (follower->Get(ropts, "polled", &value).ok()) break;
+    DelayMilliseconds(10);
+  }
+  ASSERT_EQ("v4", value);
+  delete follower;
+
+  Close();
+  DestroyDB(dbname_, options);
+  DestroyMirror(options.mirror_path);
+}
+
+TEST(DBTest, CompactionWriteRate) {
+  Options options = CurrentOptions();
+  options.compaction_write_rate = 1 << 20;
+  Reopen(&options);
+  Random rnd(301);
+  for (int r = 0; r < 2; r++) {  // Two overlapping files: no trivial move
+    for (int i = 0; i < 200; i++) {
+      ASSERT_OK(Put(Key(i), RandomString(&rnd, 1000)));
+    }
+    dbfull()->TEST_CompactMemTable();  // Flushes are not limited
+  }
+  std::string stats;
+  ASSERT_TRUE(db_->GetProperty("leveldb.stats", &stats));
+  ASSERT_TRUE(stats.find("throttled 0 times") != std::string::npos);
+
+  // ~200KB of output at 1MB/s is held back once the bucket runs out
+  const uint64_t start = env_->NowMicros();
+  db_->CompactRange(NULL, NULL);
+  ASSERT_GE(env_->NowMicros() - start, 50000);
+  ASSERT_TRUE(db_->GetProperty("leveldb.stats", &stats));
+  ASSERT_TRUE(stats.find("throttled 0 times") == std::string::npos);
+}
+
 TEST(DBTest, MinorCompactionsHappen) {
   Options options = CurrentOptions();
   options.write_buffer_size = 10000;
@@ -931,9 +1451,11 @@ TEST(DBTest, RecoverWithLargeLog) {
   }
 
   // Make sure that if we re-open with a small write buffer size that
-  // we flush table files in the middle of a large log file.
+  // we flush table files in the middle of a large log file.  Three
+  // level-0 files must not trigger a compaction before they are counted.
   Options options = CurrentOptions();
   options.write_buffer_size = 100000;
+  options.level0_compaction_trigger = 4;
   Reopen(&options);
   ASSERT_EQ(NumTableFilesAtLevel(0), 3);
   ASSERT_EQ(std::string(200000, '1'), Get("big1"));
@@ -969,6 +1491,107 @@ TEST(DBTest, CompactionsGenerateMultipleFiles) {
   }
 }
 
+TEST(DBTest, TargetFileSize) {
+  // Compacting level 2 into 3 cuts 1MB into files of the size for level 2
+  const int multipliers[] = { 1, 2 };
+  int files[2];
+  for (int m = 0; m < 2; m++) {
+    Options options = CurrentOptions();
+    options.target_file_size = 100 << 10;
+    options.target_file_size_multiplier = multipliers[m];
+    options.create_if_missing = true;
+    DestroyAndReopen(&options);
+    Random rnd(301);
+    for (int i = 0; i < 100; i++) {
+      ASSERT_OK(Put(Key(i), RandomString(&rnd, 10000)));
+    }
+    dbfull()->TEST_CompactMemTable();
+    ASSERT_EQ("0,0,1", FilesPerLevel());
+    dbfull()->TEST_CompactRange(2, NULL, NULL);
+    ASSERT_EQ(0, NumTableFilesAtLevel(2));
+    files[m] = NumTableFilesAtLevel(3);
+  }
+  ASSERT_GE(files[0], 9);
+  ASSERT_LE(files[0], 11);
+  ASSERT_GE(files[1], 4);
+  ASSERT_LE(files[1], 6);
+}
+
+TEST(DBTest, ConcurrentCompactions) {
+  // Small tables over several levels keep a few compactions going at once
+  Options options = CurrentOptions();
+  options.write_buffer_size = 100000;
+  options.target_file_size = 64 << 10;
+  options.level1_size = 1 << 20;
+  options.level_ratio = 2;
+  options.max_background_compactions = 4;
+  options.create_if_missing = true;
+  DestroyAndReopen(&options);
+  Random rnd(301);
+  std::vector<std::string> values(5000);
+  for (int i = 0; i < 20000; i++) {
+    const int k = rnd.Uniform(values.size());
+    values[k] = RandomString(&rnd, 1000);
+    ASSERT_OK(Put(Key(k), values[k]));
+  }
+  dbfull()->TEST_CompactMemTable();
+  for (int level = 0; level < config::kNumLevels - 1; level++) {
+    dbfull()->TEST_CompactRange(level, NULL, NULL);
+  }
+  for (size_t k = 0; k < values.size(); k++) {
+    ASSERT_EQ(values[k].empty() ? "NOT_FOUND" : values[k], Get(Key(k)));
+  }
+  Reopen(&options);
+  for (size_t k = 0; k < values.size(); k += 7) {
+    ASSERT_EQ(values[k].empty() ? "NOT_FOUND" : values[k], Get(Key(k)));
+  }
+}
+
+TEST(DBTest, Subcompactions) {
+  // The same overwrites, deletions and snapshot compacted in one piece
+  // and in shards read back the same
+  std::string contents[2];
+  int files[2];
+  for (int run = 0; run < 2; run++) {
+    Options options = CurrentOptions();
+    options.write_buffer_size = 100000;
+    options.target_file_size = 64 << 10;
+    options.max_subcompactions = (run == 0 ? 1 : 4);
+    options.create_if_missing = true;
+    DestroyAndReopen(&options);
+    Random rnd(301);
+    const Snapshot* snapshot = NULL;
+    for (int i = 0; i < 6000; i++) {
+      const int k = rnd.Uniform(2000);
+      if (rnd.OneIn(10)) {
+        ASSERT_OK(Delete(Key(k)));
+      } else {
+        ASSERT_OK(Put(Key(k), RandomString(&rnd, 500)));
+      }
+      if (i == 3000) {
+        snapshot = db_->GetSnapshot();
+      }
+    }
+    dbfull()->TEST_CompactMemTable();
+    dbfull()->TEST_CompactRange(0, NULL, NULL);
+    dbfull()->TEST_CompactRange(1, NULL, NULL);
+    ASSERT_EQ(0, NumTableFilesAtLevel(1));
+    files[run] = NumTableFilesAtLevel(2);
+    contents[run] = Contents();
+    ReadOptions ropts;
+    ropts.snapshot = snapshot;
+    Iterator* iter = db_->NewIterator(ropts);
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      contents[run] += iter->key().ToString() + iter->value().ToString();
+    }
+    delete iter;
+    db_->ReleaseSnapshot(snapshot);
+  }
+  ASSERT_TRUE(contents[0] == contents[1]);
+  ASSERT_GT(files[0], 1);
+  ASSERT_GE(files[1], files[0]);
+}
+
 TEST(DBTest, RepeatedWritesToSameKey) {
   Options options = CurrentOptions();
   options.env = env_;
@@ -976,8 +1599,9 @@ TEST(DBTest, RepeatedWritesToSameKey) {
   Reopen(&options);
 
   // We must have at most one file per level except for level-0,
-  // which may have up to kL0_StopWritesTrigger files.
-  const int kMaxFiles = config::kNumLevels + config::kL0_StopWritesTrigger;
+  // which may have up to level0_stop_writes_trigger files.
+  const int kMaxFiles = config::kNumLevels +
+      options.level0_stop_writes_trigger;
 
   Random rnd(301);
   std::string value = RandomString(&rnd, 2 * options.write_buffer_size);
@@ -1180,6 +1804,11 @@ TEST(DBTest, Snapshot) {
 
 TEST(DBTest, HiddenValuesAreRemoved) {
   do {
+    // A background compaction of the level-0 files while the snapshot
+    // below is held would keep "big" in level 1
+    Options options = CurrentOptions();
+    options.level0_compaction_trigger = 4;
+    Reopen(&options);
     Random rnd(301);
     FillLevels("a", "z");
 
@@ -1212,7 +1841,7 @@ TEST(DBTest, HiddenValuesAreRemoved) {
 TEST(DBTest, DeletionMarkers1) {
   Put("foo", "v1");
   ASSERT_OK(dbfull()->TEST_CompactMemTable());
-  const int last = config::kMaxMemCompactLevel;
+  const int last = last_options_.max_mem_compact_level;
   ASSERT_EQ(NumTableFilesAtLevel(last), 1);   // foo => v1 is now in last level
 
   // Place a table at level last-1 to prevent merging with preceding mutation
@@ -1241,7 +1870,7 @@ TEST(DBTest, DeletionMarkers1) {
 TEST(DBTest, DeletionMarkers2) {
   Put("foo", "v1");
   ASSERT_OK(dbfull()->TEST_CompactMemTable());
-  const int last = config::kMaxMemCompactLevel;
+  const int last = last_options_.max_mem_compact_level;
   ASSERT_EQ(NumTableFilesAtLevel(last), 1);   // foo => v1 is now in last level
 
   // Place a table at level last-1 to prevent merging with preceding mutation
@@ -1266,7 +1895,14 @@ TEST(DBTest, DeletionMarkers2) {
 
 TEST(DBTest, OverlapInLevel0) {
   do {
-    ASSERT_EQ(config::kMaxMemCompactLevel, 2) << "Fix test to match config";
+    ASSERT_EQ(last_options_.max_mem_compact_level, 2)
+        << "Fix test to match config";
+
+    // The level-0 files below must stay there: keep two of them from
+    // triggering a compaction
+    Options options = CurrentOptions();
+    options.level0_compaction_trigger = 4;
+    Reopen(&options);
 
     // Fill levels 1 and 2 to disable the pushing of new memtables to levels > 0.
     ASSERT_OK(Put("100", "v100"));
@@ -1427,8 +2063,8 @@ TEST(DBTest, CustomComparator) {
 }
 
 TEST(DBTest, ManualCompaction) {
-  ASSERT_EQ(config::kMaxMemCompactLevel, 2)
-      << "Need to update this test to match kMaxMemCompactLevel";
+  ASSERT_EQ(last_options_.max_mem_compact_level, 2)
+      << "Need to update this test to match max_mem_compact_level";
 
   MakeTables(3, "p", "q");
   ASSERT_EQ("1,1,1", FilesPerLevel());
@@ -1599,7 +2235,7 @@ TEST(DBTest, ManifestWriteError) {
     // Memtable compaction (will succeed)
     dbfull()->TEST_CompactMemTable();
     ASSERT_EQ("bar", Get("foo"));
-    const int last = config::kMaxMemCompactLevel;
+    const int last = last_options_.max_mem_compact_level;
     ASSERT_EQ(NumTableFilesAtLevel(last), 1);   // foo=>bar is now in last level
 
     // Merging compaction (will fail)
@@ -1812,7 +2448,7 @@ class ModelDB: public DB {
     assert(false);      // Not implemented
     return Status::NotFound(key);
   }
-  virtual Iterator* NewIterator(const ReadOptions& options) {
+  virtual Iterator* NewIterator(const ReadOptions& options, bool mirror) {
     if (options.snapshot == NULL) {
       KVMap* saved = new KVMap;
       *saved = map_;
@@ -9,12 +9,6 @@
 
 namespace leveldb {
 
-namespace config {
-int kTargetFileSize = 2 * 1048576;
-int kL0_Size = 10;       // in MB
-int kLevelRatio = 10;    // enlarge the level size ten times when the db levels up
-}
-
 static uint64_t PackSequenceAndType(uint64_t seq, ValueType t) {
   assert(seq <= kMaxSequenceNumber);
   assert(t <= kValueTypeForSeek);
@@ -44,7 +44,7 @@ class LogTest {
 
     virtual Status Close() { return Status::OK(); }
     virtual Status Flush() { return Status::OK(); }
-    virtual Status Sync() { return Status::OK(); }
+    virtual Status Sync(int flags) { return Status::OK(); }
     virtual Status Append(const Slice& slice) {
       contents_.append(slice.data(), slice.size());
       return Status::OK();
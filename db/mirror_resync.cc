@@ -0,0 +1,240 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/mirror_resync.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "db/filename.h"
+#include "leveldb/env.h"
+#include "leveldb/mirror.h"
+#include "util/mutexlock.h"
+#include "util/rate_limiter.h"
+
+namespace leveldb {
+
+MirrorResync::MirrorResync(Env* env, const std::string& dbname,
+                           MirrorContext* mirror, int threads,
+                           uint64_t bytes_per_second)
+    : env_(env),
+      dbname_(dbname),
+      mirror_(mirror),
+      threads_(threads > 0 ? threads : 1),
+      limiter_(NULL),
+      cv_(&mu_),
+      workers_(0),
+      shutting_down_(false),
+      start_micros_(0),
+      end_micros_(0) {
+  memset(&stats_, 0, sizeof(stats_));
+  if (bytes_per_second > 0) {
+    limiter_ = new RateLimiter(bytes_per_second, env_);
+  }
+}
+
+MirrorResync::~MirrorResync() {
+  {
+    MutexLock l(&mu_);
+    shutting_down_ = true;
+    while (workers_ > 0) {
+      cv_.Wait();
+    }
+  }
+  delete limiter_;
+}
+
+bool MirrorResync::Start(const std::map<uint64_t, uint64_t>& live,
+                         const std::set<uint64_t>& unmirrored,
+                         const std::set<uint64_t>& pending,
+                         uint64_t next_file) {
+  MutexLock l(&mu_);
+  if (stats_.running || shutting_down_) {
+    return false;
+  }
+  stats_.passes++;
+  stats_.files_to_copy = stats_.bytes_to_copy = 0;
+  stats_.files_copied = stats_.bytes_copied = 0;
+  stats_.unmirrored = 0;
+  stats_.orphans = stats_.orphans_deleted = 0;
+  stats_.errors = 0;
+
+  // Table files in the mirror directory, by number.  A missing or
+  // unreadable directory has none.
+  std::map<uint64_t, uint64_t> copies;
+  std::vector<std::string> children;
+  env_->GetChildren(mirror_->path(), &children);
+  for (size_t i = 0; i < children.size(); i++) {
+    uint64_t number, size;
+    FileType type;
+    const std::string& name = children[i];
+    if ((name.size() > 7 &&
+         name.compare(name.size() - 7, 7, ".resync") == 0) ||
+        (name.size() > 11 &&
+         name.compare(name.size() - 11, 11, ".quarantine") == 0)) {
+      // Left by a copy that never finished, or set aside by the scrubber
+      env_->DeleteFile(mirror_->path() + "/" + children[i]);
+    } else if (ParseFileName(children[i], &number, &type) && type == kTableFile &&
+        env_->GetFileSize(mirror_->path() + "/" + children[i], &size).ok()) {
+      copies[number] = size;
+    }
+  }
+
+  for (std::map<uint64_t, uint64_t>::const_iterator it = live.begin();
+       it != live.end(); ++it) {
+    const bool skipped = mirror_->IsCopySkipped(it->first);
+    if (!skipped && !mirror_->CopyLanded(it->first)) {
+      continue;  // The helpers are still writing it
+    }
+    std::map<uint64_t, uint64_t>::iterator c = copies.find(it->first);
+    const bool good = !skipped && c != copies.end() && c->second == it->second;
+    if (unmirrored.count(it->first) > 0) {
+      // A good copy may still be read; anything else is not made again
+      stats_.unmirrored++;
+      if (!good) {
+        mirror_->CopySkipped(it->first);
+        if (c != copies.end()) {
+          Task t = { it->first, c->second, true };
+          tasks_.push_back(t);
+          stats_.orphans++;
+        }
+      }
+    } else if (!good && mirror_->TryCopyStarted(it->first)) {
+      // Readers keep to the primary; the scrubber may be at it already
+      Task t = { it->first, it->second, false };
+      tasks_.push_back(t);
+      stats_.files_to_copy++;
+      stats_.bytes_to_copy += it->second;
+    }
+  }
+  for (std::map<uint64_t, uint64_t>::iterator c = copies.begin();
+       c != copies.end(); ++c) {
+    if (c->first < next_file && live.count(c->first) == 0 &&
+        pending.count(c->first) == 0) {
+      Task t = { c->first, c->second, true };
+      tasks_.push_back(t);
+      stats_.orphans++;
+    }
+  }
+
+  start_micros_ = env_->NowMicros();
+  end_micros_ = start_micros_;
+  if (tasks_.empty()) {
+    return true;
+  }
+  stats_.running = true;
+  const int n = std::min<int>(threads_, tasks_.size());
+  for (int i = 0; i < n; i++) {
+    workers_++;
+    env_->StartThread(&MirrorResync::Work, this);
+  }
+  return true;
+}
+
+bool MirrorResync::Running() {
+  MutexLock l(&mu_);
+  return stats_.running;
+}
+
+void MirrorResync::Work(void* arg) {
+  reinterpret_cast<MirrorResync*>(arg)->Run();
+}
+
+void MirrorResync::Run() {
+  mu_.Lock();
+  while (!shutting_down_ && !tasks_.empty()) {
+    const Task task = tasks_.front();
+    tasks_.pop_front();
+    mu_.Unlock();
+    RunTask(task);
+    mu_.Lock();
+  }
+  if (--workers_ == 0) {
+    // Copies left by a shutdown stay in flight: they were never made
+    tasks_.clear();
+    stats_.running = false;
+    end_micros_ = env_->NowMicros();
+  }
+  cv_.SignalAll();
+  mu_.Unlock();
+}
+
+void MirrorResync::RunTask(const Task& task) {
+  const std::string fname = TableFileName(dbname_, task.number);
+  const std::string mfname = mirror_->MirrorFileName(fname);
+  if (task.orphan) {
+    // Gone already is fine: its table may just have been deleted
+    const bool deleted = env_->DeleteFile(mfname).ok() ||
+                         !env_->FileExists(mfname);
+    MutexLock l(&mu_);
+    if (deleted) {
+      stats_.orphans_deleted++;
+    } else {
+      stats_.errors++;
+    }
+    return;
+  }
+
+  uint64_t bytes = 0;
+  Status s = mirror_->CopyFromPrimary(fname, limiter_, &bytes);
+  bool error = false;
+  if (!env_->FileExists(fname)) {
+    // Compacted away meanwhile; its mirror delete may have run already
+    env_->DeleteFile(mfname);
+  } else if (!s.ok() || bytes != task.size) {
+    // Never leave a bad copy for readers to find
+    env_->DeleteFile(mfname);
+    error = true;
+  }
+  if (error) {
+    mirror_->CopyFailed(task.number);  // Leave it to the primary
+  } else {
+    mirror_->CopyDone(task.number);
+  }
+
+  MutexLock l(&mu_);
+  if (error) {
+    stats_.errors++;
+  } else {
+    stats_.files_copied++;
+    stats_.bytes_copied += bytes;
+  }
+}
+
+void MirrorResync::GetStats(Stats* stats) {
+  MutexLock l(&mu_);
+  *stats = stats_;
+  const uint64_t end = stats_.running ? env_->NowMicros() : end_micros_;
+  stats->micros = end - start_micros_;
+}
+
+std::string MirrorResync::Summary() {
+  Stats stats;
+  GetStats(&stats);
+  char buf[500];
+  snprintf(buf, sizeof(buf),
+           "State: %s\n"
+           "Passes: %llu\n"
+           "Files copied: %llu of %llu\n"
+           "Copied(MB): %.1f of %.1f\n"
+           "Not mirrored: %llu\n"
+           "Orphans deleted: %llu of %llu\n"
+           "Errors: %llu\n"
+           "Time(sec): %.3f\n",
+           stats.running ? "running" : (stats.passes > 0 ? "done" : "idle"),
+           static_cast<unsigned long long>(stats.passes),
+           static_cast<unsigned long long>(stats.files_copied),
+           static_cast<unsigned long long>(stats.files_to_copy),
+           stats.bytes_copied / 1048576.0,
+           stats.bytes_to_copy / 1048576.0,
+           static_cast<unsigned long long>(stats.unmirrored),
+           static_cast<unsigned long long>(stats.orphans_deleted),
+           static_cast<unsigned long long>(stats.orphans),
+           static_cast<unsigned long long>(stats.errors),
+           stats.micros / 1e6);
+  return buf;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,107 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// MirrorResync brings a mirror directory back in line with the live
+// table files of a DB: copies that are missing or whose size does not
+// match are copied again from the primary by a few worker threads, and
+// table files in the mirror that the DB no longer has are deleted, as
+// are copies the MirrorScrubber quarantined.
+// Tables that Options::mirror_policy keeps off the mirror are left
+// without a copy.
+// Copies being rebuilt are marked in flight in the MirrorContext, so
+// readers use the primary until they land, and for good if the copy
+// fails.  Thread-safe.
+
+#ifndef STORAGE_LEVELDB_DB_MIRROR_RESYNC_H_
+#define STORAGE_LEVELDB_DB_MIRROR_RESYNC_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include "port/port.h"
+
+namespace leveldb {
+
+class Env;
+class MirrorContext;
+class RateLimiter;
+
+class MirrorResync {
+ public:
+  struct Stats {
+    bool running;
+    uint64_t passes;            // Calls of Start()
+    uint64_t files_to_copy;     // In the current or last pass
+    uint64_t bytes_to_copy;
+    uint64_t files_copied;
+    uint64_t bytes_copied;
+    uint64_t unmirrored;        // Live tables kept off the mirror
+    uint64_t orphans;           // Mirror files of no live table
+    uint64_t orphans_deleted;
+    uint64_t errors;
+    uint64_t micros;            // Time the pass took, or has taken so far
+  };
+
+  // Copy with "threads" workers at no more than "bytes_per_second"
+  // (0 for no limit).
+  MirrorResync(Env* env, const std::string& dbname, MirrorContext* mirror,
+               int threads, uint64_t bytes_per_second);
+
+  // Stops the workers after the copies they are making.
+  ~MirrorResync();
+
+  // Start a pass.  "live" maps the live table files to their sizes;
+  // those in "unmirrored" are not to have a copy.  Table files in
+  // "pending" (compaction outputs not installed yet) and those numbered
+  // "next_file" and up are newer than "live" and left alone.  Compares
+  // the mirror directory with "live" and marks the copies to rebuild
+  // before returning; the copying and deleting is done in the
+  // background.  Returns false if a pass is already running.
+  bool Start(const std::map<uint64_t, uint64_t>& live,
+             const std::set<uint64_t>& unmirrored,
+             const std::set<uint64_t>& pending, uint64_t next_file);
+
+  bool Running();
+
+  void GetStats(Stats* stats);
+
+  // Return a human-readable summary of the stats.
+  std::string Summary();
+
+ private:
+  struct Task {
+    uint64_t number;
+    uint64_t size;              // Expected size of a copy
+    bool orphan;                // Delete the mirror file instead
+  };
+
+  static void Work(void* arg);
+  void Run();
+  void RunTask(const Task& task);
+
+  Env* const env_;
+  const std::string dbname_;
+  MirrorContext* const mirror_;
+  const int threads_;
+  RateLimiter* limiter_;
+
+  port::Mutex mu_;
+  port::CondVar cv_;            // Signalled when a worker exits
+  std::deque<Task> tasks_;      // Protected by mu_
+  int workers_;                 // Protected by mu_
+  bool shutting_down_;          // Protected by mu_
+  uint64_t start_micros_;       // Protected by mu_
+  uint64_t end_micros_;         // Protected by mu_
+  Stats stats_;                 // Protected by mu_
+
+  // No copying allowed
+  MirrorResync(const MirrorResync&);
+  void operator=(const MirrorResync&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_MIRROR_RESYNC_H_
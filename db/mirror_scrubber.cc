@@ -0,0 +1,295 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/mirror_scrubber.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <vector>
+#include "db/filename.h"
+#include "db/table_cache.h"
+#include "db/version_set.h"
+#include "leveldb/comparator.h"
+#include "leveldb/env.h"
+#include "leveldb/mirror.h"
+#include "table/block.h"
+#include "table/format.h"
+#include "util/mutexlock.h"
+#include "util/rate_limiter.h"
+
+namespace leveldb {
+
+MirrorScrubber::MirrorScrubber(Env* env, const std::string& dbname,
+                               MirrorContext* mirror, TableCache* table_cache,
+                               VersionSet* versions, port::Mutex* db_mutex,
+                               uint64_t bytes_per_second)
+    : env_(env),
+      dbname_(dbname),
+      mirror_(mirror),
+      table_cache_(table_cache),
+      versions_(versions),
+      db_mutex_(db_mutex),
+      limiter_(NULL),
+      shutting_down_(NULL),
+      cv_(&mu_),
+      started_(false),
+      thread_running_(false),
+      in_pass_(false) {
+  memset(&stats_, 0, sizeof(stats_));
+  if (bytes_per_second > 0) {
+    limiter_ = new RateLimiter(bytes_per_second, env_);
+  }
+}
+
+MirrorScrubber::~MirrorScrubber() {
+  shutting_down_.Release_Store(this);
+  {
+    MutexLock l(&mu_);
+    while (thread_running_ || in_pass_) {
+      cv_.Wait();
+    }
+  }
+  delete limiter_;
+}
+
+void MirrorScrubber::Start() {
+  MutexLock l(&mu_);
+  if (!started_) {
+    started_ = true;
+    thread_running_ = true;
+    env_->StartThread(&MirrorScrubber::Work, this);
+  }
+}
+
+void MirrorScrubber::Work(void* arg) {
+  reinterpret_cast<MirrorScrubber*>(arg)->Run();
+}
+
+void MirrorScrubber::Run() {
+  // Sleep in slices so that shutdown is not held up
+  const uint64_t kSliceMicros = 100000;
+  uint64_t idle = 0;
+  while (shutting_down_.Acquire_Load() == NULL) {
+    if (idle < kPassIntervalMicros) {
+      env_->SleepForMicroseconds(kSliceMicros);
+      idle += kSliceMicros;
+    } else {
+      RunPass();
+      idle = 0;
+    }
+  }
+  MutexLock l(&mu_);
+  thread_running_ = false;
+  cv_.SignalAll();
+}
+
+void MirrorScrubber::RunPass() {
+  {
+    MutexLock l(&mu_);
+    while (in_pass_) {
+      cv_.Wait();
+    }
+    in_pass_ = true;
+    stats_.running = true;
+  }
+  const uint64_t start = env_->NowMicros();
+
+  // Quarantined by an earlier pass, or before a restart: deleted once
+  // this pass is through
+  std::vector<std::string> quarantined;
+  std::vector<std::string> children;
+  env_->GetChildren(mirror_->path(), &children);
+  for (size_t i = 0; i < children.size(); i++) {
+    const std::string& name = children[i];
+    if (name.size() > 11 &&
+        name.compare(name.size() - 11, 11, ".quarantine") == 0) {
+      quarantined.push_back(mirror_->path() + "/" + name);
+    }
+  }
+
+  std::map<uint64_t, uint64_t> live;
+  db_mutex_->Lock();
+  versions_->AddLiveFiles(&live);
+  db_mutex_->Unlock();
+  for (std::map<uint64_t, uint64_t>::iterator it = live.begin();
+       it != live.end() && shutting_down_.Acquire_Load() == NULL; ++it) {
+    // Copies in flight or never made are not what readers use
+    if (mirror_->CopyLanded(it->first)) {
+      ScrubFile(it->first, it->second);
+    }
+  }
+  if (shutting_down_.Acquire_Load() == NULL) {
+    for (size_t i = 0; i < quarantined.size(); i++) {
+      env_->DeleteFile(quarantined[i]);
+    }
+  }
+
+  MutexLock l(&mu_);
+  stats_.passes++;
+  stats_.micros = env_->NowMicros() - start;
+  stats_.running = false;
+  in_pass_ = false;
+  cv_.SignalAll();
+}
+
+void MirrorScrubber::ScrubFile(uint64_t number, uint64_t size) {
+  const std::string fname = TableFileName(dbname_, number);
+  const std::string mfname = mirror_->MirrorFileName(fname);
+  Status s = CheckCopy(mfname, size);
+  {
+    MutexLock l(&mu_);
+    stats_.files_checked++;
+    stats_.bytes_checked += size;
+  }
+  if (s.ok() || shutting_down_.Acquire_Load() != NULL ||
+      !env_->FileExists(fname)) {
+    return;  // Good, or compacted away while we were reading it
+  }
+  {
+    MutexLock l(&mu_);
+    stats_.mismatches++;
+  }
+  Recopy(number, size);
+}
+
+Status MirrorScrubber::CheckCopy(const std::string& mfname, uint64_t size) {
+  uint64_t msize;
+  Status s = env_->GetFileSize(mfname, &msize);
+  if (!s.ok()) {
+    return s;
+  }
+  if (msize != size || size < Footer::kEncodedLength) {
+    return Status::Corruption(mfname, "size mismatch");
+  }
+  RandomAccessFile* file;
+  s = env_->NewRandomAccessFile(mfname, &file);
+  if (!s.ok()) {
+    return s;
+  }
+  char footer_space[Footer::kEncodedLength];
+  Slice footer_input;
+  s = file->Read(size - Footer::kEncodedLength, Footer::kEncodedLength,
+                 &footer_input, footer_space);
+  Footer footer;
+  if (s.ok()) {
+    s = footer.DecodeFrom(&footer_input);
+  }
+  if (s.ok()) {
+    s = CheckBlock(file, size, footer.metaindex_handle(), true);
+  }
+  if (s.ok()) {
+    s = CheckBlock(file, size, footer.index_handle(), true);
+  }
+  delete file;
+  return s;
+}
+
+// Checks the block at "handle" and, if "walk", the blocks its entries
+// point to: the data blocks of the index block, the filter block of the
+// metaindex block.  "size" is the size of the file.
+Status MirrorScrubber::CheckBlock(RandomAccessFile* file, uint64_t size,
+                                  const BlockHandle& handle, bool walk) {
+  // A damaged handle must not make us allocate or read past the file
+  if (handle.offset() > size ||
+      handle.size() + kBlockTrailerSize > size - handle.offset()) {
+    return Status::Corruption("block handle past the end of the file");
+  }
+  if (limiter_ != NULL) {
+    limiter_->Request(handle.size() + kBlockTrailerSize);
+  }
+  ReadOptions options;
+  options.verify_checksums = true;
+  options.fill_cache = false;
+  BlockContents contents;
+  Status s = ReadBlock(file, options, handle, &contents);
+  if (!s.ok()) {
+    return s;
+  }
+  Block block(contents);  // Frees the contents if they are its own
+  if (!walk) {
+    return s;
+  }
+  Iterator* iter = block.NewIterator(BytewiseComparator());
+  for (iter->SeekToFirst(); s.ok() && iter->Valid(); iter->Next()) {
+    if (shutting_down_.Acquire_Load() != NULL) {
+      break;
+    }
+    BlockHandle child;
+    Slice input = iter->value();
+    s = child.DecodeFrom(&input);
+    if (s.ok()) {
+      s = CheckBlock(file, size, child, false);
+    }
+  }
+  if (s.ok()) {
+    s = iter->status();
+  }
+  delete iter;
+  return s;
+}
+
+void MirrorScrubber::Recopy(uint64_t number, uint64_t size) {
+  const std::string fname = TableFileName(dbname_, number);
+  const std::string mfname = mirror_->MirrorFileName(fname);
+  if (!mirror_->TryCopyStarted(number)) {
+    return;  // Somebody else is making it again
+  }
+  // Readers now keep to the primary; drop the tables open on the copy
+  table_cache_->Evict(number);
+  env_->RenameFile(mfname, mfname + ".quarantine");
+
+  uint64_t bytes = 0;
+  Status s = mirror_->CopyFromPrimary(fname, limiter_, &bytes);
+  bool error = false;
+  if (!env_->FileExists(fname)) {
+    env_->DeleteFile(mfname);  // Compacted away meanwhile
+  } else if (!s.ok() || bytes != size) {
+    env_->DeleteFile(mfname);
+    error = true;
+  }
+  if (error) {
+    mirror_->CopyFailed(number);  // Leave it to the primary
+  } else {
+    mirror_->CopyDone(number);
+  }
+
+  MutexLock l(&mu_);
+  if (error) {
+    stats_.errors++;
+  } else {
+    stats_.recopied++;
+  }
+}
+
+void MirrorScrubber::GetStats(Stats* stats) {
+  MutexLock l(&mu_);
+  *stats = stats_;
+}
+
+std::string MirrorScrubber::Summary() {
+  Stats stats;
+  GetStats(&stats);
+  char buf[500];
+  snprintf(buf, sizeof(buf),
+           "State: %s\n"
+           "Passes: %llu\n"
+           "Files checked: %llu\n"
+           "Checked(MB): %.1f\n"
+           "Mismatches: %llu\n"
+           "Recopied: %llu\n"
+           "Errors: %llu\n"
+           "Last pass(sec): %.3f\n",
+           stats.running ? "running" : "idle",
+           static_cast<unsigned long long>(stats.passes),
+           static_cast<unsigned long long>(stats.files_checked),
+           stats.bytes_checked / 1048576.0,
+           static_cast<unsigned long long>(stats.mismatches),
+           static_cast<unsigned long long>(stats.recopied),
+           static_cast<unsigned long long>(stats.errors),
+           stats.micros / 1e6);
+  return buf;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,101 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// MirrorScrubber checks, in the background, that the mirror copies of
+// the live table files are intact: every block of a copy is read and its
+// CRC verified, as ReadBlock() does with ReadOptions::verify_checksums.
+// A copy that fails is renamed to "<number>.sst.quarantine" in the
+// mirror directory, and copied again from the primary; readers use the
+// primary meanwhile.  A quarantined copy is kept for inspection until
+// the end of the next pass.  Reads are held to a rate so that the scrubber
+// leaves the device to foreground I/O.  Thread-safe.
+
+#ifndef STORAGE_LEVELDB_DB_MIRROR_SCRUBBER_H_
+#define STORAGE_LEVELDB_DB_MIRROR_SCRUBBER_H_
+
+#include <stdint.h>
+#include <string>
+#include "leveldb/status.h"
+#include "port/port.h"
+
+namespace leveldb {
+
+class BlockHandle;
+class Env;
+class MirrorContext;
+class RateLimiter;
+class RandomAccessFile;
+class TableCache;
+class VersionSet;
+
+class MirrorScrubber {
+ public:
+  struct Stats {
+    bool running;               // A pass is in progress
+    uint64_t passes;            // Passes completed
+    uint64_t files_checked;     // Since the scrubber was created
+    uint64_t bytes_checked;
+    uint64_t mismatches;        // Copies that failed the check
+    uint64_t recopied;          // Of those, copied again
+    uint64_t errors;            // Copies that could not be made again
+    uint64_t micros;            // Time the last pass took
+  };
+
+  // Reads at no more than "bytes_per_second" (0 for no limit).  The
+  // live files are taken from "versions" under "db_mutex".
+  MirrorScrubber(Env* env, const std::string& dbname, MirrorContext* mirror,
+                 TableCache* table_cache, VersionSet* versions,
+                 port::Mutex* db_mutex, uint64_t bytes_per_second);
+
+  // Stops the background thread after the file it is checking.
+  ~MirrorScrubber();
+
+  // Start the background thread.  It runs a pass every
+  // kPassIntervalMicros, the first one that long after Start().
+  void Start();
+
+  // Run a pass in the calling thread, after the one in progress if any.
+  // REQUIRES: db_mutex not held
+  void RunPass();
+
+  void GetStats(Stats* stats);
+
+  // Return a human-readable summary of the stats.
+  std::string Summary();
+
+ private:
+  enum { kPassIntervalMicros = 60000000 };
+
+  static void Work(void* arg);
+  void Run();
+  void ScrubFile(uint64_t number, uint64_t size);
+  Status CheckCopy(const std::string& mfname, uint64_t size);
+  Status CheckBlock(RandomAccessFile* file, uint64_t size,
+                    const BlockHandle& handle, bool walk);
+  void Recopy(uint64_t number, uint64_t size);
+
+  Env* const env_;
+  const std::string dbname_;
+  MirrorContext* const mirror_;
+  TableCache* const table_cache_;
+  VersionSet* const versions_;
+  port::Mutex* const db_mutex_;
+  RateLimiter* limiter_;
+  port::AtomicPointer shutting_down_;
+
+  port::Mutex mu_;
+  port::CondVar cv_;            // Signalled when a pass or the thread ends
+  bool started_;                // Protected by mu_
+  bool thread_running_;         // Protected by mu_
+  bool in_pass_;                // Protected by mu_
+  Stats stats_;                 // Protected by mu_
+
+  // No copying allowed
+  MirrorScrubber(const MirrorScrubber&);
+  void operator=(const MirrorScrubber&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_MIRROR_SCRUBBER_H_
@@ -0,0 +1,113 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/read_router.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace leveldb {
+
+namespace {
+
+class TimedRandomAccessFile : public RandomAccessFile {
+ public:
+  TimedRandomAccessFile(RandomAccessFile* file, ReadRouter* router,
+                        ReadRouter::Device device, Env* env)
+      : file_(file), router_(router), device_(device), env_(env) {
+  }
+
+  virtual ~TimedRandomAccessFile() {
+    delete file_;
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    router_->ReadStarted(device_);
+    const uint64_t start = env_->NowMicros();
+    Status s = file_->Read(offset, n, result, scratch);
+    router_->ReadDone(device_, env_->NowMicros() - start);
+    return s;
+  }
+
+ private:
+  RandomAccessFile* const file_;
+  ReadRouter* const router_;
+  const ReadRouter::Device device_;
+  Env* const env_;
+};
+
+}  // namespace
+
+ReadRouter::ReadRouter() : decisions_(0) {
+  memset(latency_, 0, sizeof(latency_));
+  memset(outstanding_, 0, sizeof(outstanding_));
+  memset(reads_, 0, sizeof(reads_));
+  memset(picks_, 0, sizeof(picks_));
+}
+
+uint64_t ReadRouter::Score(Device d) const {
+  const uint64_t latency = __atomic_load_n(&latency_[d], __ATOMIC_RELAXED);
+  const uint64_t outstanding =
+      __atomic_load_n(&outstanding_[d], __ATOMIC_RELAXED);
+  return (latency + 1) * (outstanding + 1);
+}
+
+bool ReadRouter::PreferMirror() {
+  bool mirror = Score(kMirror) < Score(kPrimary);
+  const uint64_t n = __atomic_add_fetch(&decisions_, 1, __ATOMIC_RELAXED);
+  if (n % kProbeInterval == 0) {
+    mirror = !mirror;  // Sample the device we would not have picked
+  }
+  __atomic_fetch_add(&picks_[mirror ? kMirror : kPrimary], 1,
+                     __ATOMIC_RELAXED);
+  return mirror;
+}
+
+void ReadRouter::ReadDone(Device d, uint64_t micros) {
+  const uint64_t sample = micros * 16;
+  const uint64_t old = __atomic_load_n(&latency_[d], __ATOMIC_RELAXED);
+  const uint64_t avg = (old == 0) ? sample : (7 * old + sample) / 8;
+  __atomic_store_n(&latency_[d], avg, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&reads_[d], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&outstanding_[d], 1, __ATOMIC_RELAXED);
+}
+
+RandomAccessFile* ReadRouter::TimeReads(RandomAccessFile* file, Device d,
+                                        Env* env) {
+  return new TimedRandomAccessFile(file, this, d, env);
+}
+
+void ReadRouter::GetStats(Stats* stats) const {
+  for (int d = 0; d < 2; d++) {
+    stats->picks[d] = __atomic_load_n(&picks_[d], __ATOMIC_RELAXED);
+    stats->reads[d] = __atomic_load_n(&reads_[d], __ATOMIC_RELAXED);
+    stats->latency_micros[d] =
+        (__atomic_load_n(&latency_[d], __ATOMIC_RELAXED) + 8) / 16;
+    stats->outstanding[d] = __atomic_load_n(&outstanding_[d],
+                                            __ATOMIC_RELAXED);
+  }
+}
+
+std::string ReadRouter::Summary() const {
+  Stats stats;
+  GetStats(&stats);
+  std::string result =
+      "Device      Picks     Reads  Latency(us)  Outstanding\n"
+      "----------------------------------------------------\n";
+  char buf[200];
+  static const char* kNames[2] = { "primary", "mirror" };
+  for (int d = 0; d < 2; d++) {
+    snprintf(buf, sizeof(buf), "%-7s %9llu %9llu %12llu %12llu\n",
+             kNames[d],
+             static_cast<unsigned long long>(stats.picks[d]),
+             static_cast<unsigned long long>(stats.reads[d]),
+             static_cast<unsigned long long>(stats.latency_micros[d]),
+             static_cast<unsigned long long>(stats.outstanding[d]));
+    result.append(buf);
+  }
+  return result;
+}
+
+}  // namespace leveldb
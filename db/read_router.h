@@ -0,0 +1,75 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// ReadRouter picks, per table read, between the primary copy of the
+// table files and their mirror copies.  It keeps an exponentially
+// weighted moving average of the read latency of each device and the
+// number of reads currently outstanding on it, and sends each read to
+// the device whose average latency times (outstanding reads + 1) is
+// lower.  Every kProbeInterval-th pick goes to the other device, so the
+// estimate of a device that is losing does not go stale.
+//
+// Thread-safe and lock-free; concurrent updates of an average may drop
+// samples, which only slows down how quickly it moves.
+
+#ifndef STORAGE_LEVELDB_DB_READ_ROUTER_H_
+#define STORAGE_LEVELDB_DB_READ_ROUTER_H_
+
+#include <stdint.h>
+#include <string>
+#include "leveldb/env.h"
+
+namespace leveldb {
+
+class ReadRouter {
+ public:
+  enum Device { kPrimary = 0, kMirror = 1 };
+
+  enum { kProbeInterval = 64 };
+
+  struct Stats {
+    uint64_t picks[2];          // Reads sent to each device
+    uint64_t reads[2];          // Reads timed on each device
+    uint64_t latency_micros[2]; // Average read latency, rounded
+    uint64_t outstanding[2];    // Reads in progress
+  };
+
+  ReadRouter();
+
+  // Return true if the next read should go to the mirror copy.
+  bool PreferMirror();
+
+  // Bracket one read on device "d".
+  void ReadStarted(Device d) {
+    __atomic_fetch_add(&outstanding_[d], 1, __ATOMIC_RELAXED);
+  }
+  void ReadDone(Device d, uint64_t micros);
+
+  // Wrap "file", a copy on device "d", so that its reads are timed.
+  // Takes ownership of "file".
+  RandomAccessFile* TimeReads(RandomAccessFile* file, Device d, Env* env);
+
+  void GetStats(Stats* stats) const;
+
+  // Return a human-readable summary of the stats.
+  std::string Summary() const;
+
+ private:
+  uint64_t Score(Device d) const;
+
+  // Average latency in 1/16 microsecond units, 0 until the first read
+  uint64_t latency_[2];
+  uint64_t outstanding_[2];
+  uint64_t reads_[2];
+  uint64_t picks_[2];
+  uint64_t decisions_;
+
+  // No copying allowed
+  ReadRouter(const ReadRouter&);
+  void operator=(const ReadRouter&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_DB_READ_ROUTER_H_
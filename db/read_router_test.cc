@@ -0,0 +1,110 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "db/read_router.h"
+
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class ReadRouterTest { };
+
+// Count how many of "n" picks go to the mirror.
+static int MirrorPicks(ReadRouter* router, int n) {
+  int mirror = 0;
+  for (int i = 0; i < n; i++) {
+    if (router->PreferMirror()) mirror++;
+  }
+  return mirror;
+}
+
+TEST(ReadRouterTest, IdleDevicesReadPrimary) {
+  ReadRouter router;
+  // Only the probes go to the mirror
+  ASSERT_EQ(2, MirrorPicks(&router, 2 * ReadRouter::kProbeInterval));
+}
+
+TEST(ReadRouterTest, FollowsLatency) {
+  ReadRouter router;
+  for (int i = 0; i < 10; i++) {
+    router.ReadStarted(ReadRouter::kPrimary);
+    router.ReadDone(ReadRouter::kPrimary, 1000);
+    router.ReadStarted(ReadRouter::kMirror);
+    router.ReadDone(ReadRouter::kMirror, 100);
+  }
+  ASSERT_EQ(ReadRouter::kProbeInterval - 1,
+            MirrorPicks(&router, ReadRouter::kProbeInterval));
+
+  // The primary speeds up: the average follows within a few reads
+  for (int i = 0; i < 30; i++) {
+    router.ReadStarted(ReadRouter::kPrimary);
+    router.ReadDone(ReadRouter::kPrimary, 10);
+  }
+  ASSERT_EQ(1, MirrorPicks(&router, ReadRouter::kProbeInterval));
+
+  ReadRouter::Stats stats;
+  router.GetStats(&stats);
+  ASSERT_EQ(40, stats.reads[ReadRouter::kPrimary]);
+  ASSERT_EQ(10, stats.reads[ReadRouter::kMirror]);
+  ASSERT_EQ(0, stats.outstanding[ReadRouter::kPrimary]);
+  ASSERT_LT(stats.latency_micros[ReadRouter::kPrimary], 100);
+  ASSERT_EQ(100, stats.latency_micros[ReadRouter::kMirror]);
+  ASSERT_EQ(2 * ReadRouter::kProbeInterval,
+            stats.picks[ReadRouter::kPrimary] +
+            stats.picks[ReadRouter::kMirror]);
+}
+
+TEST(ReadRouterTest, FollowsLoad) {
+  ReadRouter router;
+  router.ReadStarted(ReadRouter::kPrimary);
+  router.ReadDone(ReadRouter::kPrimary, 100);
+  router.ReadStarted(ReadRouter::kMirror);
+  router.ReadDone(ReadRouter::kMirror, 50);
+  ASSERT_TRUE(router.PreferMirror());
+
+  // A queue on the faster device sends reads to the other one
+  for (int i = 0; i < 4; i++) {
+    router.ReadStarted(ReadRouter::kMirror);
+  }
+  ASSERT_TRUE(!router.PreferMirror());
+  for (int i = 0; i < 4; i++) {
+    router.ReadDone(ReadRouter::kMirror, 50);
+  }
+  ASSERT_TRUE(router.PreferMirror());
+}
+
+namespace {
+class FixedFile : public RandomAccessFile {
+ public:
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    *result = Slice("data", 4);
+    return Status::OK();
+  }
+};
+}  // namespace
+
+TEST(ReadRouterTest, TimedFile) {
+  ReadRouter router;
+  RandomAccessFile* file =
+      router.TimeReads(new FixedFile, ReadRouter::kMirror, Env::Default());
+  Slice result;
+  for (int i = 0; i < 3; i++) {
+    ASSERT_OK(file->Read(0, 4, &result, NULL));
+    ASSERT_EQ("data", result.ToString());
+  }
+  delete file;
+
+  ReadRouter::Stats stats;
+  router.GetStats(&stats);
+  ASSERT_EQ(0, stats.reads[ReadRouter::kPrimary]);
+  ASSERT_EQ(3, stats.reads[ReadRouter::kMirror]);
+  ASSERT_EQ(0, stats.outstanding[ReadRouter::kMirror]);
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -5,23 +5,32 @@
 #include "db/table_cache.h"
 
 #include "db/filename.h"
+#include "db/read_router.h"
 #include "leveldb/env.h"
 #include "leveldb/table.h"
 #include "leveldb/mirror.h"
+#include "port/atomic_pointer.h"
 #include "util/coding.h"
+#include "util/mutexlock.h"
 
 
 namespace leveldb {
 
+// One entry per table file, for both of its copies.  The mirror table is
+// opened on the first read asked to go to the mirror.
 struct TableAndFile {
   RandomAccessFile* file;
   Table* table;
+  RandomAccessFile* mfile;
+  Table* mtable;
 };
 
 static void DeleteEntry(const Slice& key, void* value) {
   TableAndFile* tf = reinterpret_cast<TableAndFile*>(value);
   delete tf->table;
   delete tf->file;
+  delete tf->mtable;
+  delete tf->mfile;
   delete tf;
 }
 
@@ -31,67 +40,208 @@ static void UnrefEntry(void* arg1, void* arg2) {
   cache->Release(h);
 }
 
+static void DeleteScanTable(void* arg1, void* arg2) {
+  delete reinterpret_cast<Table*>(arg1);
+  delete reinterpret_cast<RandomAccessFile*>(arg2);
+}
+
+namespace {
+
+// The primary file of a table, with its block reads spread over both
+// copies once the mirror copy is complete.
+class BalancedRandomAccessFile : public RandomAccessFile {
+ public:
+  BalancedRandomAccessFile(RandomAccessFile* primary, const std::string& fname,
+                           uint64_t number, MirrorReadBalance balance,
+                           Env* env, MirrorContext* mirror, ReadRouter* router)
+      : primary_(primary),
+        mfname_(mirror->MirrorFileName(fname)),
+        number_(number),
+        balance_(balance),
+        env_(env),
+        mirror_(mirror),
+        router_(router),
+        mfile_(NULL),
+        mirror_failed_(false) {
+  }
+
+  virtual ~BalancedRandomAccessFile() {
+    delete primary_;
+    delete reinterpret_cast<RandomAccessFile*>(mfile_.NoBarrier_Load());
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    bool mirror;
+    if (balance_ == kBalanceByFileNumber) {
+      mirror = (number_ & 1) != 0;
+    } else {
+      mirror = router_->PreferMirror();
+    }
+    RandomAccessFile* file = mirror ? MirrorFile() : NULL;
+    if (file == NULL) {
+      file = primary_;
+      mirror = false;
+    }
+    if (router_ == NULL) {
+      return file->Read(offset, n, result, scratch);
+    }
+    const ReadRouter::Device d = mirror ? ReadRouter::kMirror
+                                        : ReadRouter::kPrimary;
+    router_->ReadStarted(d);
+    const uint64_t start = env_->NowMicros();
+    Status s = file->Read(offset, n, result, scratch);
+    router_->ReadDone(d, env_->NowMicros() - start);
+    return s;
+  }
+
+ private:
+  // Returns the mirror copy, or NULL while it cannot be read
+  RandomAccessFile* MirrorFile() const {
+    RandomAccessFile* f =
+        reinterpret_cast<RandomAccessFile*>(mfile_.Acquire_Load());
+    if (f != NULL || mirror_failed_ || !mirror_->CopyLanded(number_)) {
+      return f;
+    }
+    MutexLock l(&mu_);
+    f = reinterpret_cast<RandomAccessFile*>(mfile_.NoBarrier_Load());
+    if (f == NULL && !mirror_failed_) {
+      if (env_->NewRandomAccessFile(mfname_, &f).ok()) {
+        mfile_.Release_Store(f);
+      } else {
+        mirror_failed_ = true;  // Stay on the primary
+      }
+    }
+    return f;
+  }
+
+  RandomAccessFile* const primary_;
+  const std::string mfname_;
+  const uint64_t number_;
+  const MirrorReadBalance balance_;
+  Env* const env_;
+  MirrorContext* const mirror_;
+  ReadRouter* const router_;
+  mutable port::Mutex mu_;
+  mutable port::AtomicPointer mfile_;
+  mutable bool mirror_failed_;      // Set under mu_
+};
+
+}  // namespace
+
 TableCache::TableCache(const std::string& dbname,
                        const Options* options,
-                       int entries)
+                       int entries,
+                       MirrorContext* mirror)
     : env_(options->env),
       dbname_(dbname),
       options_(options),
+      mirror_(mirror),
       cache_(NewLRUCache(entries)),
-      mcache_(NewLRUCache(entries)) {
+      router_(NULL) {
+  if (mirror_ != NULL && (options_->mirror_read_routing ||
+                          options_->mirror_read_balance == kBalanceByLoad)) {
+    router_ = new ReadRouter;
+  }
 }
 
 TableCache::~TableCache() {
   delete cache_;
-  delete mcache_;
+  delete router_;  // After the cached files that report to it
+}
+
+Status TableCache::OpenTable(const std::string& fname, uint64_t file_number,
+                             uint64_t file_size, bool mirror, bool scan,
+                             RandomAccessFile** file, Table** table) {
+  *file = NULL;
+  *table = NULL;
+  // Scans of the mirror copy stream the file through readahead windows
+  Status s = env_->NewRandomAccessFile(fname, file, mirror && scan);
+  if (s.ok()) {
+    if (!mirror && mirror_ != NULL &&
+        options_->mirror_read_balance != kNoReadBalance) {
+      *file = new BalancedRandomAccessFile(
+          *file, fname, file_number, options_->mirror_read_balance, env_,
+          mirror_, router_);
+    } else if (router_ != NULL && options_->mirror_read_routing) {
+      *file = router_->TimeReads(
+          *file, mirror ? ReadRouter::kMirror : ReadRouter::kPrimary, env_);
+    }
+    s = Table::Open(*options_, *file, file_size, table);
+  }
+  if (!s.ok()) {
+    assert(*table == NULL);
+    DEBUG_INFO2(fname, mirror);
+    delete *file;
+    *file = NULL;
+  }
+  return s;
 }
 
 Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
-                             Cache::Handle** handle, bool mirror) {
+                             Cache::Handle** handle, bool* mirror,
+                             Table** table) {
   Status s;
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
   Slice key(buf, sizeof(buf));
 
-  DEBUG_INFO2(file_number, mirror);
-
-  if (mirror)
-    *handle = mcache_->Lookup(key);
-  else
-    *handle = cache_->Lookup(key);
+  if (router_ != NULL && options_->mirror_read_routing) {
+    *mirror = router_->PreferMirror();
+  }
+  *mirror = *mirror && mirror_ != NULL;
+  DEBUG_INFO2(file_number, *mirror);
 
+  *table = NULL;
+  *handle = cache_->Lookup(key);
   if (*handle == NULL) {
-    std::string fname = TableFileName(MIRROR_PATH, file_number);
-    if (!(mirror && MIRROR_ENABLE && file_size > 65536 && !FileNameHash::inuse(fname))) {
-      fname = TableFileName(dbname_, file_number);
-    }
-
-    DEBUG_INFO2(fname, mirror);
+    std::string fname = TableFileName(dbname_, file_number);
     RandomAccessFile* file = NULL;
-    Table* table = NULL;
-    s = env_->NewRandomAccessFile(fname, &file, mirror);
-    if (s.ok()) {
-      s = Table::Open(*options_, file, file_size, &table);
-    }
-    DEBUG_INFO2(fname, mirror);
-
+    Table* t = NULL;
+    s = OpenTable(fname, file_number, file_size, false, false, &file, &t);
     if (!s.ok()) {
-      assert(table == NULL);
-      DEBUG_INFO2(fname, mirror);
-      delete file;
       // We do not cache error results so that if the error is transient,
       // or somebody repairs the file, we recover automatically.
-    } else {
-      TableAndFile* tf = new TableAndFile;
-      tf->file = file;
-      tf->table = table;
-      if (mirror)
-        *handle = mcache_->Insert(key, tf, 1, &DeleteEntry);
-      else
-        *handle = cache_->Insert(key, tf, 1, &DeleteEntry);
-
-      DEBUG_INFO2(fname, mirror);
+      return s;
     }
+    TableAndFile* tf = new TableAndFile;
+    tf->file = file;
+    tf->table = t;
+    tf->mfile = NULL;
+    tf->mtable = NULL;
+    *handle = cache_->Insert(key, tf, 1, &DeleteEntry);
+  }
+
+  TableAndFile* tf = reinterpret_cast<TableAndFile*>(cache_->Value(*handle));
+  if (*mirror) {
+    mu_.Lock();
+    Table* mtable = tf->mtable;
+    mu_.Unlock();
+    if (mtable == NULL &&
+        file_size > 65536 &&
+        mirror_->WaitForCopy(file_number, MIRROR_MAX_WAIT_MICROS)) {
+      std::string fname =
+          mirror_->MirrorFileName(TableFileName(dbname_, file_number));
+      RandomAccessFile* mfile = NULL;
+      if (OpenTable(fname, file_number, file_size, true, false,
+                    &mfile, &mtable).ok()) {
+        MutexLock l(&mu_);
+        if (tf->mtable == NULL) {
+          tf->mfile = mfile;
+          tf->mtable = mtable;
+        } else {
+          // Somebody else opened it meanwhile
+          delete mtable;
+          delete mfile;
+          mtable = tf->mtable;
+        }
+      }
+    }
+    *table = mtable;
+    *mirror = (mtable != NULL);  // Copy not complete: read the primary
+  }
+  if (*table == NULL) {
+    *table = tf->table;
   }
   DEBUG_INFO2("End of FindTable", file_number);
   return s;
@@ -106,25 +256,38 @@ Iterator* TableCache::NewIterator(const ReadOptions& options,
     *tableptr = NULL;
   }
 
+  // Iterators that do not fill the block cache are scans (compactions).
+  // Their mirror reads go through a table of their own, read front to
+  // back once, that is not worth keeping in the cache.
+  const bool scan = !options.fill_cache;
+  if (mirror && scan && mirror_ != NULL && !options_->mirror_read_routing &&
+      file_size > 65536 &&
+      mirror_->WaitForCopy(file_number, MIRROR_MAX_WAIT_MICROS)) {
+    std::string fname =
+        mirror_->MirrorFileName(TableFileName(dbname_, file_number));
+    RandomAccessFile* file = NULL;
+    Table* table = NULL;
+    if (OpenTable(fname, file_number, file_size, true, true,
+                  &file, &table).ok()) {
+      Iterator* result = table->NewIterator(options);
+      result->RegisterCleanup(&DeleteScanTable, table, file);
+      if (tableptr != NULL) {
+        *tableptr = table;
+      }
+      return result;
+    }
+    mirror = false;
+  }
+
   Cache::Handle* handle = NULL;
-  Status s = FindTable(file_number, file_size, &handle, mirror);
+  Table* table = NULL;
+  Status s = FindTable(file_number, file_size, &handle, &mirror, &table);
   if (!s.ok()) {
     return NewErrorIterator(s);
   }
 
-  Table* table;
-  if (mirror)
-    table = reinterpret_cast<TableAndFile*>(mcache_->Value(handle))->table;
-  else
-    table = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
-
   Iterator* result = table->NewIterator(options);
-
-  if (mirror)
-    result->RegisterCleanup(&UnrefEntry, mcache_, handle);
-  else
-    result->RegisterCleanup(&UnrefEntry, cache_, handle);
-
+  result->RegisterCleanup(&UnrefEntry, cache_, handle);
   if (tableptr != NULL) {
     *tableptr = table;
   }
@@ -138,15 +301,20 @@ Status TableCache::Get(const ReadOptions& options,
                        uint64_t file_size,
                        const Slice& k,
                        void* arg,
-                       void (*saver)(void*, const Slice&, const Slice&)) {
+                       void (*saver)(void*, const Slice&, const Slice&),
+                       bool mirror,
+                       bool* from_mirror) {
   DEBUG_INFO2(file_number, file_size);
   Cache::Handle* handle = NULL;
-  Status s = FindTable(file_number, file_size, &handle);
+  Table* t = NULL;
+  Status s = FindTable(file_number, file_size, &handle, &mirror, &t);
   if (s.ok()) {
-    Table* t = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
     s = t->InternalGet(options, k, arg, saver);
     cache_->Release(handle);
   }
+  if (from_mirror != NULL) {
+    *from_mirror = mirror;
+  }
   DEBUG_INFO2("End", file_number);
   return s;
 }
@@ -155,7 +323,6 @@ void TableCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
   cache_->Erase(Slice(buf, sizeof(buf)));
-  mcache_->Erase(Slice(buf, sizeof(buf)));
 }
 
 }  // namespace leveldb
@@ -17,10 +17,18 @@
 namespace leveldb {
 
 class Env;
+class MirrorContext;
+class ReadRouter;
 
 class TableCache {
  public:
-  TableCache(const std::string& dbname, const Options* options, int entries);
+  // If "mirror" is non-NULL, reads asked to go to the mirror use the
+  // mirror copies of the table files, and options->mirror_read_balance
+  // may spread other block reads across both copies.  With
+  // options->mirror_read_routing, the "mirror" arguments below are
+  // ignored and router() picks the copy for every call instead.
+  TableCache(const std::string& dbname, const Options* options, int entries,
+             MirrorContext* mirror = NULL);
   ~TableCache();
 
   // Return an iterator for the specified file number (the corresponding
@@ -37,25 +45,45 @@ class TableCache {
                         bool mirror = false);
 
   // If a seek to internal key "k" in specified file finds an entry,
-  // call (*handle_result)(arg, found_key, found_value).
+  // call (*handle_result)(arg, found_key, found_value).  If "mirror" is
+  // true the mirror copy of the file is read if it is complete; if
+  // "from_mirror" is non-NULL it is set to whether it was.
   Status Get(const ReadOptions& options,
              uint64_t file_number,
              uint64_t file_size,
              const Slice& k,
              void* arg,
-             void (*handle_result)(void*, const Slice&, const Slice&));
+             void (*handle_result)(void*, const Slice&, const Slice&),
+             bool mirror = false,
+             bool* from_mirror = NULL);
 
   // Evict any entry for the specified file number
   void Evict(uint64_t file_number);
 
+  // Returns the router choosing between copies, or NULL if reads
+  // are not routed.
+  ReadRouter* router() const { return router_; }
+
  private:
   Env* const env_;
   const std::string dbname_;
   const Options* options_;
+  MirrorContext* const mirror_;
   Cache* cache_;
-  Cache* mcache_;
+  ReadRouter* router_;
+  port::Mutex mu_;        // Guards opening the mirror table of an entry
+
+  // Sets *table to the table of file_number to read from: the mirror
+  // copy if *mirror and that copy is complete, else the primary one.
+  // *mirror is left telling which.  The caller releases *handle.
+  Status FindTable(uint64_t file_number, uint64_t file_size, Cache::Handle**,
+                   bool* mirror, Table** table);
 
-  Status FindTable(uint64_t file_number, uint64_t file_size, Cache::Handle**, bool mirror = false);
+  // Open the copy of file_number at "fname", for reads of the given
+  // device, outside the cache.
+  Status OpenTable(const std::string& fname, uint64_t file_number,
+                   uint64_t file_size, bool mirror, bool scan,
+                   RandomAccessFile** file, Table** table);
 };
 
 }  // namespace leveldb
@@ -6,15 +6,18 @@
 
 #include <algorithm>
 #include <stdio.h>
+#include <string.h>
 #include "db/filename.h"
 #include "db/log_reader.h"
 #include "db/log_writer.h"
 #include "db/memtable.h"
+#include "db/read_router.h"
 #include "db/table_cache.h"
 #include "db/dbformat.h"
 #include "leveldb/env.h"
 #include "leveldb/table_builder.h"
 #include "leveldb/debug.h"
+#include "leveldb/mirror.h"
 #include "table/merger.h"
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
@@ -22,30 +25,40 @@
 
 namespace leveldb {
 
+static uint64_t MaxFileSizeForLevel(const Options* options, int level) {
+  uint64_t result = options->target_file_size;
+  while (level > 1) {
+    result *= options->target_file_size_multiplier;
+    level--;
+  }
+  return result;
+}
+
 // Maximum bytes of overlaps in grandparent (i.e., level+2) before we
 // stop building a single file in a level->level+1 compaction.
-static const int64_t kMaxGrandParentOverlapBytes = 10 * config::kTargetFileSize;
+static int64_t MaxGrandParentOverlapBytes(const Options* options, int level) {
+  return 10 * MaxFileSizeForLevel(options, level);
+}
 
 // Maximum number of bytes in all compacted files.  We avoid expanding
 // the lower level file set of a compaction if it would make the
 // total compaction cover more than this many bytes.
-static const int64_t kExpandedCompactionByteSizeLimit = 25 * config::kTargetFileSize;
+static int64_t ExpandedCompactionByteSizeLimit(const Options* options,
+                                               int level) {
+  return 25 * MaxFileSizeForLevel(options, level);
+}
 
-static double MaxBytesForLevel(int level) {
+static double MaxBytesForLevel(const Options* options, int level) {
   // Note: the result for level zero is not really used since we set
   // the level-0 compaction threshold based on number of files.
-  double result = config::kL0_Size * 1048576.0;  // Result for both level-0 and level-1
+  double result = options->level1_size;  // Result for both level-0 and level-1
   while (level > 1) {
-    result *= config::kLevelRatio;
+    result *= options->level_ratio;
     level--;
   }
   return result;
 }
 
-static uint64_t MaxFileSizeForLevel(int level) {
-  return config::kTargetFileSize;  // We could vary per level to reduce number of files?
-}
-
 static int64_t TotalFileSize(const std::vector<FileMetaData*>& files) {
   int64_t sum = 0;
   for (size_t i = 0; i < files.size(); i++) {
@@ -240,10 +253,17 @@ Iterator* Version::NewConcatenatingIterator(const ReadOptions& options,
 void Version::AddIterators(const ReadOptions& options,
                            std::vector<Iterator*>* iters, bool mirror) {
   // Merge all level zero files together since they may overlap
+  const bool mirror0 = mirror || vset_->MirrorReadLevel(0);
   for (size_t i = 0; i < files_[0].size(); i++) {
     iters->push_back(
         vset_->table_cache_->NewIterator(
-            options, files_[0][i]->number, files_[0][i]->file_size, NULL, mirror));
+            options, files_[0][i]->number, files_[0][i]->file_size, NULL,
+            mirror0));
+  }
+  // Routed reads pick their copy per table; the router counts those
+  const bool record = (vset_->table_cache_->router() == NULL);
+  if (record && !files_[0].empty()) {
+    vset_->RecordRead(0, mirror0, true);
   }
 
   // For levels > 0, we can use a concatenating iterator that sequentially
@@ -251,7 +271,9 @@ void Version::AddIterators(const ReadOptions& options,
   // lazily.
   for (int level = 1; level < config::kNumLevels; level++) {
     if (!files_[level].empty()) {
-      iters->push_back(NewConcatenatingIterator(options, level, mirror));
+      const bool m = mirror || vset_->MirrorReadLevel(level);
+      iters->push_back(NewConcatenatingIterator(options, level, m));
+      if (record) vset_->RecordRead(level, m, true);
     }
   }
 }
@@ -366,8 +388,12 @@ Status Version::Get(const ReadOptions& options,
       saver.ucmp = ucmp;
       saver.user_key = user_key;
       saver.value = value;
+      bool from_mirror = false;
       s = vset_->table_cache_->Get(options, f->number, f->file_size,
-                                   ikey, &saver, SaveValue);
+                                   ikey, &saver, SaveValue,
+                                   vset_->MirrorReadLevel(level),
+                                   &from_mirror);
+      vset_->RecordRead(level, from_mirror, false);
       if (!s.ok()) {
         return s;
       }
@@ -432,13 +458,16 @@ int Version::PickLevelForMemTableOutput(
     InternalKey start(smallest_user_key, kMaxSequenceNumber, kValueTypeForSeek);
     InternalKey limit(largest_user_key, 0, static_cast<ValueType>(0));
     std::vector<FileMetaData*> overlaps;
-    while (level < config::kMaxMemCompactLevel) {
-      if (OverlapInLevel(level + 1, &smallest_user_key, &largest_user_key)) {
+    const Options* options = vset_->options_;
+    while (level < options->max_mem_compact_level) {
+      if (OverlapInLevel(level + 1, &smallest_user_key, &largest_user_key) ||
+          vset_->OutputRangeTaken(level + 1, smallest_user_key,
+                                  largest_user_key)) {
         break;
       }
       GetOverlappingInputs(level + 2, &start, &limit, &overlaps);
       const int64_t sum = TotalFileSize(overlaps);
-      if (sum > kMaxGrandParentOverlapBytes) {
+      if (sum > MaxGrandParentOverlapBytes(options, level)) {
         break;
       }
       level++;
@@ -707,7 +736,9 @@ VersionSet::VersionSet(const std::string& dbname,
       descriptor_file_(NULL),
       descriptor_log_(NULL),
       dummy_versions_(this),
-      current_(NULL) {
+      current_(NULL),
+      flush_level_(-1) {
+  memset(reads_, 0, sizeof(reads_));
   AppendVersion(new Version(this));
 }
 
@@ -943,39 +974,152 @@ Status VersionSet::Recover() {
   return s;
 }
 
+Status VersionSet::Replay(const std::vector<std::string>& records,
+                          bool from_scratch, bool* installed) {
+  *installed = false;
+  Status s;
+  bool have_log_number = false;
+  bool have_prev_log_number = false;
+  bool have_next_file = false;
+  bool have_last_sequence = false;
+  uint64_t next_file = 0;
+  uint64_t last_sequence = 0;
+  uint64_t log_number = 0;
+  uint64_t prev_log_number = 0;
+  Builder builder(this, from_scratch ? new Version(this) : current_);
+
+  for (size_t i = 0; i < records.size() && s.ok(); i++) {
+    VersionEdit edit;
+    s = edit.DecodeFrom(records[i]);
+    if (s.ok() && edit.has_comparator_ &&
+        edit.comparator_ != icmp_.user_comparator()->Name()) {
+      s = Status::InvalidArgument(
+          edit.comparator_ + " does not match existing comparator ",
+          icmp_.user_comparator()->Name());
+    }
+    if (!s.ok()) {
+      break;
+    }
+    builder.Apply(&edit);
+    if (edit.has_log_number_) {
+      log_number = edit.log_number_;
+      have_log_number = true;
+    }
+    if (edit.has_prev_log_number_) {
+      prev_log_number = edit.prev_log_number_;
+      have_prev_log_number = true;
+    }
+    if (edit.has_next_file_number_) {
+      next_file = edit.next_file_number_;
+      have_next_file = true;
+    }
+    if (edit.has_last_sequence_) {
+      last_sequence = edit.last_sequence_;
+      have_last_sequence = true;
+    }
+  }
+  if (s.ok() && from_scratch &&
+      (!have_next_file || !have_log_number || !have_last_sequence)) {
+    s = Status::Corruption("incomplete descriptor");
+  }
+  if (!s.ok()) {
+    return s;
+  }
+
+  Version* v = new Version(this);
+  builder.SaveTo(v);
+
+  // The edits may name tables whose copies have not landed yet: keep to
+  // the current version until every new one is there whole
+  std::set<uint64_t> known;
+  for (int level = 0; level < config::kNumLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      known.insert(files[i]->number);
+    }
+  }
+  for (int level = 0; level < config::kNumLevels; level++) {
+    const std::vector<FileMetaData*>& files = v->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      uint64_t size;
+      if (known.count(files[i]->number) == 0 &&
+          (!env_->GetFileSize(TableFileName(dbname_, files[i]->number),
+                              &size).ok() ||
+           size != files[i]->file_size)) {
+        delete v;
+        return s;
+      }
+    }
+  }
+
+  Finalize(v);
+  AppendVersion(v);
+  *installed = true;
+  if (have_next_file) {
+    MarkFileNumberUsed(next_file);
+  }
+  if (have_log_number) {
+    MarkFileNumberUsed(log_number);
+    log_number_ = log_number;
+  }
+  if (have_prev_log_number) {
+    MarkFileNumberUsed(prev_log_number);
+    prev_log_number_ = prev_log_number;
+  }
+  if (have_last_sequence && last_sequence > last_sequence_) {
+    last_sequence_ = last_sequence;
+  }
+  return s;
+}
+
 void VersionSet::MarkFileNumberUsed(uint64_t number) {
   if (next_file_number_ <= number) {
     next_file_number_ = number + 1;
   }
 }
 
+double VersionSet::LevelScore(Version* v, int level) const {
+  const std::vector<FileMetaData*>& files = v->files_[level];
+  if (level == 0) {
+    // We treat level-0 specially by bounding the number of files
+    // instead of number of bytes for two reasons:
+    //
+    // (1) With larger write-buffer sizes, it is nice not to do too
+    // many level-0 compactions.
+    //
+    // (2) The files in level-0 are merged on every read and
+    // therefore we wish to avoid too many files when the individual
+    // file size is small (perhaps because of a small write-buffer
+    // setting, or very high compression ratios, or lots of
+    // overwrites/deletions).
+    int num_files = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+      if (compacting_files_.count(files[i]->number) == 0) {
+        num_files++;
+      }
+    }
+    return num_files /
+        static_cast<double>(options_->level0_compaction_trigger);
+  } else {
+    // Compute the ratio of current size to size limit.
+    uint64_t level_bytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+      if (compacting_files_.count(files[i]->number) == 0) {
+        level_bytes += files[i]->file_size;
+      }
+    }
+    return static_cast<double>(level_bytes) /
+        MaxBytesForLevel(options_, level);
+  }
+}
+
 void VersionSet::Finalize(Version* v) {
   // Precomputed best level for next compaction
   int best_level = -1;
   double best_score = -1;
 
   for (int level = 0; level < config::kNumLevels-1; level++) {
-    double score;
-    if (level == 0) {
-      // We treat level-0 specially by bounding the number of files
-      // instead of number of bytes for two reasons:
-      //
-      // (1) With larger write-buffer sizes, it is nice not to do too
-      // many level-0 compactions.
-      //
-      // (2) The files in level-0 are merged on every read and
-      // therefore we wish to avoid too many files when the individual
-      // file size is small (perhaps because of a small write-buffer
-      // setting, or very high compression ratios, or lots of
-      // overwrites/deletions).
-      score = v->files_[level].size() /
-          static_cast<double>(config::kL0_CompactionTrigger);
-    } else {
-      // Compute the ratio of current size to size limit.
-      const uint64_t level_bytes = TotalFileSize(v->files_[level]);
-      score = static_cast<double>(level_bytes) / MaxBytesForLevel(level);
-    }
-
+    const double score = LevelScore(v, level);
     if (score > best_score) {
       best_level = level;
       best_score = score;
@@ -1037,6 +1181,38 @@ const char* VersionSet::LevelSummary(LevelSummaryStorage* scratch) const {
   return scratch->buffer;
 }
 
+std::string VersionSet::ReadPlacementSummary() const {
+  std::string result =
+      "                    Gets                Iterators\n"
+      "Level  Mirror   Primary    Mirror   Primary    Mirror\n"
+      "----------------------------------------------------\n";
+  char buf[200];
+  ReadRouter* router = table_cache_->router();
+  for (int level = 0; level < config::kNumLevels; level++) {
+    uint64_t r[2][2];
+    for (int i = 0; i < 2; i++) {
+      for (int j = 0; j < 2; j++) {
+        r[i][j] = __atomic_load_n(&reads_[level][i][j], __ATOMIC_RELAXED);
+      }
+    }
+    if (r[0][0] + r[0][1] + r[1][0] + r[1][1] > 0) {
+      snprintf(buf, sizeof(buf), "%3d %8s %9llu %9llu %9llu %9llu\n",
+               level, (router != NULL) ? "auto" :
+                      MirrorReadLevel(level) ? "yes" : "no",
+               static_cast<unsigned long long>(r[0][0]),
+               static_cast<unsigned long long>(r[0][1]),
+               static_cast<unsigned long long>(r[1][0]),
+               static_cast<unsigned long long>(r[1][1]));
+      result.append(buf);
+    }
+  }
+  if (router != NULL) {
+    result.append("\nRouted reads (all levels, including compactions)\n");
+    result.append(router->Summary());
+  }
+  return result;
+}
+
 // Return true iff the manifest contains the specified record.
 bool VersionSet::ManifestContains(const std::string& record) const {
   std::string fname = DescriptorFileName(dbname_, manifest_file_number_);
@@ -1107,6 +1283,28 @@ void VersionSet::AddLiveFiles(std::set<uint64_t>* live) {
   }
 }
 
+void VersionSet::AddLiveFiles(std::map<uint64_t, uint64_t>* live) {
+  for (Version* v = dummy_versions_.next_;
+       v != &dummy_versions_;
+       v = v->next_) {
+    for (int level = 0; level < config::kNumLevels; level++) {
+      const std::vector<FileMetaData*>& files = v->files_[level];
+      for (size_t i = 0; i < files.size(); i++) {
+        (*live)[files[i]->number] = files[i]->file_size;
+      }
+    }
+  }
+}
+
+void VersionSet::GetFileLevels(std::map<uint64_t, int>* levels) {
+  for (int level = 0; level < config::kNumLevels; level++) {
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+    for (size_t i = 0; i < files.size(); i++) {
+      (*levels)[files[i]->number] = level;
+    }
+  }
+}
+
 int64_t VersionSet::NumLevelBytes(int level) const {
   assert(level >= 0);
   assert(level < config::kNumLevels);
@@ -1171,6 +1369,7 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c, bool mirror) {
   ReadOptions options;
   options.verify_checksums = options_->paranoid_checks;
   options.fill_cache = false;
+  options.prefetch_blocks = HLSM_CPREFETCH;
 
   // Level-0 files have to be merged together.  For other levels,
   // we will make a concatenating iterator per level.
@@ -1206,40 +1405,56 @@ Iterator* VersionSet::MakeInputIterator(Compaction* c, bool mirror) {
 }
 
 Compaction* VersionSet::PickCompaction() {
-  Compaction* c;
-  int level;
-
   // We prefer compactions triggered by too much data in a level over
-  // the compactions triggered by seeks.
-  const bool size_compaction = (current_->compaction_score_ >= 1);
-  const bool seek_compaction = (current_->file_to_compact_ != NULL);
-  if (size_compaction) {
-    level = current_->compaction_level_;
-    assert(level >= 0);
-    assert(level+1 < config::kNumLevels);
-    c = new Compaction(level);
-
-    // Pick the first file that comes after compact_pointer_[level]
-    for (size_t i = 0; i < current_->files_[level].size(); i++) {
-      FileMetaData* f = current_->files_[level][i];
-      if (compact_pointer_[level].empty() ||
-          icmp_.Compare(f->largest.Encode(), compact_pointer_[level]) > 0) {
-        c->inputs_[0].push_back(f);
-        break;
-      }
+  // the compactions triggered by seeks.  Levels are tried by decreasing
+  // score, so that one taken by compactions in progress does not hold
+  // up the others.
+  std::vector<std::pair<double, int> > scores;
+  for (int level = 0; level < config::kNumLevels-1; level++) {
+    const double score = LevelScore(current_, level);
+    if (score >= 1) {
+      scores.push_back(std::make_pair(score, level));
     }
-    if (c->inputs_[0].empty()) {
-      // Wrap-around to the beginning of the key space
-      c->inputs_[0].push_back(current_->files_[level][0]);
+  }
+  std::sort(scores.rbegin(), scores.rend());
+
+  for (size_t i = 0; i < scores.size(); i++) {
+    const int level = scores[i].second;
+    const std::vector<FileMetaData*>& files = current_->files_[level];
+
+    // Pick the first file that comes after compact_pointer_[level],
+    // wrapping around to the beginning of the key space, that is free
+    size_t start = 0;
+    while (start < files.size() &&
+           !compact_pointer_[level].empty() &&
+           icmp_.Compare(files[start]->largest.Encode(),
+                         compact_pointer_[level]) <= 0) {
+      start++;
+    }
+    for (size_t j = 0; j < files.size(); j++) {
+      FileMetaData* f = files[(start + j) % files.size()];
+      if (compacting_files_.count(f->number) != 0) {
+        continue;
+      }
+      Compaction* c = SetupCompaction(level, f);
+      if (c != NULL) {
+        return c;
+      }
     }
-  } else if (seek_compaction) {
-    level = current_->file_to_compact_level_;
-    c = new Compaction(level);
-    c->inputs_[0].push_back(current_->file_to_compact_);
-  } else {
-    return NULL;
   }
 
+  FileMetaData* f = current_->file_to_compact_;
+  if (f != NULL && compacting_files_.count(f->number) == 0) {
+    return SetupCompaction(current_->file_to_compact_level_, f);
+  }
+  return NULL;
+}
+
+Compaction* VersionSet::SetupCompaction(int level, FileMetaData* f) {
+  assert(level >= 0);
+  assert(level+1 < config::kNumLevels);
+  Compaction* c = new Compaction(options_, level);
+  c->inputs_[0].push_back(f);
   c->input_version_ = current_;
   c->input_version_->Ref();
 
@@ -1254,11 +1469,87 @@ Compaction* VersionSet::PickCompaction() {
     assert(!c->inputs_[0].empty());
   }
 
+  const std::string compact_pointer = compact_pointer_[level];
   SetupOtherInputs(c);
 
+  if (Conflicts(c)) {
+    compact_pointer_[level] = compact_pointer;
+    delete c;
+    return NULL;
+  }
+  Register(c);
   return c;
 }
 
+bool VersionSet::Conflicts(Compaction* c) {
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      if (compacting_files_.count(c->inputs_[which][i]->number) != 0) {
+        return true;
+      }
+    }
+  }
+  if (c->level() == 0) {
+    for (std::set<Compaction*>::const_iterator it = compactions_.begin();
+         it != compactions_.end(); ++it) {
+      if ((*it)->level() == 0) {
+        return true;
+      }
+    }
+  }
+  InternalKey smallest, largest;
+  GetRange2(c->inputs_[0], c->inputs_[1], &smallest, &largest);
+  return OutputRangeTaken(c->level() + 1,
+                          smallest.user_key(), largest.user_key());
+}
+
+void VersionSet::Register(Compaction* c) {
+  assert(c->vset_ == NULL);
+  c->vset_ = this;
+  GetRange2(c->inputs_[0], c->inputs_[1], &c->smallest_, &c->largest_);
+  compactions_.insert(c);
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      compacting_files_.insert(c->inputs_[which][i]->number);
+    }
+  }
+}
+
+void VersionSet::Unregister(Compaction* c) {
+  compactions_.erase(c);
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->inputs_[which].size(); i++) {
+      compacting_files_.erase(c->inputs_[which][i]->number);
+    }
+  }
+}
+
+bool VersionSet::OutputRangeTaken(int level,
+                                  const Slice& smallest_user_key,
+                                  const Slice& largest_user_key) const {
+  const Comparator* ucmp = icmp_.user_comparator();
+  for (std::set<Compaction*>::const_iterator it = compactions_.begin();
+       it != compactions_.end(); ++it) {
+    const Compaction* c = *it;
+    if (c->level() + 1 == level &&
+        ucmp->Compare(largest_user_key, c->smallest_.user_key()) >= 0 &&
+        ucmp->Compare(smallest_user_key, c->largest_.user_key()) <= 0) {
+      return true;
+    }
+  }
+  return flush_level_ == level &&
+      ucmp->Compare(largest_user_key, flush_smallest_.user_key()) >= 0 &&
+      ucmp->Compare(smallest_user_key, flush_largest_.user_key()) <= 0;
+}
+
+void VersionSet::ReserveFlushOutput(int level, const InternalKey& smallest,
+                                    const InternalKey& largest) {
+  assert(flush_level_ < 0);
+  flush_level_ = level;
+  flush_smallest_ = smallest;
+  flush_largest_ = largest;
+}
+
 void VersionSet::SetupOtherInputs(Compaction* c) {
   const int level = c->level();
   InternalKey smallest, largest;
@@ -1278,8 +1569,15 @@ void VersionSet::SetupOtherInputs(Compaction* c) {
     const int64_t inputs0_size = TotalFileSize(c->inputs_[0]);
     const int64_t inputs1_size = TotalFileSize(c->inputs_[1]);
     const int64_t expanded0_size = TotalFileSize(expanded0);
-    if (expanded0.size() > c->inputs_[0].size() &&
-        inputs1_size + expanded0_size < kExpandedCompactionByteSizeLimit) {
+    bool expanded0_free = true;
+    for (size_t i = 0; i < expanded0.size(); i++) {
+      if (compacting_files_.count(expanded0[i]->number) != 0) {
+        expanded0_free = false;
+      }
+    }
+    if (expanded0.size() > c->inputs_[0].size() && expanded0_free &&
+        inputs1_size + expanded0_size <
+            ExpandedCompactionByteSizeLimit(options_, level)) {
       InternalKey new_start, new_limit;
       GetRange(expanded0, &new_start, &new_limit);
       std::vector<FileMetaData*> expanded1;
@@ -1341,7 +1639,7 @@ Compaction* VersionSet::CompactRange(
   // and we must not pick one file and drop another older file if the
   // two files overlap.
   if (level > 0) {
-    const uint64_t limit = MaxFileSizeForLevel(level);
+    const uint64_t limit = MaxFileSizeForLevel(options_, level);
     uint64_t total = 0;
     for (size_t i = 0; i < inputs.size(); i++) {
       uint64_t s = inputs[i]->file_size;
@@ -1353,17 +1651,21 @@ Compaction* VersionSet::CompactRange(
     }
   }
 
-  Compaction* c = new Compaction(level);
+  Compaction* c = new Compaction(options_, level);
   c->input_version_ = current_;
   c->input_version_->Ref();
   c->inputs_[0] = inputs;
   SetupOtherInputs(c);
+  Register(c);
   return c;
 }
 
-Compaction::Compaction(int level)
-    : level_(level),
-      max_output_file_size_(MaxFileSizeForLevel(level)),
+Compaction::Compaction(const Options* options, int level)
+    : vset_(NULL),
+      level_(level),
+      max_output_file_size_(MaxFileSizeForLevel(options, level)),
+      max_grandparent_overlap_bytes_(
+          MaxGrandParentOverlapBytes(options, level)),
       input_version_(NULL),
       grandparent_index_(0),
       seen_key_(false),
@@ -1374,6 +1676,9 @@ Compaction::Compaction(int level)
 }
 
 Compaction::~Compaction() {
+  if (vset_ != NULL) {
+    vset_->Unregister(this);
+  }
   if (input_version_ != NULL) {
     input_version_->Unref();
   }
@@ -1385,7 +1690,7 @@ bool Compaction::IsTrivialMove() const {
   // a very expensive merge later on.
   return (num_input_files(0) == 1 &&
           num_input_files(1) == 0 &&
-          TotalFileSize(grandparents_) <= kMaxGrandParentOverlapBytes);
+          TotalFileSize(grandparents_) <= max_grandparent_overlap_bytes_);
 }
 
 void Compaction::AddInputDeletions(VersionEdit* edit) {
@@ -1430,7 +1735,7 @@ bool Compaction::ShouldStopBefore(const Slice& internal_key) {
   }
   seen_key_ = true;
 
-  if (overlapped_bytes_ > kMaxGrandParentOverlapBytes) {
+  if (overlapped_bytes_ > max_grandparent_overlap_bytes_) {
     // Too much overlap for current output; start new output
     overlapped_bytes_ = 0;
     return true;
@@ -1446,4 +1751,61 @@ void Compaction::ReleaseInputs() {
   }
 }
 
+namespace {
+struct ByLargestKey {
+  const InternalKeyComparator* internal_comparator;
+
+  bool operator()(FileMetaData* f1, FileMetaData* f2) const {
+    return internal_comparator->Compare(f1->largest, f2->largest) < 0;
+  }
+};
+}  // namespace
+
+void Compaction::GetShardBoundaries(
+    int n, std::vector<std::string>* boundaries) const {
+  boundaries->clear();
+  const InternalKeyComparator* icmp = &input_version_->vset_->icmp_;
+  const Comparator* user_cmp = icmp->user_comparator();
+  std::vector<FileMetaData*> files(inputs_[0]);
+  files.insert(files.end(), inputs_[1].begin(), inputs_[1].end());
+  if (n <= 1 || files.size() <= 1) {
+    return;
+  }
+  ByLargestKey cmp;
+  cmp.internal_comparator = icmp;
+  std::sort(files.begin(), files.end(), cmp);
+
+  // Cut after the file that takes the bytes read so far past the next
+  // n-th of the total.  The last file ends the key range: no cut there.
+  const Slice last = files.back()->largest.user_key();
+  const int64_t total = TotalFileSize(files);
+  int64_t bytes = 0;
+  for (size_t i = 0; i + 1 < files.size() &&
+           boundaries->size() + 1 < static_cast<size_t>(n); i++) {
+    bytes += files[i]->file_size;
+    if (bytes * n < total * static_cast<int64_t>(boundaries->size() + 1)) {
+      continue;
+    }
+    const Slice key = files[i]->largest.user_key();
+    if (user_cmp->Compare(key, last) < 0 &&
+        (boundaries->empty() ||
+         user_cmp->Compare(key, Slice(boundaries->back())) > 0)) {
+      boundaries->push_back(key.ToString());
+    }
+  }
+}
+
+Compaction* Compaction::NewShard() const {
+  Compaction* c = new Compaction(*this);
+  c->vset_ = NULL;
+  c->input_version_->Ref();
+  c->grandparent_index_ = 0;
+  c->seen_key_ = false;
+  c->overlapped_bytes_ = 0;
+  for (int i = 0; i < config::kNumLevels; i++) {
+    c->level_ptrs_[i] = 0;
+  }
+  return c;
+}
+
 }  // namespace leveldb
@@ -166,6 +166,16 @@ class VersionSet {
   // Recover the last saved descriptor from persistent storage.
   Status Recover();
 
+  // Apply the encoded edits "records", read from a descriptor some other
+  // process is writing, and install the result as the current version;
+  // if "from_scratch" they start from an empty version instead, i.e.
+  // they are a whole new descriptor.  Sets *installed to false and keeps
+  // the current version if a table the edits add is missing or shorter
+  // than they say; the caller retries later.  Nothing is written.
+  // REQUIRES: the DB mutex is held and nothing calls LogAndApply()
+  Status Replay(const std::vector<std::string>& records, bool from_scratch,
+                bool* installed);
+
   // Return the current version.
   Version* current() const { return current_; }
 
@@ -175,6 +185,9 @@ class VersionSet {
   // Allocate and return a new file number
   uint64_t NewFileNumber() { return next_file_number_++; }
 
+  // Return the number the next call of NewFileNumber() will allocate.
+  uint64_t NextFileNumber() const { return next_file_number_; }
+
   // Arrange to reuse "file_number" unless a newer file number has
   // already been allocated.
   // REQUIRES: "file_number" was returned by a call to NewFileNumber().
@@ -213,17 +226,39 @@ class VersionSet {
   // Returns NULL if there is no compaction to be done.
   // Otherwise returns a pointer to a heap-allocated object that
   // describes the compaction.  Caller should delete the result.
+  // Compactions in progress, i.e. returned and not deleted yet, may run
+  // at the same time as the result: it takes none of their inputs, and
+  // adds no files where they or a memtable flush add theirs (see
+  // OutputRangeTaken()).  Only one compaction of level-0 runs at a time.
   Compaction* PickCompaction();
 
   // Return a compaction object for compacting the range [begin,end] in
   // the specified level.  Returns NULL if there is nothing in that
   // level that overlaps the specified range.  Caller should delete
   // the result.
+  // REQUIRES: no other compaction is in progress, nor a memtable flush
   Compaction* CompactRange(
       int level,
       const InternalKey* begin,
       const InternalKey* end);
 
+  // Returns true if a compaction in progress or a memtable flush adds
+  // files to "level" in a key range that overlaps
+  // [smallest_user_key,largest_user_key].  A file added there now would
+  // overlap theirs.
+  bool OutputRangeTaken(int level,
+                        const Slice& smallest_user_key,
+                        const Slice& largest_user_key) const;
+
+  // Reserve [smallest,largest] of "level" for the table a memtable flush
+  // is about to add there, until ReleaseFlushOutput().
+  void ReserveFlushOutput(int level, const InternalKey& smallest,
+                          const InternalKey& largest);
+  void ReleaseFlushOutput() { flush_level_ = -1; }
+
+  // Return the number of compactions in progress.
+  int NumRunningCompactions() const { return compactions_.size(); }
+
   // Return the maximum overlapping data (in bytes) at next level for any
   // file at a level >= 1.
   int64_t MaxNextLevelOverlappingBytes();
@@ -242,6 +277,12 @@ class VersionSet {
   // May also mutate some internal state.
   void AddLiveFiles(std::set<uint64_t>* live);
 
+  // Same, mapping each file to its size.
+  void AddLiveFiles(std::map<uint64_t, uint64_t>* live);
+
+  // Map each file of the current version to its level.
+  void GetFileLevels(std::map<uint64_t, int>* levels);
+
   // Return the approximate offset in the database of the data for
   // "key" as of version "v".
   uint64_t ApproximateOffsetOf(Version* v, const InternalKey& key);
@@ -253,6 +294,22 @@ class VersionSet {
   };
   const char* LevelSummary(LevelSummaryStorage* scratch) const;
 
+  // Returns true if user reads of level "level" go to the mirror copies.
+  bool MirrorReadLevel(int level) const {
+    return (options_->mirror_read_levels >> level) & 1;
+  }
+
+  // Count a table read at "level", served by the mirror copy if "mirror".
+  // Gets count the tables actually probed; iterators count the levels
+  // they were opened over.  Thread-safe.
+  void RecordRead(int level, bool mirror, bool iterator) {
+    uint64_t* counter = &reads_[level][iterator ? 1 : 0][mirror ? 1 : 0];
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+  }
+
+  // Return a human-readable multi-line summary of the reads per level.
+  std::string ReadPlacementSummary() const;
+
  private:
   class Builder;
 
@@ -261,6 +318,23 @@ class VersionSet {
 
   void Finalize(Version* v);
 
+  // Compaction score of "level" in "v", not counting the files
+  // compactions in progress take out of it
+  double LevelScore(Version* v, int level) const;
+
+  // Returns a compaction of "level" starting from file "f" of the
+  // current version, or NULL if it would conflict with a compaction in
+  // progress.
+  Compaction* SetupCompaction(int level, FileMetaData* f);
+
+  // Returns true if "c" may not run alongside the compactions in
+  // progress.
+  bool Conflicts(Compaction* c);
+
+  // Track "c" as in progress until it is deleted
+  void Register(Compaction* c);
+  void Unregister(Compaction* c);
+
   void GetRange(const std::vector<FileMetaData*>& inputs,
                 InternalKey* smallest,
                 InternalKey* largest);
@@ -300,6 +374,19 @@ class VersionSet {
   // Either an empty string, or a valid InternalKey.
   std::string compact_pointer_[config::kNumLevels];
 
+  // Per-level [get, iterator][primary, mirror] read counts
+  uint64_t reads_[config::kNumLevels][2][2];
+
+  // Compactions in progress and the files they compact
+  std::set<Compaction*> compactions_;
+  std::set<uint64_t> compacting_files_;
+
+  // Level and key range of the table a memtable flush is adding;
+  // flush_level_ is -1 if there is none
+  int flush_level_;
+  InternalKey flush_smallest_;
+  InternalKey flush_largest_;
+
   // No copying allowed
   VersionSet(const VersionSet&);
   void operator=(const VersionSet&);
@@ -347,14 +434,38 @@ class Compaction {
   // is successful.
   void ReleaseInputs();
 
+  // Split the key range of the compaction into at most "n" shards that
+  // read about the same number of input bytes, cutting at the largest
+  // user keys of input files.  Stores the cuts in *boundaries, in
+  // order: shard i holds the user keys after (*boundaries)[i-1] and up
+  // to (*boundaries)[i].  Leaves *boundaries empty if the inputs cannot
+  // be split.
+  void GetShardBoundaries(int n, std::vector<std::string>* boundaries) const;
+
+  // Return a compaction over the same inputs, for a shard to scan its
+  // key range with: ShouldStopBefore() and IsBaseLevelForKey() keep
+  // state for the keys they were asked about so far.  It is not
+  // registered with the VersionSet, and has nothing to install.
+  // Caller should delete the result.
+  // REQUIRES: the DB mutex is held, ReleaseInputs() was not called
+  Compaction* NewShard() const;
+
  private:
   friend class Version;
   friend class VersionSet;
 
-  explicit Compaction(int level);
+  Compaction(const Options* options, int level);
+
+  // Set while the compaction is in progress: the VersionSet it is
+  // registered with, and the key range of its inputs, where it adds its
+  // outputs
+  VersionSet* vset_;
+  InternalKey smallest_;
+  InternalKey largest_;
 
   int level_;
   uint64_t max_output_file_size_;
+  int64_t max_grandparent_overlap_bytes_;
   Version* input_version_;
   VersionEdit edit_;
 
@@ -0,0 +1,463 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "helpers/memenv/device_env.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "leveldb/mirror.h"
+#include "leveldb/status.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+namespace {
+
+struct NamedProfile {
+  const char* name;
+  DeviceProfile profile;
+};
+
+static const uint64_t kMB = 1 << 20;
+
+// read/write/sync latency, read/write bandwidth, seek, queue depth
+static const NamedProfile kProfiles[] = {
+  { "ram",  { 0, 0, 0, 0, 0, 0, 1 } },
+  { "nvme", { 20, 15, 50, 3000 * kMB, 2000 * kMB, 0, 64 } },
+  { "ssd",  { 80, 40, 500, 500 * kMB, 400 * kMB, 0, 32 } },
+  { "hdd",  { 100, 100, 4000, 150 * kMB, 150 * kMB, 8000, 1 } },
+  { "raid", { 100, 100, 4000, 600 * kMB, 600 * kMB, 8000, 4 } },
+};
+
+// Device time a thread owes: it has issued requests that would not have
+// finished yet, but sleeping that little would mostly measure the
+// scheduler.  Its next request is issued this much later.
+static __thread uint64_t owed_micros = 0;
+
+// Each of the queue_depth slots of a device serves one request at a
+// time; a request takes the slot that frees up first and its caller
+// sleeps until the request would have finished.  Thread-safe.
+class EmulatedDevice {
+ public:
+  enum Kind {
+    kRead,
+    kWrite,
+    kSync
+  };
+
+  // Passed as the "file" of a request that continues the last one
+  static const uint64_t kContinue = ~static_cast<uint64_t>(0);
+
+  EmulatedDevice(Env* clock, const DeviceProfile& profile)
+      : clock_(clock),
+        profile_(profile),
+        free_at_(profile.queue_depth > 0 ? profile.queue_depth : 1, 0),
+        last_file_(kContinue),
+        last_end_(0) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  // Serve "n" bytes at "offset" of "file", an id that tells requests to
+  // different files apart.
+  void Charge(Kind kind, uint64_t file, uint64_t offset, uint64_t n) {
+    uint64_t sleep_micros = 0;
+    {
+      MutexLock l(&mu_);
+      uint64_t service;
+      if (kind == kSync) {
+        service = profile_.sync_latency_micros;
+        stats_.syncs++;
+      } else {
+        const bool write = (kind == kWrite);
+        const uint64_t rate = write ? profile_.write_bytes_per_second :
+                                      profile_.read_bytes_per_second;
+        service = write ? profile_.write_latency_micros :
+                          profile_.read_latency_micros;
+        if (rate > 0) {
+          service += n * 1000000 / rate;
+        }
+        if (file == kContinue) {
+          file = last_file_;
+          offset = last_end_;
+        } else if (file != last_file_ || offset != last_end_) {
+          service += profile_.seek_micros;
+          stats_.seeks++;
+        }
+        last_file_ = file;
+        last_end_ = offset + n;
+        if (write) {
+          stats_.writes++;
+          stats_.write_bytes += n;
+        } else {
+          stats_.reads++;
+          stats_.read_bytes += n;
+        }
+      }
+      if (service == 0) {
+        return;
+      }
+
+      size_t slot = 0;
+      for (size_t i = 1; i < free_at_.size(); i++) {
+        if (free_at_[i] < free_at_[slot]) {
+          slot = i;
+        }
+      }
+      const uint64_t now = clock_->NowMicros();
+      const uint64_t issued = now + owed_micros;
+      const uint64_t start = std::max(free_at_[slot], issued);
+      free_at_[slot] = start + service;
+      stats_.busy_micros += service;
+      stats_.queue_micros += start - issued;
+      owed_micros = free_at_[slot] - now;
+      if (owed_micros >= kMinSleepMicros) {
+        sleep_micros = owed_micros;
+        owed_micros = 0;
+      }
+    }
+    if (sleep_micros > 0) {
+      clock_->SleepForMicroseconds(static_cast<int>(sleep_micros));
+    }
+  }
+
+  void GetStats(DeviceEnv::Stats* stats) {
+    MutexLock l(&mu_);
+    *stats = stats_;
+  }
+
+ private:
+  enum { kMinSleepMicros = 100 };
+
+  Env* const clock_;
+  const DeviceProfile profile_;
+
+  port::Mutex mu_;
+  std::vector<uint64_t> free_at_;   // Protected by mu_; per slot
+  uint64_t last_file_;              // Protected by mu_
+  uint64_t last_end_;               // Protected by mu_
+  DeviceEnv::Stats stats_;          // Protected by mu_
+
+  // No copying allowed
+  EmulatedDevice(const EmulatedDevice&);
+  void operator=(const EmulatedDevice&);
+};
+
+class DeviceSequentialFile : public SequentialFile {
+ public:
+  DeviceSequentialFile(SequentialFile* file, EmulatedDevice* device,
+                       uint64_t id)
+      : file_(file), device_(device), id_(id), offset_(0) {
+  }
+
+  virtual ~DeviceSequentialFile() {
+    delete file_;
+  }
+
+  virtual Status Read(size_t n, Slice* result, char* scratch) {
+    Status s = file_->Read(n, result, scratch);
+    if (s.ok()) {
+      device_->Charge(EmulatedDevice::kRead, id_, offset_, result->size());
+      offset_ += result->size();
+    }
+    return s;
+  }
+
+  virtual Status Skip(uint64_t n) {
+    offset_ += n;
+    return file_->Skip(n);
+  }
+
+ private:
+  SequentialFile* const file_;
+  EmulatedDevice* const device_;
+  const uint64_t id_;
+  uint64_t offset_;
+};
+
+// A file opened for a scan (see Env::NewRandomAccessFile) is read ahead
+// in windows of "readahead" bytes: the device only sees a read when the
+// scan leaves the window.
+class DeviceRandomAccessFile : public RandomAccessFile {
+ public:
+  DeviceRandomAccessFile(RandomAccessFile* file, EmulatedDevice* device,
+                         uint64_t id, uint64_t readahead, uint64_t size)
+      : file_(file), device_(device), id_(id), readahead_(readahead),
+        size_(size), window_start_(0), window_end_(0) {
+  }
+
+  virtual ~DeviceRandomAccessFile() {
+    delete file_;
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    Status s = file_->Read(offset, n, result, scratch);
+    if (!s.ok()) {
+      return s;
+    }
+    if (readahead_ == 0) {
+      device_->Charge(EmulatedDevice::kRead, id_, offset, result->size());
+      return s;
+    }
+    const uint64_t end = offset + result->size();
+    uint64_t start = 0, len = 0;
+    {
+      MutexLock l(&mu_);
+      if (offset < window_start_ || end > window_end_) {
+        start = offset;
+        len = std::max<uint64_t>(readahead_, result->size());
+        if (size_ > start && len > size_ - start) {
+          len = size_ - start;
+        }
+        window_start_ = start;
+        window_end_ = start + len;
+      }
+    }
+    if (len > 0) {
+      device_->Charge(EmulatedDevice::kRead, id_, start, len);
+    }
+    return s;
+  }
+
+ private:
+  RandomAccessFile* const file_;
+  EmulatedDevice* const device_;
+  const uint64_t id_;
+  const uint64_t readahead_;      // 0 to charge every read
+  const uint64_t size_;
+
+  mutable port::Mutex mu_;
+  mutable uint64_t window_start_; // Protected by mu_
+  mutable uint64_t window_end_;   // Protected by mu_
+};
+
+// Appends go to the page cache; the device sees them written back in
+// kWriteBackBytes pieces, and the rest on Sync() or Close().
+class DeviceWritableFile : public WritableFile {
+ public:
+  DeviceWritableFile(WritableFile* file, EmulatedDevice* device,
+                     uint64_t id)
+      : file_(file), device_(device), id_(id), offset_(0), pending_(0) {
+  }
+
+  virtual ~DeviceWritableFile() {
+    delete file_;
+  }
+
+  virtual Status Append(const Slice& data) {
+    pending_ += data.size();
+    if (pending_ >= kWriteBackBytes) {
+      WriteBack();
+    }
+    return file_->Append(data);
+  }
+
+  virtual Status Close() {
+    WriteBack();
+    return file_->Close();
+  }
+
+  virtual Status Flush() { return file_->Flush(); }
+
+  virtual Status Sync(int flags) {
+    WriteBack();
+    device_->Charge(EmulatedDevice::kSync, id_, 0, 0);
+    return file_->Sync(flags);
+  }
+
+ private:
+  enum { kWriteBackBytes = 1 << 20 };
+
+  void WriteBack() {
+    if (pending_ > 0) {
+      device_->Charge(EmulatedDevice::kWrite, id_, offset_, pending_);
+      offset_ += pending_;
+      pending_ = 0;
+    }
+  }
+
+  WritableFile* const file_;
+  EmulatedDevice* const device_;
+  const uint64_t id_;
+  uint64_t offset_;             // Of the data written back
+  uint64_t pending_;            // Bytes appended since
+};
+
+class DeviceEnvImpl : public DeviceEnv {
+ public:
+  DeviceEnvImpl(Env* base_env, const DeviceProfile& primary,
+                const DeviceProfile& secondary)
+      : DeviceEnv(base_env),
+        primary_(base_env, primary),
+        secondary_(base_env, secondary),
+        next_id_(0) {
+  }
+
+  virtual Status NewSequentialFile(const std::string& fname,
+                                   SequentialFile** result) {
+    SequentialFile* file;
+    Status s = target()->NewSequentialFile(fname, &file);
+    *result = s.ok() ?
+        new DeviceSequentialFile(file, DeviceOf(fname), NewId()) : NULL;
+    return s;
+  }
+
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result, bool mirror) {
+    RandomAccessFile* file;
+    Status s = target()->NewRandomAccessFile(fname, &file, mirror);
+    if (!s.ok()) {
+      *result = NULL;
+      return s;
+    }
+    // Scans read ahead like the POSIX Env's, or read the whole file
+    uint64_t readahead = 0, size = 0;
+    if (mirror && target()->GetFileSize(fname, &size).ok()) {
+      readahead = (MIRROR_READAHEAD > 0) ? MIRROR_READAHEAD : size;
+    }
+    *result = new DeviceRandomAccessFile(file, DeviceOf(fname), NewId(),
+                                         readahead, size);
+    return s;
+  }
+
+  virtual Status NewWritableFile(const std::string& fname,
+                                 WritableFile** result, bool mirror) {
+    WritableFile* file;
+    Status s = target()->NewWritableFile(fname, &file, mirror);
+    *result = s.ok() ?
+        new DeviceWritableFile(file, DeviceOf(fname), NewId()) : NULL;
+    return s;
+  }
+
+  virtual Status AttachMirror(const std::string& dbname,
+                              const Options& options,
+                              MirrorContext** result) {
+    Status s = target()->AttachMirror(dbname, options, result);
+    if (s.ok()) {
+      {
+        MutexLock l(&mu_);
+        mirror_paths_.push_back((*result)->path());
+      }
+      (*result)->SetIOHook(&DeviceEnvImpl::ChargeMirrorIO, this);
+    }
+    return s;
+  }
+
+  virtual void DetachMirror(MirrorContext* mirror) {
+    const std::string path = mirror->path();
+    target()->DetachMirror(mirror);
+    MutexLock l(&mu_);
+    for (size_t i = 0; i < mirror_paths_.size(); i++) {
+      if (mirror_paths_[i] == path) {
+        mirror_paths_.erase(mirror_paths_.begin() + i);
+        break;
+      }
+    }
+  }
+
+  virtual void GetStats(Device device, Stats* stats) {
+    (device == kPrimary ? primary_ : secondary_).GetStats(stats);
+  }
+
+  virtual std::string Summary() {
+    std::string result =
+        "Device       Reads  Read(MB)    Writes  Written(MB)   Syncs"
+        "   Seeks  Busy(sec)  Queued(sec)\n";
+    const char* names[] = { "primary", "secondary" };
+    for (int d = kPrimary; d <= kSecondary; d++) {
+      Stats stats;
+      GetStats(static_cast<Device>(d), &stats);
+      char buf[200];
+      snprintf(buf, sizeof(buf),
+               "%-9s %8llu %9.1f %9llu %12.1f %7llu %7llu %10.3f %12.3f\n",
+               names[d],
+               static_cast<unsigned long long>(stats.reads),
+               stats.read_bytes / 1048576.0,
+               static_cast<unsigned long long>(stats.writes),
+               stats.write_bytes / 1048576.0,
+               static_cast<unsigned long long>(stats.syncs),
+               static_cast<unsigned long long>(stats.seeks),
+               stats.busy_micros / 1e6,
+               stats.queue_micros / 1e6);
+      result.append(buf);
+    }
+    return result;
+  }
+
+ private:
+  // Ids of the files the helpers write by descriptor; those of Env files
+  // count up from zero.
+  static uint64_t FdId(int fd) {
+    return (static_cast<uint64_t>(1) << 32) + fd;
+  }
+
+  static void ChargeMirrorIO(void* arg, int type, int fd, uint64_t offset,
+                             size_t size) {
+    DeviceEnvImpl* env = reinterpret_cast<DeviceEnvImpl*>(arg);
+    const uint64_t id = FdId(fd);
+    switch (type) {
+      case MBufSync:
+        env->secondary_.Charge(EmulatedDevice::kWrite, id, offset, size);
+        break;
+      case MAppend:
+        env->secondary_.Charge(EmulatedDevice::kWrite,
+                               EmulatedDevice::kContinue, 0, size);
+        break;
+      case MBufClose:
+        env->secondary_.Charge(EmulatedDevice::kSync, id, 0, 0);
+        break;
+      case MCopy:
+        env->primary_.Charge(EmulatedDevice::kRead, id, offset, size);
+        env->secondary_.Charge(EmulatedDevice::kWrite, id, offset, size);
+        break;
+    }
+  }
+
+  EmulatedDevice* DeviceOf(const std::string& fname) {
+    MutexLock l(&mu_);
+    for (size_t i = 0; i < mirror_paths_.size(); i++) {
+      const std::string& path = mirror_paths_[i];
+      if (fname.size() > path.size() && fname[path.size()] == '/' &&
+          fname.compare(0, path.size(), path) == 0) {
+        return &secondary_;
+      }
+    }
+    return &primary_;
+  }
+
+  uint64_t NewId() {
+    return __atomic_fetch_add(&next_id_, 1, __ATOMIC_RELAXED);
+  }
+
+  EmulatedDevice primary_;
+  EmulatedDevice secondary_;
+  uint64_t next_id_;
+
+  port::Mutex mu_;
+  std::vector<std::string> mirror_paths_;   // Protected by mu_
+};
+
+}  // namespace
+
+DeviceEnv::~DeviceEnv() { }
+
+bool GetDeviceProfile(const std::string& name, DeviceProfile* profile) {
+  for (size_t i = 0; i < sizeof(kProfiles) / sizeof(kProfiles[0]); i++) {
+    if (name == kProfiles[i].name) {
+      *profile = kProfiles[i].profile;
+      return true;
+    }
+  }
+  return false;
+}
+
+DeviceEnv* NewDeviceEnv(Env* base_env, const DeviceProfile& primary,
+                        const DeviceProfile& secondary) {
+  return new DeviceEnvImpl(base_env, primary, secondary);
+}
+
+}  // namespace leveldb
@@ -0,0 +1,85 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// DeviceEnv makes benchmarks of a mirrored DB independent of the disks
+// they run on.  It emulates two devices, the primary holding the DB and
+// the secondary holding its mirror (Options::mirror_path), and delays
+// every read, write and sync by the time the device would take to serve
+// it.  Appends reach the device as the page cache would write them back,
+// and scans as readahead windows of MIRROR_READAHEAD bytes.  Files
+// under a mirror path attached through this Env are on the
+// secondary, all others on the primary.  The mirror I/O the helpers do
+// themselves is charged through MirrorContext::SetIOHook(), so the
+// mirror code runs unchanged.
+//
+// Run it over a memenv, or over Env::Default() on a tmpfs when the DB is
+// to be mirrored: the time the base Env takes itself is not emulated
+// away, so it should be small next to the device's.
+
+#ifndef STORAGE_LEVELDB_HELPERS_MEMENV_DEVICE_ENV_H_
+#define STORAGE_LEVELDB_HELPERS_MEMENV_DEVICE_ENV_H_
+
+#include <stdint.h>
+#include <string>
+#include "leveldb/env.h"
+
+namespace leveldb {
+
+struct DeviceProfile {
+  // Time a device takes to serve a request of "n" bytes: the latency,
+  // plus "n" over the bandwidth (0 for no limit), plus seek_micros if
+  // the request does not start where the device's last one ended.
+  uint64_t read_latency_micros;
+  uint64_t write_latency_micros;
+  uint64_t sync_latency_micros;
+  uint64_t read_bytes_per_second;
+  uint64_t write_bytes_per_second;
+  uint64_t seek_micros;
+
+  // Requests the device serves at once; the others queue behind them.
+  int queue_depth;
+};
+
+// Stores the profile called "name" in *profile: "ram" (no delays),
+// "nvme", "ssd", "hdd" or "raid" (four striped disks).  Returns false
+// if there is no such profile.
+bool GetDeviceProfile(const std::string& name, DeviceProfile* profile);
+
+class DeviceEnv : public EnvWrapper {
+ public:
+  enum Device {
+    kPrimary = 0,
+    kSecondary = 1
+  };
+
+  struct Stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t syncs;
+    uint64_t seeks;
+    uint64_t busy_micros;       // Time spent serving requests
+    uint64_t queue_micros;      // Time requests waited for a free slot
+  };
+
+  explicit DeviceEnv(Env* base_env) : EnvWrapper(base_env) { }
+  virtual ~DeviceEnv();
+
+  virtual void GetStats(Device device, Stats* stats) = 0;
+
+  // Return a human-readable summary of the stats of both devices.
+  virtual std::string Summary() = 0;
+};
+
+// Returns a new environment that delays the file I/O of base_env as
+// "primary" and "secondary" would serve it.  The caller must delete the
+// result when it is no longer needed.
+// *base_env must remain live while the result is in use.
+DeviceEnv* NewDeviceEnv(Env* base_env, const DeviceProfile& primary,
+                        const DeviceProfile& secondary);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_HELPERS_MEMENV_DEVICE_ENV_H_
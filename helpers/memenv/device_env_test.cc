@@ -0,0 +1,279 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "helpers/memenv/device_env.h"
+
+#include "helpers/memenv/memenv.h"
+#include "leveldb/env.h"
+#include "leveldb/mirror.h"
+#include "leveldb/options.h"
+#include "port/port.h"
+#include "util/mutexlock.h"
+#include "util/testharness.h"
+#include <string>
+
+namespace leveldb {
+
+// A clock that only moves when somebody sleeps.  The mirror helpers
+// sleep on it too, hence the atomics.
+class FakeClockEnv : public EnvWrapper {
+ public:
+  uint64_t now_;
+
+  explicit FakeClockEnv(Env* base) : EnvWrapper(base), now_(1000000) { }
+
+  virtual uint64_t NowMicros() {
+    return __atomic_load_n(&now_, __ATOMIC_RELAXED);
+  }
+  virtual void SleepForMicroseconds(int micros) {
+    __atomic_fetch_add(&now_, micros, __ATOMIC_RELAXED);
+  }
+};
+
+class DeviceEnvTest {
+ public:
+  Env* mem_;
+  FakeClockEnv clock_;
+
+  DeviceEnvTest()
+      : mem_(NewMemEnv(Env::Default())),
+        clock_(mem_) {
+  }
+  ~DeviceEnvTest() {
+    delete mem_;
+  }
+
+  static DeviceProfile Profile(const std::string& name) {
+    DeviceProfile profile;
+    ASSERT_TRUE(GetDeviceProfile(name, &profile));
+    return profile;
+  }
+
+  struct ReaderState {
+    RandomAccessFile* file;
+    port::Mutex mu;
+    port::CondVar cv;
+    int running;
+    ReaderState() : cv(&mu), running(0) { }
+  };
+
+  static void Reader(void* arg) {
+    ReaderState* state = reinterpret_cast<ReaderState*>(arg);
+    char scratch[1];
+    Slice result;
+    for (int i = 0; i < 10; i++) {
+      ASSERT_OK(state->file->Read(0, 0, &result, scratch));
+    }
+    MutexLock l(&state->mu);
+    state->running--;
+    state->cv.Signal();
+  }
+
+  // Real time 4 threads take for 10 reads each of 2ms on a device of
+  // "queue_depth"
+  uint64_t TimeReads(int queue_depth) {
+    DeviceProfile profile = Profile("ram");
+    profile.read_latency_micros = 2000;
+    profile.queue_depth = queue_depth;
+    DeviceEnv* env = NewDeviceEnv(mem_, profile, profile);
+    WritableFile* file;
+    ASSERT_OK(env->NewWritableFile("/dir/f", &file));
+    delete file;
+    ReaderState state;
+    ASSERT_OK(env->NewRandomAccessFile("/dir/f", &state.file));
+    const uint64_t start = env->NowMicros();
+    state.running = 4;
+    for (int i = 0; i < 4; i++) {
+      env->StartThread(&DeviceEnvTest::Reader, &state);
+    }
+    {
+      MutexLock l(&state.mu);
+      while (state.running > 0) {
+        state.cv.Wait();
+      }
+    }
+    const uint64_t elapsed = env->NowMicros() - start;
+    delete state.file;
+    delete env;
+    return elapsed;
+  }
+};
+
+TEST(DeviceEnvTest, Profiles) {
+  DeviceProfile profile;
+  ASSERT_TRUE(GetDeviceProfile("hdd", &profile));
+  ASSERT_EQ(8000, profile.seek_micros);
+  ASSERT_EQ(1, profile.queue_depth);
+  ASSERT_TRUE(GetDeviceProfile("ssd", &profile));
+  ASSERT_EQ(0, profile.seek_micros);
+  ASSERT_TRUE(!GetDeviceProfile("floppy", &profile));
+}
+
+TEST(DeviceEnvTest, ServiceTime) {
+  DeviceEnv* env = NewDeviceEnv(&clock_, Profile("hdd"), Profile("ram"));
+  const std::string block(1 << 20, 'x');
+  uint64_t start = clock_.NowMicros();
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile("/dir/f", &file));
+  ASSERT_OK(file->Append(block));   // 100 + 6666 + a seek
+  ASSERT_OK(file->Append(block));   // 100 + 6666
+  ASSERT_OK(file->Sync());          // 4000
+  ASSERT_OK(file->Close());
+  delete file;
+  ASSERT_EQ(14766 + 6766 + 4000, clock_.NowMicros() - start);
+
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile("/dir/f", &rfile));
+  std::string scratch(1 << 20, ' ');
+  Slice result;
+  start = clock_.NowMicros();
+  ASSERT_OK(rfile->Read(0, 1 << 20, &result, &scratch[0]));
+  ASSERT_OK(rfile->Read(1 << 20, 1 << 20, &result, &scratch[0]));
+  ASSERT_EQ(14766 + 6766, clock_.NowMicros() - start);
+  delete rfile;
+
+  DeviceEnv::Stats stats;
+  env->GetStats(DeviceEnv::kPrimary, &stats);
+  ASSERT_EQ(2, stats.writes);
+  ASSERT_EQ(2 << 20, stats.write_bytes);
+  ASSERT_EQ(2, stats.reads);
+  ASSERT_EQ(2 << 20, stats.read_bytes);
+  ASSERT_EQ(1, stats.syncs);
+  ASSERT_EQ(2, stats.seeks);
+  ASSERT_EQ(0, stats.queue_micros);
+  env->GetStats(DeviceEnv::kSecondary, &stats);
+  ASSERT_EQ(0, stats.writes + stats.reads);
+  delete env;
+}
+
+TEST(DeviceEnvTest, QueueDepth) {
+  // One at a time 80ms, four at a time 20ms
+  ASSERT_GE(TimeReads(1), 80000);
+  ASSERT_LT(TimeReads(4), 60000);
+}
+
+TEST(DeviceEnvTest, ShortRequests) {
+  // Not slept off one by one, but they add up
+  DeviceProfile profile = Profile("ram");
+  profile.read_latency_micros = 30;
+  profile.queue_depth = 8;
+  DeviceEnv* env = NewDeviceEnv(&clock_, profile, profile);
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile("/dir/f", &file));
+  delete file;
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile("/dir/f", &rfile));
+  char scratch[1];
+  Slice result;
+  const uint64_t start = clock_.NowMicros();
+  for (int i = 0; i < 100; i++) {
+    ASSERT_OK(rfile->Read(0, 0, &result, scratch));
+    ASSERT_TRUE(clock_.NowMicros() - start <= 30 * (i + 1));
+  }
+  ASSERT_GE(clock_.NowMicros() - start, 3000 - 100);
+  delete rfile;
+  delete env;
+}
+
+TEST(DeviceEnvTest, WriteBack) {
+  DeviceEnv* env = NewDeviceEnv(&clock_, Profile("ssd"), Profile("ram"));
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile("/dir/f", &file));
+  const uint64_t start = clock_.NowMicros();
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_OK(file->Append(std::string(100, 'x')));
+  }
+  ASSERT_EQ(start, clock_.NowMicros());   // In the page cache
+  ASSERT_OK(file->Sync());
+  ASSERT_OK(file->Close());
+  delete file;
+
+  DeviceEnv::Stats stats;
+  env->GetStats(DeviceEnv::kPrimary, &stats);
+  ASSERT_EQ(1, stats.writes);
+  ASSERT_EQ(100000, stats.write_bytes);
+  ASSERT_EQ(1, stats.syncs);
+  delete env;
+}
+
+TEST(DeviceEnvTest, ScanReadahead) {
+  const size_t saved = MIRROR_READAHEAD;
+  MIRROR_READAHEAD = 1 << 20;
+  DeviceEnv* env = NewDeviceEnv(&clock_, Profile("hdd"), Profile("ram"));
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile("/dir/f", &file));
+  ASSERT_OK(file->Append(std::string(3 << 20, 'x')));
+  ASSERT_OK(file->Close());
+  delete file;
+
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile("/dir/f", &rfile, true));
+  char scratch[4096];
+  Slice result;
+  for (uint64_t offset = 0; offset < (3 << 20); offset += 4096) {
+    ASSERT_OK(rfile->Read(offset, 4096, &result, scratch));
+  }
+  delete rfile;
+  DeviceEnv::Stats stats;
+  env->GetStats(DeviceEnv::kPrimary, &stats);
+  ASSERT_EQ(3, stats.reads);
+  ASSERT_EQ(3 << 20, stats.read_bytes);
+  ASSERT_EQ(2, stats.seeks);     // To the write, then to the scan
+  delete env;
+  MIRROR_READAHEAD = saved;
+}
+
+TEST(DeviceEnvTest, Mirror) {
+  FakeClockEnv clock(Env::Default());
+  DeviceEnv* env = NewDeviceEnv(&clock, Profile("ram"), Profile("ssd"));
+  const std::string dir = test::TmpDir() + "/device_env_mirror";
+  const std::string db = dir + "/db";
+  env->CreateDir(dir);
+  env->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  MirrorContext* mirror;
+  ASSERT_OK(env->AttachMirror(db, options, &mirror));
+
+  // The helpers' writes and fdatasync() go to the secondary
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile(db + "/000009.sst", &file));
+  ASSERT_OK(file->Append(std::string(5000, 'x')));
+  ASSERT_OK(file->Close());
+  delete file;
+  ASSERT_TRUE(mirror->WaitForWatermark(9, 10000000));
+  DeviceEnv::Stats stats;
+  env->GetStats(DeviceEnv::kSecondary, &stats);
+  ASSERT_GE(stats.writes, 1);
+  ASSERT_GE(stats.write_bytes, 5000);
+  ASSERT_EQ(1, stats.syncs);
+  ASSERT_EQ(0, stats.reads);
+
+  // So do reads of the copy
+  RandomAccessFile* rfile;
+  ASSERT_OK(env->NewRandomAccessFile(options.mirror_path + "/000009.sst",
+                                     &rfile));
+  char scratch[100];
+  Slice result;
+  ASSERT_OK(rfile->Read(0, 100, &result, scratch));
+  delete rfile;
+  env->GetStats(DeviceEnv::kSecondary, &stats);
+  ASSERT_EQ(1, stats.reads);
+  env->GetStats(DeviceEnv::kPrimary, &stats);
+  ASSERT_EQ(0, stats.reads);
+  ASSERT_EQ(1, stats.writes);
+
+  ASSERT_OK(env->DeleteFile(db + "/000009.sst"));
+  env->DetachMirror(mirror);
+  env->DeleteDir(options.mirror_path);
+  env->DeleteDir(db);
+  env->DeleteDir(dir);
+  delete env;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
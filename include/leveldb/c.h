@@ -206,6 +206,8 @@ enum {
   leveldb_snappy_compression = 1
 };
 extern void leveldb_options_set_compression(leveldb_options_t*, int);
+extern void leveldb_options_set_mirror_path(leveldb_options_t*, const char*);
+extern void leveldb_options_set_mirror_helpers(leveldb_options_t*, int);
 
 /* Comparator */
 
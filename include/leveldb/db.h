@@ -12,12 +12,6 @@
 
 namespace leveldb {
 
-namespace config {
-extern int kTargetFileSize;
-extern int kL0_Size;     // in MB
-extern int kLevelRatio;  // enlarge the level size by ten when the db levels up
-}
-
 // Update Makefile if you change these
 static const int kMajorVersion = 1;
 static const int kMinorVersion = 12;
@@ -58,6 +52,24 @@ class DB {
                      const std::string& name,
                      DB** dbptr);
 
+  // Open the mirror directory of a DB opened elsewhere with
+  // options.mirror_path == "mirror_path" and options.mirror_metadata, as
+  // a read-only follower of that DB.  The follower replays the edits the
+  // leader appends to its MANIFEST and the records it appends to its
+  // log, every options.follower_poll_micros and on CatchUp(), so its
+  // reads trail the leader's by about that much.  Writes return
+  // NotSupported.  A follower reads every table file from the mirror:
+  // the leader must not keep any off it (options.mirror_policy), and
+  // as it deletes the tables it compacts away, iterators and snapshots
+  // that stay open on a follower across a compaction may fail with an
+  // IOError.
+  // Stores a pointer to a heap-allocated follower in *dbptr and returns
+  // OK on success.
+  // Stores NULL in *dbptr and returns a non-OK status on error.
+  static Status OpenAsFollower(const Options& options,
+                               const std::string& mirror_path,
+                               DB** dbptr);
+
   DB() { }
   virtual ~DB();
 
@@ -118,9 +130,43 @@ class DB {
   //  "leveldb.num-files-at-level<N>" - return the number of files at level <N>,
   //     where <N> is an ASCII representation of a level number (e.g. "0").
   //  "leveldb.stats" - returns a multi-line string that describes statistics
-  //     about the internal operation of the DB.
+  //     about the internal operation of the DB, including the time
+  //     compactions were held to options.compaction_write_rate.
   //  "leveldb.sstables" - returns a multi-line string that describes all
   //     of the sstables that make up the db contents.
+  //  "leveldb.read-placement" - returns a multi-line string with the
+  //     number of table reads per level served by the primary and by
+  //     the mirror copies (see Options::mirror_read_levels), and with
+  //     Options::mirror_read_routing the latency and load of each copy.
+  //  "leveldb.mirror-queue" - returns a multi-line string that describes
+  //     the mirror buffers queued for the secondary device, how often
+  //     compaction output was throttled by the queue cap, how many write
+  //     calls the helpers needed for the buffers, how long they were held
+  //     to their rate limits and how often compaction inputs waited for
+  //     their mirror copies to land.  Only available when
+  //     options.mirror_path is set.
+  //  "leveldb.mirror-watermark" - returns the highest table file number
+  //     such that every table file numbered up to it has been copied to
+  //     the mirror and synced.  Tables that options.mirror_policy keeps
+  //     off the mirror, and copies that failed, do not hold it back.
+  //     Only available when options.mirror_path is set.
+  //  "leveldb.mirror-resync" - returns a multi-line string with the
+  //     progress of the current or last mirror resync.  Only available
+  //     when options.mirror_path is set.
+  //  "leveldb.mirror-scrub" - returns a multi-line string with the
+  //     mirror copies the scrubber checked and those it found bad and
+  //     copied again.  Only available when options.mirror_path and
+  //     options.mirror_scrub_rate are set.
+  //  "leveldb.mirrored-sequence" - returns the highest sequence number
+  //     such that every update up to it is in table files that have been
+  //     copied to the mirror and synced, or that options.mirror_policy
+  //     keeps off the mirror.  A live table whose copy failed holds it
+  //     back.  Updates still in the memtable are not mirrored.  Only
+  //     available when options.mirror_path is set.
+  //  "leveldb.follower" - returns a multi-line string with the catch-ups
+  //     a follower has run, the edits and log records it replayed and
+  //     the sequence number it reads at.  Only available on a DB opened
+  //     with DB::OpenAsFollower().
   virtual bool GetProperty(const Slice& property, std::string* value) = 0;
 
   // For each i in [0,n-1], store in "sizes[i]", the approximate
@@ -146,6 +192,32 @@ class DB {
   //    db->CompactRange(NULL, NULL);
   virtual void CompactRange(const Slice* begin, const Slice* end) = 0;
 
+  // Wait until every table file written before the call has been copied
+  // to the mirror, synced, and its name made durable in the mirror
+  // directory.  Tables that options.mirror_policy keeps off the mirror
+  // are not waited for.  Updates still in the memtable are not covered; compact
+  // it first if they have to be.  With options.mirror_metadata it also
+  // waits for the MANIFEST and log records written before the call, so
+  // a follower that catches up afterwards sees every update made before
+  // it.  Returns a non-OK status if the copies did not complete within
+  // "timeout_micros" or if the copy of a live table failed (ResyncMirror()
+  // copies it again), and NotSupported if the DB has no mirror.
+  virtual Status WaitForMirror(uint64_t timeout_micros);
+
+  // Start bringing the mirror back in line with the live table files in
+  // the background, as is done on open (see
+  // Options::mirror_resync_threads).  Copies being rebuilt are not read
+  // until they are complete; WaitForMirror() waits for them.  Does
+  // nothing if a resync is already running.  Returns NotSupported if the
+  // DB has no mirror.
+  virtual Status ResyncMirror();
+
+  // Replay what the leader of a follower (see OpenAsFollower()) has
+  // written to the mirror since the last catch-up.  A table its edits
+  // add that has not reached the mirror whole holds them back until a
+  // later catch-up.  Returns NotSupported on a DB that is not a follower.
+  virtual Status CatchUp();
+
  private:
   // No copying allowed
   DB(const DB&);
@@ -23,6 +23,8 @@ namespace leveldb {
 
 class FileLock;
 class Logger;
+class MirrorContext;
+struct Options;
 class RandomAccessFile;
 class SequentialFile;
 class Slice;
@@ -55,6 +57,10 @@ class Env {
   // returns non-OK.  If the file does not exist, returns a non-OK
   // status.
   //
+  // If "mirror" is true the file is about to be scanned front to back
+  // (a compaction input read from the mirror) and may be opened for
+  // streaming reads.
+  //
   // The returned file may be concurrently accessed by multiple threads.
   virtual Status NewRandomAccessFile(const std::string& fname,
                                      RandomAccessFile** result, bool mirror = false) = 0;
@@ -66,8 +72,11 @@ class Env {
   // returns non-OK.
   //
   // The returned file will only be accessed by one thread at a time.
+  //
+  // If "mirror" is false, a table file of a mirrored DB gets no mirror
+  // copy (see Options::mirror_policy).
   virtual Status NewWritableFile(const std::string& fname,
-                                 WritableFile** result) = 0;
+                                 WritableFile** result, bool mirror = true) = 0;
 
   // Returns true iff the named file exists.
   virtual bool FileExists(const std::string& fname) = 0;
@@ -125,10 +134,49 @@ class Env {
       void (*function)(void* arg),
       void* arg) = 0;
 
+  // Background work runs in one of two pools of threads: kHighPriority
+  // for short work that writers wait on, such as memtable flushes, and
+  // kLowPriority for the rest.  Schedule(function, arg) is in the low
+  // priority pool.
+  enum Priority {
+    kLowPriority = 0,
+    kHighPriority = 1
+  };
+
+  // Arrange to run "(*function)(arg)" once in a thread of the pool of
+  // "pri".  Functions in one pool run in the order they were added as
+  // its threads become free.  The default implementation ignores "pri".
+  virtual void Schedule(
+      void (*function)(void* arg),
+      void* arg,
+      Priority pri) {
+    Schedule(function, arg);
+  }
+
+  // Make sure the pool of "pri" grows to at least "number" threads as
+  // work is scheduled in it.  Pools only grow, as the DBs sharing an Env
+  // may ask for different sizes.
+  // The default implementation does nothing.
+  virtual void EnsureBackgroundThreads(int number, Priority pri) { }
+
   // Start a new thread, invoking "function(arg)" within the new thread.
   // When "function(arg)" returns, the thread will be destroyed.
   virtual void StartThread(void (*function)(void* arg), void* arg) = 0;
 
+  // Start a new thread, invoking "function(arg)" within the new thread,
+  // that the caller waits for with JoinThread(): the thread is only
+  // destroyed once the handle returned here is passed to JoinThread().
+  // The default implementation runs "function(arg)" in the calling
+  // thread and returns NULL.
+  virtual void* StartJoinableThread(void (*function)(void* arg), void* arg) {
+    (*function)(arg);
+    return NULL;
+  }
+
+  // Wait for the thread started by StartJoinableThread() that returned
+  // "thread" to finish, and destroy it.
+  virtual void JoinThread(void* thread) { }
+
   // *path is set to a temporary directory that can be used for testing. It may
   // or many not have just been created. The directory may or may not differ
   // between runs of the same process, but subsequent calls will return the
@@ -138,6 +186,23 @@ class Env {
   // Create and return a log file for storing informational messages.
   virtual Status NewLogger(const std::string& fname, Logger** result) = 0;
 
+  // Start mirroring the table files of the database in directory
+  // "dbname" to options.mirror_path, typically on a second device.  From
+  // then on, table files created in "dbname" are also written to the
+  // mirror directory in the background, and deleting or renaming them
+  // does the same to their copies.  On success stores the per-DB mirror
+  // state in *result; the caller must hand it to DetachMirror() when it
+  // is done with the database.
+  //
+  // The default implementation does not support mirroring.
+  virtual Status AttachMirror(const std::string& dbname,
+                              const Options& options,
+                              MirrorContext** result);
+
+  // Wait for the queued mirror I/O of "mirror" to finish, stop mirroring
+  // its database and delete "mirror".
+  virtual void DetachMirror(MirrorContext* mirror);
+
   // Returns the number of micro-seconds since some fixed point in time. Only
   // useful for computing deltas of time.
   virtual uint64_t NowMicros() = 0;
@@ -283,11 +348,13 @@ class EnvWrapper : public Env {
   Status NewSequentialFile(const std::string& f, SequentialFile** r) {
     return target_->NewSequentialFile(f, r);
   }
-  Status NewRandomAccessFile(const std::string& f, RandomAccessFile** r) {
-    return target_->NewRandomAccessFile(f, r);
+  Status NewRandomAccessFile(const std::string& f, RandomAccessFile** r,
+                             bool m = false) {
+    return target_->NewRandomAccessFile(f, r, m);
   }
-  Status NewWritableFile(const std::string& f, WritableFile** r) {
-    return target_->NewWritableFile(f, r);
+  Status NewWritableFile(const std::string& f, WritableFile** r,
+                         bool m = true) {
+    return target_->NewWritableFile(f, r, m);
   }
   bool FileExists(const std::string& f) { return target_->FileExists(f); }
   Status GetChildren(const std::string& dir, std::vector<std::string>* r) {
@@ -309,15 +376,32 @@ class EnvWrapper : public Env {
   void Schedule(void (*f)(void*), void* a) {
     return target_->Schedule(f, a);
   }
+  void Schedule(void (*f)(void*), void* a, Priority pri) {
+    return target_->Schedule(f, a, pri);
+  }
+  void EnsureBackgroundThreads(int number, Priority pri) {
+    target_->EnsureBackgroundThreads(number, pri);
+  }
   void StartThread(void (*f)(void*), void* a) {
     return target_->StartThread(f, a);
   }
+  void* StartJoinableThread(void (*f)(void*), void* a) {
+    return target_->StartJoinableThread(f, a);
+  }
+  void JoinThread(void* thread) {
+    target_->JoinThread(thread);
+  }
   virtual Status GetTestDirectory(std::string* path) {
     return target_->GetTestDirectory(path);
   }
   virtual Status NewLogger(const std::string& fname, Logger** result) {
     return target_->NewLogger(fname, result);
   }
+  Status AttachMirror(const std::string& d, const Options& o,
+                      MirrorContext** m) {
+    return target_->AttachMirror(d, o, m);
+  }
+  void DetachMirror(MirrorContext* m) { target_->DetachMirror(m); }
   uint64_t NowMicros() {
     return target_->NowMicros();
   }
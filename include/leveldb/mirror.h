@@ -7,61 +7,241 @@
 #include <time.h>
 #include <malloc.h>
 #include <unistd.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include "leveldb/status.h"
 #include "util/hash.h"
+#include "util/mpsc_ring.h"
 
-extern int MIRROR_ENABLE;
-extern const char *MIRROR_PATH;
+//Mirroring itself is configured per DB through Options::mirror_path etc.
+//The buffer pool is shared by every mirrored DB in the process.
+extern int MIRROR_POOL_BUFFERS;	//idle mirror buffers kept for reuse
+extern int MIRROR_HUGE_PAGES;	//back mirror buffers with huge pages if possible
+extern size_t MIRROR_READAHEAD;	//bytes per readahead window of a mirror scan, 0 to read whole files
 
 #define BLKSIZE 4096
+#define MIRROR_BUFFER_SIZE	(4<<20)	//PosixBufferFile_ buffer, a BLKSIZE multiple
 
 /************************** Configuration Macros *****************************/
-#define COMPACT_READ_ON_SECONDARY 1
-#define HLSM_CPREFETCH false //for compaction
+#define HLSM_CPREFETCH	8	//data blocks each compaction input reads ahead, 0 to disable
+#define HLSM_PREFETCH_THREADS	4	//I/O threads reading data blocks ahead of iterators
 #define USE_OPQ_THREAD
+#define USE_OPQ_RING		//lock-free op ring instead of the TAILQ
+#define OPQ_RING_SLOTS	4096	//ops the ring holds before producers park
+#define MIRROR_URING_DEPTH	8	//io_uring writes in flight per helper, 0 to always pwrite
+#define MIRROR_HELPER_BATCH	64	//ops a helper takes per pass; adjacent writes among them are coalesced
+#define MIRROR_MAX_WAIT_MICROS	20000	//longest a compaction waits for a mirror copy to land
+#define MIRROR_COPY_CHUNK	(1<<20)	//bytes per copy_file_range() of a resync copy
+#define MIRROR_METADATA_MAX_WAIT_MICROS	1000000	//longest a MANIFEST write waits for the copies of the tables it names
 #define COMPACT_SECONDARY_PWRITE
 
 
 #define EXCLUDE_FILE(fname_, str_)	((fname_.find(str_) == std::string::npos))
-#define EXCLUDE_FILES(fname_)	((MIRROR_ENABLE ? 	\
+#define EXCLUDE_FILES(fname_)	(	\
 	EXCLUDE_FILE(fname_, "MANIFEST") && EXCLUDE_FILE(fname_, "CURRENT") 	\
 	&& EXCLUDE_FILE(fname_, ".dbtmp") && EXCLUDE_FILE(fname_, "LOG") 	\
-	&& EXCLUDE_FILE(fname_, ".log") && EXCLUDE_FILE(fname_, "LOCK") : 0 ))
+	&& EXCLUDE_FILE(fname_, ".log") && EXCLUDE_FILE(fname_, "LOCK") )
 
-//assume that .log will only be written, deleted, and renamed
-//#define HLSM_HDD_ONLY(fname_)	((MIRROR_ENABLE ? 	\
-	!EXCLUDE_FILE(fname_, ".log") : 0 ))		\
-
-#define HLSM_HDD_ONLY(fname_)	0
-
-/************************** For Mirror Write Status ****************************/
+/************************** Per-DB Mirror State ****************************/
 
 namespace leveldb {
 
-class FileNameHash {
-#define HSIZE 4096
-private:
-	static uint32_t hash[HSIZE]; 
+class RateLimiter;
+
+//Called for the mirror I/O the helpers do outside the Env, so that an
+//emulated device (helpers/memenv/device_env.h) can account for it:
+//"type" is MBufSync for a write of "size" bytes at "offset" of "fd"
+//(MAppend for an append to a mirror file opened by the Env), MBufClose
+//for an fdatasync() of "fd" and MCopy for "size" bytes at "offset"
+//copied from the primary to "fd" by CopyFromPrimary().
+typedef void (*MirrorIOHook)(void* arg, int type, int fd, uint64_t offset, size_t size);
+
+//Mirror buffers that are queued or being written are charged against
+//Options::mirror_queue_cap.  Past half the cap each new buffer costs the
+//writer a 1ms sleep; at the cap the writer waits for the helpers.
+struct MirrorQueueStats {
+	uint64_t inflight_bytes;	//queued or being written
+	uint64_t peak_bytes;
+	uint64_t cap_bytes;
+	uint64_t slowdowns;		//buffers delayed by 1ms
+	uint64_t stalls;		//buffers that waited for the helpers
+	uint64_t stall_micros;	//total time spent waiting
+	int helpers;			//0 if the helpers are not running
+	uint64_t pace_waits;		//compaction outputs held back for the mirror to catch up
+	uint64_t pace_micros;		//total time they were held back
+	uint64_t write_calls;		//pwrite(v)s and io_uring writes issued by the helpers
+	uint64_t buffers_written;	//buffers they wrote; more than write_calls when coalesced
+	uint64_t write_throttle_micros;	//helpers held to Options::mirror_write_rate
+	uint64_t delete_throttle_micros;	//helpers held to Options::mirror_delete_rate
+	uint64_t files_copied;		//closed files copied whole, see Options::mirror_copy_on_close
+	uint64_t files_cloned;		//of those, reflinked rather than copied
+	uint64_t metadata_failures;	//metadata copies removed after a failed write, see Options::mirror_metadata
+	uint64_t metadata_wait_timeouts;	//MANIFEST records written before the table copies they name landed
+
+	//table file copies, see MirrorContext::WaitForCopy()
+	uint64_t copies_inflight;	//created but not yet complete
+	uint64_t copy_land_micros;	//average time from writer close to landed
+	uint64_t copy_waits;		//reads that waited for a copy to land
+	uint64_t copy_wait_micros;	//total time spent waiting
+	uint64_t copy_fallbacks;	//reads sent to the primary instead
+	uint64_t copies_skipped;	//live tables left without a copy, see Options::mirror_policy
+	uint64_t copies_failed;		//live tables whose copy failed, see MirrorContext::CopyFailed()
+
+	//MIRROR_BUFFER_SIZE buffer pool
+	uint64_t buffer_hits;	//buffers reused
+	uint64_t buffer_misses;	//buffers newly allocated
+	uint64_t buffers_peak;	//most buffers in use at once
+	uint64_t buffers_free;	//buffers kept for reuse
+	uint64_t buffers_huge;	//buffers backed by huge pages
+};
 
+//Mirror state of one DB, returned by Env::AttachMirror() and released
+//with Env::DetachMirror().  Each DB has its own helpers and queues.
+class MirrorContext {
 public:
-	static int add(const std::string filename) {
-		uint32_t h = Hash(filename.c_str(), filename.length(), 1);
-		hash[h%HSIZE]++;
-		return 0;
-	}
+	MirrorContext(const std::string& dbname, const std::string& path);
+	virtual ~MirrorContext();
 
-	static int drop(const std::string filename) {
-		uint32_t h = Hash(filename.c_str(), filename.length(), 1);
-		hash[h%HSIZE]--;
+	const std::string& dbname() const { return dbname_; }
 
-		return 0;
+	//directory holding the mirror copies
+	const std::string& path() const { return path_; }
+
+	//mirror copy of the DB file "fname"
+	std::string MirrorFileName(const std::string& fname) const {
+		return path_ + fname.substr(fname.find_last_of("/"));
+	}
+
+	virtual void GetStats(MirrorQueueStats* stats) = 0;
+
+	//bytes queued for the mirror or being written to it
+	virtual uint64_t QueuedBytes() = 0;
+
+	//Waits up to "max_wait_micros" for QueuedBytes() to drop to
+	//"target_bytes".  Returns true if it did.
+	virtual bool WaitForLag(uint64_t target_bytes, uint64_t max_wait_micros) = 0;
+
+	//The copy of table file "number" is in flight from CopyStarted(),
+	//when the Env creates it, to CopyDone(), when the helper has closed
+	//it.  CopyQueued() marks the writer closing it, i.e. all its data
+	//is queued.  Thread-safe.
+	void CopyStarted(uint64_t number);
+	void CopyQueued(uint64_t number);
+	void CopyDone(uint64_t number);
+
+	//CopyStarted() unless the copy is already in flight; returns false then
+	bool TryCopyStarted(uint64_t number);
+
+	//Table file "number" was created without a copy, or the copy it has
+	//is not to be read.  Until CopyStarted() or TableDeleted() it counts
+	//as neither complete nor in flight: reads go to the primary and the
+	//watermark does not wait for it.  Unless its copy failed (see
+	//CopyFailed()), such a table is one Options::mirror_policy keeps off
+	//the mirror; it is not expected to have a copy, so it does not hold
+	//back DB::WaitForMirror() or leveldb.mirrored-sequence either.
+	//Thread-safe.
+	void CopySkipped(uint64_t number);
+	bool IsCopySkipped(uint64_t number);
+
+	//The table file is gone: forgets it, ending the flight of its copy
+	void TableDeleted(uint64_t number);
+
+	//Ends the flight of a copy that could not be made, written or synced:
+	//the table is skipped as above, and until CopyStarted() or
+	//TableDeleted() FirstFailedCopy() reports it.  Does nothing if the
+	//copy is no longer in flight, e.g. its table was deleted.  Thread-safe.
+	void CopyFailed(uint64_t number);
+
+	//Sets *number to the lowest live table whose copy failed; returns
+	//false if there is none.
+	bool FirstFailedCopy(uint64_t* number);
+
+	//Returns true if the copy of table file "number" is complete.  If it
+	//is still in flight and, judging by how long recent copies took to
+	//land, is expected to land within "max_wait_micros", waits for it.
+	//Returns false if the copy is not complete; read the primary then.
+	bool WaitForCopy(uint64_t number, uint64_t max_wait_micros);
+
+	//Returns true if the copy of table file "number" is complete; never waits.
+	bool CopyLanded(uint64_t number);
+
+	//Every table file numbered up to Watermark() that was copied has its
+	//copy complete, i.e. written, fdatasync()ed and closed by a helper.
+	//Files older than the mirror context count as complete.
+	uint64_t Watermark();
+
+	//highest table file number whose copy was started
+	uint64_t LastCopyStarted();
+
+	//Waits up to "max_wait_micros" for Watermark() to reach "number".
+	//Returns true if it did.
+	bool WaitForWatermark(uint64_t number, uint64_t max_wait_micros);
+
+	//Waits up to "max_wait_micros" for the copies queued (all data handed
+	//to the helpers) at or before "queued_by", in gettimeofday() micros,
+	//to land.  Copies still being written are not waited for.  Returns
+	//true if they did.
+	bool WaitForQueuedCopies(uint64_t queued_by, uint64_t max_wait_micros);
+
+	//fsync()s the mirror directory, making the names of complete copies durable
+	Status SyncDir();
+
+	//Copies the DB file "fname" to the mirror: a FICLONE reflink if both
+	//are on one file system that supports it, else copy_file_range()
+	//(pread/pwrite where the kernel cannot) in MIRROR_COPY_CHUNK pieces
+	//charged to "limiter" if it is not NULL.  The copy is written under a
+	//temporary name, fdatasync()ed and renamed over the old one.
+	//Does not track the copy; callers bracket it with CopyStarted() and
+	//CopyDone().  Sets *bytes to the bytes copied and, if "cloned" is not
+	//NULL, *cloned to whether the copy is a reflink.
+	Status CopyFromPrimary(const std::string& fname, RateLimiter* limiter,
+	                       uint64_t* bytes, bool* cloned = NULL);
+
+	//parses the number of the table file "<dir>/<number>.sst"
+	static bool TableFileNumber(const std::string& fname, uint64_t* number);
+
+	//true for the files Options::mirror_metadata mirrors: MANIFEST-*,
+	//CURRENT, its temporary *.dbtmp and the <number>.log files
+	static bool IsMetadataFile(const std::string& fname);
+
+	//Installs "hook", NULL to remove it.  Set it before the DB queues any
+	//mirror I/O; it is called from the helpers and copying threads.
+	void SetIOHook(MirrorIOHook hook, void* arg) {
+		__atomic_store_n(&io_hook_arg_, arg, __ATOMIC_RELAXED);
+		__atomic_store_n(&io_hook_, hook, __ATOMIC_RELEASE);
 	}
 
-	static int inuse(const std::string filename) {
-		uint32_t h = Hash(filename.c_str(), filename.length(), 1);
-		return (hash[h%HSIZE]>0);
+	void ChargeIO(int type, int fd, uint64_t offset, size_t size) {
+		MirrorIOHook hook = __atomic_load_n(&io_hook_, __ATOMIC_ACQUIRE);
+		if (hook != NULL) (*hook)(io_hook_arg_, type, fd, offset, size);
 	}
 
-#undef HSIZE
+protected:
+	//fills the copies_* and copy_* fields
+	void GetCopyStats(MirrorQueueStats* stats);
+
+private:
+	const std::string dbname_;
+	const std::string path_;
+
+	pthread_mutex_t copy_mu_;
+	pthread_cond_t copy_done_;
+	std::map<uint64_t, uint64_t> copies_;	//in flight, number -> queued at (0 before)
+	std::set<uint64_t> skipped_;	//without a copy
+	std::set<uint64_t> failed_;	//of those, the ones whose copy failed
+	uint64_t last_started_;		//highest number passed to CopyStarted()
+	uint64_t land_micros_;		//moving average of queued -> done
+	uint64_t waits_;
+	uint64_t wait_micros_;
+	uint64_t fallbacks_;
+	MirrorIOHook io_hook_;
+	void* io_hook_arg_;
+
+	//No copying allowed
+	MirrorContext(const MirrorContext&);
+	void operator=(const MirrorContext&);
 };
 
 }
@@ -71,7 +251,7 @@ public:
 //1. Status Append(const Slice& data)
 //2. Status Sync() 
 //3. Status Close() 
-typedef enum { MAppend = 1, MSync, MClose, MDelete, MHalt, MBufSync, MBufClose, MTruncate} mio_op_t;
+typedef enum { MAppend = 1, MSync, MClose, MDelete, MHalt, MBufSync, MBufClose, MTruncate, MCopy, MWrite, MRename} mio_op_t;
 
 typedef struct {
 	mio_op_t type;
@@ -80,8 +260,13 @@ typedef struct {
 	int fd;
 	size_t size;
 	uint64_t offset;
+	uint64_t number;	//table file number, for MBufClose and MCopy; for MWrite see below
 } *mio_op, mio_op_s;
 
+/* Two queue implementations are available to hand ops to the helper:
+ *  - OPQ_TAILQ_*: a mutex-protected TAILQ, two mallocs per op
+ *  - MPSCRing: a preallocated lock-free ring of op slots (util/mpsc_ring.h)
+ * USE_OPQ_RING selects the ring for the generic OPQ_* macros below. */
 struct entry_ {
 	mio_op op;
 	TAILQ_ENTRY(entry_) entries_;
@@ -95,120 +280,177 @@ typedef struct {
 
 	pthread_cond_t noop; //no operation
 	pthread_mutex_t cond_m;
-} *opq, opq_s;
+} *opq_tailq, opq_tailq_s;
 
-#define OPQ_MALLOC	(opq) malloc(sizeof(opq_s))
+#define OPQ_TAILQ_MALLOC	(opq_tailq) malloc(sizeof(opq_tailq_s))
 
-#define OPQ_NONEMPTY(q_)	(( (q_->head).tqh_first ))
+//the queue must be empty
+#define OPQ_TAILQ_FREE(q_)	do {		\
+		pthread_mutex_destroy(&(q_->mutex));	\
+		pthread_mutex_destroy(&(q_->cond_m));	\
+		pthread_cond_destroy(&(q_->noop));	\
+		free(q_);	\
+	} while(0)
+
+#define OPQ_TAILQ_NONEMPTY(q_)	(( (q_->head).tqh_first ))
 
-#define OPQ_INIT(q_) 	do {		\
+#define OPQ_TAILQ_INIT(q_) 	do {		\
 		pthread_mutex_init(&(q_->mutex), NULL);	\
 		pthread_mutex_init(&(q_->cond_m), NULL);\
 		pthread_cond_init(&(q_->noop), NULL);\
 		TAILQ_INIT(&(q_->head));	\
 	} while(0)
 
-#define OPQ_WAIT(q_) do { \
+//recheck under cond_m, otherwise a wakeup sent between the caller's
+//OPQ_TAILQ_NONEMPTY and the wait is lost
+#define OPQ_TAILQ_WAIT(q_) do { \
 		pthread_mutex_lock(&(q_->cond_m) );	\
-		pthread_cond_wait(&(q_->noop), &(q_->cond_m) ); 	\
+		if (!OPQ_TAILQ_NONEMPTY(q_))	\
+			pthread_cond_wait(&(q_->noop), &(q_->cond_m) ); 	\
 		pthread_mutex_unlock(&(q_->cond_m) );\
 	} while(0)
 
-#define OPQ_WAKEUP(q_) do { \
+#define OPQ_TAILQ_WAKEUP(q_) do { \
 		pthread_mutex_lock(&(q_->cond_m) );	\
 		pthread_cond_signal(&(q_->noop) ); \
 		pthread_mutex_unlock(&(q_->cond_m) );\
 	} while(0)
 
-#define OPQ_ADD(q_, op_)	do {	\
+#define OPQ_TAILQ_ADD(q_, op_)	do {	\
 		struct entry_ *e_;\
 		e_ = (struct entry_ *) malloc(sizeof(struct entry_));	\
-		e_->op = op_;	\
+		e_->op = (mio_op)malloc(sizeof(mio_op_s));	\
+		*(e_->op) = op_;	\
 		pthread_mutex_lock(&(q_->mutex) );	\
 		TAILQ_INSERT_TAIL(&(q_->head), e_, entries_);	\
 		pthread_mutex_unlock(&(q_->mutex) );\
-		OPQ_WAKEUP(q_);	\
+		OPQ_TAILQ_WAKEUP(q_);	\
 	} while(0)
 
+//copies the head op into *op_ (a mio_op)
+#define OPQ_TAILQ_POP(q_, op_) do{	\
+		struct entry_ *e_;				\
+		pthread_mutex_lock(&(q_->mutex) );	\
+		e_ = (q_->head.tqh_first);\
+		TAILQ_REMOVE(&(q_->head), (q_->head).tqh_first, entries_);\
+		pthread_mutex_unlock(&(q_->mutex) );\
+		*(op_) = *(e_->op);	\
+		free(e_->op);		\
+		free(e_);			\
+	} while(0)
+
+#ifdef USE_OPQ_RING
+typedef leveldb::MPSCRing<mio_op_s> opq_s;
+typedef opq_s *opq;
+
+#define OPQ_MALLOC	(new opq_s(OPQ_RING_SLOTS))
+#define OPQ_FREE(q_)	(delete (q_))
+#define OPQ_INIT(q_)	do {} while(0)
+#define OPQ_NONEMPTY(q_)	((q_)->NonEmpty())
+#define OPQ_WAIT(q_)	((q_)->WaitNonEmpty())
+#define OPQ_ADD(q_, op_)	((q_)->Push(op_))
+#define OPQ_POP(q_, op_)	((q_)->TryPop(op_))
+#else
+typedef opq_tailq_s opq_s;
+typedef opq_tailq opq;
+
+#define OPQ_MALLOC	OPQ_TAILQ_MALLOC
+#define OPQ_FREE(q_)	OPQ_TAILQ_FREE(q_)
+#define OPQ_INIT(q_)	OPQ_TAILQ_INIT(q_)
+#define OPQ_NONEMPTY(q_)	OPQ_TAILQ_NONEMPTY(q_)
+#define OPQ_WAIT(q_)	OPQ_TAILQ_WAIT(q_)
+#define OPQ_ADD(q_, op_)	OPQ_TAILQ_ADD(q_, op_)
+#define OPQ_POP(q_, op_)	OPQ_TAILQ_POP(q_, op_)
+#endif
+
+//ops are built on the stack and copied into the queue
+#define OPQ_NEW_OP(op_, type_)	\
+		mio_op_s op_;	\
+		memset(&op_, 0, sizeof(op_));	\
+		op_.type = type_
+
 #define OPQ_ADD_TRUNCATE(q_, fd_, size_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MTruncate;\
-		op_->fd = fd_;	\
-		op_->size = size_;	\
+		OPQ_NEW_OP(op_, MTruncate);	\
+		op_.fd = fd_;	\
+		op_.size = size_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
 #define OPQ_ADD_SYNC(q_, mfp_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MSync;\
-		op_->ptr1 = mfp_;	\
+		OPQ_NEW_OP(op_, MSync);	\
+		op_.ptr1 = mfp_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
 #define OPQ_ADD_BUF_SYNC(q_, buf_, size_, fd_, off_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MBufSync;\
-		op_->ptr1 = buf_;	\
-		op_->size = size_;\
-		op_->fd = fd_;		\
-		op_->offset = off_;	\
+		OPQ_NEW_OP(op_, MBufSync);	\
+		op_.ptr1 = buf_;	\
+		op_.size = size_;\
+		op_.fd = fd_;		\
+		op_.offset = off_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
 #define OPQ_ADD_CLOSE(q_, mfp_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MClose;	\
-		op_->ptr1 = mfp_;	\
+		OPQ_NEW_OP(op_, MClose);	\
+		op_.ptr1 = mfp_;	\
+		OPQ_ADD(q_, op_);	\
+	} while(0)
+
+#define OPQ_ADD_BUF_CLOSE(q_, fd_, number_)	do{	\
+		OPQ_NEW_OP(op_, MBufClose);	\
+		op_.fd = fd_;	\
+		op_.number = number_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
-#define OPQ_ADD_BUF_CLOSE(q_, fd_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MBufClose;\
-		op_->fd = fd_;	\
+//copies the closed file "fname_" (a new std::string) whole
+#define OPQ_ADD_COPY(q_, fname_, size_, number_)	do{	\
+		OPQ_NEW_OP(op_, MCopy);	\
+		op_.ptr1 = (void*)fname_;	\
+		op_.size = size_;	\
+		op_.number = number_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
 #define OPQ_ADD_DELETE(q_, fname_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MDelete;		\
-		op_->ptr1 = (void*)fname_;	\
+		OPQ_NEW_OP(op_, MDelete);	\
+		op_.ptr1 = (void*)fname_;	\
 		OPQ_ADD(q_, op_);		\
 	} while(0)
 
+//writes the malloc-ed "buf_" at "off_" of "fd_" and frees it, once the
+//table copies queued by "queued_by_" (0 for none) have landed
+#define OPQ_ADD_WRITE(q_, buf_, size_, fd_, off_, queued_by_)	do{	\
+		OPQ_NEW_OP(op_, MWrite);	\
+		op_.ptr1 = buf_;	\
+		op_.size = size_;	\
+		op_.fd = fd_;	\
+		op_.offset = off_;	\
+		op_.number = queued_by_;	\
+		OPQ_ADD(q_, op_);	\
+	} while(0)
+
+//renames the mirror file "src_" to "target_" (new std::strings); "fd_"
+//is the metadata copy open under "src_", -1 for none
+#define OPQ_ADD_RENAME(q_, src_, target_, fd_)	do{	\
+		OPQ_NEW_OP(op_, MRename);	\
+		op_.ptr1 = (void*)src_;	\
+		op_.ptr2 = (void*)target_;	\
+		op_.fd = fd_;	\
+		OPQ_ADD(q_, op_);	\
+	} while(0)
+
 #define OPQ_ADD_HALT(q_)	do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MHalt;		\
+		OPQ_NEW_OP(op_, MHalt);	\
 		OPQ_ADD(q_, op_);		\
 	} while(0)
 
 #define OPQ_ADD_APPEND(q_, mfp_, slice_)do{	\
-		mio_op op_ = (mio_op)malloc(sizeof(mio_op_s));	\
-		op_->type = MAppend;	\
-		op_->ptr1 = mfp_;	\
-		op_->ptr2 = (void *)slice_;	\
+		OPQ_NEW_OP(op_, MAppend);	\
+		op_.ptr1 = mfp_;	\
+		op_.ptr2 = (void *)slice_;	\
 		OPQ_ADD(q_, op_);	\
 	} while(0)
 
-#define OPQ_POP(q_, op_) do{	\
-		struct entry_ *e_;				\
-		pthread_mutex_lock(&(q_->mutex) );	\
-		e_ = (q_->head.tqh_first);\
-		TAILQ_REMOVE(&(q_->head), (q_->head).tqh_first, entries_);\
-		pthread_mutex_unlock(&(q_->mutex) );\
-		op_ = e_->op;	\
-		free(e_);			\
-	} while(0) //ToDo: free e_
-
-#define INIT_HELPER_AND_QUEUE(helper_, queue_)	\
-	do {										\
-		if (helper_ == NULL) {\
-			helper_ = (pthread_t *) malloc(sizeof(pthread_t));	\
-			queue_ = OPQ_MALLOC;\
-			OPQ_INIT(queue_);		\
-			pthread_create(helper_, NULL,  &mirrorCompactionHelper, queue_);	\
-			DEBUG_INFO2("INIT_HELPER", queue_);	\
-		}											\
-	} while (0)
-
 #endif  //MIRROR_LEVEL_H
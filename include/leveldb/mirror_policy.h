@@ -0,0 +1,45 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A mirrored database can be configured with a MirrorPolicy object that
+// decides which new table files get a mirror copy.  Tables that are
+// compacted away soon after they are written, typically those of the
+// first levels, are read little from the mirror and only add to its
+// write traffic.  Reads of a table without a copy go to the primary.
+//
+// Most people will want to use the builtin level policy (see
+// NewLevelMirrorPolicy() below).
+
+#ifndef STORAGE_LEVELDB_INCLUDE_MIRROR_POLICY_H_
+#define STORAGE_LEVELDB_INCLUDE_MIRROR_POLICY_H_
+
+#include <stdint.h>
+
+namespace leveldb {
+
+class MirrorPolicy {
+ public:
+  virtual ~MirrorPolicy();
+
+  // Return the name of this policy.
+  virtual const char* Name() const = 0;
+
+  // Return true if a table file about to be written at "level", expected
+  // to hold about "expected_size" bytes, should be copied to the mirror.
+  // Memtable flushes are asked as level-0 files.  The resync on open asks
+  // again for the live files, by the level they are at then and their
+  // size, so a table that moved to a mirrored level gets its copy later.
+  virtual bool ShouldMirror(int level, uint64_t expected_size) const = 0;
+};
+
+// Return a new mirror policy that mirrors the table files of "min_level"
+// and the levels below it, and none of the levels above.
+//
+// Callers must delete the result after any database that is using the
+// result has been closed.
+extern const MirrorPolicy* NewLevelMirrorPolicy(int min_level);
+
+}
+
+#endif  // STORAGE_LEVELDB_INCLUDE_MIRROR_POLICY_H_
@@ -6,6 +6,7 @@
 #define STORAGE_LEVELDB_INCLUDE_OPTIONS_H_
 
 #include <stddef.h>
+#include <string>
 
 namespace leveldb {
 
@@ -13,6 +14,7 @@ class Cache;
 class Comparator;
 class Env;
 class FilterPolicy;
+class MirrorPolicy;
 class Logger;
 class Snapshot;
 
@@ -27,6 +29,14 @@ enum CompressionType {
   kSnappyCompression = 0x1
 };
 
+// When a DB is mirrored, the block reads of a table file can be spread
+// across the primary and the mirror copy once the latter is complete.
+enum MirrorReadBalance {
+  kNoReadBalance = 0,       // Block reads go to the primary
+  kBalanceByFileNumber,     // Odd-numbered files read the mirror copy
+  kBalanceByLoad            // Each read goes to the less loaded device
+};
+
 // Options to control the behavior of a database (passed to DB::Open)
 struct Options {
   // -------------------
@@ -89,6 +99,53 @@ struct Options {
   // Default: 1000
   int max_open_files;
 
+  // Shape of the tree of levels.  Compactions into levels 0 and 1 cut
+  // their output into table files of target_file_size bytes, and into
+  // each level below into files target_file_size_multiplier times as
+  // large as the level above.  Level 1 holds up to level1_size bytes and
+  // each level below level_ratio times as many as the one above.
+  //
+  // Default: 2MB, 1, 10MB, 10
+  uint64_t target_file_size;
+  int target_file_size_multiplier;
+  uint64_t level1_size;
+  int level_ratio;
+
+  // Level 0 is bounded by its number of files instead.  Its compaction
+  // is started at level0_compaction_trigger files, writes are slowed
+  // down at level0_slowdown_writes_trigger and stopped at
+  // level0_stop_writes_trigger until it is compacted.
+  //
+  // Default: 2, 16, 32
+  int level0_compaction_trigger;
+  int level0_slowdown_writes_trigger;
+  int level0_stop_writes_trigger;
+
+  // Deepest level a compacted memtable is pushed to when it overlaps
+  // nothing on the way.  Pushing past level 0 avoids the relatively
+  // expensive level 0=>1 compactions and some MANIFEST writes; pushing
+  // all the way down wastes space if the same keys are written over and
+  // over.
+  //
+  // Default: 2
+  int max_mem_compact_level;
+
+  // Number of compactions that may run at once, in the Env's
+  // low-priority background threads.  Memtable flushes run in its
+  // high-priority ones, so they do not wait behind compactions.
+  //
+  // Default: 1
+  int max_background_compactions;
+
+  // Number of threads a large compaction is split across.  Each
+  // compacts a key range of its own, cut at the boundaries of input
+  // files, into tables of its own; the tables of all of them are
+  // installed at once.  A compaction is split into no more parts than
+  // it has output files' worth of input.
+  //
+  // Default: 1
+  int max_subcompactions;
+
   // Control over blocks (user data is stored in a set of blocks, and
   // a block is the unit of reading from disk).
 
@@ -135,6 +192,124 @@ struct Options {
   // Default: NULL
   const FilterPolicy* filter_policy;
 
+  // -------------------
+  // Parameters that affect mirroring of table files to a second device
+
+  // If non-empty, every table file is also written, in the background, to
+  // this directory (see Env::AttachMirror).  The directory should be
+  // private to this database.
+  // Default: "" (no mirror)
+  std::string mirror_path;
+
+  // If true, compactions read their inputs from the mirror copies, which
+  // leaves the primary device to the foreground reads and writes.
+  // Default: true
+  bool mirror_compaction_reads;
+
+  // Bit L set: point lookups and iterators read the level-L table files
+  // from their mirror copies.  Setting the bits of the deep levels keeps
+  // the upper levels, which take most reads, on the primary device and
+  // serves the cold bulk of the data from the mirror.
+  // Default: 0 (user reads stay on the primary)
+  int mirror_read_levels;
+
+  // If true, every table read picks whichever copy, primary or mirror,
+  // currently answers faster given the recent read latency and the reads
+  // outstanding on each device.  This overrides mirror_read_levels and
+  // mirror_compaction_reads.
+  // Default: false
+  bool mirror_read_routing;
+
+  // How the block reads of point lookups and iterators that are not
+  // sent to the mirror by the options above are spread across both
+  // copies.  Reading both devices roughly doubles the random-read rate
+  // of a pair of disks.  kBalanceByLoad sends each read to the device
+  // with the lower latency times outstanding reads.
+  // Default: kNoReadBalance
+  MirrorReadBalance mirror_read_balance;
+
+  // Number of threads writing to the mirror.  I/O for one file always
+  // goes through the same thread, in order.
+  // Default: 4
+  int mirror_helpers;
+
+  // Bytes of table data that may be queued for the mirror.  Past half of
+  // it, compaction output is slowed down; at the cap it waits for the
+  // mirror.  Zero means no cap.
+  // Default: 256MB
+  size_t mirror_queue_cap;
+
+  // Mirror lag, in bytes queued for the mirror, that compactions try to
+  // stay under.  Above it a compaction holds back before starting each
+  // new output file until the mirror catches up (for at most 100ms per
+  // file, and never while a memtable is waiting to be flushed), and new
+  // compactions read their inputs from the primary rather than from the
+  // busy mirror.  Zero disables both.
+  // Default: 64MB
+  size_t mirror_lag_target;
+
+  // Background I/O budgets, in bytes per second, that leave device time
+  // to foreground reads.  compaction_write_rate holds back compaction
+  // output on the primary; mirror_write_rate the helpers' writes to the
+  // mirror and mirror_delete_rate their unlinks of obsolete copies,
+  // counted by file size.  Memtable flushes are never held back.  Zero
+  // means no limit.
+  // Default: 0
+  uint64_t compaction_write_rate;
+  uint64_t mirror_write_rate;
+  uint64_t mirror_delete_rate;
+
+  // If non-NULL, only the new table files this policy picks by level and
+  // expected size are copied to the mirror; reads of the others go to
+  // the primary.  DB::WaitForMirror() does not wait for tables without
+  // a copy, but the "leveldb.mirrored-sequence" property does not pass
+  // the updates in them.  See leveldb/mirror_policy.h.
+  // Default: NULL (every table file is mirrored)
+  const MirrorPolicy* mirror_policy;
+
+  // If true, table files are written to the primary only and each is
+  // copied to the mirror whole once it is closed, by copy_file_range()
+  // or, when the mirror is on the same reflink-capable file system, by
+  // a FICLONE reflink.  This takes the second write and its 4MB buffers
+  // off the compaction path, at the cost of copies that land only after
+  // the file is complete.  If false, the mirror copy is written
+  // alongside the primary through the helpers' buffers.
+  // Default: false
+  bool mirror_copy_on_close;
+
+  // Threads that resync the mirror when the DB is opened: table copies
+  // that are missing or of the wrong size are copied again from the
+  // primary, and mirror files of tables the DB no longer has are
+  // deleted.  Zero skips the resync on open; DB::ResyncMirror() still
+  // runs one with a single thread.
+  // Default: 2
+  int mirror_resync_threads;
+
+  // Bytes per second a resync may copy; zero means no limit.
+  // Default: 64MB
+  uint64_t mirror_resync_rate;
+
+  // Bytes per second the mirror scrubber may read.  A minute after the
+  // DB is opened, and a minute after each pass, it verifies the block
+  // checksums of the mirror copies of the live table files; a copy that
+  // fails is quarantined and copied again from the primary.  Zero
+  // disables the scrubber.
+  // Default: 4MB
+  uint64_t mirror_scrub_rate;
+
+  // If true, the MANIFEST, CURRENT and log files are mirrored too, in
+  // the order they are written, so that a follower can open the mirror
+  // directory with DB::OpenAsFollower().  Metadata writes reach the
+  // mirror when the DB flushes them, not only when it syncs them.
+  // Default: false
+  bool mirror_metadata;
+
+  // Of a follower opened with DB::OpenAsFollower(): microseconds
+  // between the catch-ups its background thread runs.  Zero leaves
+  // catching up to DB::CatchUp().
+  // Default: 1000000
+  uint64_t follower_poll_micros;
+
   // Create an Options object with default values for all fields.
   Options();
 };
@@ -158,10 +333,19 @@ struct ReadOptions {
   // Default: NULL
   const Snapshot* snapshot;
 
+  // Number of data blocks an sstable iterator reads ahead of its position
+  // while moving forward, on a small pool of background I/O threads.
+  // Useful for long scans; point lookups and backward iteration do not
+  // read ahead.  Blocks read ahead go into the block cache only if
+  // fill_cache is set.
+  // Default: 0
+  int prefetch_blocks;
+
   ReadOptions()
       : verify_checksums(false),
         fill_cache(true),
-        snapshot(NULL) {
+        snapshot(NULL),
+        prefetch_blocks(0) {
   }
 };
 
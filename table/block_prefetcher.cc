@@ -0,0 +1,152 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "table/block_prefetcher.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "leveldb/iterator.h"
+#include "leveldb/mirror.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+BlockPrefetcher::BlockPrefetcher(int threads)
+    : work_cv_(&mu_),
+      done_cv_(&mu_),
+      shutting_down_(false) {
+  memset(&stats_, 0, sizeof(stats_));
+  for (int i = 0; i < threads; i++) {
+    pthread_t t;
+    int r = pthread_create(&t, NULL, &BlockPrefetcher::RunWrapper, this);
+    if (r != 0) {
+      fprintf(stderr, "pthread create: %s\n", strerror(r));
+      abort();
+    }
+    threads_.push_back(t);
+  }
+}
+
+BlockPrefetcher::~BlockPrefetcher() {
+  {
+    MutexLock l(&mu_);
+    assert(queue_.empty());
+    shutting_down_ = true;
+    work_cv_.SignalAll();
+  }
+  for (size_t i = 0; i < threads_.size(); i++) {
+    pthread_join(threads_[i], NULL);
+  }
+}
+
+static port::OnceType once = LEVELDB_ONCE_INIT;
+static BlockPrefetcher* default_prefetcher;
+
+static void InitDefaultPrefetcher() {
+  default_prefetcher = new BlockPrefetcher(HLSM_PREFETCH_THREADS);
+}
+
+BlockPrefetcher* BlockPrefetcher::Default() {
+  port::InitOnce(&once, InitDefaultPrefetcher);
+  return default_prefetcher;
+}
+
+BlockPrefetcher::Request* BlockPrefetcher::Submit(
+    BlockFunction function, void* arg, const ReadOptions& options,
+    const Slice& index_value, bool mirror) {
+  Request* r = new Request;
+  r->function = function;
+  r->arg = arg;
+  r->options = options;
+  r->index_value.assign(index_value.data(), index_value.size());
+  r->mirror = mirror;
+  r->state = kQueued;
+  r->result = NULL;
+
+  MutexLock l(&mu_);
+  stats_.submitted++;
+  queue_.push_back(r);
+  work_cv_.Signal();
+  return r;
+}
+
+Iterator* BlockPrefetcher::Wait(Request* r) {
+  mu_.Lock();
+  if (r->state == kQueued) {
+    // No thread got to it yet: read it here rather than queue behind others
+    queue_.erase(std::find(queue_.begin(), queue_.end(), r));
+    stats_.inline_reads++;
+    mu_.Unlock();
+    r->result = (*r->function)(r->arg, r->options, r->index_value, r->mirror);
+  } else {
+    if (r->state == kDone) {
+      stats_.ready++;
+    } else {
+      stats_.waited++;
+      while (r->state != kDone) {
+        done_cv_.Wait();
+      }
+    }
+    mu_.Unlock();
+  }
+  Iterator* result = r->result;
+  delete r;
+  return result;
+}
+
+void BlockPrefetcher::Cancel(Request* r) {
+  {
+    MutexLock l(&mu_);
+    stats_.cancelled++;
+    if (r->state == kQueued) {
+      queue_.erase(std::find(queue_.begin(), queue_.end(), r));
+    } else {
+      while (r->state != kDone) {
+        done_cv_.Wait();
+      }
+    }
+  }
+  delete r->result;
+  delete r;
+}
+
+void BlockPrefetcher::GetStats(Stats* stats) {
+  MutexLock l(&mu_);
+  *stats = stats_;
+}
+
+void BlockPrefetcher::Run() {
+  mu_.Lock();
+  while (true) {
+    while (queue_.empty() && !shutting_down_) {
+      work_cv_.Wait();
+    }
+    if (queue_.empty()) {
+      break;
+    }
+    Request* r = queue_.front();
+    queue_.pop_front();
+    r->state = kRunning;
+    mu_.Unlock();
+
+    Iterator* result = (*r->function)(r->arg, r->options, r->index_value,
+                                      r->mirror);
+
+    mu_.Lock();
+    r->result = result;
+    r->state = kDone;
+    done_cv_.SignalAll();
+  }
+  mu_.Unlock();
+}
+
+void* BlockPrefetcher::RunWrapper(void* arg) {
+  reinterpret_cast<BlockPrefetcher*>(arg)->Run();
+  return NULL;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,98 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// BlockPrefetcher is a small pool of I/O threads that turns index
+// entries into data block iterators ahead of a two-level iterator, so
+// that the blocks of a compaction input or a long scan are already read
+// (and, with fill_cache, inserted into the block cache) by the time the
+// iterator reaches them.  Callers park on a condition variable until
+// their block is ready; a request nobody has started yet is run by the
+// waiting caller itself.  Thread-safe.
+
+#ifndef STORAGE_LEVELDB_TABLE_BLOCK_PREFETCHER_H_
+#define STORAGE_LEVELDB_TABLE_BLOCK_PREFETCHER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "leveldb/options.h"
+#include "port/port.h"
+
+namespace leveldb {
+
+class Iterator;
+class Slice;
+
+class BlockPrefetcher {
+ public:
+  typedef Iterator* (*BlockFunction)(void*, const ReadOptions&, const Slice&,
+                                     const bool mirror);
+
+  struct Request {
+    BlockFunction function;
+    void* arg;
+    ReadOptions options;
+    std::string index_value;
+    bool mirror;
+    int state;                  // Protected by the prefetcher's mutex
+    Iterator* result;
+  };
+
+  struct Stats {
+    uint64_t submitted;         // Requests handed to Submit()
+    uint64_t ready;             // Wait() found the block already read
+    uint64_t waited;            // Wait() parked until a thread finished it
+    uint64_t inline_reads;      // Wait() read a block nobody had started
+    uint64_t cancelled;         // Requests dropped by Cancel()
+  };
+
+  // Start "threads" I/O threads.
+  explicit BlockPrefetcher(int threads);
+
+  // Waits for the threads to exit.  REQUIRES: no outstanding requests.
+  ~BlockPrefetcher();
+
+  // Returns the prefetcher shared by every iterator in the process.
+  // It is started on first use and never deleted.
+  static BlockPrefetcher* Default();
+
+  // Queue a call of (*function)(arg, options, index_value, mirror).
+  // "arg" must stay live until the request is waited for or cancelled.
+  Request* Submit(BlockFunction function, void* arg,
+                  const ReadOptions& options, const Slice& index_value,
+                  bool mirror);
+
+  // Return the iterator produced for "r", blocking until it is ready.
+  // The caller owns the result; "r" is deleted.
+  Iterator* Wait(Request* r);
+
+  // Drop "r" and whatever it produced.  "r" is deleted.
+  void Cancel(Request* r);
+
+  void GetStats(Stats* stats);
+
+ private:
+  enum { kQueued, kRunning, kDone };
+
+  void Run();
+  static void* RunWrapper(void* arg);
+
+  port::Mutex mu_;
+  port::CondVar work_cv_;
+  port::CondVar done_cv_;
+  std::deque<Request*> queue_;      // Protected by mu_
+  bool shutting_down_;              // Protected by mu_
+  Stats stats_;                     // Protected by mu_
+  std::vector<pthread_t> threads_;
+
+  // No copying allowed
+  BlockPrefetcher(const BlockPrefetcher&);
+  void operator=(const BlockPrefetcher&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_TABLE_BLOCK_PREFETCHER_H_
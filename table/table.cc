@@ -210,7 +210,8 @@ Iterator* Table::BlockReader(void* arg,
 Iterator* Table::NewIterator(const ReadOptions& options) const {
   return NewTwoLevelIterator(
       rep_->index_block->NewIterator(rep_->options.comparator),
-      &Table::BlockReader, const_cast<Table*>(this), options);
+      &Table::BlockReader, const_cast<Table*>(this), options, false,
+      options.prefetch_blocks);
 }
 
 Status Table::InternalGet(const ReadOptions& options, const Slice& k,
@@ -15,6 +15,7 @@
 #include "leveldb/table_builder.h"
 #include "table/block.h"
 #include "table/block_builder.h"
+#include "table/block_prefetcher.h"
 #include "table/format.h"
 #include "util/random.h"
 #include "util/testharness.h"
@@ -95,7 +96,7 @@ class StringSink: public WritableFile {
 
   virtual Status Close() { return Status::OK(); }
   virtual Status Flush() { return Status::OK(); }
-  virtual Status Sync() { return Status::OK(); }
+  virtual Status Sync(int flags) { return Status::OK(); }
 
   virtual Status Append(const Slice& data) {
     contents_.append(data.data(), data.size());
@@ -220,8 +221,9 @@ class BlockConstructor: public Constructor {
 
 class TableConstructor: public Constructor {
  public:
-  TableConstructor(const Comparator* cmp)
+  TableConstructor(const Comparator* cmp, int prefetch_blocks = 0)
       : Constructor(cmp),
+        prefetch_blocks_(prefetch_blocks),
         source_(NULL), table_(NULL) {
   }
   ~TableConstructor() {
@@ -251,7 +253,9 @@ class TableConstructor: public Constructor {
   }
 
   virtual Iterator* NewIterator() const {
-    return table_->NewIterator(ReadOptions());
+    ReadOptions options;
+    options.prefetch_blocks = prefetch_blocks_;
+    return table_->NewIterator(options);
   }
 
   uint64_t ApproximateOffsetOf(const Slice& key) const {
@@ -266,6 +270,7 @@ class TableConstructor: public Constructor {
     source_ = NULL;
   }
 
+  const int prefetch_blocks_;
   StringSource* source_;
   Table* table_;
 
@@ -398,6 +403,7 @@ class DBConstructor: public Constructor {
 
 enum TestType {
   TABLE_TEST,
+  PREFETCH_TABLE_TEST,
   BLOCK_TEST,
   MEMTABLE_TEST,
   DB_TEST
@@ -417,6 +423,10 @@ static const TestArgs kTestArgList[] = {
   { TABLE_TEST, true, 1 },
   { TABLE_TEST, true, 1024 },
 
+  // Restart interval does not matter for reading ahead
+  { PREFETCH_TABLE_TEST, false, 16 },
+  { PREFETCH_TABLE_TEST, true, 16 },
+
   { BLOCK_TEST, false, 16 },
   { BLOCK_TEST, false, 1 },
   { BLOCK_TEST, false, 1024 },
@@ -454,6 +464,9 @@ class Harness {
       case TABLE_TEST:
         constructor_ = new TableConstructor(options_.comparator);
         break;
+      case PREFETCH_TABLE_TEST:
+        constructor_ = new TableConstructor(options_.comparator, 3);
+        break;
       case BLOCK_TEST:
         constructor_ = new BlockConstructor(options_.comparator);
         break;
@@ -861,6 +874,50 @@ TEST(TableTest, ApproximateOffsetOfCompressed) {
   ASSERT_TRUE(Between(c.ApproximateOffsetOf("xyz"),    4000,   6000));
 }
 
+TEST(TableTest, PrefetchedScan) {
+  TableConstructor c(BytewiseComparator(), 4);
+  char buf[16];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(buf, sizeof(buf), "k%06d", i);
+    c.Add(buf, std::string(100, 'a' + (i % 26)));
+  }
+  std::vector<std::string> keys;
+  KVMap kvmap;
+  Options options;
+  options.block_size = 1024;
+  options.compression = kNoCompression;
+  c.Finish(options, &keys, &kvmap);
+
+  BlockPrefetcher::Stats before, after;
+  BlockPrefetcher::Default()->GetStats(&before);
+  Iterator* iter = c.NewIterator();
+  int n = 0;
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    ASSERT_EQ(keys[n], iter->key().ToString());
+    n++;
+  }
+  ASSERT_EQ(1000, n);
+  ASSERT_TRUE(iter->status().ok());
+  BlockPrefetcher::Default()->GetStats(&after);
+  const uint64_t read_ahead = after.submitted - before.submitted;
+  ASSERT_GT(read_ahead, 90);  // ~10 entries per 1KB block
+  ASSERT_EQ(read_ahead, (after.ready - before.ready) +
+                        (after.waited - before.waited) +
+                        (after.inline_reads - before.inline_reads));
+
+  // Turning around and dropping an iterator mid-scan cancel the read ahead
+  iter->Seek("k000500");
+  ASSERT_EQ("k000500", iter->key().ToString());
+  iter->Prev();
+  ASSERT_EQ("k000499", iter->key().ToString());
+  iter->Next();
+  iter->Next();
+  ASSERT_EQ("k000501", iter->key().ToString());
+  delete iter;
+  BlockPrefetcher::Default()->GetStats(&after);
+  ASSERT_GT(after.cancelled, before.cancelled);
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -2,21 +2,17 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
-#include <queue>
 #include "table/two_level_iterator.h"
 
+#include <deque>
 #include "leveldb/table.h"
 #include "table/block.h"
+#include "table/block_prefetcher.h"
 #include "table/format.h"
 #include "table/iterator_wrapper.h"
-#include "leveldb/mirror.h"
-#include "util/aio_wrapper.h"
 
 namespace leveldb {
 
-int AIOWrapper::prefetch_counter_(0);
-port::Mutex AIOWrapper::mu_;
-
 namespace {
 
 typedef Iterator* (*BlockFunction)(void*, const ReadOptions&, const Slice&, const bool mirror);
@@ -28,7 +24,8 @@ class TwoLevelIterator: public Iterator {
     BlockFunction block_function,
     void* arg,
     const ReadOptions& options,
-    bool mirror = false);
+    bool mirror,
+    int prefetch);
 
   virtual ~TwoLevelIterator();
 
@@ -68,8 +65,10 @@ class TwoLevelIterator: public Iterator {
   void SkipEmptyDataBlocksBackward();
   void SetDataIterator(Iterator* data_iter);
   void InitDataBlock();
-  void PrefetchDataBlock();
+  void Prefetch();
   void InitPrefetchedDataBlock();
+  void DropPrefetches();
+  void Resync();
 
   BlockFunction block_function_;
   void* arg_;
@@ -81,12 +80,14 @@ class TwoLevelIterator: public Iterator {
   // "index_value" passed to block_function_ to create the data_iter_.
   std::string data_block_handle_;
   bool mirror_;
-  bool prefetch_;
-	std::queue<Iterator*> prefetch_data_iter_;
-	std::queue<Slice> prefetch_handle_;
-	static const int max_prefetch_num_ = 2;
-	static const int max_op_before_prefetch_ = 1024;
-	int op_after_prefetch_;
+
+  // When reading ahead, index_iter_ sits on the last block handed to the
+  // prefetcher rather than on the block of data_iter_, and "pending_"
+  // holds the requests for the blocks after data_iter_ in index order.
+  const size_t prefetch_;             // Blocks to read ahead, 0 if none
+  BlockPrefetcher* prefetcher_;
+  std::deque<BlockPrefetcher::Request*> pending_;
+  bool ahead_;
 };
 
 TwoLevelIterator::TwoLevelIterator(
@@ -94,40 +95,44 @@ TwoLevelIterator::TwoLevelIterator(
     BlockFunction block_function,
     void* arg,
     const ReadOptions& options,
-    bool mirror)
+    bool mirror,
+    int prefetch)
     : block_function_(block_function),
       arg_(arg),
       options_(options),
       index_iter_(index_iter),
       data_iter_(NULL),
-			op_after_prefetch_(0),
       mirror_(mirror),
-			prefetch_(mirror && HLSM_CPREFETCH) {
+      prefetch_(prefetch > 0 ? prefetch : 0),
+      prefetcher_(prefetch > 0 ? BlockPrefetcher::Default() : NULL),
+      ahead_(false) {
 }
 
 TwoLevelIterator::~TwoLevelIterator() {
+  // Blocks still being read refer to arg_, which our cleanup may release
+  DropPrefetches();
 }
 
 void TwoLevelIterator::Seek(const Slice& target) {
+  DropPrefetches();
   index_iter_.Seek(target);
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.Seek(target);
+  Prefetch();
   SkipEmptyDataBlocksForward();
 }
 
 void TwoLevelIterator::SeekToFirst() {
+  DropPrefetches();
   index_iter_.SeekToFirst();
-	if (prefetch_)  {
-  	DEBUG_INFO("[Prefetch] SeekToFirst");
-		InitPrefetchedDataBlock();
-	} else
-  	InitDataBlock();
-
+  InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.SeekToFirst();
+  Prefetch();
   SkipEmptyDataBlocksForward();
 }
 
 void TwoLevelIterator::SeekToLast() {
+  DropPrefetches();
   index_iter_.SeekToLast();
   InitDataBlock();
   if (data_iter_.iter() != NULL) data_iter_.SeekToLast();
@@ -137,19 +142,12 @@ void TwoLevelIterator::SeekToLast() {
 void TwoLevelIterator::Next() {
   assert(Valid());
   data_iter_.Next();
-	if (prefetch_) {
-  	DEBUG_INFO("[Prefetch] Next");
-		op_after_prefetch_++;
-		if (op_after_prefetch_ > max_op_before_prefetch_) {
-			PrefetchDataBlock();
-			op_after_prefetch_ = 0;
-		}
-	}
   SkipEmptyDataBlocksForward();
 }
 
 void TwoLevelIterator::Prev() {
   assert(Valid());
+  if (ahead_) Resync();
   data_iter_.Prev();
   SkipEmptyDataBlocksBackward();
 }
@@ -157,24 +155,23 @@ void TwoLevelIterator::Prev() {
 
 void TwoLevelIterator::SkipEmptyDataBlocksForward() {
   while (data_iter_.iter() == NULL || !data_iter_.Valid()) {
-		if (prefetch_) {
-  		DEBUG_INFO("[Prefetch] SkipEmptyDataBlocksForward");
-			PrefetchDataBlock();
-			if (prefetch_handle_.size() == 0) {
-    	  SetDataIterator(NULL);
-    	  return;
-			}
-			InitPrefetchedDataBlock();
-		} else {
-    	// Move to next block
-    	if (!index_iter_.Valid()) {
-    	  SetDataIterator(NULL);
-    	  return;
-    	}
-    	index_iter_.Next();
-    	InitDataBlock();
-		}
-
+    if (ahead_) {
+      // Prefetch() keeps pending_ full until index_iter_ runs out
+      if (pending_.empty()) {
+        SetDataIterator(NULL);
+        return;
+      }
+      InitPrefetchedDataBlock();
+    } else {
+      // Move to next block
+      if (!index_iter_.Valid()) {
+        SetDataIterator(NULL);
+        return;
+      }
+      index_iter_.Next();
+      InitDataBlock();
+      Prefetch();  // Read ahead again after having turned around
+    }
     if (data_iter_.iter() != NULL) data_iter_.SeekToFirst();
   }
 }
@@ -213,38 +210,40 @@ void TwoLevelIterator::InitDataBlock() {
   }
 }
 
+// Hand the blocks after the current one to the prefetcher until
+// prefetch_ of them are outstanding.
+void TwoLevelIterator::Prefetch() {
+  if (prefetch_ == 0) return;
+  ahead_ = true;
+  while (pending_.size() < prefetch_ && index_iter_.Valid()) {
+    index_iter_.Next();
+    if (index_iter_.Valid()) {
+      pending_.push_back(prefetcher_->Submit(
+          block_function_, arg_, options_, index_iter_.value(), mirror_));
+    }
+  }
+}
+
 void TwoLevelIterator::InitPrefetchedDataBlock() {
-	PrefetchDataBlock();
-	if (prefetch_handle_.size() == 0)
-    SetDataIterator(NULL);
-	else {
-    Slice handle = prefetch_handle_.front();
-    if (data_iter_.iter() != NULL && handle.compare(data_block_handle_) == 0) {
-			// data_iter_ is already constructed
-		} else {
-			prefetch_handle_.pop();
-			data_block_handle_.assign(handle.data(), handle.size());
-			SetDataIterator(prefetch_data_iter_.front());
-			prefetch_data_iter_.pop();
-		}
-	}
+  BlockPrefetcher::Request* r = pending_.front();
+  pending_.pop_front();
+  data_block_handle_ = r->index_value;
+  SetDataIterator(prefetcher_->Wait(r));
+  Prefetch();
 }
-		
 
-void TwoLevelIterator::PrefetchDataBlock() {
-	if (!prefetch_) return;
-	while ( AIOWrapper::getPrefetchingNum() < max_prefetch_num_ && index_iter_.Valid() ) {
-		index_iter_.Next();
-		
-  	if (index_iter_.Valid()) {
-    	Slice handle = index_iter_.value();
-			DEBUG_INFO(handle.data());
-      Iterator* iter = (*block_function_)(arg_, options_, handle, mirror_);
-			prefetch_handle_.push(handle);
-			prefetch_data_iter_.push(iter);
-    }
+void TwoLevelIterator::DropPrefetches() {
+  for (size_t i = 0; i < pending_.size(); i++) {
+    prefetcher_->Cancel(pending_[i]);
   }
+  pending_.clear();
+  ahead_ = false;
+}
 
+// Put index_iter_ back on the block of data_iter_ before moving backward.
+void TwoLevelIterator::Resync() {
+  DropPrefetches();
+  index_iter_.Seek(data_iter_.key());
 }
 
 }  // namespace
@@ -254,8 +253,10 @@ Iterator* NewTwoLevelIterator(
     BlockFunction block_function,
     void* arg,
     const ReadOptions& options,
-    const bool mirror) {
-  return new TwoLevelIterator(index_iter, block_function, arg, options, mirror);
+    const bool mirror,
+    int prefetch) {
+  return new TwoLevelIterator(index_iter, block_function, arg, options, mirror,
+                              prefetch);
 }
 
 }  // namespace leveldb
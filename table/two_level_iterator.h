@@ -20,6 +20,10 @@ struct ReadOptions;
 //
 // Uses a supplied function to convert an index_iter value into
 // an iterator over the contents of the corresponding block.
+//
+// If "prefetch" is positive, forward iteration keeps that many of the
+// following blocks being read by BlockPrefetcher::Default(), so
+// block_function must be safe to call from other threads.
 extern Iterator* NewTwoLevelIterator(
     Iterator* index_iter,
     Iterator* (*block_function)(
@@ -29,7 +33,8 @@ extern Iterator* NewTwoLevelIterator(
         const bool mirror),
     void* arg,
     const ReadOptions& options,
-    bool mirror = false);
+    bool mirror = false,
+    int prefetch = 0);
 
 }  // namespace leveldb
 
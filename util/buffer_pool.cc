@@ -0,0 +1,102 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/buffer_pool.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+AlignedBufferPool::AlignedBufferPool(size_t buffer_size, size_t alignment,
+                                     int max_free, bool huge_pages)
+    : buffer_size_(buffer_size),
+      alignment_(alignment),
+      max_free_(max_free > 0 ? max_free : 0),
+      huge_pages_(huge_pages) {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  // Buffers still handed out are leaked rather than freed under a user
+  for (size_t i = 0; i < free_.size(); i++) {
+    DeleteBuffer(free_[i]);
+  }
+}
+
+char* AlignedBufferPool::Allocate() {
+  {
+    MutexLock l(&mu_);
+    stats_.in_use++;
+    if (stats_.in_use > stats_.peak_in_use) {
+      stats_.peak_in_use = stats_.in_use;
+    }
+    if (!free_.empty()) {
+      char* buf = free_.back();
+      free_.pop_back();
+      stats_.hits++;
+      stats_.free = free_.size();
+      return buf;
+    }
+    stats_.misses++;
+  }
+  return NewBuffer();
+}
+
+void AlignedBufferPool::Release(char* buf) {
+  {
+    MutexLock l(&mu_);
+    stats_.in_use--;
+    if (free_.size() < max_free_) {
+      free_.push_back(buf);
+      stats_.free = free_.size();
+      return;
+    }
+  }
+  DeleteBuffer(buf);
+}
+
+void AlignedBufferPool::GetStats(Stats* stats) {
+  MutexLock l(&mu_);
+  *stats = stats_;
+}
+
+char* AlignedBufferPool::NewBuffer() {
+#if defined(MAP_HUGETLB)
+  if (huge_pages_) {
+    void* p = mmap(NULL, buffer_size_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      char* buf = reinterpret_cast<char*>(p);
+      MutexLock l(&mu_);
+      huge_buffers_.insert(buf);
+      stats_.huge_pages++;
+      return buf;
+    }
+    // No huge pages reserved; fall through to the heap
+  }
+#endif
+  return reinterpret_cast<char*>(memalign(alignment_, buffer_size_));
+}
+
+void AlignedBufferPool::DeleteBuffer(char* buf) {
+  bool huge = false;
+  if (huge_pages_) {
+    MutexLock l(&mu_);
+    if (huge_buffers_.erase(buf) > 0) {
+      huge = true;
+      stats_.huge_pages--;
+    }
+  }
+  if (huge) {
+    munmap(buf, buffer_size_);
+  } else {
+    free(buf);
+  }
+}
+
+}  // namespace leveldb
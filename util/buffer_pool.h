@@ -0,0 +1,71 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// AlignedBufferPool hands out fixed-size, aligned buffers and keeps
+// released ones for reuse, so that writers producing large I/O buffers
+// at a high rate do not go through memalign()/free() (and glibc's
+// mmap/munmap) for every buffer.  Buffers may optionally be backed by
+// huge pages; if those cannot be mapped the pool falls back to
+// memalign().  Thread-safe.
+
+#ifndef STORAGE_LEVELDB_UTIL_BUFFER_POOL_H_
+#define STORAGE_LEVELDB_UTIL_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <set>
+#include <vector>
+#include "port/port.h"
+
+namespace leveldb {
+
+class AlignedBufferPool {
+ public:
+  struct Stats {
+    uint64_t hits;          // Allocate() served from the free list
+    uint64_t misses;        // Allocate() that had to allocate
+    uint64_t in_use;        // Buffers currently handed out
+    uint64_t peak_in_use;   // Highest value of in_use
+    uint64_t free;          // Buffers kept for reuse
+    uint64_t huge_pages;    // Buffers backed by huge pages
+  };
+
+  // Create a pool of "buffer_size"-byte buffers aligned to "alignment".
+  // At most "max_free" released buffers are kept; extra ones are freed.
+  AlignedBufferPool(size_t buffer_size, size_t alignment, int max_free,
+                    bool huge_pages);
+  ~AlignedBufferPool();
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  // Return a buffer of buffer_size() bytes.
+  char* Allocate();
+
+  // Give back a buffer obtained from Allocate().
+  void Release(char* buf);
+
+  void GetStats(Stats* stats);
+
+ private:
+  char* NewBuffer();
+  void DeleteBuffer(char* buf);
+
+  const size_t buffer_size_;
+  const size_t alignment_;
+  const size_t max_free_;
+  const bool huge_pages_;
+
+  port::Mutex mu_;
+  std::vector<char*> free_;          // Protected by mu_
+  std::set<char*> huge_buffers_;     // Protected by mu_
+  Stats stats_;                      // Protected by mu_
+
+  // No copying allowed
+  AlignedBufferPool(const AlignedBufferPool&);
+  void operator=(const AlignedBufferPool&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_BUFFER_POOL_H_
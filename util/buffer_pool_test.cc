@@ -0,0 +1,77 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/buffer_pool.h"
+
+#include <stdint.h>
+#include <string.h>
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class BufferPoolTest { };
+
+TEST(BufferPoolTest, Alignment) {
+  AlignedBufferPool pool(1 << 20, 4096, 2, false);
+  ASSERT_EQ(1 << 20, pool.buffer_size());
+  char* a = pool.Allocate();
+  char* b = pool.Allocate();
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(a) % 4096);
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(b) % 4096);
+  memset(a, 'a', pool.buffer_size());
+  memset(b, 'b', pool.buffer_size());
+  pool.Release(a);
+  pool.Release(b);
+}
+
+TEST(BufferPoolTest, Reuse) {
+  AlignedBufferPool pool(64 << 10, 4096, 2, false);
+  AlignedBufferPool::Stats stats;
+
+  char* a = pool.Allocate();
+  char* b = pool.Allocate();
+  char* c = pool.Allocate();
+  pool.GetStats(&stats);
+  ASSERT_EQ(0, stats.hits);
+  ASSERT_EQ(3, stats.misses);
+  ASSERT_EQ(3, stats.in_use);
+  ASSERT_EQ(3, stats.peak_in_use);
+
+  // Only two released buffers are kept
+  pool.Release(a);
+  pool.Release(b);
+  pool.Release(c);
+  pool.GetStats(&stats);
+  ASSERT_EQ(0, stats.in_use);
+  ASSERT_EQ(2, stats.free);
+
+  char* d = pool.Allocate();
+  ASSERT_TRUE(d == a || d == b);
+  pool.GetStats(&stats);
+  ASSERT_EQ(1, stats.hits);
+  ASSERT_EQ(1, stats.free);
+  ASSERT_EQ(3, stats.peak_in_use);
+  pool.Release(d);
+}
+
+TEST(BufferPoolTest, HugePagesFallBack) {
+  // Works whether or not huge pages are reserved on this machine
+  AlignedBufferPool pool(2 << 20, 4096, 1, true);
+  char* a = pool.Allocate();
+  ASSERT_TRUE(a != NULL);
+  ASSERT_EQ(0, reinterpret_cast<uintptr_t>(a) % 4096);
+  memset(a, 'x', pool.buffer_size());
+  pool.Release(a);
+  char* b = pool.Allocate();
+  ASSERT_TRUE(b == a);
+  char* c = pool.Allocate();
+  pool.Release(b);
+  pool.Release(c);
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
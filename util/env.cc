@@ -4,11 +4,23 @@
 
 #include "leveldb/env.h"
 
+#include "leveldb/mirror.h"
+
 namespace leveldb {
 
 Env::~Env() {
 }
 
+Status Env::AttachMirror(const std::string& dbname, const Options& options,
+                         MirrorContext** result) {
+  *result = NULL;
+  return Status::NotSupported("table file mirroring", dbname);
+}
+
+void Env::DetachMirror(MirrorContext* mirror) {
+  delete mirror;
+}
+
 SequentialFile::~SequentialFile() {
 }
 
@@ -3,11 +3,13 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include <deque>
+#include <map>
 #include <set>
 #include <string>
 #include <iostream>
 #include <cstring>
 
+#include <aio.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -19,25 +21,25 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #if defined(LEVELDB_PLATFORM_ANDROID)
 #include <sys/stat.h>
 #endif
 #include "leveldb/env.h"
+#include "leveldb/options.h"
 #include "leveldb/slice.h"
 #include "port/port.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
 #include "util/posix_logger.h"
 #include "leveldb/mirror.h"
-#include "util/aio_wrapper.h"
+#include "util/buffer_pool.h"
+#include "util/rate_limiter.h"
+#include "util/uring_writer.h"
 
 namespace leveldb {
-pthread_t *mirror_helper = NULL;//for compaction
-opq mio_queue = NULL;		//for helper
-
-uint32_t FileNameHash::hash[] = {0};
 
 namespace {
 
@@ -50,6 +52,134 @@ static size_t Roundup(size_t x, size_t y) {
   return ((x + y - 1) / y) * y;
 }
 
+static uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Accounts the bytes of mirror buffers handed to the helpers and slows
+// down writers that get too far ahead of the secondary device.  A cap
+// of 0 disables throttling.
+class MirrorThrottle {
+ public:
+  explicit MirrorThrottle(uint64_t cap)
+      : cap_(cap), cv_(&mu_), inflight_(0), peak_(0),
+        slowdowns_(0), stalls_(0), stall_micros_(0),
+        pace_waits_(0), pace_micros_(0) { }
+
+  // Called before a buffer of n bytes is queued.
+  void Charge(size_t n) {
+    MutexLock l(&mu_);
+    inflight_ += n;
+    if (inflight_ > peak_) peak_ = inflight_;
+  }
+
+  // Called by the helper once a buffer of n bytes has been written.
+  void Release(size_t n) {
+    MutexLock l(&mu_);
+    inflight_ -= n;
+    cv_.SignalAll();
+  }
+
+  // Called by the writer after queueing a buffer.  Works like the L0
+  // slowdown/stop in DBImpl::MakeRoomForWrite.
+  void Throttle() {
+    const uint64_t cap = cap_;
+    if (cap == 0) return;
+    bool slowdown = false;
+    {
+      MutexLock l(&mu_);
+      if (inflight_ >= cap) {
+        stalls_++;
+        const uint64_t start = NowMicros();
+        while (inflight_ >= cap) {
+          cv_.Wait();
+        }
+        stall_micros_ += NowMicros() - start;
+      } else if (inflight_ >= cap / 2) {
+        slowdowns_++;
+        slowdown = true;
+      }
+    }
+    if (slowdown) {
+      // Delay this buffer by 1ms rather than the whole compaction later
+      usleep(1000);
+    }
+  }
+
+  uint64_t Inflight() {
+    MutexLock l(&mu_);
+    return inflight_;
+  }
+
+  // Called by compactions between output files to let the mirror catch
+  // up.  Polls like the 1ms slowdown so that it can give up on time.
+  bool WaitBelow(uint64_t target, uint64_t max_wait_micros) {
+    if (Inflight() <= target) return true;
+    const uint64_t start = NowMicros();
+    uint64_t waited = 0;
+    bool below = false;
+    while (!below && waited < max_wait_micros) {
+      usleep(1000);
+      below = (Inflight() <= target);
+      waited = NowMicros() - start;
+    }
+    MutexLock l(&mu_);
+    pace_waits_++;
+    pace_micros_ += waited;
+    return below;
+  }
+
+  void GetStats(MirrorQueueStats* stats) {
+    MutexLock l(&mu_);
+    stats->inflight_bytes = inflight_;
+    stats->peak_bytes = peak_;
+    stats->cap_bytes = cap_;
+    stats->slowdowns = slowdowns_;
+    stats->stalls = stalls_;
+    stats->stall_micros = stall_micros_;
+    stats->pace_waits = pace_waits_;
+    stats->pace_micros = pace_micros_;
+  }
+
+ private:
+  const uint64_t cap_;
+  port::Mutex mu_;
+  port::CondVar cv_;
+  uint64_t inflight_;
+  uint64_t peak_;
+  uint64_t slowdowns_;
+  uint64_t stalls_;
+  uint64_t stall_micros_;
+  uint64_t pace_waits_;
+  uint64_t pace_micros_;
+};
+
+// Process-wide pool of the aligned buffers PosixBufferFile_ fills and
+// the helpers write out.
+static pthread_once_t mirror_buffers_once = PTHREAD_ONCE_INIT;
+static AlignedBufferPool* mirror_buffers = NULL;
+
+static void InitMirrorBuffers() {
+  mirror_buffers = new AlignedBufferPool(MIRROR_BUFFER_SIZE, BLKSIZE,
+                                         MIRROR_POOL_BUFFERS,
+                                         MIRROR_HUGE_PAGES != 0);
+}
+
+static AlignedBufferPool* MirrorBuffers() {
+  pthread_once(&mirror_buffers_once, &InitMirrorBuffers);
+  return mirror_buffers;
+}
+
+// Called by the helpers once a buffer has been written; also the
+// completion callback of their io_uring writers.  "arg" is the
+// MirrorThrottle the buffer was charged to.
+static void MirrorBufferDone(void* arg, char* buf, size_t size) {
+  MirrorBuffers()->Release(buf);
+  reinterpret_cast<MirrorThrottle*>(arg)->Release(size);
+}
+
 class PosixSequentialFile: public SequentialFile {
  private:
   std::string filename_;
@@ -111,6 +241,174 @@ class PosixRandomAccessFile: public RandomAccessFile {
   }
 };
 
+// Streams a file that is scanned front to back, e.g. a compaction input
+// read from the mirror, through two aligned readahead windows: while the
+// caller consumes one window the next one is read with aio_read().  The
+// file is opened with O_DIRECT where the file system allows it, so the
+// scan neither fills nor evicts the page cache.  Memory stays at two
+// windows per open file, and the first block is available as soon as
+// its window has been read.
+class PosixReadaheadFile: public RandomAccessFile {
+ private:
+  std::string filename_;
+  int fd_;
+  uint64_t size_;
+  size_t window_;         // Bytes per window, a BLKSIZE multiple
+
+  struct Window {
+    char* buf;
+    uint64_t start;       // File offset of buf[0]
+    size_t len;           // Valid bytes once the read completed
+    bool valid;
+    bool pending;         // aio_read in flight
+    struct aiocb cb;
+  };
+
+  port::Mutex mu_;
+  mutable Window w_[2];   // Protected by mu_
+  mutable int last_;      // Window of the last read, protected by mu_
+
+  // Start reading the window at "start" into w_[i].
+  Status Fill(int i, uint64_t start) const {
+    Complete(i);  // The buffer may still be the target of a read
+    Window* w = &w_[i];
+    w->start = start;
+    w->valid = false;
+    w->pending = false;
+    memset(&w->cb, 0, sizeof(w->cb));
+    w->cb.aio_fildes = fd_;
+    w->cb.aio_buf = w->buf;
+    w->cb.aio_nbytes = window_;   // Short read at EOF
+    w->cb.aio_offset = start;
+    if (aio_read(&w->cb) != 0) {
+      return IOError(filename_, errno);
+    }
+    w->pending = true;
+    return Status::OK();
+  }
+
+  // Read the window at "start" into w_[i] in the calling thread, for
+  // when its aio_read() could not be started or failed.
+  Status FillSync(int i, uint64_t start) const {
+    Complete(i);
+    Window* w = &w_[i];
+    w->start = start;
+    w->valid = false;
+    w->pending = false;
+    ssize_t r;
+    do {
+      r = pread(fd_, w->buf, window_, start);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+      return IOError(filename_, errno);
+    }
+    w->len = r;
+    w->valid = true;
+    return Status::OK();
+  }
+
+  // Wait for the read of w_[i] to complete.
+  Status Complete(int i) const {
+    Window* w = &w_[i];
+    if (!w->pending) {
+      return Status::OK();
+    }
+    const struct aiocb* list[1] = { &w->cb };
+    int err;
+    while ((err = aio_error(&w->cb)) == EINPROGRESS) {
+      aio_suspend(list, 1, NULL);
+    }
+    const ssize_t r = aio_return(&w->cb);
+    w->pending = false;
+    if (err != 0 || r < 0) {
+      return IOError(filename_, err != 0 ? err : EIO);
+    }
+    w->len = r;
+    w->valid = true;
+    return Status::OK();
+  }
+
+  bool Covers(int i, uint64_t pos) const {
+    return (w_[i].pending || w_[i].valid) && pos >= w_[i].start &&
+           pos < w_[i].start + window_;
+  }
+
+ public:
+  PosixReadaheadFile(const std::string& fname, int fd, uint64_t size,
+                     size_t window)
+      : filename_(fname), fd_(fd), size_(size),
+        window_(Roundup(window, BLKSIZE)), last_(0) {
+    for (int i = 0; i < 2; i++) {
+      w_[i].buf = reinterpret_cast<char*>(memalign(BLKSIZE, window_));
+      w_[i].valid = false;
+      w_[i].pending = false;
+    }
+    DEBUG_INFO2(fname, window_);
+  }
+
+  virtual ~PosixReadaheadFile() {
+    for (int i = 0; i < 2; i++) {
+      Complete(i);
+      free(w_[i].buf);
+    }
+    close(fd_);
+  }
+
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    MutexLock l(const_cast<port::Mutex*>(&mu_));
+    Status s;
+    if (offset + n > size_) {
+      *result = Slice();
+      return IOError(filename_, EINVAL);
+    }
+
+    // Windows are reused, so the data is always copied to scratch
+    size_t copied = 0;
+    while (s.ok() && copied < n) {
+      const uint64_t pos = offset + copied;
+      int i;
+      if (Covers(last_, pos)) {
+        i = last_;
+      } else if (Covers(1 - last_, pos)) {
+        i = 1 - last_;
+      } else {
+        // Miss: read the window holding pos into the older window
+        i = 1 - last_;
+        s = Fill(i, pos - pos % window_);
+        if (!s.ok()) {
+          s = FillSync(i, pos - pos % window_);
+        }
+      }
+      if (s.ok() && !Complete(i).ok()) {
+        s = FillSync(i, w_[i].start);
+      }
+      if (!s.ok()) {
+        break;
+      }
+      const Window& w = w_[i];
+      if (pos >= w.start + w.len) {
+        s = IOError(filename_, EIO);  // File shrank under us
+        break;
+      }
+      const size_t avail = w.start + w.len - pos;
+      const size_t k = (n - copied < avail) ? n - copied : avail;
+      memcpy(scratch + copied, w.buf + (pos - w.start), k);
+      copied += k;
+
+      // Keep the window after this one on its way
+      const uint64_t next = w.start + window_;
+      last_ = i;
+      if (next < size_ && !Covers(1 - i, next)) {
+        // Only a hint: a window that fails to start is read on its miss
+        Fill(1 - i, next);
+      }
+    }
+    *result = s.ok() ? Slice(scratch, n) : Slice();
+    return s;
+  }
+};
+
 // Helper class to limit mmap file usage so that we do not end up
 // running out virtual memory or running into kernel performance
 // problems for very large databases.
@@ -167,15 +465,14 @@ class PosixMmapReadableFile: public RandomAccessFile {
   void* mmapped_region_;
   size_t length_;
   MmapLimiter* limiter_;
-  bool prefetch_;
-	AIOWrapper* awp_;
+  bool prefetch_;          // Region was read into malloc()ed memory
 
  public:
   // base[0,length-1] contains the mmapped contents of the file.
   PosixMmapReadableFile(const std::string& fname, void* base, size_t length,
-                        MmapLimiter* limiter, bool prefetch = false, AIOWrapper* awp = NULL)
+                        MmapLimiter* limiter, bool prefetch = false)
       : filename_(fname), mmapped_region_(base), length_(length),
-        limiter_(limiter), prefetch_(prefetch), awp_(awp) {
+        limiter_(limiter), prefetch_(prefetch) {
     DEBUG_INFO(fname);
   }
 
@@ -185,16 +482,12 @@ class PosixMmapReadableFile: public RandomAccessFile {
 	} else {
    		munmap(mmapped_region_, length_);
 	}
-	if (awp_) delete awp_;
 	limiter_->Release();
   }
 
   virtual Status Read(uint64_t offset, size_t n, Slice* result,
                       char* scratch) const {
     DEBUG_INFO3(filename_, offset, n);
-		if (prefetch_ && awp_ != NULL && !(awp_->isFinished()) )
-			awp_->wait();
-
     Status s;
     if (offset + n > length_) {
       *result = Slice();
@@ -213,30 +506,39 @@ class PosixBufferFile_ : public WritableFile {
 	int buffer_size_; 
   std::string filename_;
   int fd_;
+  opq queue_;             // Helper queue that owns this file
+  MirrorThrottle* throttle_;
+  MirrorContext* mirror_;
+  uint64_t number_;       // Table file number, 0 if not tracked
   char* base_;            // The mapped region
   char* limit_;           // Limit of the mapped region
   char* dst_;             // Where to write next  (in range [base_,limit_])
   uint64_t file_offset_;  // Offset of base_ in file
 
  public:
-  PosixBufferFile_(const std::string& fname, int fd)
+  PosixBufferFile_(const std::string& fname, int fd, opq queue,
+                   MirrorThrottle* throttle, MirrorContext* mirror)
       : filename_(fname),
         fd_(fd),
+        queue_(queue),
+        throttle_(throttle),
+        mirror_(mirror),
+        number_(0),
         limit_(NULL),
         dst_(NULL),
         file_offset_(0) {
-		buffer_size_ = 4<<20;
-		base_ = (char*) memalign(BLKSIZE,buffer_size_); 
+		buffer_size_ = MIRROR_BUFFER_SIZE;
+		base_ = MirrorBuffers()->Allocate();
 		dst_ = base_;
 		limit_ = base_ + buffer_size_;
     DEBUG_INFO2(fname, fd);
-		FileNameHash::add(filename_);
+		if (MirrorContext::TableFileNumber(filename_, &number_))
+			mirror_->CopyStarted(number_);
   }
 
 
   ~PosixBufferFile_() {
     if (fd_ >= 0) {
-			FileNameHash::drop(filename_);
       PosixBufferFile_::Close();
     }
   }
@@ -250,9 +552,11 @@ class PosixBufferFile_ : public WritableFile {
       assert(dst_ <= limit_);
       size_t avail = limit_ - dst_;
       if (avail == 0) {
-				OPQ_ADD_BUF_SYNC(mio_queue, base_, dst_-base_, fd_, file_offset_);		
+				throttle_->Charge(dst_-base_);
+				OPQ_ADD_BUF_SYNC(queue_, base_, dst_-base_, fd_, file_offset_);		
+				throttle_->Throttle();
 				file_offset_ += limit_ - base_;
-				base_ = (char*) memalign(BLKSIZE,buffer_size_); 
+				base_ = MirrorBuffers()->Allocate();
 				dst_ = base_;
 				limit_ = base_ + buffer_size_;
       }
@@ -269,9 +573,12 @@ class PosixBufferFile_ : public WritableFile {
 
   virtual Status Close() {
     Status s;
-		OPQ_ADD_BUF_SYNC(mio_queue, base_, Roundup(dst_-base_, BLKSIZE), fd_, file_offset_);		
-		OPQ_ADD_TRUNCATE(mio_queue, fd_, file_offset_ + dst_-base_);
-		OPQ_ADD_BUF_CLOSE(mio_queue, fd_);
+		throttle_->Charge(Roundup(dst_-base_, BLKSIZE));
+		OPQ_ADD_BUF_SYNC(queue_, base_, Roundup(dst_-base_, BLKSIZE), fd_, file_offset_);		
+		OPQ_ADD_TRUNCATE(queue_, fd_, file_offset_ + dst_-base_);
+		if (number_ != 0) mirror_->CopyQueued(number_);
+		OPQ_ADD_BUF_CLOSE(queue_, fd_, number_);
+		throttle_->Throttle();
 
     fd_ = -1;
     base_ = NULL;
@@ -284,7 +591,7 @@ class PosixBufferFile_ : public WritableFile {
   }
 
   virtual Status Sync(int flags) {
-
+    //the helper fdatasync()s the copy when it closes it
     return Status::OK();
   }
 };
@@ -469,18 +776,124 @@ class PosixMmapFile_ : public WritableFile {
   }
 };
 
+// A mirror helper thread and the queue it drains
+struct MirrorHelper {
+	pthread_t thread;
+	opq queue;
+	MirrorThrottle* throttle;	//charged for the buffers in queue
+	MirrorContext* mirror;
+	RateLimiter* write_limiter;	//NULL without Options::mirror_write_rate
+	RateLimiter* delete_limiter;	//NULL without Options::mirror_delete_rate
+	uint64_t write_calls;		//updated atomically, see MirrorQueueStats
+	uint64_t buffers_written;
+	uint64_t files_copied;
+	uint64_t files_cloned;
+	uint64_t metadata_failures;
+	uint64_t metadata_wait_timeouts;
+	Logger* info_log;		//the DB's, for metadata trouble
+};
+
+//Writes iov[0,cnt) at "offset" of "fd" with as few pwritev()s as it takes.
+//Returns false if a pwritev() failed, leaving the copy incomplete.
+static bool mirrorWriteV(int fd, struct iovec* iov, int cnt, uint64_t offset) {
+	while (cnt > 0) {
+		ssize_t ret = pwritev(fd, iov, cnt, offset);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) continue;
+			DEBUG_INFO3("pwritev", fd, errno);
+			return false;
+		}
+		offset += ret;
+		while (cnt > 0 && (size_t) ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char*) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return true;
+}
+
+//Writes the run of MBufSync ops ops[0,n): one file, adjacent offsets.
+//"tail" is set when the file's truncate or close follows the run; its
+//writes have to land before that anyway, so they are not worth handing
+//to io_uring and are written right here instead.  Returns false if a
+//write made here failed; io_uring failures are left to URingWriter.
+static bool mirrorWriteRun(MirrorHelper* helper, URingWriter* uring,
+                           bool use_uring, mio_op ops, int n, bool tail) {
+	if (helper->write_limiter != NULL) {
+		uint64_t bytes = 0;
+		for (int i = 0; i < n; i++) bytes += ops[i].size;
+		helper->write_limiter->Request(bytes);
+	}
+	for (int i = 0; i < n; i++) {
+		helper->mirror->ChargeIO(MBufSync, ops[i].fd, ops[i].offset, ops[i].size);
+	}
+	bool ok = true;
+	if (use_uring && !tail) {
+		for (int i = 0; i < n; i++) {
+			uring->Write(ops[i].fd, (char*) ops[i].ptr1, ops[i].size, ops[i].offset);	//freed on completion
+		}
+		__atomic_fetch_add(&helper->write_calls, n, __ATOMIC_RELAXED);
+	} else {
+		struct iovec iov[MIRROR_HELPER_BATCH];
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base = ops[i].ptr1;
+			iov[i].iov_len = ops[i].size;
+		}
+		if (use_uring) uring->Drain();	//earlier writes of the file stay ordered
+		ok = mirrorWriteV(ops[0].fd, iov, n, ops[0].offset);
+		for (int i = 0; i < n; i++) {
+			MirrorBufferDone(helper->throttle, (char*) ops[i].ptr1, ops[i].size);
+		}
+		__atomic_fetch_add(&helper->write_calls, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&helper->buffers_written, n, __ATOMIC_RELAXED);
+	return ok;
+}
+
 static void * mirrorCompactionHelper(void * arg) {
-	opq mio_queue = (opq) arg;
+	MirrorHelper* helper = (MirrorHelper*) arg;
+	opq mio_queue = helper->queue;
+	mio_op_s batch[MIRROR_HELPER_BATCH];
 	mio_op op;
 	PosixMmapFile_ *mfp;
 	struct timespec wtime = {0, 128000000}; //ToDo: interval
 	int c = 0;
+	bool halt = false;
+	std::set<int> failed_fds;	//files with a failed write, until their MBufClose
+	std::map<int, std::string> metadata_names;	//open metadata copies, see MRename
+	std::set<std::string> torn;	//metadata copies removed after a failed write
+
+	//falls back to pwrite if the kernel lacks io_uring
+	URingWriter uring(&MirrorBufferDone, helper->throttle);
+	const bool use_uring = MIRROR_URING_DEPTH > 0 && uring.Init(MIRROR_URING_DEPTH);
+
+	DEBUG_INFO3("Run_Helper", mio_queue, use_uring);
+	while(!halt) {
+		//take whatever is queued, up to a batch, in one pass
+		int n = 0;
+		while (n < MIRROR_HELPER_BATCH && OPQ_NONEMPTY(mio_queue)) {
+			op = &batch[n++];
+			OPQ_POP(mio_queue, op);			//operation, copied into batch[]
+		}
 
-	DEBUG_INFO2("Run_Helper", mio_queue);
-	while(1) {
-		if (OPQ_NONEMPTY(mio_queue)) {
+		if (n == 0) {
+			if (use_uring && uring.inflight() > 0) {
+				uring.WaitOne();	//nothing queued, retire a write instead
+				continue;
+			}
+			OPQ_WAIT(mio_queue);
+			//nanosleep(&wtime, NULL);
+			DEBUG_INFO2("Helper_count", c++);
+			continue;
+		}
 
-			OPQ_POP(mio_queue, op);			//operation
+		for (int i = 0; i < n && !halt; i++) {
+			op = &batch[i];
 			//DEBUG_INFO3("OPQ_POP", op->type, op);
 
 			if (op->type == MSync) {
@@ -489,21 +902,78 @@ static void * mirrorCompactionHelper(void * arg) {
 				//DEBUG_INFO3("MSync[E]", mfp, s.ToString());
 
 			} else if (op->type == MBufSync) {
-				char* buf = (char*) op->ptr1;	//buffer to sync
-				size_t size = op->size;	//buffer size
-				int fd = op->fd;	//file descriptor 
-				uint64_t offset = op->offset;	//corresponding offset
-				
-				ssize_t ret = pwrite(fd, buf, size, offset);
-				free(buf);
+				//coalesce the buffers that continue this one in the same file
+				int j = i + 1;
+				while (j < n && batch[j].type == MBufSync && batch[j].fd == op->fd &&
+				       batch[j].offset == batch[j-1].offset + batch[j-1].size) {
+					j++;
+				}
+				const bool tail = j < n && batch[j].fd == op->fd &&
+				                  (batch[j].type == MTruncate || batch[j].type == MBufClose);
+				if (!mirrorWriteRun(helper, &uring, use_uring, op, j - i, tail)) {
+					failed_fds.insert(op->fd);
+				}
+				i = j - 1;
 
 			} else if (op->type == MTruncate) {
 				size_t size = op->size;	//file size
 				int fd = op->fd;	//file descriptor 
+				if (use_uring) uring.Drain();	//the tail write must land first
 				int ret = ftruncate(fd, size);
+				if (ret != 0) failed_fds.insert(fd);
+
+			} else if (op->type == MBufClose) {
+				if (use_uring) uring.Drain();
+				bool ok = (failed_fds.erase(op->fd) == 0);
+				metadata_names.erase(op->fd);
+				if (use_uring && uring.TakeFailure(op->fd)) ok = false;
+				//a table copy only counts as done once it is on the device
+				if (op->number != 0) {
+					helper->mirror->ChargeIO(MBufClose, op->fd, 0, 0);
+					if (ok && fdatasync(op->fd) != 0) {
+						DEBUG_INFO3("fdatasync", op->fd, errno);
+						ok = false;
+					}
+				}
+				close(op->fd);
+				if (op->number != 0) {
+					if (ok) {
+						helper->mirror->CopyDone(op->number);
+					} else {
+						helper->mirror->CopyFailed(op->number);
+					}
+				}
+
+			} else if (op->type == MCopy) {
+				//a closed file, see PosixCopyOnCloseFile; a source deleted
+				//meanwhile fails to open and leaves no copy behind, its
+				//flight already ended by TableDeleted()
+				std::string *fname = (std::string*) (op->ptr1);
+				uint64_t bytes;
+				bool cloned;
+				Status s = helper->mirror->CopyFromPrimary(*fname, helper->write_limiter,
+				                                           &bytes, &cloned);
+				if (s.ok()) {
+					__atomic_fetch_add(&helper->files_copied, 1, __ATOMIC_RELAXED);
+					if (cloned) __atomic_fetch_add(&helper->files_cloned, 1, __ATOMIC_RELAXED);
+				}
+				DEBUG_INFO3("MCopy[E]", *fname, s.ToString());
+				helper->throttle->Release(op->size);
+				if (op->number != 0) {
+					if (s.ok()) {
+						helper->mirror->CopyDone(op->number);
+					} else {
+						helper->mirror->CopyFailed(op->number);
+					}
+				}
+				delete fname;
 
 			} else if (op->type == MAppend) {
 				mfp = (PosixMmapFile_*) op->ptr1;	//file handler
+				if (helper->write_limiter != NULL) {
+					helper->write_limiter->Request(((const Slice *) op->ptr2)->size());
+				}
+				helper->mirror->ChargeIO(MAppend, -1, 0, ((const Slice *) op->ptr2)->size());
 				Status s = mfp->Append(*((const Slice *) op->ptr2));
 				free((void*) (((const Slice *) op->ptr2)->data() ));	//it is malloc-ed
 				delete ((Slice *) op->ptr2);
@@ -515,28 +985,248 @@ static void * mirrorCompactionHelper(void * arg) {
 				//DEBUG_INFO3("MClose[E]", op, s.ToString());
 
 			} else if (op->type == MDelete) {
+				//every unlink queued since the last pass is done here
 				std::string *fname = (std::string*) (op->ptr1);
+				struct stat sbuf;
+				if (helper->delete_limiter != NULL && stat(fname->c_str(), &sbuf) == 0) {
+					helper->delete_limiter->Request(sbuf.st_size);	//freeing blocks costs device time too
+				}
 				int ret = unlink(fname->c_str());
+				torn.erase(*fname);
 				DEBUG_INFO2("MDelete[E]", fname);
 				delete fname;
 
+			} else if (op->type == MWrite) {
+				//metadata, see PosixMetadataFile: a MANIFEST record is not to
+				//reach the mirror before the tables it names
+				if (op->number != 0 &&
+				    !helper->mirror->WaitForQueuedCopies(op->number, MIRROR_METADATA_MAX_WAIT_MICROS)) {
+					__atomic_fetch_add(&helper->metadata_wait_timeouts, 1, __ATOMIC_RELAXED);
+					Log(helper->info_log, "Mirror: MANIFEST record written before the table copies it names landed");
+				}
+				if (failed_fds.count(op->fd) == 0) {
+					helper->mirror->ChargeIO(MBufSync, op->fd, op->offset, op->size);
+					struct iovec iov;
+					iov.iov_base = op->ptr1;
+					iov.iov_len = op->size;
+					if (!mirrorWriteV(op->fd, &iov, 1, op->offset)) {
+						//a torn copy is neither to be replayed by a follower nor
+						//renamed into place: remove it, skip its later writes
+						failed_fds.insert(op->fd);
+						std::map<int, std::string>::iterator it = metadata_names.find(op->fd);
+						if (it != metadata_names.end()) {
+							unlink(it->second.c_str());
+							torn.insert(it->second);
+							Log(helper->info_log, "Mirror: write to %s failed, copy removed",
+							    it->second.c_str());
+						}
+						__atomic_fetch_add(&helper->metadata_failures, 1, __ATOMIC_RELAXED);
+					}
+					__atomic_fetch_add(&helper->write_calls, 1, __ATOMIC_RELAXED);
+				}
+				free(op->ptr1);
+				helper->throttle->Release(op->size);
+
+			} else if (op->type == MRename) {
+				std::string *src = (std::string*) (op->ptr1);
+				std::string *target = (std::string*) (op->ptr2);
+				int ret = -1;
+				if (torn.erase(*src) == 0) {
+					ret = rename(src->c_str(), target->c_str());
+				}
+				if (op->fd >= 0) {
+					metadata_names[op->fd] = (ret == 0) ? *target : *src;
+				}
+				DEBUG_INFO3("MRename[E]", *target, ret);
+				delete src;
+				delete target;
+
 			} else if (op->type == MHalt) {
 				//DEBUG_INFO("MHalt");
-				break;
+				if (use_uring) uring.Drain();
+				halt = true;	//nothing is queued after MHalt
 			}
-
-			free(op);
-			continue;
 		}
-
-		OPQ_WAIT(mio_queue);
-		//nanosleep(&wtime, NULL);
-		DEBUG_INFO2("Helper_count", c++);
 	}
 
   return NULL;
 }
 
+// Mirror state of one DB.  Each helper thread drains its own op queue.
+// Ops are sharded by mirror file name, so the ops of one file (writes,
+// truncate, close and the final unlink) stay in FIFO order on one
+// helper while different files are mirrored in parallel.  Under
+// Options::mirror_metadata one more helper takes the ops of all the
+// metadata files, in the order the DB made them.
+class PosixMirror : public MirrorContext {
+ public:
+  PosixMirror(const std::string& dbname, const Options& options)
+      : MirrorContext(dbname, options.mirror_path),
+        n_(options.mirror_helpers > 0 ? options.mirror_helpers : 1),
+        nhelpers_(n_ + (options.mirror_metadata ? 1 : 0)),
+        copy_on_close_(options.mirror_copy_on_close),
+        metadata_(options.mirror_metadata),
+        running_(false),
+        throttle_(options.mirror_queue_cap),
+        write_limiter_(NULL),
+        delete_limiter_(NULL) {
+    pthread_mutex_init(&mu_, NULL);
+    if (options.mirror_write_rate > 0) {
+      write_limiter_ = new RateLimiter(options.mirror_write_rate,
+                                       Env::Default());
+    }
+    if (options.mirror_delete_rate > 0) {
+      delete_limiter_ = new RateLimiter(options.mirror_delete_rate,
+                                        Env::Default());
+    }
+    helpers_ = new MirrorHelper[nhelpers_];
+    for (int i = 0; i < nhelpers_; i++) {
+      helpers_[i].queue = OPQ_MALLOC;
+      OPQ_INIT(helpers_[i].queue);
+      helpers_[i].throttle = &throttle_;
+      helpers_[i].mirror = this;
+      helpers_[i].write_limiter = write_limiter_;
+      helpers_[i].delete_limiter = delete_limiter_;
+      helpers_[i].write_calls = 0;
+      helpers_[i].buffers_written = 0;
+      helpers_[i].files_copied = 0;
+      helpers_[i].files_cloned = 0;
+      helpers_[i].metadata_failures = 0;
+      helpers_[i].metadata_wait_timeouts = 0;
+      helpers_[i].info_log = options.info_log;
+    }
+  }
+
+  virtual ~PosixMirror() {
+    Halt();
+    for (int i = 0; i < nhelpers_; i++) {
+      OPQ_FREE(helpers_[i].queue);
+    }
+    delete[] helpers_;
+    delete write_limiter_;
+    delete delete_limiter_;
+    pthread_mutex_destroy(&mu_);
+  }
+
+  // Returns the helper queue that owns the mirror file "mfname",
+  // starting the helpers if they are not running.
+  opq Queue(const std::string& mfname) {
+    Start();
+    return helpers_[Hash(mfname.data(), mfname.size(), 0) % n_].queue;
+  }
+
+  // Returns the queue of the metadata helper.
+  // REQUIRES: metadata()
+  opq MetadataQueue() {
+    assert(metadata_);
+    Start();
+    return helpers_[n_].queue;
+  }
+
+  MirrorThrottle* throttle() { return &throttle_; }
+
+  // See Options::mirror_copy_on_close
+  bool copy_on_close() const { return copy_on_close_; }
+
+  // See Options::mirror_metadata
+  bool metadata() const { return metadata_; }
+
+  virtual uint64_t QueuedBytes() {
+    return throttle_.Inflight();
+  }
+
+  virtual bool WaitForLag(uint64_t target_bytes, uint64_t max_wait_micros) {
+    return throttle_.WaitBelow(target_bytes, max_wait_micros);
+  }
+
+  // Let every helper finish the ops queued so far, then stop it.
+  void Halt() {
+    pthread_mutex_lock(&mu_);
+    if (running_) {
+      for (int i = 0; i < nhelpers_; i++) {
+        OPQ_ADD_HALT(helpers_[i].queue);
+      }
+      for (int i = 0; i < nhelpers_; i++) {
+        pthread_join(helpers_[i].thread, NULL);
+      }
+      running_ = false;
+    }
+    pthread_mutex_unlock(&mu_);
+  }
+
+  virtual void GetStats(MirrorQueueStats* stats) {
+    throttle_.GetStats(stats);
+    GetCopyStats(stats);
+    AlignedBufferPool::Stats pool;
+    MirrorBuffers()->GetStats(&pool);
+    stats->buffer_hits = pool.hits;
+    stats->buffer_misses = pool.misses;
+    stats->buffers_peak = pool.peak_in_use;
+    stats->buffers_free = pool.free;
+    stats->buffers_huge = pool.huge_pages;
+    stats->write_calls = 0;
+    stats->buffers_written = 0;
+    stats->files_copied = 0;
+    stats->files_cloned = 0;
+    stats->metadata_failures = 0;
+    stats->metadata_wait_timeouts = 0;
+    for (int i = 0; i < nhelpers_; i++) {
+      stats->write_calls +=
+          __atomic_load_n(&helpers_[i].write_calls, __ATOMIC_RELAXED);
+      stats->buffers_written +=
+          __atomic_load_n(&helpers_[i].buffers_written, __ATOMIC_RELAXED);
+      stats->files_copied +=
+          __atomic_load_n(&helpers_[i].files_copied, __ATOMIC_RELAXED);
+      stats->files_cloned +=
+          __atomic_load_n(&helpers_[i].files_cloned, __ATOMIC_RELAXED);
+      stats->metadata_failures +=
+          __atomic_load_n(&helpers_[i].metadata_failures, __ATOMIC_RELAXED);
+      stats->metadata_wait_timeouts +=
+          __atomic_load_n(&helpers_[i].metadata_wait_timeouts, __ATOMIC_RELAXED);
+    }
+    RateLimiter::Stats limit;
+    stats->write_throttle_micros = 0;
+    if (write_limiter_ != NULL) {
+      write_limiter_->GetStats(&limit);
+      stats->write_throttle_micros = limit.throttled_micros;
+    }
+    stats->delete_throttle_micros = 0;
+    if (delete_limiter_ != NULL) {
+      delete_limiter_->GetStats(&limit);
+      stats->delete_throttle_micros = limit.throttled_micros;
+    }
+    pthread_mutex_lock(&mu_);
+    stats->helpers = running_ ? nhelpers_ : 0;
+    pthread_mutex_unlock(&mu_);
+  }
+
+ private:
+  // Starts the helpers if they are not running.
+  void Start() {
+    pthread_mutex_lock(&mu_);
+    if (!running_) {
+      for (int i = 0; i < nhelpers_; i++) {
+        pthread_create(&helpers_[i].thread, NULL, &mirrorCompactionHelper,
+                       &helpers_[i]);
+      }
+      running_ = true;
+      DEBUG_INFO2(dbname(), nhelpers_);
+    }
+    pthread_mutex_unlock(&mu_);
+  }
+
+  const int n_;             // Helpers the mirror files are sharded over
+  const int nhelpers_;      // n_, plus the metadata helper if any
+  const bool copy_on_close_;
+  const bool metadata_;
+  pthread_mutex_t mu_;
+  bool running_;            // Protected by mu_
+  MirrorHelper* helpers_;
+  MirrorThrottle throttle_;
+  RateLimiter* write_limiter_;
+  RateLimiter* delete_limiter_;
+};
+
 class PosixMmapFile : public WritableFile {
  private:
   std::string filename_;
@@ -545,6 +1235,7 @@ class PosixMmapFile : public WritableFile {
   int mfd_;
   size_t page_size_;
   PosixMmapFile_ *fp_;
+  opq mq_;	//helper queue of the mirror file
 
 #if !defined(COMPACT_SECONDARY_PWRITE)
   PosixMmapFile_ *mfp_;
@@ -571,25 +1262,24 @@ class PosixMmapFile : public WritableFile {
   }
 
  public:
-  PosixMmapFile(const std::string& fname, int fd, size_t page_size, int mfd)
+  PosixMmapFile(const std::string& fname, int fd, size_t page_size, int mfd,
+                PosixMirror* mirror)
       : filename_(fname),
         fd_(fd),
         mfd_(mfd),
         page_size_(page_size) {
 		assert((page_size & (page_size - 1)) == 0);
 
-    if (MIRROR_ENABLE) {
-			mfilename_ = std::string(MIRROR_PATH) + fname.substr(fname.find_last_of("/"));
+		mfilename_ = mirror->MirrorFileName(fname);
+#ifdef USE_OPQ_THREAD
+		mq_ = mirror->Queue(mfilename_);
+#endif
 #if !defined(COMPACT_SECONDARY_PWRITE)
-    	mfp_ = new PosixMmapFile_(mfilename_, mfd, page_size);
+		mfp_ = new PosixMmapFile_(mfilename_, mfd, page_size);
 #else
-    	mfp_ = new PosixBufferFile_(mfilename_, mfd);
+		mfp_ = new PosixBufferFile_(mfilename_, mfd, mq_, mirror->throttle(),
+		                            mirror);
 #endif
-
-#ifdef USE_OPQ_THREAD
-			INIT_HELPER_AND_QUEUE(mirror_helper, mio_queue);
-#endif
-    }
     fp_ = new PosixMmapFile_(fname, fd, page_size);
     DEBUG_INFO(filename_);
   }
@@ -605,8 +1295,8 @@ class PosixMmapFile : public WritableFile {
 #if defined(USE_OPQ_THREAD) && !defined(COMPACT_SECONDARY_PWRITE)
 		Slice *mdata = data.clone();
     //DEBUG_INFO3(filename_, data.compare((*mdata)), data.size());
-    //DEBUG_MEASURE(OPQ_ADD_APPEND(mio_queue, mfp_, mdata), "Append_Queue_Time");
-    OPQ_ADD_APPEND(mio_queue, mfp_, mdata);
+    //DEBUG_MEASURE(OPQ_ADD_APPEND(mq_, mfp_, mdata), "Append_Queue_Time");
+    OPQ_ADD_APPEND(mq_, mfp_, mdata);
 #else
     Status ms = mfp_->Append(data);
     if (!ms.ok())
@@ -619,7 +1309,7 @@ class PosixMmapFile : public WritableFile {
 
   virtual Status Close() {
 #if defined(USE_OPQ_THREAD) && !defined(COMPACT_SECONDARY_PWRITE)
-    OPQ_ADD_CLOSE(mio_queue, mfp_);
+    OPQ_ADD_CLOSE(mq_, mfp_);
 #else
     Status ms = mfp_->Close();
     if (!ms.ok())
@@ -638,7 +1328,7 @@ class PosixMmapFile : public WritableFile {
   virtual Status Sync(int flags) {
     DEBUG_INFO3("Sync Starts", filename_, mfilename_);
 #if defined(USE_OPQ_THREAD) && !defined(COMPACT_SECONDARY_PWRITE)
-    OPQ_ADD_SYNC(mio_queue, mfp_);
+    OPQ_ADD_SYNC(mq_, mfp_);
 #else
     //Status ms = mfp_->Sync(MS_ASYNC);
     //if (!ms.ok())
@@ -652,6 +1342,167 @@ class PosixMmapFile : public WritableFile {
   }
 };
 
+// A mirrored file under Options::mirror_copy_on_close: written to the
+// primary only, then copied to the mirror whole by the helper that owns
+// the mirror file once it is closed.  Its bytes count as queued for the
+// mirror from the close until the copy is done.
+class PosixCopyOnCloseFile : public WritableFile {
+ private:
+  std::string filename_;
+  PosixMmapFile_* fp_;
+  PosixMirror* mirror_;
+  uint64_t number_;       // Table file number, 0 if not tracked
+  bool closed_;
+
+ public:
+  PosixCopyOnCloseFile(const std::string& fname, int fd, size_t page_size,
+                       PosixMirror* mirror)
+      : filename_(fname),
+        fp_(new PosixMmapFile_(fname, fd, page_size)),
+        mirror_(mirror),
+        number_(0),
+        closed_(false) {
+    if (MirrorContext::TableFileNumber(filename_, &number_)) {
+      mirror_->CopyStarted(number_);
+    }
+    DEBUG_INFO(filename_);
+  }
+
+  ~PosixCopyOnCloseFile() {
+    if (!closed_) {
+      PosixCopyOnCloseFile::Close();
+    }
+    delete fp_;
+  }
+
+  virtual Status Append(const Slice& data) {
+    return fp_->Append(data);
+  }
+
+  virtual Status Close() {
+    Status s = fp_->Close();
+    closed_ = true;
+    if (!s.ok()) {
+      // Nothing complete to copy; the DB drops the file
+      if (number_ != 0) {
+        mirror_->CopySkipped(number_);
+        mirror_->CopyDone(number_);
+      }
+      return s;
+    }
+    struct stat sbuf;
+    const uint64_t size = (stat(filename_.c_str(), &sbuf) == 0) ?
+                          sbuf.st_size : 0;
+    const std::string mfname = mirror_->MirrorFileName(filename_);
+    MirrorThrottle* throttle = mirror_->throttle();
+    throttle->Charge(size);
+    if (number_ != 0) mirror_->CopyQueued(number_);
+    OPQ_ADD_COPY(mirror_->Queue(mfname), new std::string(filename_), size,
+                 number_);
+    throttle->Throttle();
+    return s;
+  }
+
+  virtual Status Flush() {
+    return fp_->Flush();
+  }
+
+  virtual Status Sync(int flags) {
+    //the helper fdatasync()s the copy
+    return fp_->Sync(MS_SYNC);
+  }
+};
+
+// A metadata file under Options::mirror_metadata: a MANIFEST, a log or
+// CURRENT's temporary.  Appends are collected and handed to the
+// metadata helper at each Flush(), Sync() and Close(), so the mirror
+// copy grows record by record, in the order the DB wrote them.  Its
+// bytes count as queued for the mirror until the helper writes them.
+// The copy is created under a temporary name that the helper renames
+// once the metadata ops queued before it are done: whoever finds a
+// newer log in the mirror finds the older ones complete.  A copy whose
+// write fails is removed rather than left torn, and never renamed.
+class PosixMetadataFile : public WritableFile {
+ private:
+  std::string filename_;
+  PosixMmapFile_* fp_;
+  PosixMirror* mirror_;
+  opq mq_;
+  int mfd_;
+  uint64_t moffset_;      // Bytes handed to the helper so far
+  std::string pending_;   // Appended since
+  bool manifest_;
+  bool closed_;
+
+  // A MANIFEST record waits for the table copies queued before it
+  void QueuePending() {
+    if (pending_.empty()) {
+      return;
+    }
+    const size_t n = pending_.size();
+    char* buf = (char*) malloc(n);
+    memcpy(buf, pending_.data(), n);
+    pending_.clear();
+    MirrorThrottle* throttle = mirror_->throttle();
+    throttle->Charge(n);
+    OPQ_ADD_WRITE(mq_, buf, n, mfd_, moffset_,
+                  manifest_ ? Env::Default()->NowMicros() : 0);
+    moffset_ += n;
+    throttle->Throttle();
+  }
+
+ public:
+  PosixMetadataFile(const std::string& fname, int fd, size_t page_size,
+                    int mfd, PosixMirror* mirror)
+      : filename_(fname),
+        fp_(new PosixMmapFile_(fname, fd, page_size)),
+        mirror_(mirror),
+        mq_(mirror->MetadataQueue()),
+        mfd_(mfd),
+        moffset_(0),
+        manifest_(fname.find("/MANIFEST-") != std::string::npos),
+        closed_(false) {
+    const std::string mfname = mirror->MirrorFileName(fname);
+    OPQ_ADD_RENAME(mq_, new std::string(TempName(mfname)),
+                   new std::string(mfname), mfd_);
+    DEBUG_INFO(filename_);
+  }
+
+  // Name the mirror copy of a metadata file is created under
+  static std::string TempName(const std::string& mfname) {
+    return mfname + ".new";
+  }
+
+  ~PosixMetadataFile() {
+    if (!closed_) {
+      PosixMetadataFile::Close();
+    }
+    delete fp_;
+  }
+
+  virtual Status Append(const Slice& data) {
+    pending_.append(data.data(), data.size());
+    return fp_->Append(data);
+  }
+
+  virtual Status Close() {
+    QueuePending();
+    OPQ_ADD_BUF_CLOSE(mq_, mfd_, 0);
+    closed_ = true;
+    return fp_->Close();
+  }
+
+  virtual Status Flush() {
+    QueuePending();
+    return fp_->Flush();
+  }
+
+  virtual Status Sync(int flags) {
+    QueuePending();
+    return fp_->Sync(MS_SYNC);
+  }
+};
+
 static int LockOrUnlock(int fd, bool lock) {
   errno = 0;
   struct flock f;
@@ -712,36 +1563,24 @@ class PosixEnv : public Env {
     DEBUG_INFO(fname);
     *result = NULL;
     Status s;
-		
-		int flags = O_RDONLY;
-		//if (MIRROR_ENABLE && mirror)
-		//	flags = flags | O_DIRECT; 
+    if (mirror) {
+      return NewScanFile(fname, result);
+    }
 
-    int fd = open(fname.c_str(), flags);
+    int fd = open(fname.c_str(), O_RDONLY);
     if (fd < 0) {
       s = IOError(fname, errno);
     } else if (mmap_limit_.Acquire()) {
       uint64_t size;
       s = GetFileSize(fname, &size);
       if (s.ok()) {
-				if (MIRROR_ENABLE && mirror) {
-					void* base = (void*) malloc(size);
-					ssize_t ret = pread(fd, base, size, 0);
-					//void* base = (void*) memalign(BLKSIZE, Roundup(size, BLKSIZE) );
-					//ssize_t ret = pread(fd, base, Roundup(size, BLKSIZE), 0);
-					//AIOWrapper *awp = new AIOWrapper();
-					//ssize_t ret = awp->read(fd, base, size, 0);
-					*result = new PosixMmapReadableFile(fname, base, size, &mmap_limit_, true, NULL);
-				} else {
-        	void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-        	if (base != MAP_FAILED) {
-          		*result = new PosixMmapReadableFile(fname, base, size, &mmap_limit_);
-        	} else {
-          		s = IOError(fname, errno);
-        	}
-	}
+        void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+          *result = new PosixMmapReadableFile(fname, base, size, &mmap_limit_);
+        } else {
+          s = IOError(fname, errno);
+        }
       }
-	if (!(MIRROR_ENABLE && mirror))	// to perform AIO, fd is closed later
       close(fd);
       if (!s.ok()) {
         mmap_limit_.Release();
@@ -753,35 +1592,67 @@ class PosixEnv : public Env {
   }
 
   virtual Status NewWritableFile(const std::string& fname,
-                                 WritableFile** result) {
+                                 WritableFile** result, bool mirror_file) {
     Status s;
     std::string mfname;
-    bool mirror = MIRROR_ENABLE ? EXCLUDE_FILES(fname) : false;
+    PosixMirror* mirror = MirrorOf(fname);
+    uint64_t number;
+    if (mirror && !mirror_file) {
+      if (MirrorContext::TableFileNumber(fname, &number)) {
+        mirror->CopySkipped(number);
+      }
+      mirror = NULL;  // Written to the primary only
+    }
+    const bool metadata = mirror && MirrorContext::IsMetadataFile(fname);
 
     const int fd = open(fname.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0777);
     int mfd;
-    if (mirror) {
-      mfname = std::string(MIRROR_PATH) + fname.substr(fname.find_last_of("/"));
+    if (metadata) {
+      mfname = PosixMetadataFile::TempName(mirror->MirrorFileName(fname));
+      mfd = open(mfname.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0777);
+      DEBUG_INFO2(fname, mfname);
+    } else if (mirror && mirror->copy_on_close()) {
+      mfd = 1;  // Copied by a helper once closed
+      DEBUG_INFO(fname);
+    } else if (mirror) {
+      mfname = mirror->MirrorFileName(fname);
 #ifdef COMPACT_SECONDARY_PWRITE
       mfd = open(mfname.c_str(), O_CREAT | O_RDWR | O_TRUNC| O_DIRECT , 0777);
 #else
       mfd = open(mfname.c_str(), O_CREAT | O_RDWR | O_TRUNC , 0777);
 #endif
-			DEBUG_INFO3(fname, mfname, mirror);
+			DEBUG_INFO2(fname, mfname);
     } else {
       mfd = 1;
-			DEBUG_INFO2(fname, mirror);
+			DEBUG_INFO(fname);
 		}
 
     if (fd < 0) {
+      const int err = errno;
+      if (mfd >= 0 && !mfname.empty()) {
+        close(mfd);
+        unlink(mfname.c_str());
+      }
       *result = NULL;
-      s = IOError(fname, errno);
-    } else if (mfd < 0){
-      *result = NULL;
-      s = IOError(mfname, errno);
+      s = IOError(fname, err);
+    } else if (mfd < 0) {
+      // The mirror cannot take the file: write it to the primary only
+      // rather than fail the DB.  A table is left to the primary and
+      // reported by WaitForMirror(); metadata is missing from the mirror
+      // until the DB writes the next MANIFEST, log or CURRENT.
+      DEBUG_INFO3("open", mfname, errno);
+      if (!metadata && MirrorContext::TableFileNumber(fname, &number)) {
+        mirror->CopyStarted(number);
+        mirror->CopyFailed(number);
+      }
+      *result = new PosixMmapFile_(fname, fd, page_size_);
     } else {
-      if (mirror) {
-        *result = new PosixMmapFile(fname, fd, page_size_, mfd);
+      if (metadata) {
+        *result = new PosixMetadataFile(fname, fd, page_size_, mfd, mirror);
+      } else if (mirror && mirror->copy_on_close()) {
+        *result = new PosixCopyOnCloseFile(fname, fd, page_size_, mirror);
+      } else if (mirror) {
+        *result = new PosixMmapFile(fname, fd, page_size_, mfd, mirror);
       } else {
         *result = new PosixMmapFile_(fname, fd, page_size_);
       }
@@ -816,12 +1687,19 @@ class PosixEnv : public Env {
       result = IOError(fname, errno);
     }
 
-    bool mirror = MIRROR_ENABLE ? EXCLUDE_FILES(fname) : false;
-		if (mirror) {
-	    std::string	mfname = std::string(MIRROR_PATH) + fname.substr(fname.find_last_of("/"));
+    PosixMirror* mirror = MirrorOf(fname);
+		if (mirror != NULL && MirrorContext::IsMetadataFile(fname)) {
+			//after the metadata writes queued before it
+			OPQ_ADD_DELETE(mirror->MetadataQueue(),
+			               new std::string(mirror->MirrorFileName(fname)));
+		} else if (mirror != NULL) {
+	    std::string	mfname = mirror->MirrorFileName(fname);
+	    uint64_t number;
+	    if (MirrorContext::TableFileNumber(fname, &number)) {
+	      mirror->TableDeleted(number);
+	    }
 #ifdef USE_OPQ_THREAD
-			INIT_HELPER_AND_QUEUE(mirror_helper, mio_queue);
-			OPQ_ADD_DELETE(mio_queue, new std::string(mfname) );
+			OPQ_ADD_DELETE(mirror->Queue(mfname), new std::string(mfname) );
 #else
 			if (unlink(mfname.c_str()) != 0) {
 				result = IOError(fname, errno);
@@ -866,16 +1744,21 @@ class PosixEnv : public Env {
 	//ToDo: Add to OPQ
   virtual Status RenameFile(const std::string& src, const std::string& target) {
     Status result;
-    bool mirror = MIRROR_ENABLE ? EXCLUDE_FILES(src) : false;
+    PosixMirror* mirror = MirrorOf(src);
 
     DEBUG_INFO2(src + "\t" + target, mirror);
 
     if (rename(src.c_str(), target.c_str()) != 0) {
       result = IOError(src, errno);
     }
-    if (mirror) {
-    	const std::string msrc = std::string(MIRROR_PATH) + src.substr(src.find_last_of("/"));
-    	const std::string mtarget = std::string(MIRROR_PATH) + target.substr(target.find_last_of("/"));
+    if (mirror != NULL && MirrorContext::IsMetadataFile(src)) {
+    	//CURRENT is replaced once the temporary's writes are in
+    	OPQ_ADD_RENAME(mirror->MetadataQueue(),
+    	               new std::string(mirror->MirrorFileName(src)),
+    	               new std::string(mirror->MirrorFileName(target)), -1);
+    } else if (mirror != NULL) {
+    	const std::string msrc = mirror->MirrorFileName(src);
+    	const std::string mtarget = mirror->MirrorFileName(target);
 			if (rename(msrc.c_str(), mtarget.c_str()) != 0) {
 				result = IOError(msrc, errno);
 			}
@@ -917,10 +1800,20 @@ class PosixEnv : public Env {
     return result;
   }
 
-  virtual void Schedule(void (*function)(void*), void* arg);
+  virtual void Schedule(void (*function)(void*), void* arg) {
+    Schedule(function, arg, kLowPriority);
+  }
+
+  virtual void Schedule(void (*function)(void*), void* arg, Priority pri);
+
+  virtual void EnsureBackgroundThreads(int number, Priority pri);
 
   virtual void StartThread(void (*function)(void* arg), void* arg);
 
+  virtual void* StartJoinableThread(void (*function)(void* arg), void* arg);
+
+  virtual void JoinThread(void* thread);
+
   virtual Status GetTestDirectory(std::string* result) {
     const char* env = getenv("TEST_TMPDIR");
     if (env && env[0] != '\0') {
@@ -954,6 +1847,32 @@ class PosixEnv : public Env {
     }
   }
 
+  virtual Status AttachMirror(const std::string& dbname,
+                              const Options& options,
+                              MirrorContext** result) {
+    *result = NULL;
+    if (options.mirror_path.empty()) {
+      return Status::InvalidArgument(dbname, "no mirror_path");
+    }
+    CreateDir(options.mirror_path);  // Ignore error; the copies fail later
+    MutexLock l(&mirrors_mu_);
+    if (mirrors_.count(dbname) > 0) {
+      return Status::InvalidArgument(dbname, "already mirrored");
+    }
+    PosixMirror* mirror = new PosixMirror(dbname, options);
+    mirrors_[dbname] = mirror;
+    *result = mirror;
+    return Status::OK();
+  }
+
+  virtual void DetachMirror(MirrorContext* mirror) {
+    {
+      MutexLock l(&mirrors_mu_);
+      mirrors_.erase(mirror->dbname());
+    }
+    delete mirror;  // Waits for the helpers
+  }
+
   virtual uint64_t NowMicros() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -972,70 +1891,169 @@ class PosixEnv : public Env {
     }
   }
 
-  // BGThread() is the body of the background thread
-  void BGThread();
+  // Open "fname" for a front-to-back scan (see NewRandomAccessFile).
+  Status NewScanFile(const std::string& fname, RandomAccessFile** result) {
+    uint64_t size;
+    Status s = GetFileSize(fname, &size);
+    if (!s.ok()) {
+      return s;
+    }
+    if (MIRROR_READAHEAD == 0) {
+      // Read the whole file up front
+      int fd = open(fname.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return IOError(fname, errno);
+      }
+      if (!mmap_limit_.Acquire()) {
+        *result = new PosixRandomAccessFile(fname, fd);
+        return s;
+      }
+      void* base = malloc(size);
+      ssize_t r = pread(fd, base, size, 0);
+      close(fd);
+      if (r != static_cast<ssize_t>(size)) {
+        free(base);
+        mmap_limit_.Release();
+        return IOError(fname, (r < 0) ? errno : EIO);
+      }
+      *result = new PosixMmapReadableFile(fname, base, size, &mmap_limit_,
+                                          true);
+      return s;
+    }
+
+    int fd = open(fname.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+      fd = open(fname.c_str(), O_RDONLY);  // No O_DIRECT on this fs
+    }
+    if (fd < 0) {
+      return IOError(fname, errno);
+    }
+    *result = new PosixReadaheadFile(fname, fd, size, MIRROR_READAHEAD);
+    return s;
+  }
+
+  // BGThread() is the body of the background threads of pool "pri"
+  void BGThread(Priority pri);
+  struct BGThreadArg { PosixEnv* env; Priority pri; };
   static void* BGThreadWrapper(void* arg) {
-    reinterpret_cast<PosixEnv*>(arg)->BGThread();
+    BGThreadArg* bg = reinterpret_cast<BGThreadArg*>(arg);
+    PosixEnv* env = bg->env;
+    const Priority pri = bg->pri;
+    delete bg;
+    env->BGThread(pri);
     return NULL;
   }
 
+  // REQUIRES: mu_ is held
+  void StartBGThread(Priority pri);
+
   size_t page_size_;
   pthread_mutex_t mu_;
-  pthread_cond_t bgsignal_;
-  pthread_t bgthread_;
-  bool started_bgthread_;
 
   // Entry per Schedule() call
   struct BGItem { void* arg; void (*function)(void*); };
   typedef std::deque<BGItem> BGQueue;
-  BGQueue queue_;
+
+  // A pool of threads per Priority, each fed by its own queue
+  struct BGPool {
+    pthread_cond_t signal;
+    BGQueue queue;
+    int threads;
+    int size;         // Threads to start as work comes in
+  };
+  BGPool pools_[2];
 
   PosixLockTable locks_;
   MmapLimiter mmap_limit_;
+
+  // Mirror state of the attached DBs, keyed by DB directory
+  port::Mutex mirrors_mu_;
+  std::map<std::string, PosixMirror*> mirrors_;
+
+  // Returns the mirror of the DB that "fname" belongs to, or NULL.
+  PosixMirror* FindMirror(const std::string& fname) {
+    MutexLock l(&mirrors_mu_);
+    if (mirrors_.empty()) {
+      return NULL;
+    }
+    std::map<std::string, PosixMirror*>::const_iterator it =
+        mirrors_.find(fname.substr(0, fname.find_last_of("/")));
+    return (it == mirrors_.end()) ? NULL : it->second;
+  }
+
+  // Returns the mirror that keeps a copy of "fname", or NULL: that of
+  // its DB, if "fname" is a table file or, under Options::mirror_metadata,
+  // a metadata file.
+  PosixMirror* MirrorOf(const std::string& fname) {
+    if (EXCLUDE_FILES(fname)) {
+      return FindMirror(fname);
+    }
+    if (!MirrorContext::IsMetadataFile(fname)) {
+      return NULL;
+    }
+    PosixMirror* mirror = FindMirror(fname);
+    return (mirror != NULL && mirror->metadata()) ? mirror : NULL;
+  }
 };
 
-PosixEnv::PosixEnv() : page_size_(getpagesize()),
-                       started_bgthread_(false) {
+PosixEnv::PosixEnv() : page_size_(getpagesize()) {
   PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
-  PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
+  for (int i = 0; i < 2; i++) {
+    PthreadCall("cvar_init", pthread_cond_init(&pools_[i].signal, NULL));
+    pools_[i].threads = 0;
+    pools_[i].size = 1;
+  }
+}
+
+void PosixEnv::StartBGThread(Priority pri) {
+  BGThreadArg* arg = new BGThreadArg;
+  arg->env = this;
+  arg->pri = pri;
+  pthread_t t;
+  PthreadCall(
+      "create thread",
+      pthread_create(&t, NULL,  &PosixEnv::BGThreadWrapper, arg));
+  pools_[pri].threads++;
 }
 
-void PosixEnv::Schedule(void (*function)(void*), void* arg) {
+void PosixEnv::Schedule(void (*function)(void*), void* arg, Priority pri) {
   PthreadCall("lock", pthread_mutex_lock(&mu_));
+  BGPool* pool = &pools_[pri];
 
-  // Start background thread if necessary
-  if (!started_bgthread_) {
-    started_bgthread_ = true;
-    PthreadCall(
-        "create thread",
-        pthread_create(&bgthread_, NULL,  &PosixEnv::BGThreadWrapper, this));
+  // Start another background thread if the pool is not at its size yet
+  if (pool->threads < pool->size) {
+    StartBGThread(pri);
   }
 
-  // If the queue is currently empty, the background thread may currently be
-  // waiting.
-  if (queue_.empty()) {
-    PthreadCall("signal", pthread_cond_signal(&bgsignal_));
-  }
+  // Add to priority queue; one of the threads may be waiting for it
+  pool->queue.push_back(BGItem());
+  pool->queue.back().function = function;
+  pool->queue.back().arg = arg;
+  PthreadCall("signal", pthread_cond_signal(&pool->signal));
 
-  // Add to priority queue
-  queue_.push_back(BGItem());
-  queue_.back().function = function;
-  queue_.back().arg = arg;
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
 
+void PosixEnv::EnsureBackgroundThreads(int number, Priority pri) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  if (pools_[pri].size < number) {
+    pools_[pri].size = number;
+  }
   PthreadCall("unlock", pthread_mutex_unlock(&mu_));
 }
 
-void PosixEnv::BGThread() {
+void PosixEnv::BGThread(Priority pri) {
+  BGPool* pool = &pools_[pri];
   while (true) {
     // Wait until there is an item that is ready to run
     PthreadCall("lock", pthread_mutex_lock(&mu_));
-    while (queue_.empty()) {
-      PthreadCall("wait", pthread_cond_wait(&bgsignal_, &mu_));
+    while (pool->queue.empty()) {
+      PthreadCall("wait", pthread_cond_wait(&pool->signal, &mu_));
     }
 
-    void (*function)(void*) = queue_.front().function;
-    void* arg = queue_.front().arg;
-    queue_.pop_front();
+    void (*function)(void*) = pool->queue.front().function;
+    void* arg = pool->queue.front().arg;
+    pool->queue.pop_front();
 
     PthreadCall("unlock", pthread_mutex_unlock(&mu_));
     (*function)(arg);
@@ -1062,6 +2080,24 @@ void PosixEnv::StartThread(void (*function)(void* arg), void* arg) {
   state->arg = arg;
   PthreadCall("start thread",
 		pthread_create(&t, NULL,  &StartThreadWrapper, state));
+  // Nobody joins it: let it go once it returns
+  PthreadCall("detach thread", pthread_detach(t));
+}
+
+void* PosixEnv::StartJoinableThread(void (*function)(void* arg), void* arg) {
+  pthread_t* t = new pthread_t;
+  StartThreadState* state = new StartThreadState;
+  state->user_function = function;
+  state->arg = arg;
+  PthreadCall("start thread",
+              pthread_create(t, NULL, &StartThreadWrapper, state));
+  return t;
+}
+
+void PosixEnv::JoinThread(void* thread) {
+  pthread_t* t = reinterpret_cast<pthread_t*>(thread);
+  PthreadCall("join thread", pthread_join(*t, NULL));
+  delete t;
 }
 
 }  // namespace
@@ -4,8 +4,15 @@
 
 #include "leveldb/env.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "leveldb/mirror.h"
+#include "leveldb/options.h"
 #include "port/port.h"
+#include "util/random.h"
 #include "util/testharness.h"
+#include "util/testutil.h"
 
 namespace leveldb {
 
@@ -97,6 +104,513 @@ TEST(EnvPosixTest, StartThread) {
   ASSERT_EQ(state.val, 3);
 }
 
+TEST(EnvPosixTest, JoinThread) {
+  State state;
+  state.val = 0;
+  state.num_running = 3;
+  void* threads[3];
+  for (int i = 0; i < 3; i++) {
+    threads[i] = env_->StartJoinableThread(&ThreadBody, &state);
+  }
+  for (int i = 0; i < 3; i++) {
+    env_->JoinThread(threads[i]);
+  }
+  ASSERT_EQ(state.num_running, 0);
+  ASSERT_EQ(state.val, 3);
+}
+
+// Waits, up to a second, for the other of a pair to start
+struct Rendezvous {
+  port::AtomicPointer* started;   // Set by this one
+  port::AtomicPointer* other;     // Set by the other one
+  port::AtomicPointer* met;       // Set if the other one started in time
+
+  static void Run(void* v) {
+    Rendezvous* r = reinterpret_cast<Rendezvous*>(v);
+    r->started->Release_Store(r);
+    for (int i = 0; i < 1000 && r->other->Acquire_Load() == NULL; i++) {
+      Env::Default()->SleepForMicroseconds(1000);
+    }
+    if (r->other->Acquire_Load() != NULL) {
+      r->met->Release_Store(r);
+    }
+  }
+};
+
+TEST(EnvPosixTest, PriorityPools) {
+  // A high priority item runs while the low priority pool is busy
+  port::AtomicPointer low(NULL), high(NULL), met(NULL), ignored(NULL);
+  Rendezvous busy = { &low, &high, &met };
+  Rendezvous flush = { &high, &low, &ignored };
+  env_->Schedule(&Rendezvous::Run, &busy, Env::kLowPriority);
+  env_->Schedule(&Rendezvous::Run, &flush, Env::kHighPriority);
+  Env::Default()->SleepForMicroseconds(kDelayMicros);
+  ASSERT_TRUE(met.Acquire_Load() != NULL);
+
+  // Two low priority items run at once in a pool of two
+  env_->EnsureBackgroundThreads(2, Env::kLowPriority);
+  port::AtomicPointer first(NULL), second(NULL), met2(NULL), ignored2(NULL);
+  Rendezvous a = { &first, &second, &met2 };
+  Rendezvous b = { &second, &first, &ignored2 };
+  env_->Schedule(&Rendezvous::Run, &a, Env::kLowPriority);
+  env_->Schedule(&Rendezvous::Run, &b, Env::kLowPriority);
+  Env::Default()->SleepForMicroseconds(kDelayMicros);
+  ASSERT_TRUE(met2.Acquire_Load() != NULL);
+}
+
+static void WriteTableFile(Env* env, const std::string& fname,
+                           const std::string& data) {
+  WritableFile* file;
+  ASSERT_OK(env->NewWritableFile(fname, &file));
+  ASSERT_OK(file->Append(data));
+  ASSERT_OK(file->Close());
+  delete file;
+}
+
+TEST(EnvPosixTest, MirrorPerDB) {
+  const std::string dir = test::TmpDir() + "/env_mirror_test";
+  const std::string dbs[2] = { dir + "/db0", dir + "/db1" };
+  const std::string paths[2] = { dir + "/mirror0", dir + "/mirror1" };
+  env_->CreateDir(dir);
+
+  MirrorContext* mirrors[2];
+  for (int i = 0; i < 2; i++) {
+    env_->CreateDir(dbs[i]);
+    Options options;
+    options.mirror_path = paths[i];
+    options.mirror_helpers = i + 1;
+    ASSERT_OK(env_->AttachMirror(dbs[i], options, &mirrors[i]));
+    ASSERT_EQ(paths[i] + "/000007.sst",
+              mirrors[i]->MirrorFileName(dbs[i] + "/000007.sst"));
+
+    // A DB is mirrored at most once
+    MirrorContext* again;
+    ASSERT_TRUE(!env_->AttachMirror(dbs[i], options, &again).ok());
+  }
+
+  WriteTableFile(env_, dbs[0] + "/000007.sst", "zero");
+  WriteTableFile(env_, dbs[1] + "/000007.sst", "one");
+  WriteTableFile(env_, dbs[0] + "/MANIFEST-000001", "manifest");
+  for (int i = 0; i < 2; i++) {
+    env_->DetachMirror(mirrors[i]);
+  }
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, paths[0] + "/000007.sst", &data));
+  ASSERT_EQ("zero", data);
+  ASSERT_OK(ReadFileToString(env_, paths[1] + "/000007.sst", &data));
+  ASSERT_EQ("one", data);
+  ASSERT_TRUE(!env_->FileExists(paths[0] + "/MANIFEST-000001"));
+
+  // Files written after DetachMirror() are no longer copied
+  WriteTableFile(env_, dbs[0] + "/000008.sst", "eight");
+  ASSERT_TRUE(!env_->FileExists(paths[0] + "/000008.sst"));
+
+  for (int i = 0; i < 2; i++) {
+    env_->DeleteFile(dbs[i] + "/000007.sst");
+    env_->DeleteFile(paths[i] + "/000007.sst");
+    env_->DeleteDir(paths[i]);
+  }
+  env_->DeleteFile(dbs[0] + "/MANIFEST-000001");
+  env_->DeleteFile(dbs[0] + "/000008.sst");
+  for (int i = 0; i < 2; i++) {
+    env_->DeleteDir(dbs[i]);
+  }
+  env_->DeleteDir(dir);
+}
+
+TEST(EnvPosixTest, MirrorWrites) {
+  const std::string dir = test::TmpDir() + "/env_mirror_writes";
+  const std::string db = dir + "/db";
+  env_->CreateDir(dir);
+  env_->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  MirrorContext* mirror;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+
+  // Three full buffers and a partial one, each byte telling its offset
+  std::string contents;
+  for (size_t i = 0; i < MIRROR_BUFFER_SIZE * 3 + 5000; i++) {
+    contents.push_back(static_cast<char>(i % 251));
+  }
+  WritableFile* file;
+  ASSERT_OK(env_->NewWritableFile(db + "/000009.sst", &file));
+  for (size_t off = 0; off < contents.size(); off += 100000) {
+    ASSERT_OK(file->Append(Slice(contents.data() + off,
+                                 std::min<size_t>(100000,
+                                                  contents.size() - off))));
+  }
+  ASSERT_OK(file->Close());
+  delete file;
+  ASSERT_TRUE(mirror->WaitForWatermark(9, 10000000));
+
+  MirrorQueueStats stats;
+  mirror->GetStats(&stats);
+  ASSERT_EQ(4, stats.buffers_written);
+  ASSERT_GE(stats.write_calls, 1);
+  ASSERT_LE(stats.write_calls, 4);
+  env_->DetachMirror(mirror);
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/000009.sst",
+                             &data));
+  ASSERT_TRUE(data == contents);
+  env_->DeleteFile(db + "/000009.sst");
+  env_->DeleteFile(options.mirror_path + "/000009.sst");
+  env_->DeleteDir(options.mirror_path);
+  env_->DeleteDir(db);
+  env_->DeleteDir(dir);
+}
+
+TEST(EnvPosixTest, MirrorCopyOnClose) {
+  const std::string dir = test::TmpDir() + "/env_mirror_copy_on_close";
+  const std::string db = dir + "/db";
+  env_->CreateDir(dir);
+  env_->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  options.mirror_copy_on_close = true;
+  MirrorContext* mirror;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+
+  std::string contents;
+  for (size_t i = 0; i < MIRROR_BUFFER_SIZE + 5000; i++) {
+    contents.push_back(static_cast<char>(i % 251));
+  }
+  WritableFile* file;
+  ASSERT_OK(env_->NewWritableFile(db + "/000009.sst", &file));
+  ASSERT_OK(file->Append(contents));
+  // Nothing reaches the mirror before the close
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000009.sst"));
+  ASSERT_TRUE(!mirror->CopyLanded(9));
+  ASSERT_OK(file->Close());
+  delete file;
+  ASSERT_TRUE(mirror->WaitForWatermark(9, 10000000));
+
+  MirrorQueueStats stats;
+  mirror->GetStats(&stats);
+  ASSERT_EQ(1, stats.files_copied);
+  ASSERT_LE(stats.files_cloned, 1);
+  ASSERT_EQ(0, stats.buffers_written);
+  ASSERT_EQ(0, stats.inflight_bytes);
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/000009.sst",
+                             &data));
+  ASSERT_TRUE(data == contents);
+
+  // The unlink is ordered after the copy
+  ASSERT_OK(env_->DeleteFile(db + "/000009.sst"));
+  env_->DetachMirror(mirror);
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000009.sst"));
+  env_->DeleteDir(options.mirror_path);
+  env_->DeleteDir(db);
+  env_->DeleteDir(dir);
+}
+
+TEST(EnvPosixTest, MirrorMetadata) {
+  ASSERT_TRUE(MirrorContext::IsMetadataFile("/a/b/MANIFEST-000002"));
+  ASSERT_TRUE(MirrorContext::IsMetadataFile("/a/b/CURRENT"));
+  ASSERT_TRUE(MirrorContext::IsMetadataFile("/a/b/000003.dbtmp"));
+  ASSERT_TRUE(MirrorContext::IsMetadataFile("/a/b/000004.log"));
+  ASSERT_TRUE(!MirrorContext::IsMetadataFile("/a/b/000005.sst"));
+  ASSERT_TRUE(!MirrorContext::IsMetadataFile("/a/b/LOG"));
+  ASSERT_TRUE(!MirrorContext::IsMetadataFile("/a/b/LOCK"));
+
+  const std::string dir = test::TmpDir() + "/env_mirror_metadata";
+  const std::string db = dir + "/db";
+  env_->CreateDir(dir);
+  env_->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  options.mirror_metadata = true;
+  MirrorContext* mirror;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+
+  // Each flush reaches the mirror before the file is closed
+  WritableFile* file;
+  ASSERT_OK(env_->NewWritableFile(db + "/000004.log", &file));
+  ASSERT_OK(file->Append("record1"));
+  ASSERT_OK(file->Flush());
+  ASSERT_OK(file->Append("record2"));
+  ASSERT_OK(file->Flush());
+  ASSERT_TRUE(mirror->WaitForLag(0, 10000000));
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/000004.log",
+                             &data));
+  ASSERT_EQ("record1record2", data);
+  ASSERT_OK(file->Close());
+  delete file;
+
+  // CURRENT is written under a temporary name and renamed
+  ASSERT_OK(WriteStringToFile(env_, "MANIFEST-000002\n",
+                              db + "/000002.dbtmp"));
+  ASSERT_OK(env_->RenameFile(db + "/000002.dbtmp", db + "/CURRENT"));
+  ASSERT_OK(env_->DeleteFile(db + "/000004.log"));
+  env_->DetachMirror(mirror);
+  ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/CURRENT", &data));
+  ASSERT_EQ("MANIFEST-000002\n", data);
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000002.dbtmp"));
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000004.log"));
+
+  // Without the option they stay on the primary
+  options.mirror_metadata = false;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+  ASSERT_OK(WriteStringToFile(env_, "x", db + "/MANIFEST-000005"));
+  env_->DetachMirror(mirror);
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/MANIFEST-000005"));
+
+  // A mirror that cannot take the file leaves it to the primary
+  options.mirror_metadata = true;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+  ASSERT_OK(env_->CreateDir(options.mirror_path + "/MANIFEST-000006.new"));
+  ASSERT_OK(WriteStringToFile(env_, "y", db + "/MANIFEST-000006"));
+  env_->DetachMirror(mirror);
+  ASSERT_OK(ReadFileToString(env_, db + "/MANIFEST-000006", &data));
+  ASSERT_EQ("y", data);
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/MANIFEST-000006"));
+
+  env_->DeleteDir(options.mirror_path + "/MANIFEST-000006.new");
+  env_->DeleteFile(db + "/MANIFEST-000006");
+  env_->DeleteFile(db + "/MANIFEST-000005");
+  env_->DeleteFile(db + "/CURRENT");
+  env_->DeleteFile(options.mirror_path + "/CURRENT");
+  env_->DeleteDir(options.mirror_path);
+  env_->DeleteDir(db);
+  env_->DeleteDir(dir);
+}
+
+// Makes the next mirror write fail once "arg", an AtomicPointer, is set
+static void FailMirrorWrite(void* arg, int type, int fd, uint64_t offset,
+                            size_t size) {
+  port::AtomicPointer* armed = reinterpret_cast<port::AtomicPointer*>(arg);
+  if (type == MBufSync && armed->Acquire_Load() != NULL) {
+    armed->Release_Store(NULL);
+    const int rd = open("/dev/null", O_RDONLY);
+    dup2(rd, fd);
+    close(rd);
+  }
+}
+
+TEST(EnvPosixTest, MirrorMetadataWriteFailure) {
+  const std::string dir = test::TmpDir() + "/env_mirror_metadata_failure";
+  const std::string db = dir + "/db";
+  env_->CreateDir(dir);
+  env_->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  options.mirror_metadata = true;
+  MirrorContext* mirror;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+  port::AtomicPointer armed(NULL);
+  mirror->SetIOHook(&FailMirrorWrite, &armed);
+
+  // A CURRENT whose temporary copy is torn is not renamed into place
+  ASSERT_OK(WriteStringToFile(env_, "MANIFEST-000002\n",
+                              db + "/000002.dbtmp"));
+  ASSERT_OK(env_->RenameFile(db + "/000002.dbtmp", db + "/CURRENT"));
+  ASSERT_TRUE(mirror->WaitForLag(0, 10000000));
+  armed.Release_Store(&armed);
+  ASSERT_OK(WriteStringToFile(env_, "MANIFEST-000003\n",
+                              db + "/000003.dbtmp"));
+  ASSERT_OK(env_->RenameFile(db + "/000003.dbtmp", db + "/CURRENT"));
+  ASSERT_TRUE(mirror->WaitForLag(0, 10000000));
+  MirrorQueueStats stats;
+  mirror->GetStats(&stats);
+  ASSERT_EQ(1, stats.metadata_failures);
+  env_->DetachMirror(mirror);
+  std::string data;
+  ASSERT_OK(ReadFileToString(env_, options.mirror_path + "/CURRENT", &data));
+  ASSERT_EQ("MANIFEST-000002\n", data);
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000003.dbtmp"));
+  ASSERT_TRUE(!env_->FileExists(options.mirror_path + "/000003.dbtmp.new"));
+
+  env_->DeleteFile(db + "/CURRENT");
+  env_->DeleteFile(options.mirror_path + "/CURRENT");
+  env_->DeleteDir(options.mirror_path);
+  env_->DeleteDir(db);
+  env_->DeleteDir(dir);
+}
+
+TEST(EnvPosixTest, MirrorLag) {
+  const std::string dir = test::TmpDir() + "/env_mirror_lag";
+  const std::string db = dir + "/db";
+  env_->CreateDir(dir);
+  env_->CreateDir(db);
+  Options options;
+  options.mirror_path = dir + "/mirror";
+  MirrorContext* mirror;
+  ASSERT_OK(env_->AttachMirror(db, options, &mirror));
+  ASSERT_EQ(0, mirror->QueuedBytes());
+  ASSERT_TRUE(mirror->WaitForLag(0, 0));
+
+  // Two full buffers are queued while the file is still open
+  WritableFile* file;
+  ASSERT_OK(env_->NewWritableFile(db + "/000009.sst", &file));
+  ASSERT_OK(file->Append(std::string(MIRROR_BUFFER_SIZE * 2 + 1, 'x')));
+  ASSERT_TRUE(mirror->WaitForLag(0, 10000000));
+  ASSERT_EQ(0, mirror->QueuedBytes());
+  ASSERT_OK(file->Close());
+  delete file;
+  env_->DetachMirror(mirror);
+
+  uint64_t size;
+  ASSERT_OK(env_->GetFileSize(options.mirror_path + "/000009.sst", &size));
+  ASSERT_EQ(MIRROR_BUFFER_SIZE * 2 + 1, size);
+  env_->DeleteFile(db + "/000009.sst");
+  env_->DeleteFile(options.mirror_path + "/000009.sst");
+  env_->DeleteDir(options.mirror_path);
+  env_->DeleteDir(db);
+  env_->DeleteDir(dir);
+}
+
+TEST(EnvPosixTest, ReadaheadScan) {
+  const std::string fname = test::TmpDir() + "/env_readahead_test";
+  const size_t saved = MIRROR_READAHEAD;
+  MIRROR_READAHEAD = 64 << 10;
+
+  Random rnd(301);
+  std::string data;
+  test::RandomString(&rnd, 230 << 10, &data);  // 3.6 windows
+  ASSERT_OK(WriteStringToFile(env_, data, fname));
+
+  RandomAccessFile* file;
+  ASSERT_OK(env_->NewRandomAccessFile(fname, &file, true));
+  std::string scratch(data.size(), '\0');
+  Slice result;
+
+  // The footer and index first, as Table::Open reads them
+  ASSERT_OK(file->Read(data.size() - 48, 48, &result, &scratch[0]));
+  ASSERT_EQ(data.substr(data.size() - 48), result.ToString());
+  ASSERT_OK(file->Read(data.size() - 5000, 4000, &result, &scratch[0]));
+  ASSERT_EQ(data.substr(data.size() - 5000, 4000), result.ToString());
+
+  // Then the blocks in order, some straddling two windows
+  size_t offset = 0;
+  while (offset < data.size()) {
+    size_t n = 1 + rnd.Uniform(20000);
+    if (offset + n > data.size()) n = data.size() - offset;
+    ASSERT_OK(file->Read(offset, n, &result, &scratch[0]));
+    ASSERT_EQ(data.substr(offset, n), result.ToString());
+    offset += n;
+  }
+
+  // Random reads still work, and reading past the end fails
+  for (int i = 0; i < 100; i++) {
+    const size_t off = rnd.Uniform(data.size() - 100);
+    ASSERT_OK(file->Read(off, 100, &result, &scratch[0]));
+    ASSERT_EQ(data.substr(off, 100), result.ToString());
+  }
+  ASSERT_TRUE(!file->Read(data.size() - 10, 20, &result, &scratch[0]).ok());
+
+  delete file;
+  env_->DeleteFile(fname);
+  MIRROR_READAHEAD = saved;
+}
+
+class TestMirror : public MirrorContext {
+ public:
+  TestMirror() : MirrorContext("db", "mirror") { }
+  virtual void GetStats(MirrorQueueStats* stats) { GetCopyStats(stats); }
+  virtual uint64_t QueuedBytes() { return 0; }
+  virtual bool WaitForLag(uint64_t target, uint64_t max_wait) { return true; }
+};
+
+static void FinishCopy(void* arg) {
+  Env::Default()->SleepForMicroseconds(10000);
+  reinterpret_cast<TestMirror*>(arg)->CopyDone(7);
+}
+
+TEST(EnvPosixTest, MirrorCopyTracking) {
+  uint64_t number;
+  ASSERT_TRUE(MirrorContext::TableFileNumber("/a/b/000007.sst", &number));
+  ASSERT_EQ(7, number);
+  ASSERT_TRUE(!MirrorContext::TableFileNumber("/a/b/000007.log", &number));
+  ASSERT_TRUE(!MirrorContext::TableFileNumber("/a/b/MANIFEST-000007",
+                                              &number));
+
+  TestMirror mirror;
+  MirrorQueueStats stats;
+  ASSERT_TRUE(mirror.WaitForCopy(7, 0));  // Not tracked
+
+  // Still written by its compaction: never waited for
+  mirror.CopyStarted(7);
+  ASSERT_TRUE(!mirror.WaitForCopy(7, 1000000));
+  mirror.GetStats(&stats);
+  ASSERT_EQ(1, stats.copies_inflight);
+  ASSERT_EQ(1, stats.copy_fallbacks);
+
+  mirror.CopyQueued(7);
+  env_->StartThread(&FinishCopy, &mirror);
+  ASSERT_TRUE(mirror.WaitForCopy(7, 10000000));
+  mirror.GetStats(&stats);
+  ASSERT_EQ(0, stats.copies_inflight);
+  ASSERT_EQ(1, stats.copy_waits);
+  ASSERT_GT(stats.copy_land_micros, 0);
+
+  // Recent copies took ~10ms to land; do not wait 1ms for the next one
+  mirror.CopyStarted(8);
+  mirror.CopyQueued(8);
+  ASSERT_TRUE(!mirror.WaitForCopy(8, 1000));
+  mirror.CopyDone(8);
+  ASSERT_TRUE(mirror.WaitForCopy(8, 0));
+}
+
+TEST(EnvPosixTest, MirrorWatermark) {
+  TestMirror mirror;
+  ASSERT_EQ(0, mirror.Watermark());
+  mirror.CopyStarted(7);
+  mirror.CopyStarted(9);
+  ASSERT_EQ(6, mirror.Watermark());
+  ASSERT_EQ(9, mirror.LastCopyStarted());
+
+  // A later copy landing first does not move the watermark
+  mirror.CopyDone(9);
+  ASSERT_EQ(6, mirror.Watermark());
+  ASSERT_TRUE(!mirror.WaitForWatermark(7, 1000));
+
+  mirror.CopyQueued(7);
+  env_->StartThread(&FinishCopy, &mirror);
+  ASSERT_TRUE(mirror.WaitForWatermark(9, 10000000));
+  ASSERT_EQ(9, mirror.Watermark());
+}
+
+TEST(EnvPosixTest, MirrorCopyFailed) {
+  TestMirror mirror;
+  MirrorQueueStats stats;
+  uint64_t number;
+  mirror.CopyStarted(7);
+  mirror.CopyQueued(7);
+  ASSERT_TRUE(!mirror.FirstFailedCopy(&number));
+
+  // Ends the flight, but the copy is neither read nor landed
+  mirror.CopyFailed(7);
+  ASSERT_EQ(7, mirror.Watermark());
+  ASSERT_TRUE(!mirror.CopyLanded(7));
+  ASSERT_TRUE(!mirror.WaitForCopy(7, 0));
+  ASSERT_TRUE(mirror.FirstFailedCopy(&number));
+  ASSERT_EQ(7, number);
+  mirror.GetStats(&stats);
+  ASSERT_EQ(0, stats.copies_inflight);
+  ASSERT_EQ(0, stats.copies_skipped);
+  ASSERT_EQ(1, stats.copies_failed);
+
+  // Until it is copied again or the table is gone
+  mirror.CopyStarted(7);
+  ASSERT_TRUE(!mirror.FirstFailedCopy(&number));
+  mirror.CopyFailed(7);
+  mirror.TableDeleted(7);
+  ASSERT_TRUE(!mirror.FirstFailedCopy(&number));
+
+  // A copy whose table was deleted in flight cannot fail any more
+  mirror.CopyStarted(8);
+  mirror.TableDeleted(8);
+  ASSERT_EQ(8, mirror.Watermark());
+  mirror.CopyFailed(8);
+  ASSERT_TRUE(!mirror.FirstFailedCopy(&number));
+}
+
 }  // namespace leveldb
 
 int main(int argc, char** argv) {
@@ -0,0 +1,425 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/mirror.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "util/rate_limiter.h"
+
+namespace leveldb {
+
+static uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+MirrorContext::MirrorContext(const std::string& dbname,
+                             const std::string& path)
+    : dbname_(dbname),
+      path_(path),
+      last_started_(0),
+      land_micros_(0),
+      waits_(0),
+      wait_micros_(0),
+      fallbacks_(0),
+      io_hook_(NULL),
+      io_hook_arg_(NULL) {
+  pthread_mutex_init(&copy_mu_, NULL);
+  pthread_cond_init(&copy_done_, NULL);
+}
+
+MirrorContext::~MirrorContext() {
+  pthread_cond_destroy(&copy_done_);
+  pthread_mutex_destroy(&copy_mu_);
+}
+
+void MirrorContext::CopyStarted(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  skipped_.erase(number);
+  failed_.erase(number);
+  copies_[number] = 0;
+  if (number > last_started_) {
+    last_started_ = number;
+  }
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+bool MirrorContext::TryCopyStarted(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  const bool started = (copies_.count(number) == 0);
+  if (started) {
+    skipped_.erase(number);
+    failed_.erase(number);
+    copies_[number] = 0;
+    if (number > last_started_) {
+      last_started_ = number;
+    }
+  }
+  pthread_mutex_unlock(&copy_mu_);
+  return started;
+}
+
+void MirrorContext::CopyQueued(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  std::map<uint64_t, uint64_t>::iterator it = copies_.find(number);
+  if (it != copies_.end()) {
+    it->second = NowMicros();
+  }
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+void MirrorContext::CopyDone(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  std::map<uint64_t, uint64_t>::iterator it = copies_.find(number);
+  if (it != copies_.end()) {
+    if (it->second != 0) {
+      const uint64_t now = NowMicros();
+      const uint64_t sample = (now > it->second) ? now - it->second : 0;
+      land_micros_ = (land_micros_ == 0) ? sample
+                                         : (7 * land_micros_ + sample) / 8;
+    }
+    copies_.erase(it);
+    pthread_cond_broadcast(&copy_done_);
+  }
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+void MirrorContext::CopySkipped(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  skipped_.insert(number);
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+void MirrorContext::CopyFailed(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  if (copies_.erase(number) > 0) {
+    skipped_.insert(number);
+    failed_.insert(number);
+    pthread_cond_broadcast(&copy_done_);
+  }
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+bool MirrorContext::FirstFailedCopy(uint64_t* number) {
+  pthread_mutex_lock(&copy_mu_);
+  const bool failed = !failed_.empty();
+  if (failed) {
+    *number = *failed_.begin();
+  }
+  pthread_mutex_unlock(&copy_mu_);
+  return failed;
+}
+
+bool MirrorContext::IsCopySkipped(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  const bool skipped = (skipped_.count(number) > 0);
+  pthread_mutex_unlock(&copy_mu_);
+  return skipped;
+}
+
+void MirrorContext::TableDeleted(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  skipped_.erase(number);
+  failed_.erase(number);
+  // Nothing reads a deleted table: its copy has nothing to hold back
+  if (copies_.erase(number) > 0) {
+    pthread_cond_broadcast(&copy_done_);
+  }
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+bool MirrorContext::WaitForCopy(uint64_t number, uint64_t max_wait_micros) {
+  pthread_mutex_lock(&copy_mu_);
+  if (skipped_.count(number) > 0) {
+    pthread_mutex_unlock(&copy_mu_);
+    return false;  // Nothing to wait for
+  }
+  std::map<uint64_t, uint64_t>::iterator it = copies_.find(number);
+  if (it == copies_.end()) {
+    pthread_mutex_unlock(&copy_mu_);
+    return true;
+  }
+
+  // Still being written by its compaction: no estimate, do not wait
+  const uint64_t start = NowMicros();
+  bool wait = false;
+  if (it->second != 0) {
+    const uint64_t elapsed = (start > it->second) ? start - it->second : 0;
+    const uint64_t expected =
+        (land_micros_ > elapsed) ? land_micros_ - elapsed : 0;
+    wait = (expected <= max_wait_micros);
+  }
+
+  if (wait) {
+    const uint64_t deadline = start + max_wait_micros;
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while (copies_.count(number) > 0) {
+      if (pthread_cond_timedwait(&copy_done_, &copy_mu_, &ts) == ETIMEDOUT) {
+        break;
+      }
+    }
+  }
+
+  const bool done = (copies_.count(number) == 0);
+  if (done) {
+    waits_++;
+    wait_micros_ += NowMicros() - start;
+  } else {
+    fallbacks_++;
+  }
+  pthread_mutex_unlock(&copy_mu_);
+  return done;
+}
+
+bool MirrorContext::CopyLanded(uint64_t number) {
+  pthread_mutex_lock(&copy_mu_);
+  const bool landed = (copies_.count(number) == 0 &&
+                       skipped_.count(number) == 0);
+  pthread_mutex_unlock(&copy_mu_);
+  return landed;
+}
+
+uint64_t MirrorContext::Watermark() {
+  pthread_mutex_lock(&copy_mu_);
+  const uint64_t w = copies_.empty() ? last_started_
+                                     : copies_.begin()->first - 1;
+  pthread_mutex_unlock(&copy_mu_);
+  return w;
+}
+
+uint64_t MirrorContext::LastCopyStarted() {
+  pthread_mutex_lock(&copy_mu_);
+  const uint64_t n = last_started_;
+  pthread_mutex_unlock(&copy_mu_);
+  return n;
+}
+
+bool MirrorContext::WaitForWatermark(uint64_t number,
+                                     uint64_t max_wait_micros) {
+  const uint64_t deadline = NowMicros() + max_wait_micros;
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000;
+  ts.tv_nsec = (deadline % 1000000) * 1000;
+  pthread_mutex_lock(&copy_mu_);
+  // copies_ is ordered: the watermark is held back by its first entry
+  while (!copies_.empty() && copies_.begin()->first <= number) {
+    if (pthread_cond_timedwait(&copy_done_, &copy_mu_, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+  const bool reached = copies_.empty() || copies_.begin()->first > number;
+  pthread_mutex_unlock(&copy_mu_);
+  return reached;
+}
+
+bool MirrorContext::WaitForQueuedCopies(uint64_t queued_by,
+                                       uint64_t max_wait_micros) {
+  const uint64_t deadline = NowMicros() + max_wait_micros;
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000;
+  ts.tv_nsec = (deadline % 1000000) * 1000;
+  pthread_mutex_lock(&copy_mu_);
+  bool reached = false;
+  while (true) {
+    reached = true;
+    for (std::map<uint64_t, uint64_t>::const_iterator it = copies_.begin();
+         it != copies_.end(); ++it) {
+      if (it->second != 0 && it->second <= queued_by) {
+        reached = false;
+        break;
+      }
+    }
+    if (reached ||
+        pthread_cond_timedwait(&copy_done_, &copy_mu_, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&copy_mu_);
+  return reached;
+}
+
+Status MirrorContext::SyncDir() {
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status::IOError(path_, strerror(errno));
+  }
+  Status s;
+  if (fsync(fd) != 0) {
+    s = Status::IOError(path_, strerror(errno));
+  }
+  close(fd);
+  return s;
+}
+
+// Copies up to "n" bytes at *offset from "in" to "out"; returns the
+// bytes copied, 0 at the end of "in", or -1.
+static ssize_t CopyChunk(int in, int out, uint64_t* offset, size_t n,
+                         bool* use_copy_range) {
+  if (*use_copy_range) {
+    loff_t in_off = *offset, out_off = *offset;
+    const ssize_t r = copy_file_range(in, &in_off, out, &out_off, n, 0);
+    if (r >= 0) {
+      *offset += r;
+      return r;
+    }
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+        errno != EOPNOTSUPP) {
+      return -1;
+    }
+    *use_copy_range = false;  // e.g. across file systems on older kernels
+  }
+  char* buf = new char[n];
+  ssize_t r = pread(in, buf, n, *offset);
+  if (r > 0 && pwrite(out, buf, r, *offset) != r) {
+    r = -1;
+  }
+  delete[] buf;
+  if (r > 0) {
+    *offset += r;
+  }
+  return r;
+}
+
+Status MirrorContext::CopyFromPrimary(const std::string& fname,
+                                      RateLimiter* limiter,
+                                      uint64_t* bytes, bool* cloned) {
+  *bytes = 0;
+  if (cloned != NULL) {
+    *cloned = false;
+  }
+  // Readers that still hold the old copy open keep reading it
+  const std::string mfname = MirrorFileName(fname);
+  const std::string tmp = mfname + ".resync";
+  const int in = open(fname.c_str(), O_RDONLY);
+  if (in < 0) {
+    return Status::IOError(fname, strerror(errno));
+  }
+  const int out = open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (out < 0) {
+    Status s = Status::IOError(tmp, strerror(errno));
+    close(in);
+    return s;
+  }
+
+  Status s;
+  struct stat sbuf;
+  if (fstat(in, &sbuf) != 0) {
+    s = Status::IOError(fname, strerror(errno));
+  }
+  bool use_copy_range = true;
+  uint64_t offset = 0;
+#ifdef FICLONE
+  // Shares the primary's extents when both are on one reflink-capable
+  // file system; fails with EXDEV or EOPNOTSUPP everywhere else.
+  if (s.ok() && ioctl(out, FICLONE, in) == 0) {
+    offset = sbuf.st_size;
+    if (cloned != NULL) {
+      *cloned = true;
+    }
+  }
+#endif
+  while (s.ok() && offset < static_cast<uint64_t>(sbuf.st_size)) {
+    const size_t n = std::min<uint64_t>(MIRROR_COPY_CHUNK,
+                                        sbuf.st_size - offset);
+    if (limiter != NULL) {
+      limiter->Request(n);
+    }
+    ChargeIO(MCopy, out, offset, n);
+    const ssize_t r = CopyChunk(in, out, &offset, n, &use_copy_range);
+    if (r < 0) {
+      s = Status::IOError(mfname, strerror(errno));
+    } else if (r == 0) {
+      break;  // Shrank under us
+    }
+  }
+  if (s.ok()) {
+    ChargeIO(MBufClose, out, 0, 0);
+  }
+  if (s.ok() && fdatasync(out) != 0) {
+    s = Status::IOError(mfname, strerror(errno));
+  }
+  close(out);
+  close(in);
+  if (s.ok() && rename(tmp.c_str(), mfname.c_str()) != 0) {
+    s = Status::IOError(mfname, strerror(errno));
+  }
+  if (!s.ok()) {
+    unlink(tmp.c_str());
+  }
+  *bytes = offset;
+  return s;
+}
+
+bool MirrorContext::TableFileNumber(const std::string& fname,
+                                    uint64_t* number) {
+  const size_t slash = fname.find_last_of("/");
+  const std::string base = (slash == std::string::npos) ?
+                           fname : fname.substr(slash + 1);
+  const size_t dot = base.find('.');
+  if (dot == 0 || dot == std::string::npos || base.substr(dot) != ".sst") {
+    return false;
+  }
+  uint64_t n = 0;
+  for (size_t i = 0; i < dot; i++) {
+    const char c = base[i];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    n = n * 10 + (c - '0');
+  }
+  *number = n;
+  return true;
+}
+
+bool MirrorContext::IsMetadataFile(const std::string& fname) {
+  const size_t slash = fname.find_last_of("/");
+  const std::string base = (slash == std::string::npos) ?
+                           fname : fname.substr(slash + 1);
+  if (base == "CURRENT" || base.compare(0, 9, "MANIFEST-") == 0) {
+    return true;
+  }
+  const size_t dot = base.find('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+  const std::string suffix = base.substr(dot);
+  if (suffix == ".dbtmp") {
+    return true;
+  }
+  if (dot == 0 || suffix != ".log") {
+    return false;
+  }
+  for (size_t i = 0; i < dot; i++) {
+    if (base[i] < '0' || base[i] > '9') {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MirrorContext::GetCopyStats(MirrorQueueStats* stats) {
+  pthread_mutex_lock(&copy_mu_);
+  stats->copies_inflight = copies_.size();
+  stats->copy_land_micros = land_micros_;
+  stats->copy_waits = waits_;
+  stats->copy_wait_micros = wait_micros_;
+  stats->copy_fallbacks = fallbacks_;
+  stats->copies_skipped = skipped_.size() - failed_.size();
+  stats->copies_failed = failed_.size();
+  pthread_mutex_unlock(&copy_mu_);
+}
+
+}  // namespace leveldb
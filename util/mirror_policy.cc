@@ -0,0 +1,35 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "leveldb/mirror_policy.h"
+
+namespace leveldb {
+
+MirrorPolicy::~MirrorPolicy() { }
+
+namespace {
+
+class LevelMirrorPolicy : public MirrorPolicy {
+ private:
+  const int min_level_;
+
+ public:
+  explicit LevelMirrorPolicy(int min_level) : min_level_(min_level) { }
+
+  virtual const char* Name() const {
+    return "leveldb.LevelMirrorPolicy";
+  }
+
+  virtual bool ShouldMirror(int level, uint64_t expected_size) const {
+    return level >= min_level_;
+  }
+};
+
+}
+
+const MirrorPolicy* NewLevelMirrorPolicy(int min_level) {
+  return new LevelMirrorPolicy(min_level);
+}
+
+}  // namespace leveldb
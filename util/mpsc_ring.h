@@ -0,0 +1,249 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// MPSCRing is a bounded multi-producer/single-consumer queue of
+// fixed-size slots.  It is used to hand mirror I/O operations from the
+// compaction thread(s) to a mirror helper thread without allocating and
+// without taking a lock on the fast path.
+//
+// Slots are preallocated and each one is padded to a cache line.  A
+// producer claims a slot by advancing the tail with a CAS and publishes
+// it by bumping the slot's sequence number (Vyukov's bounded queue).
+// The consumer parks on a futex when the ring is empty, and producers
+// only issue a wakeup system call when they observe a parked consumer.
+// A producer that finds the ring full parks the same way until the
+// consumer frees a slot.
+//
+// T must be a POD type: values are copied in and out with assignment.
+
+#ifndef STORAGE_LEVELDB_UTIL_MPSC_RING_H_
+#define STORAGE_LEVELDB_UTIL_MPSC_RING_H_
+
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#if defined(OS_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace leveldb {
+
+// A 32-bit word that one side can sleep on until the other side
+// changes it.  Backed by a futex on Linux and by a mutex/condvar pair
+// elsewhere.
+class ParkingWord {
+ public:
+  ParkingWord() : word_(0) {
+#if !defined(OS_LINUX)
+    pthread_mutex_init(&mu_, NULL);
+    pthread_cond_init(&cv_, NULL);
+#endif
+  }
+
+  ~ParkingWord() {
+#if !defined(OS_LINUX)
+    pthread_cond_destroy(&cv_);
+    pthread_mutex_destroy(&mu_);
+#endif
+  }
+
+  int32_t Load() const {
+    return __atomic_load_n(&word_, __ATOMIC_SEQ_CST);
+  }
+
+  void Store(int32_t v) {
+    __atomic_store_n(&word_, v, __ATOMIC_SEQ_CST);
+  }
+
+  // Sleep while the word still equals "expected".  May return
+  // spuriously; callers re-check their condition.
+  void Wait(int32_t expected) {
+#if defined(OS_LINUX)
+    syscall(SYS_futex, &word_, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&mu_);
+    while (Load() == expected) {
+      pthread_cond_wait(&cv_, &mu_);
+    }
+    pthread_mutex_unlock(&mu_);
+#endif
+  }
+
+  // Wake every thread sleeping on the word.
+  void WakeAll() {
+#if defined(OS_LINUX)
+    syscall(SYS_futex, &word_, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&mu_);
+    pthread_cond_broadcast(&cv_);
+    pthread_mutex_unlock(&mu_);
+#endif
+  }
+
+ private:
+  int32_t word_;
+#if !defined(OS_LINUX)
+  pthread_mutex_t mu_;
+  pthread_cond_t cv_;
+#endif
+
+  // No copying allowed
+  ParkingWord(const ParkingWord&);
+  void operator=(const ParkingWord&);
+};
+
+template <typename T>
+class MPSCRing {
+ public:
+  enum { kCacheLineSize = 64 };
+
+  // Create a ring that holds up to "capacity" entries.  "capacity" is
+  // rounded up to a power of two.
+  explicit MPSCRing(size_t capacity)
+      : head_(0), tail_(0) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    mask_ = cap - 1;
+    slots_ = reinterpret_cast<Slot*>(memalign(kCacheLineSize,
+                                              sizeof(Slot) * cap));
+    for (size_t i = 0; i < cap; i++) {
+      slots_[i].seq = i;
+    }
+  }
+
+  ~MPSCRing() {
+    free(slots_);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Approximate number of queued entries.
+  size_t Size() const {
+    uint64_t tail = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    return (tail > head) ? static_cast<size_t>(tail - head) : 0;
+  }
+
+  // Add "v" to the ring.  Returns false if the ring is full.
+  // Safe to call from any number of threads.
+  bool TryPush(const T& v) {
+    Slot* slot;
+    uint64_t pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    for (;;) {
+      slot = &slots_[pos & mask_];
+      const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      const int64_t diff = static_cast<int64_t>(seq - pos);
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&tail_, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
+        // pos was reloaded by the failed CAS
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+      }
+    }
+    slot->value = v;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence in WaitNonEmpty(): either the consumer sees
+    // the slot we just published, or we see that it is parked.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (consumer_parked_.Load() != 0) {
+      consumer_parked_.Store(0);
+      consumer_parked_.WakeAll();
+    }
+    return true;
+  }
+
+  // Add "v" to the ring, parking the caller while the ring is full.
+  void Push(const T& v) {
+    while (!TryPush(v)) {
+      producers_parked_.Store(1);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (Full()) {
+        producers_parked_.Wait(1);
+      }
+    }
+  }
+
+  // Remove the oldest entry into *v.  Returns false if the ring is empty.
+  // REQUIRES: only one thread ever calls TryPop()/WaitNonEmpty().
+  bool TryPop(T* v) {
+    Slot* slot = &slots_[head_ & mask_];
+    const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != head_ + 1) {
+      return false;
+    }
+    *v = slot->value;
+    __atomic_store_n(&slot->seq, head_ + mask_ + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&head_, head_ + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (producers_parked_.Load() != 0) {
+      producers_parked_.Store(0);
+      producers_parked_.WakeAll();
+    }
+    return true;
+  }
+
+  // Returns true iff the next TryPop() would succeed.
+  // REQUIRES: called from the consumer thread.
+  bool NonEmpty() const {
+    const Slot* slot = &slots_[head_ & mask_];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == head_ + 1;
+  }
+
+  // Park the consumer until a producer publishes an entry.  May return
+  // spuriously.
+  // REQUIRES: called from the consumer thread.
+  void WaitNonEmpty() {
+    consumer_parked_.Store(1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!NonEmpty()) {
+      consumer_parked_.Wait(1);
+    }
+    consumer_parked_.Store(0);
+  }
+
+ private:
+  struct Slot {
+    uint64_t seq;
+    T value;
+    char pad[kCacheLineSize - (sizeof(uint64_t) + sizeof(T)) % kCacheLineSize];
+  };
+
+  bool Full() const {
+    const uint64_t pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+    const Slot* slot = &slots_[pos & mask_];
+    return static_cast<int64_t>(
+        __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos) < 0;
+  }
+
+  // Consumer and producer cursors live on separate cache lines so that
+  // the helper popping entries does not bounce the line producers CAS.
+  char pad0_[kCacheLineSize];
+  uint64_t head_;
+  char pad1_[kCacheLineSize - sizeof(uint64_t)];
+  uint64_t tail_;
+  char pad2_[kCacheLineSize - sizeof(uint64_t)];
+  Slot* slots_;
+  size_t mask_;
+  ParkingWord consumer_parked_;
+  ParkingWord producers_parked_;
+
+  // No copying allowed
+  MPSCRing(const MPSCRing&);
+  void operator=(const MPSCRing&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_MPSC_RING_H_
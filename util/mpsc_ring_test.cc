@@ -0,0 +1,117 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/mpsc_ring.h"
+
+#include <vector>
+#include "leveldb/env.h"
+#include "port/port.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+struct Item {
+  int producer;
+  int seq;
+};
+
+class MPSCRingTest { };
+
+TEST(MPSCRingTest, Empty) {
+  MPSCRing<Item> ring(8);
+  Item item;
+  ASSERT_EQ(8, ring.capacity());
+  ASSERT_TRUE(!ring.NonEmpty());
+  ASSERT_TRUE(!ring.TryPop(&item));
+  ASSERT_EQ(0, ring.Size());
+}
+
+TEST(MPSCRingTest, CapacityRoundsUp) {
+  MPSCRing<Item> ring(5);
+  ASSERT_EQ(8, ring.capacity());
+}
+
+TEST(MPSCRingTest, FifoAndFull) {
+  MPSCRing<Item> ring(4);
+  Item item;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 4; i++) {
+      item.producer = 0;
+      item.seq = round * 4 + i;
+      ASSERT_TRUE(ring.TryPush(item));
+    }
+    ASSERT_TRUE(!ring.TryPush(item));
+    ASSERT_EQ(4, ring.Size());
+    for (int i = 0; i < 4; i++) {
+      ASSERT_TRUE(ring.NonEmpty());
+      ASSERT_TRUE(ring.TryPop(&item));
+      ASSERT_EQ(round * 4 + i, item.seq);
+    }
+    ASSERT_TRUE(!ring.TryPop(&item));
+  }
+}
+
+static const int kProducers = 4;
+static const int kItemsPerProducer = 100000;
+
+struct ProducerArg {
+  MPSCRing<Item>* ring;
+  int id;
+  port::AtomicPointer* done;
+};
+
+static void Producer(void* arg) {
+  ProducerArg* p = reinterpret_cast<ProducerArg*>(arg);
+  Item item;
+  item.producer = p->id;
+  for (int i = 0; i < kItemsPerProducer; i++) {
+    item.seq = i;
+    p->ring->Push(item);
+  }
+  p->done->Release_Store(p);
+}
+
+TEST(MPSCRingTest, ConcurrentProducers) {
+  // A small ring forces producers to park on a full ring and the
+  // consumer to park on an empty one.
+  MPSCRing<Item> ring(16);
+  port::AtomicPointer done[kProducers];
+  ProducerArg args[kProducers];
+  for (int i = 0; i < kProducers; i++) {
+    done[i].NoBarrier_Store(NULL);
+    args[i].ring = &ring;
+    args[i].id = i;
+    args[i].done = &done[i];
+    Env::Default()->StartThread(&Producer, &args[i]);
+  }
+
+  std::vector<int> next(kProducers, 0);
+  int received = 0;
+  Item item;
+  while (received < kProducers * kItemsPerProducer) {
+    if (!ring.TryPop(&item)) {
+      ring.WaitNonEmpty();
+      continue;
+    }
+    ASSERT_TRUE(item.producer >= 0 && item.producer < kProducers);
+    // Each producer's items arrive in the order they were pushed
+    ASSERT_EQ(next[item.producer], item.seq);
+    next[item.producer]++;
+    received++;
+  }
+  ASSERT_TRUE(!ring.TryPop(&item));
+
+  for (int i = 0; i < kProducers; i++) {
+    while (done[i].Acquire_Load() == NULL) {
+      Env::Default()->SleepForMicroseconds(1000);
+    }
+    ASSERT_EQ(kItemsPerProducer, next[i]);
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -18,11 +18,38 @@ Options::Options()
       info_log(NULL),
       write_buffer_size(4<<20),
       max_open_files(1000),
+      target_file_size(2<<20),
+      target_file_size_multiplier(1),
+      level1_size(10<<20),
+      level_ratio(10),
+      level0_compaction_trigger(2),
+      level0_slowdown_writes_trigger(16),
+      level0_stop_writes_trigger(32),
+      max_mem_compact_level(2),
+      max_background_compactions(1),
+      max_subcompactions(1),
       block_cache(NULL),
       block_size(4096),
       block_restart_interval(16),
       compression(kSnappyCompression),
-      filter_policy(NULL) {
+      filter_policy(NULL),
+      mirror_compaction_reads(true),
+      mirror_read_levels(0),
+      mirror_read_routing(false),
+      mirror_read_balance(kNoReadBalance),
+      mirror_helpers(4),
+      mirror_queue_cap(256<<20),
+      mirror_lag_target(64<<20),
+      compaction_write_rate(0),
+      mirror_write_rate(0),
+      mirror_delete_rate(0),
+      mirror_policy(NULL),
+      mirror_copy_on_close(false),
+      mirror_resync_threads(2),
+      mirror_resync_rate(64<<20),
+      mirror_scrub_rate(4<<20),
+      mirror_metadata(false),
+      follower_poll_micros(1000000) {
 }
 
 
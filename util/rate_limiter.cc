@@ -0,0 +1,107 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/rate_limiter.h"
+
+#include <assert.h>
+#include <string.h>
+#include "leveldb/env.h"
+#include "util/mutexlock.h"
+
+namespace leveldb {
+
+RateLimiter::RateLimiter(uint64_t bytes_per_second, Env* env)
+    : rate_(bytes_per_second),
+      burst_(bytes_per_second / 10 > 0 ? bytes_per_second / 10 : 1),
+      env_(env),
+      available_(burst_),
+      last_refill_(env->NowMicros()) {
+  assert(bytes_per_second > 0);
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.bytes_per_second = rate_;
+}
+
+void RateLimiter::Refill(uint64_t now) {
+  mu_.AssertHeld();
+  if (now <= last_refill_) {
+    return;
+  }
+  const uint64_t tokens = (now - last_refill_) * rate_ / 1000000;
+  if (tokens == 0) {
+    return;  // Keep last_refill_ so the fraction is not lost
+  }
+  available_ += static_cast<int64_t>(tokens);
+  if (available_ > burst_) {
+    available_ = burst_;
+  }
+  last_refill_ = now;
+}
+
+void RateLimiter::Request(uint64_t bytes) {
+  uint64_t sleep_micros = 0;
+  {
+    MutexLock l(&mu_);
+    Refill(env_->NowMicros());
+    available_ -= static_cast<int64_t>(bytes);
+    stats_.requests++;
+    stats_.bytes += bytes;
+    if (available_ < 0) {
+      // Our share of the debt is paid off once the bucket is back at zero.
+      // Smaller debts are left to later requests: sleeps that short
+      // would mostly measure the scheduler.
+      sleep_micros = static_cast<uint64_t>(-available_) * 1000000 / rate_;
+      if (sleep_micros < kMinSleepMicros) {
+        sleep_micros = 0;
+      }
+    }
+  }
+  if (sleep_micros > 0) {
+    const uint64_t start = env_->NowMicros();
+    env_->SleepForMicroseconds(static_cast<int>(sleep_micros));
+    const uint64_t slept = env_->NowMicros() - start;
+    MutexLock l(&mu_);
+    stats_.throttled++;
+    stats_.throttled_micros += slept;
+  }
+}
+
+void RateLimiter::GetStats(Stats* stats) {
+  MutexLock l(&mu_);
+  *stats = stats_;
+}
+
+namespace {
+
+class RateLimitedWritableFile : public WritableFile {
+ public:
+  RateLimitedWritableFile(WritableFile* file, RateLimiter* limiter)
+      : file_(file), limiter_(limiter) {
+  }
+
+  virtual ~RateLimitedWritableFile() {
+    delete file_;
+  }
+
+  virtual Status Append(const Slice& data) {
+    limiter_->Request(data.size());
+    return file_->Append(data);
+  }
+
+  virtual Status Close() { return file_->Close(); }
+  virtual Status Flush() { return file_->Flush(); }
+  virtual Status Sync(int flags) { return file_->Sync(flags); }
+
+ private:
+  WritableFile* const file_;
+  RateLimiter* const limiter_;
+};
+
+}  // namespace
+
+WritableFile* NewRateLimitedWritableFile(WritableFile* file,
+                                         RateLimiter* limiter) {
+  return new RateLimitedWritableFile(file, limiter);
+}
+
+}  // namespace leveldb
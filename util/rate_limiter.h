@@ -0,0 +1,70 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// RateLimiter is a token bucket that holds background I/O (compaction
+// output, mirror writes, mirror deletes) to a number of bytes per
+// second, so that it leaves some of the device to foreground reads.
+// The bucket holds at most a tenth of a second of tokens.  A request
+// larger than what is left takes the bucket into debt and its caller
+// sleeps until the debt is paid off, so large writes are not starved
+// and concurrent callers are served in the order they asked.  Debts
+// under a millisecond are carried over rather than slept off.
+// Thread-safe.
+
+#ifndef STORAGE_LEVELDB_UTIL_RATE_LIMITER_H_
+#define STORAGE_LEVELDB_UTIL_RATE_LIMITER_H_
+
+#include <stdint.h>
+#include "port/port.h"
+
+namespace leveldb {
+
+class Env;
+class WritableFile;
+
+class RateLimiter {
+ public:
+  struct Stats {
+    uint64_t bytes_per_second;
+    uint64_t requests;          // Calls of Request()
+    uint64_t bytes;             // Bytes requested
+    uint64_t throttled;         // Requests that had to sleep
+    uint64_t throttled_micros;  // Total time they slept
+  };
+
+  // Allow "bytes_per_second" (> 0), timed with "env".
+  RateLimiter(uint64_t bytes_per_second, Env* env);
+
+  // Take "bytes" from the bucket, sleeping until they are available.
+  void Request(uint64_t bytes);
+
+  void GetStats(Stats* stats);
+
+ private:
+  enum { kMinSleepMicros = 1000 };
+
+  void Refill(uint64_t now);
+
+  const uint64_t rate_;
+  const int64_t burst_;
+  Env* const env_;
+
+  port::Mutex mu_;
+  int64_t available_;           // Protected by mu_; negative when in debt
+  uint64_t last_refill_;        // Protected by mu_
+  Stats stats_;                 // Protected by mu_
+
+  // No copying allowed
+  RateLimiter(const RateLimiter&);
+  void operator=(const RateLimiter&);
+};
+
+// Return a file whose appends are charged to "limiter" before they are
+// passed on to "file".  Takes ownership of "file", not of "limiter".
+WritableFile* NewRateLimitedWritableFile(WritableFile* file,
+                                         RateLimiter* limiter);
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_RATE_LIMITER_H_
@@ -0,0 +1,106 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/rate_limiter.h"
+
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+// A clock that only moves when somebody sleeps
+class FakeClockEnv : public EnvWrapper {
+ public:
+  uint64_t now_;
+  uint64_t slept_;
+
+  FakeClockEnv() : EnvWrapper(Env::Default()), now_(1000000), slept_(0) { }
+
+  virtual uint64_t NowMicros() { return now_; }
+  virtual void SleepForMicroseconds(int micros) {
+    now_ += micros;
+    slept_ += micros;
+  }
+};
+
+class RateLimiterTest { };
+
+TEST(RateLimiterTest, Burst) {
+  FakeClockEnv env;
+  RateLimiter limiter(10 << 20, &env);  // 1MB bucket
+  limiter.Request(1 << 20);
+  ASSERT_EQ(0, env.slept_);
+
+  // Empty bucket: 1MB more takes 100ms
+  limiter.Request(1 << 20);
+  ASSERT_EQ(100000, env.slept_);
+
+  RateLimiter::Stats stats;
+  limiter.GetStats(&stats);
+  ASSERT_EQ(10 << 20, stats.bytes_per_second);
+  ASSERT_EQ(2, stats.requests);
+  ASSERT_EQ(2 << 20, stats.bytes);
+  ASSERT_EQ(1, stats.throttled);
+  ASSERT_EQ(100000, stats.throttled_micros);
+}
+
+TEST(RateLimiterTest, SteadyRate) {
+  FakeClockEnv env;
+  RateLimiter limiter(1 << 20, &env);
+  const uint64_t start = env.NowMicros();
+  for (int i = 0; i < 64; i++) {
+    limiter.Request(64 << 10);
+  }
+  // 4MB at 1MB/s, less the 0.1s bucket the limiter started with
+  const uint64_t elapsed = env.NowMicros() - start;
+  ASSERT_GE(elapsed, 3850000);
+  ASSERT_LE(elapsed, 3950000);
+}
+
+TEST(RateLimiterTest, IdleTimeIsCapped) {
+  FakeClockEnv env;
+  RateLimiter limiter(1 << 20, &env);
+  env.now_ += 60000000;  // A minute idle does not buy a minute's burst
+  limiter.Request(1 << 20);
+  ASSERT_GE(env.slept_, 850000);
+}
+
+TEST(RateLimiterTest, LargeRequest) {
+  FakeClockEnv env;
+  RateLimiter limiter(1 << 20, &env);
+  // Far larger than the bucket: served at once, then paid off
+  limiter.Request(8 << 20);
+  ASSERT_GE(env.slept_, 7800000);
+  ASSERT_LE(env.slept_, 8000000);
+}
+
+TEST(RateLimiterTest, LimitedFile) {
+  FakeClockEnv env;
+  RateLimiter limiter(1 << 20, &env);
+  const std::string fname = test::TmpDir() + "/rate_limiter_test_file";
+  WritableFile* base;
+  ASSERT_OK(env.NewWritableFile(fname, &base));
+  WritableFile* file = NewRateLimitedWritableFile(base, &limiter);
+  const std::string block(256 << 10, 'x');
+  for (int i = 0; i < 8; i++) {
+    ASSERT_OK(file->Append(block));
+  }
+  ASSERT_OK(file->Close());
+  delete file;
+
+  uint64_t size;
+  ASSERT_OK(env.GetFileSize(fname, &size));
+  ASSERT_EQ(2 << 20, size);
+  ASSERT_GE(env.slept_, 1800000);
+  RateLimiter::Stats stats;
+  limiter.GetStats(&stats);
+  ASSERT_EQ(8, stats.requests);
+  ASSERT_OK(env.DeleteFile(fname));
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,220 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/uring_writer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(LEVELDB_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace leveldb {
+
+URingWriter::URingWriter(DoneFunction done, void* arg)
+    : done_(done),
+      arg_(arg),
+      ring_fd_(-1),
+      depth_(0),
+      inflight_(0),
+      unsubmitted_(0),
+      requests_(NULL),
+      free_list_(NULL),
+      sq_ptr_(NULL),
+      sq_len_(0),
+      cq_ptr_(NULL),
+      cq_len_(0),
+      sqes_(NULL),
+      sqes_len_(0) {
+}
+
+#if defined(LEVELDB_HAVE_IO_URING)
+
+static int SysSetup(unsigned entries, struct io_uring_params* p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int SysEnter(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, NULL, 0));
+}
+
+URingWriter::~URingWriter() {
+  if (ring_fd_ < 0) {
+    return;
+  }
+  Drain();
+  munmap(sqes_, sqes_len_);
+  if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+  munmap(sq_ptr_, sq_len_);
+  close(ring_fd_);
+  delete[] requests_;
+}
+
+bool URingWriter::Init(unsigned depth) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = SysSetup(depth, &p);
+  if (fd < 0) {
+    return false;
+  }
+
+  sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    if (cq_len_ > sq_len_) sq_len_ = cq_len_;
+    cq_len_ = sq_len_;
+  }
+  sq_ptr_ = mmap(NULL, sq_len_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  if (single_mmap) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(NULL, cq_len_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      munmap(sq_ptr_, sq_len_);
+      close(fd);
+      return false;
+    }
+  }
+  sqes_len_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmap(NULL, sqes_len_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+    munmap(sq_ptr_, sq_len_);
+    close(fd);
+    return false;
+  }
+
+  char* sq = reinterpret_cast<char*>(sq_ptr_);
+  char* cq = reinterpret_cast<char*>(cq_ptr_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes_ = cq + p.cq_off.cqes;
+
+  ring_fd_ = fd;
+  depth_ = (depth < p.sq_entries) ? depth : p.sq_entries;
+  requests_ = new Request[depth_];
+  for (unsigned i = 0; i < depth_; i++) {
+    requests_[i].next_free = free_list_;
+    free_list_ = &requests_[i];
+  }
+  return true;
+}
+
+void URingWriter::Write(int fd, char* buf, size_t size, uint64_t offset) {
+  while (free_list_ == NULL) {
+    Reap(1);
+  }
+  Request* req = free_list_;
+  free_list_ = req->next_free;
+  req->iov.iov_base = buf;
+  req->iov.iov_len = size;
+  req->buf = buf;
+  req->fd = fd;
+  req->offset = offset;
+
+  // We are the only submitter, so the tail is ours to read plainly.
+  const unsigned tail = *sq_tail_;
+  const unsigned index = tail & *sq_mask_;
+  struct io_uring_sqe* sqe =
+      reinterpret_cast<struct io_uring_sqe*>(sqes_) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = reinterpret_cast<uint64_t>(&req->iov);
+  sqe->len = 1;
+  sqe->user_data = reinterpret_cast<uint64_t>(req);
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  inflight_++;
+  unsubmitted_++;
+
+  Reap(0);
+}
+
+void URingWriter::Reap(unsigned min_complete) {
+  if (min_complete > 0 || unsubmitted_ > 0) {
+    // Entries the kernel did not take (e.g. EBUSY while the CQ is full)
+    // stay in the SQ and are passed again here.
+    const unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int r;
+    do {
+      r = SysEnter(ring_fd_, unsubmitted_, min_complete, flags);
+    } while (r < 0 && errno == EINTR);
+    if (r > 0) {
+      unsubmitted_ -= static_cast<unsigned>(r);
+    }
+  }
+  unsigned head = *cq_head_;
+  const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  struct io_uring_cqe* cqes = reinterpret_cast<struct io_uring_cqe*>(cqes_);
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &cqes[head & *cq_mask_];
+    Request* req = reinterpret_cast<Request*>(cqe->user_data);
+    const int res = cqe->res;
+    head++;
+    Complete(req, res);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+void URingWriter::Complete(Request* req, int res) {
+  // Finish a failed or short write synchronously, like the pwrite path.
+  size_t done = (res > 0) ? static_cast<size_t>(res) : 0;
+  while (done < req->iov.iov_len) {
+    ssize_t r = pwrite(req->fd, req->buf + done, req->iov.iov_len - done,
+                       req->offset + done);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      failed_fds_.insert(req->fd);
+      break;
+    }
+    done += r;
+  }
+  if (done_ != NULL) {
+    (*done_)(arg_, req->buf, req->iov.iov_len);
+  } else {
+    free(req->buf);
+  }
+  req->next_free = free_list_;
+  free_list_ = req;
+  inflight_--;
+}
+
+#else  // !LEVELDB_HAVE_IO_URING
+
+URingWriter::~URingWriter() {
+}
+
+bool URingWriter::Init(unsigned depth) {
+  return false;
+}
+
+void URingWriter::Write(int fd, char* buf, size_t size, uint64_t offset) {
+}
+
+void URingWriter::Reap(unsigned min_complete) {
+}
+
+#endif  // LEVELDB_HAVE_IO_URING
+
+}  // namespace leveldb
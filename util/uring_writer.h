@@ -0,0 +1,101 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// URingWriter submits buffer writes through io_uring using the raw
+// system calls (no liburing).  A mirror helper owns one writer and
+// keeps up to "depth" buffers in flight; each buffer is freed when its
+// write completes instead of right after a blocking pwrite().
+//
+// If the kernel (or the build) lacks io_uring, Init() fails and the
+// caller keeps using pwrite().  A writer is not thread-safe: only the
+// thread that owns it may call its methods.
+
+#ifndef STORAGE_LEVELDB_UTIL_URING_WRITER_H_
+#define STORAGE_LEVELDB_UTIL_URING_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <set>
+
+namespace leveldb {
+
+class URingWriter {
+ public:
+  // Called with "arg" and each buffer once its write has completed.
+  // The default (NULL) frees the buffer.
+  typedef void (*DoneFunction)(void* arg, char* buf, size_t size);
+
+  explicit URingWriter(DoneFunction done = NULL, void* arg = NULL);
+  ~URingWriter();
+
+  // Set up a submission ring with room for "depth" writes.  Returns
+  // false if io_uring is unavailable; the writer must not be used then.
+  bool Init(unsigned depth);
+
+  // Queue a write of buf[0,size) at "offset" of "fd".  "buf" is handed
+  // to the DoneFunction (or freed) once the write has completed.
+  // Blocks reaping completions while "depth" writes are in flight.
+  void Write(int fd, char* buf, size_t size, uint64_t offset);
+
+  // Reap whatever has completed without blocking.
+  void Reap() { Reap(0); }
+
+  // Wait for at least one in-flight write to complete, and reap it.
+  void WaitOne() { if (inflight_ > 0) Reap(1); }
+
+  // Wait for every in-flight write to complete.
+  void Drain() { while (inflight_ > 0) Reap(1); }
+
+  unsigned inflight() const { return inflight_; }
+
+  // Returns true if a completed write to "fd" could not be finished,
+  // and forgets it.  Drain() first to cover every write queued for "fd".
+  bool TakeFailure(int fd) { return failed_fds_.erase(fd) > 0; }
+
+ private:
+  struct Request {
+    struct iovec iov;
+    char* buf;
+    int fd;
+    uint64_t offset;
+    Request* next_free;
+  };
+
+  void Reap(unsigned min_complete);
+  void Complete(Request* req, int res);
+
+  DoneFunction done_;
+  void* arg_;
+  int ring_fd_;
+  unsigned depth_;
+  unsigned inflight_;
+  unsigned unsubmitted_;   // Entries in the SQ not yet taken by the kernel
+  Request* requests_;
+  Request* free_list_;
+  std::set<int> failed_fds_;  // Files with a write that failed
+
+  // Mapped ring state
+  void* sq_ptr_;
+  size_t sq_len_;
+  void* cq_ptr_;
+  size_t cq_len_;
+  void* sqes_;
+  size_t sqes_len_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  void* cqes_;
+
+  // No copying allowed
+  URingWriter(const URingWriter&);
+  void operator=(const URingWriter&);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_UTIL_URING_WRITER_H_
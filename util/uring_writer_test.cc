@@ -0,0 +1,65 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "util/uring_writer.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include "leveldb/env.h"
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class URingWriterTest {
+ public:
+  std::string fname_;
+  int fd_;
+
+  URingWriterTest() {
+    fname_ = test::TmpDir() + "/uring_writer_test";
+    fd_ = open(fname_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  }
+
+  ~URingWriterTest() {
+    close(fd_);
+    unlink(fname_.c_str());
+  }
+};
+
+TEST(URingWriterTest, WritesLandInOrder) {
+  URingWriter writer;
+  if (!writer.Init(4)) {
+    fprintf(stderr, "io_uring is not available; skipping\n");
+    return;
+  }
+  ASSERT_TRUE(fd_ >= 0);
+
+  const int kBuffers = 32;
+  const size_t kSize = 64 << 10;
+  for (int i = 0; i < kBuffers; i++) {
+    char* buf = reinterpret_cast<char*>(memalign(4096, kSize));
+    memset(buf, 'a' + (i % 26), kSize);
+    writer.Write(fd_, buf, kSize, static_cast<uint64_t>(i) * kSize);
+    ASSERT_TRUE(writer.inflight() <= 4);
+  }
+  writer.Drain();
+  ASSERT_EQ(0, writer.inflight());
+
+  std::string data;
+  ASSERT_OK(ReadFileToString(Env::Default(), fname_, &data));
+  ASSERT_EQ(kBuffers * kSize, data.size());
+  for (int i = 0; i < kBuffers; i++) {
+    ASSERT_EQ(std::string(kSize, 'a' + (i % 26)), data.substr(i * kSize, kSize));
+  }
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}